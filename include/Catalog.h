@@ -0,0 +1,416 @@
+/**
+ * @file
+ *
+ * This file contains the catalog of chart files in a data directory.
+ *
+ * The catalog discovers all chart files (*.json) in the directory, and keeps a
+ * manifest of their names, sizes and content hashes.  If a cache directory is
+ * given, the songs parsed from each file are also stored there in a compact binary
+ * form, so that on the next load files whose contents have not changed are read
+ * from the cache instead of being parsed again.
+ *
+ * Cache file format (integers little endian):
+ *   magic (4 bytes, "MSNG"), version (4 bytes), source hash (8 bytes), count (4 bytes)
+ *   songs, each: artist size (4 bytes), artist, title size (4 bytes), title
+ *
+ */
+#ifndef LAB5_CATALOG_H
+#define LAB5_CATALOG_H
+
+#include "Song.h"
+#include "JsonConverter.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define CATALOG_MANIFEST "manifest.json"
+#define CATALOG_CACHE_MAGIC 0x474E534D    // "MSNG"
+#define CATALOG_CACHE_VERSION 1
+
+// manifest keys
+#define CATALOG_FILES "files"
+#define CATALOG_FILE_NAME "name"
+#define CATALOG_FILE_SIZE "size"
+#define CATALOG_FILE_HASH "hash"
+
+/**
+ * Manifest entry for a single chart file
+ */
+struct CatalogFile {
+  std::string name;
+  uint64_t size;
+  uint64_t hash;
+};
+
+/**
+ * Discovers and loads the chart files in a data directory
+ */
+class Catalog {
+  std::string dir_;
+  std::string cache_dir_;
+
+  std::mutex mutex_;                          // guards manifest_
+  std::map<std::string, CatalogFile> manifest_;
+
+  std::string path(const std::string& dir, const std::string& name) const {
+    return dir + "/" + name;
+  }
+
+  std::string cachePath(const std::string& name) const {
+    return path(cache_dir_, name + ".songs");
+  }
+
+  static void putUint32(std::string& out, uint32_t v) {
+    for (int i = 0; i < 4; ++i) {
+      out.push_back((char)((v >> (8*i)) & 0xFF));
+    }
+  }
+
+  static uint64_t getUint(const std::string& in, size_t& pos, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; ++i) {
+      v |= ((uint64_t)(uint8_t)in[pos++]) << (8*i);
+    }
+    return v;
+  }
+
+  // reads an entire file
+  static bool readFile(const std::string& filename, std::string& out) {
+    std::ifstream fin(filename, std::ios::binary);
+    if (!fin.is_open()) {
+      return false;
+    }
+    std::ostringstream ss;
+    ss << fin.rdbuf();
+    out = ss.str();
+    return true;
+  }
+
+  // writes the parsed songs of a file to the cache
+  bool writeCache(const std::string& name, uint64_t hash, const std::vector<Song>& songs) const {
+    std::string out;
+    putUint32(out, CATALOG_CACHE_MAGIC);
+    putUint32(out, CATALOG_CACHE_VERSION);
+    putUint32(out, (uint32_t)(hash & 0xFFFFFFFF));
+    putUint32(out, (uint32_t)(hash >> 32));
+    putUint32(out, (uint32_t)songs.size());
+    for (const auto& song : songs) {
+      putUint32(out, (uint32_t)song.artist.size());
+      out.append(song.artist);
+      putUint32(out, (uint32_t)song.title.size());
+      out.append(song.title);
+    }
+
+    std::ofstream fout(cachePath(name), std::ios::binary | std::ios::trunc);
+    fout.write(out.data(), out.size());
+    return (bool)fout;
+  }
+
+  // reads the parsed songs of a file from the cache, if it matches the hash
+  bool readCache(const std::string& name, uint64_t hash, std::vector<Song>& songs) const {
+    std::string in;
+    if (!readFile(cachePath(name), in) || in.size() < 20) {
+      return false;
+    }
+    size_t pos = 0;
+    if (getUint(in, pos, 4) != CATALOG_CACHE_MAGIC || getUint(in, pos, 4) != CATALOG_CACHE_VERSION
+        || getUint(in, pos, 8) != hash) {
+      return false;
+    }
+    size_t count = (size_t)getUint(in, pos, 4);
+
+    std::vector<Song> out;
+    out.reserve(std::min(count, in.size()/8));
+    for (size_t i = 0; i < count; ++i) {
+      if (in.size() - pos < 4) {
+        return false;
+      }
+      size_t asize = (size_t)getUint(in, pos, 4);
+      if (in.size() - pos < asize + 4) {
+        return false;
+      }
+      std::string artist = in.substr(pos, asize);
+      pos += asize;
+      size_t tsize = (size_t)getUint(in, pos, 4);
+      if (in.size() - pos < tsize) {
+        return false;
+      }
+      out.push_back(Song(artist, in.substr(pos, tsize)));
+      pos += tsize;
+    }
+    songs.swap(out);
+    return true;
+  }
+
+ public:
+  /**
+   * Creates a catalog of a data directory
+   * @param dir directory containing the chart files
+   * @param cache_dir directory to cache parsed files in, empty to disable caching
+   */
+  Catalog(const std::string& dir, const std::string& cache_dir = "") :
+      dir_(dir), cache_dir_(cache_dir), mutex_(), manifest_() {
+    if (!cache_dir_.empty()) {
+      makeDirectory(cache_dir_);
+      loadManifest();
+    }
+  }
+
+  /**
+   * Computes the 64-bit FNV-1a hash of a block of data
+   */
+  static uint64_t hash(const char* data, size_t size) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i) {
+      h ^= (uint8_t)data[i];
+      h *= 1099511628211ull;
+    }
+    return h;
+  }
+
+  /**
+   * Computes a signature of files from their names, sizes and modification times,
+   * to tell whether anything made from them is out of date without reading them.
+   * An edit is noticed even if it keeps the size, unless it lands within the same
+   * second as the last one.
+   * @param dir directory of the files
+   * @param names file names, relative to the directory
+   * @return signature
+   */
+  static uint64_t signature(const std::string& dir, const std::vector<std::string>& names) {
+    std::string listing;
+    for (const auto& name : names) {
+      struct stat st;
+      bool found = stat((dir + "/" + name).c_str(), &st) == 0;
+      listing.append(name);
+      listing.push_back('\0');
+      listing.append(std::to_string(found ? (long long)st.st_size : -1LL));
+      listing.push_back('\0');
+      listing.append(std::to_string(found ? (long long)st.st_mtime : -1LL));
+      listing.push_back('\0');
+    }
+    return hash(listing.data(), listing.size());
+  }
+
+  /**
+   * Creates a directory if it doesn't already exist
+   * @param dir directory to create
+   */
+  static void makeDirectory(const std::string& dir) {
+#ifdef _WIN32
+    _mkdir(dir.c_str());
+#else
+    mkdir(dir.c_str(), 0755);
+#endif
+  }
+
+  /**
+   * Lists the regular files in a directory with a given suffix
+   * @param dir directory to list
+   * @param suffix file name ending, e.g. ".json"
+   * @return sorted file names, relative to the directory
+   */
+  static std::vector<std::string> list(const std::string& dir, const std::string& suffix) {
+    std::vector<std::string> out;
+
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((dir + "/*" + suffix).c_str(), &data);
+    if (find != INVALID_HANDLE_VALUE) {
+      do {
+        if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+          out.push_back(data.cFileName);
+        }
+      } while (FindNextFileA(find, &data));
+      FindClose(find);
+    }
+#else
+    DIR* d = opendir(dir.c_str());
+    if (d != nullptr) {
+      struct dirent* entry;
+      while ((entry = readdir(d)) != nullptr) {
+        std::string name = entry->d_name;
+        struct stat st;
+        if (name.size() > suffix.size()
+            && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0
+            && stat((dir + "/" + name).c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+          out.push_back(name);
+        }
+      }
+      closedir(d);
+    }
+#endif
+
+    std::sort(out.begin(), out.end());
+    return out;
+  }
+
+  /**
+   * Lists the chart files in the data directory
+   * @return sorted file names, relative to the data directory
+   */
+  std::vector<std::string> scan() const {
+    std::vector<std::string> out = list(dir_, ".json");
+    out.erase(std::remove(out.begin(), out.end(), std::string(CATALOG_MANIFEST)), out.end());
+    return out;
+  }
+
+  /**
+   * Computes a signature of the chart files, changing whenever one is added,
+   * removed or edited, see signature(dir, names)
+   * @return signature
+   */
+  uint64_t signature() const {
+    return signature(dir_, scan());
+  }
+
+  /**
+   * Full path of a chart file
+   * @param name file name from scan()
+   * @return path including the data directory
+   */
+  std::string path(const std::string& name) const {
+    return path(dir_, name);
+  }
+
+  /**
+   * Loads the songs of a chart file, from the cache if the file has not
+   * changed since it was last parsed.  Safe to call from several threads.
+   *
+   * @param name file name from scan()
+   * @param songs songs in the file, in file order
+   * @param cached set to true if the songs came from the cache
+   * @return true if successful
+   */
+  bool load(const std::string& name, std::vector<Song>& songs, bool& cached) {
+    cached = false;
+
+    std::string contents;
+    if (!readFile(path(name), contents)) {
+      std::cerr << "Failed to open file: " << path(name) << std::endl;
+      return false;
+    }
+    CatalogFile file{ name, contents.size(), hash(contents.data(), contents.size()) };
+
+    bool unchanged = false;
+    if (!cache_dir_.empty()) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto entry = manifest_.find(name);
+      unchanged = entry != manifest_.end() && entry->second.size == file.size
+          && entry->second.hash == file.hash;
+    }
+    if (unchanged && readCache(name, file.hash, songs)) {
+      cached = true;
+      return true;
+    }
+
+    try {
+      songs = JsonConverter::parseSongs(JSON::parse(contents));
+    }
+    catch (std::exception& exc) {
+      std::cerr << "Failed to parse file: " << path(name) << ": " << exc.what() << std::endl;
+      return false;
+    }
+
+    if (!cache_dir_.empty() && writeCache(name, file.hash, songs)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      manifest_[name] = file;
+    }
+    return true;
+  }
+
+  /**
+   * Reads the manifest from the cache directory
+   * @return true if a manifest was read
+   */
+  bool loadManifest() {
+    std::string contents;
+    if (cache_dir_.empty() || !readFile(path(cache_dir_, CATALOG_MANIFEST), contents)) {
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    manifest_.clear();
+    try {
+      JSON j = JSON::parse(contents);
+      for (const auto& jfile : j[CATALOG_FILES]) {
+        std::string hex = jfile[CATALOG_FILE_HASH];
+        CatalogFile file{ jfile[CATALOG_FILE_NAME], jfile[CATALOG_FILE_SIZE],
+                          std::stoull(hex, nullptr, 16) };
+        manifest_[file.name] = file;
+      }
+    }
+    catch (std::exception&) {
+      manifest_.clear();   // unreadable manifest, everything is parsed again
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * Writes the manifest to the cache directory, listing only files that
+   * still exist
+   * @return true if successful
+   */
+  bool saveManifest() {
+    if (cache_dir_.empty()) {
+      return false;
+    }
+
+    std::vector<std::string> names = scan();
+    JSON j;
+    j[CATALOG_FILES] = JSON::array();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (const auto& name : names) {
+        auto entry = manifest_.find(name);
+        if (entry != manifest_.end()) {
+          char hex[17];
+          std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)entry->second.hash);
+          JSON jfile;
+          jfile[CATALOG_FILE_NAME] = entry->second.name;
+          jfile[CATALOG_FILE_SIZE] = entry->second.size;
+          jfile[CATALOG_FILE_HASH] = std::string(hex);
+          j[CATALOG_FILES].push_back(jfile);
+        }
+      }
+    }
+
+    std::ofstream fout(path(cache_dir_, CATALOG_MANIFEST), std::ios::trunc);
+    fout << j.dump(2);
+    return (bool)fout;
+  }
+
+  /**
+   * Manifest entries of all files loaded or cached so far
+   */
+  std::vector<CatalogFile> files() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<CatalogFile> out;
+    for (const auto& entry : manifest_) {
+      out.push_back(entry.second);
+    }
+    return out;
+  }
+};
+
+#endif //LAB5_CATALOG_H
@@ -0,0 +1,338 @@
+/**
+ * @file
+ *
+ * This file contains the history of past charts, used to answer how long a song
+ * has been on a chart and how high it got.
+ *
+ * Each run of billboard_downloader.py saves a dated snapshot of every chart.  The
+ * history holds, for each song and chart, the song's trajectory: the date and rank
+ * of every snapshot it appeared in.  Trajectories are stored as delta-encoded
+ * columns, and the usual questions (weeks on chart, peak position, weeks at peak,
+ * first and last appearance) are kept as aggregates that are updated as snapshots
+ * are added, so they are answered without decoding anything.
+ *
+ * Trajectory format, one entry per snapshot the song appeared in, oldest first:
+ *   date minus previous date (varint), rank minus previous rank (zigzag varint)
+ * Weekly snapshots of a song moving a few places a week take 2 bytes per entry.
+ *
+ * Dates are days since 1970-01-01, written "YYYY-MM-DD".  History files are named
+ * "<chart file>.<YYYY-MM-DD>.json", e.g. "billboard_rock.2017-11-04.json".
+ *
+ */
+#ifndef LAB5_CHART_HISTORY_H
+#define LAB5_CHART_HISTORY_H
+
+#include "Song.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+
+#define CHART_HISTORY_SUFFIX ".json"
+
+/**
+ * Rank of a song in one snapshot of a chart
+ */
+struct ChartPosition {
+  uint32_t date;
+  uint32_t rank;
+};
+
+/**
+ * How a song did on one chart
+ */
+struct ChartStats {
+  std::string chart;
+  uint32_t weeks;                       // snapshots the song was on the chart
+  uint32_t peak;                        // best rank
+  uint32_t weeks_at_peak;
+  uint32_t first;                       // date first on the chart
+  uint32_t last;                        // date last on the chart
+  uint32_t last_rank;
+  std::vector<ChartPosition> positions; // trajectory, only if requested
+};
+
+/**
+ * Rank trajectories of songs across successive chart snapshots
+ */
+class ChartHistory {
+  /**
+   * Trajectory of a song on a chart, with its aggregates
+   */
+  struct Series {
+    std::string data;
+    uint32_t weeks = 0;
+    uint32_t peak = 0;
+    uint32_t weeks_at_peak = 0;
+    uint32_t first = 0;
+    uint32_t last = 0;
+    uint32_t last_rank = 0;
+  };
+
+  std::vector<std::string> charts_;                 // chart id -> name
+  std::vector<std::vector<uint32_t>> dates_;        // chart id -> snapshot dates, sorted
+  std::map<Song, uint32_t> ids_;
+  std::vector<std::map<uint32_t, Series>> series_;  // song id -> chart id -> trajectory
+  size_t entries_;
+  size_t bytes_;
+
+  static void putVarint(std::string& out, uint32_t v) {
+    while (v >= 0x80) {
+      out.push_back((char)((v & 0x7F) | 0x80));
+      v >>= 7;
+    }
+    out.push_back((char)v);
+  }
+
+  static uint32_t getVarint(const std::string& in, size_t& pos) {
+    uint32_t v = 0;
+    for (int shift = 0; pos < in.size(); shift += 7) {
+      uint8_t b = (uint8_t)in[pos++];
+      v |= (uint32_t)(b & 0x7F) << shift;
+      if (!(b & 0x80)) {
+        break;
+      }
+    }
+    return v;
+  }
+
+  // appends a position to a series, after all the ones it has
+  static void append(Series& series, uint32_t date, uint32_t rank) {
+    int64_t drank = (int64_t)rank - series.last_rank;
+    putVarint(series.data, date - series.last);
+    putVarint(series.data, (uint32_t)(((uint64_t)drank << 1) ^ (uint64_t)(drank >> 63)));
+    if (series.weeks == 0) {
+      series.first = date;
+    }
+    if (series.weeks == 0 || rank < series.peak) {
+      series.peak = rank;
+      series.weeks_at_peak = 0;
+    }
+    if (rank == series.peak) {
+      ++series.weeks_at_peak;
+    }
+    ++series.weeks;
+    series.last = date;
+    series.last_rank = rank;
+  }
+
+  // decodes all positions of a series
+  static std::vector<ChartPosition> decode(const Series& series) {
+    std::vector<ChartPosition> out;
+    out.reserve(series.weeks);
+    size_t pos = 0;
+    uint32_t date = 0;
+    uint32_t rank = 0;
+    while (pos < series.data.size()) {
+      date += getVarint(series.data, pos);
+      uint32_t z = getVarint(series.data, pos);
+      rank += (uint32_t)((z >> 1) ^ (~(z & 1) + 1));
+      out.push_back(ChartPosition{ date, rank });
+    }
+    return out;
+  }
+
+  uint32_t chart(const std::string& name) {
+    for (size_t i = 0; i < charts_.size(); ++i) {
+      if (charts_[i] == name) {
+        return (uint32_t)i;
+      }
+    }
+    charts_.push_back(name);
+    dates_.push_back(std::vector<uint32_t>());
+    return (uint32_t)(charts_.size() - 1);
+  }
+
+  uint32_t id(const Song& song) {
+    auto it = ids_.find(song);
+    if (it != ids_.end()) {
+      return it->second;
+    }
+    uint32_t id = (uint32_t)series_.size();
+    ids_.insert(std::make_pair(song, id));
+    series_.push_back(std::map<uint32_t, Series>());
+    return id;
+  }
+
+  // adds a position older than the last one in a series, re-encoding it
+  static void insert(Series& series, uint32_t date, uint32_t rank) {
+    std::vector<ChartPosition> positions = decode(series);
+    auto it = std::lower_bound(positions.begin(), positions.end(), date,
+                               [](const ChartPosition& p, uint32_t d) { return p.date < d; });
+    positions.insert(it, ChartPosition{ date, rank });
+    series = Series();
+    for (const auto& position : positions) {
+      append(series, position.date, position.rank);
+    }
+  }
+
+ public:
+  ChartHistory() : charts_(), dates_(), ids_(), series_(), entries_(0), bytes_(0) {}
+
+  /**
+   * Converts a date to days since 1970-01-01
+   * @param date "YYYY-MM-DD"
+   * @param days set to the day number
+   * @return true if the date is well-formed
+   */
+  static bool parseDate(const std::string& date, uint32_t& days) {
+    int y, m, d;
+    char tail;
+    if (date.size() != 10 || std::sscanf(date.c_str(), "%4d-%2d-%2d%c", &y, &m, &d, &tail) != 3
+        || y < 1970 || m < 1 || m > 12 || d < 1 || d > 31) {
+      return false;
+    }
+    // days from civil, with years starting in March so leap days come last
+    y -= m <= 2;
+    int era = y / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    days = (uint32_t)(era * 146097 + doe - 719468);
+    return true;
+  }
+
+  /**
+   * Converts days since 1970-01-01 to a date
+   * @param days day number
+   * @return "YYYY-MM-DD"
+   */
+  static std::string formatDate(uint32_t days) {
+    int z = (int)days + 719468;
+    int era = z / 146097;
+    int doe = z - era * 146097;
+    int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int mp = (5 * doy + 2) / 153;
+    int d = doy - (153 * mp + 2) / 5 + 1;
+    int m = mp + (mp < 10 ? 3 : -9);
+    int y = yoe + era * 400 + (m <= 2);
+    char out[32];   // room for any int year, month and day
+    std::snprintf(out, sizeof(out), "%04d-%02d-%02d", y, m, d);
+    return out;
+  }
+
+  /**
+   * Works out the chart file and date of a history file,
+   * "<chart file>.<YYYY-MM-DD>.json"
+   * @param name history file name
+   * @param file set to the chart file name, e.g. "billboard_rock.json"
+   * @param date set to the date of the snapshot
+   * @return true if the name has the expected form
+   */
+  static bool parseName(const std::string& name, std::string& file, uint32_t& date) {
+    const std::string suffix = CHART_HISTORY_SUFFIX;
+    if (name.size() < suffix.size() + 12
+        || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) {
+      return false;
+    }
+    size_t dot = name.size() - suffix.size() - 11;
+    if (name[dot] != '.' || !parseDate(name.substr(dot + 1, 10), date)) {
+      return false;
+    }
+    file = name.substr(0, dot) + suffix;
+    return true;
+  }
+
+  /**
+   * Adds a snapshot of a chart
+   * @param name chart name
+   * @param date date of the snapshot
+   * @param songs songs on the chart, in rank order.  A song listed more than once
+   *        keeps its highest rank.
+   * @return false if the chart already has a snapshot for the date
+   */
+  bool add(const std::string& name, uint32_t date, const std::vector<Song>& songs) {
+    uint32_t c = chart(name);
+    std::vector<uint32_t>& dates = dates_[c];
+    auto at = std::lower_bound(dates.begin(), dates.end(), date);
+    if (at != dates.end() && *at == date) {
+      return false;
+    }
+    dates.insert(at, date);
+
+    std::set<uint32_t> seen;
+    for (size_t r = 0; r < songs.size(); ++r) {
+      uint32_t i = id(songs[r]);
+      if (!seen.insert(i).second) {
+        continue;
+      }
+      Series& series = series_[i][c];
+      bytes_ -= series.data.size();
+      if (series.weeks == 0 || date > series.last) {
+        append(series, date, (uint32_t)(r + 1));
+      }
+      else {
+        insert(series, date, (uint32_t)(r + 1));   // snapshots loaded out of order
+      }
+      bytes_ += series.data.size();
+      ++entries_;
+    }
+    return true;
+  }
+
+  /**
+   * How a song did on every chart it has been on
+   * @param song song to look up
+   * @param trajectory also decode the date and rank of every appearance
+   * @return stats per chart, in the order the charts were first added
+   */
+  std::vector<ChartStats> stats(const Song& song, bool trajectory = false) const {
+    std::vector<ChartStats> out;
+    auto it = ids_.find(song);
+    if (it == ids_.end()) {
+      return out;
+    }
+    for (const auto& entry : series_[it->second]) {
+      const Series& series = entry.second;
+      ChartStats stats{ charts_[entry.first], series.weeks, series.peak, series.weeks_at_peak,
+                        series.first, series.last, series.last_rank, {} };
+      if (trajectory) {
+        stats.positions = decode(series);
+      }
+      out.push_back(stats);
+    }
+    return out;
+  }
+
+  /**
+   * Dates of the snapshots of a chart
+   * @param name chart name
+   * @return dates, oldest first, empty if the chart is unknown
+   */
+  std::vector<uint32_t> dates(const std::string& name) const {
+    for (size_t i = 0; i < charts_.size(); ++i) {
+      if (charts_[i] == name) {
+        return dates_[i];
+      }
+    }
+    return std::vector<uint32_t>();
+  }
+
+  /**
+   * Number of songs that have been on any chart
+   */
+  size_t size() const {
+    return series_.size();
+  }
+
+  /**
+   * Number of positions stored, one per song per snapshot
+   */
+  size_t entries() const {
+    return entries_;
+  }
+
+  /**
+   * Size of the encoded trajectories in bytes
+   */
+  size_t bytes() const {
+    return bytes_;
+  }
+};
+
+#endif //LAB5_CHART_HISTORY_H
@@ -0,0 +1,403 @@
+/**
+ * @file
+ *
+ * This file contains the index of which charts each song is on and at what rank,
+ * used to filter searches by chart before any regular expressions are run, and to
+ * list the top songs of a chart.
+ *
+ * Every song seen on a chart gets a small integer id, and every chart a bitmap with
+ * one bit per song id.  The charts of a song are its bits across the bitmaps, and a
+ * chart filter is evaluated 64 songs at a time by combining whole words of the
+ * bitmaps.  Ids are never reused; a song dropped from every chart keeps its id with
+ * all bits clear, and gets it back if it is added again.
+ *
+ * Ranks are the positions of songs in their chart file, counting from 1.  Each
+ * chart keeps the ranks of only the songs on it, as (song id, rank) pairs sorted by
+ * id, so memory grows with the chart's length rather than with every song seen on
+ * any chart.  It also keeps its song ids in rank order, so the top songs are read
+ * off without sorting.
+ *
+ * Chart names are the chart file names without the ".json" suffix and the
+ * "billboard_" prefix, e.g. "rock" or "hot_100".
+ *
+ * Filter syntax:
+ *   chart                songs on the chart
+ *   a AND b              songs on both
+ *   a OR b               songs on either
+ *   NOT a                songs on any chart but a
+ *   ( ... )              grouping
+ * NOT binds tightest, then AND, then OR.  Keywords are case-insensitive.
+ *
+ */
+#ifndef LAB5_CHART_MEMBERSHIP_H
+#define LAB5_CHART_MEMBERSHIP_H
+
+#include "Song.h"
+#include "SongIds.h"
+
+#include <cstdint>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <utility>
+#include <algorithm>
+
+#define CHART_FILE_PREFIX "billboard_"
+#define CHART_FILE_SUFFIX ".json"
+
+/**
+ * Bitmaps of the songs on each chart
+ */
+class ChartMembership {
+  using Bitmap = std::vector<uint64_t>;
+
+  std::vector<std::string> charts_;           // bit -> chart name
+  std::unordered_map<Song, uint32_t, SongHash> ids_;
+  std::vector<Song> songs_;                   // id -> song
+  std::vector<Bitmap> bits_;                  // chart -> songs on it
+  using Ranks = std::vector<std::pair<uint32_t, uint32_t>>;
+
+  std::vector<Ranks> ranks_;                  // chart -> (song id, rank) sorted by id
+  std::vector<std::vector<uint32_t>> ranked_; // chart -> song ids in rank order
+
+  /**
+   * Evaluates a filter by recursive descent, one bitmap per sub-expression
+   */
+  class Parser {
+    const ChartMembership& index_;
+    std::vector<std::string> tokens_;
+    size_t pos_;
+    bool error_;
+
+    bool accept(const char* keyword) {
+      if (pos_ >= tokens_.size()) {
+        return false;
+      }
+      std::string token;
+      for (char c : tokens_[pos_]) {
+        token.push_back((char)std::toupper((unsigned char)c));
+      }
+      if (token != keyword) {
+        return false;
+      }
+      ++pos_;
+      return true;
+    }
+
+    Bitmap unary() {
+      if (accept("NOT")) {
+        Bitmap out = index_.any();
+        Bitmap operand = unary();
+        for (size_t i = 0; i < out.size(); ++i) {
+          out[i] &= ~word(operand, i);
+        }
+        return out;
+      }
+      if (accept("(")) {
+        Bitmap out = expression();
+        error_ |= !accept(")");
+        return out;
+      }
+      if (pos_ >= tokens_.size() || tokens_[pos_] == ")") {
+        error_ = true;
+        return Bitmap();
+      }
+      int chart = index_.chart(tokens_[pos_++]);
+      if (chart < 0) {
+        error_ = true;
+        return Bitmap();
+      }
+      return index_.bits_[chart];
+    }
+
+    Bitmap conjunction() {
+      Bitmap out = unary();
+      while (accept("AND")) {
+        Bitmap operand = unary();
+        out.resize(std::min(out.size(), operand.size()));
+        for (size_t i = 0; i < out.size(); ++i) {
+          out[i] &= operand[i];
+        }
+      }
+      return out;
+    }
+
+    Bitmap expression() {
+      Bitmap out = conjunction();
+      while (accept("OR")) {
+        Bitmap operand = conjunction();
+        out.resize(std::max(out.size(), operand.size()), 0);
+        for (size_t i = 0; i < operand.size(); ++i) {
+          out[i] |= operand[i];
+        }
+      }
+      return out;
+    }
+
+   public:
+    Parser(const ChartMembership& index, const std::string& filter) :
+        index_(index), tokens_(), pos_(0), error_(false) {
+      std::string token;
+      for (char c : filter) {
+        if (std::isspace((unsigned char)c) || c == '(' || c == ')') {
+          if (!token.empty()) {
+            tokens_.push_back(token);
+            token.clear();
+          }
+          if (c == '(' || c == ')') {
+            tokens_.push_back(std::string(1, c));
+          }
+        }
+        else {
+          token.push_back(c);
+        }
+      }
+      if (!token.empty()) {
+        tokens_.push_back(token);
+      }
+    }
+
+    /**
+     * Evaluates the whole filter
+     * @param out songs matching the filter
+     * @return false if the filter is malformed or names an unknown chart
+     */
+    bool parse(Bitmap& out) {
+      out = expression();
+      return !error_ && pos_ == tokens_.size();
+    }
+  };
+
+  static uint64_t word(const Bitmap& bits, size_t i) {
+    return i < bits.size() ? bits[i] : 0;
+  }
+
+  // songs on any chart
+  Bitmap any() const {
+    Bitmap out((songs_.size() + 63)/64, 0);
+    for (const auto& bits : bits_) {
+      for (size_t i = 0; i < bits.size(); ++i) {
+        out[i] |= bits[i];
+      }
+    }
+    return out;
+  }
+
+  // bit of a chart, -1 if unknown
+  int chart(const std::string& name) const {
+    for (size_t i = 0; i < charts_.size(); ++i) {
+      if (charts_[i] == name) {
+        return (int)i;
+      }
+    }
+    return -1;
+  }
+
+
+ public:
+  /**
+   * Works out the name of a chart from its file name
+   * @param file chart file name, e.g. "billboard_rock.json"
+   * @return chart name, e.g. "rock"
+   */
+  static std::string chartName(const std::string& file) {
+    const std::string prefix = CHART_FILE_PREFIX;
+    const std::string suffix = CHART_FILE_SUFFIX;
+    std::string name = file;
+    if (name.size() >= suffix.size()
+        && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+      name.erase(name.size() - suffix.size());
+    }
+    if (name.size() > prefix.size() && name.compare(0, prefix.size(), prefix) == 0) {
+      name.erase(0, prefix.size());
+    }
+    return name;
+  }
+
+  /**
+   * Id of a song, assigning the next one if it was never seen on a chart
+   * @param song song to look up
+   * @return id, less than size()
+   */
+  uint32_t id(const Song& song) {
+    auto it = ids_.find(song);
+    if (it != ids_.end()) {
+      return it->second;
+    }
+    uint32_t id = (uint32_t)songs_.size();
+    ids_.insert(std::make_pair(song, id));
+    songs_.push_back(song);
+    return id;
+  }
+
+  /**
+   * Song with an id
+   * @param id id from id()
+   * @return song
+   */
+  const Song& song(uint32_t id) const {
+    return songs_[id];
+  }
+
+  /**
+   * Replaces the songs on a chart
+   * @param name chart name
+   * @param songs songs now on the chart, in chart order.  A song listed more than
+   *        once keeps its highest rank.
+   */
+  void set(const std::string& name, const std::vector<Song>& songs) {
+    std::vector<uint32_t> ids;
+    ids.reserve(songs.size());
+    for (const auto& song : songs) {
+      ids.push_back(id(song));
+    }
+    set(name, ids);
+  }
+
+  /**
+   * Replaces the songs on a chart, given by id
+   * @param name chart name
+   * @param ids ids of the songs now on the chart, in chart order, from id()
+   */
+  void set(const std::string& name, const std::vector<uint32_t>& ids) {
+    int bit = chart(name);
+    if (bit < 0) {
+      bit = (int)charts_.size();
+      charts_.push_back(name);
+      bits_.push_back(Bitmap());
+      ranks_.push_back(Ranks());
+      ranked_.push_back(std::vector<uint32_t>());
+    }
+
+    Bitmap& bits = bits_[bit];
+    Ranks& ranks = ranks_[bit];
+    std::vector<uint32_t>& ranked = ranked_[bit];
+    bits.assign((songs_.size() + 63)/64, 0);
+    ranks.clear();
+    ranked.clear();
+    for (size_t r = 0; r < ids.size(); ++r) {
+      uint32_t i = ids[r];
+      if ((bits[i/64] & ((uint64_t)1 << (i%64))) == 0) {
+        bits[i/64] |= (uint64_t)1 << (i%64);
+        ranks.push_back(std::make_pair(i, (uint32_t)(r + 1)));
+        ranked.push_back(i);
+      }
+    }
+    std::sort(ranks.begin(), ranks.end());
+    Ranks(ranks).swap(ranks);   // drop capacity left from a longer chart
+  }
+
+  /**
+   * Clears a chart, e.g. when its file is deleted.  Its name is kept, so filters
+   * naming it stay valid and match nothing.
+   * @param name chart name
+   */
+  void clear(const std::string& name) {
+    int bit = chart(name);
+    if (bit >= 0) {
+      bits_[bit].clear();
+      Ranks().swap(ranks_[bit]);
+      ranked_[bit].clear();
+    }
+  }
+
+  /**
+   * Names of all charts, in the order they were first loaded
+   */
+  const std::vector<std::string>& charts() const {
+    return charts_;
+  }
+
+  /**
+   * Charts a song is on
+   * @param song song to look up
+   * @return chart names
+   */
+  std::vector<std::string> charts(const Song& song) const {
+    std::vector<std::string> out;
+    auto it = ids_.find(song);
+    if (it == ids_.end()) {
+      return out;
+    }
+    uint32_t i = it->second;
+    for (size_t c = 0; c < charts_.size(); ++c) {
+      if (word(bits_[c], i/64) & ((uint64_t)1 << (i%64))) {
+        out.push_back(charts_[c]);
+      }
+    }
+    return out;
+  }
+
+  /**
+   * Finds the songs matching a chart filter
+   * @param filter chart names combined with AND, OR, NOT and parentheses
+   * @param songs songs matching the filter, sorted, valid until the next change
+   * @return false if the filter is malformed or names an unknown chart
+   */
+  bool select(const std::string& filter, std::vector<const Song*>& songs) const {
+    songs.clear();
+    Bitmap bits;
+    Parser parser(*this, filter);
+    if (!parser.parse(bits)) {
+      return false;
+    }
+    for (size_t i = 0; i < bits.size(); ++i) {
+      uint64_t w = bits[i];
+      for (size_t bit = 0; w != 0; ++bit, w >>= 1) {
+        if (w & 1) {
+          songs.push_back(&songs_[i*64 + bit]);
+        }
+      }
+    }
+    std::sort(songs.begin(), songs.end(),
+              [](const Song* a, const Song* b) { return *a < *b; });
+    return true;
+  }
+
+  /**
+   * Rank of a song on a chart
+   * @param name chart name
+   * @param song song to look up
+   * @return position in the chart from 1, 0 if not on it
+   */
+  uint32_t rank(const std::string& name, const Song& song) const {
+    int bit = chart(name);
+    auto it = ids_.find(song);
+    if (bit < 0 || it == ids_.end()) {
+      return 0;
+    }
+    const Ranks& ranks = ranks_[bit];
+    auto entry = std::lower_bound(ranks.begin(), ranks.end(),
+                                  std::make_pair(it->second, (uint32_t)0));
+    return entry != ranks.end() && entry->first == it->second ? entry->second : 0;
+  }
+
+  /**
+   * Songs on a chart, in rank order
+   * @param name chart name
+   * @param songs songs on the chart, valid until the next change
+   * @return false if the chart is unknown
+   */
+  bool ranked(const std::string& name, std::vector<const Song*>& songs) const {
+    songs.clear();
+    int bit = chart(name);
+    if (bit < 0) {
+      return false;
+    }
+    songs.reserve(ranked_[bit].size());
+    for (uint32_t i : ranked_[bit]) {
+      songs.push_back(&songs_[i]);
+    }
+    return true;
+  }
+
+  /**
+   * Number of songs ever seen on a chart
+   */
+  size_t size() const {
+    return songs_.size();
+  }
+};
+
+#endif //LAB5_CHART_MEMBERSHIP_H
@@ -0,0 +1,337 @@
+/**
+ * @file
+ *
+ * This file contains the record of which chart file each song in the library was
+ * loaded from, used to work out what changes when a chart file is reloaded.
+ *
+ * A song may appear on several charts.  It is only added to the library when the
+ * first file containing it is loaded, and only removed once no loaded file contains
+ * it anymore, so reloading one chart never drops songs that another chart still
+ * lists.  Songs whose membership doesn't change are left alone, so client changes
+ * to them are kept.
+ *
+ * The charts each song is on are also kept as bitmaps, see ChartMembership, so
+ * searches can be filtered by chart.
+ *
+ * The sources can be saved, e.g. next to a snapshot of the library, and loaded on
+ * the next start instead of every chart file, as long as the chart files have not
+ * changed since, see Catalog::signature.  If they have, updating the loaded
+ * sources with the chart files gives the changes the library missed.
+ *
+ * Saved file format (integers little endian):
+ *   magic (4 bytes, "MCHS"), version (4 bytes), signature (8 bytes), count (4 bytes)
+ *   files, each: name size (4 bytes), name, count (4 bytes)
+ *     songs in rank order, each: rank (4 bytes), artist size (4 bytes), artist,
+ *     title size (4 bytes), title
+ *
+ */
+#ifndef LAB5_CHART_SOURCES_H
+#define LAB5_CHART_SOURCES_H
+
+#include "Song.h"
+#include "MutationQueue.h"
+#include "ChartMembership.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <iterator>
+#include <fstream>
+#include <sstream>
+
+#define CHART_SOURCES_MAGIC 0x5348434D    // "MCHS"
+#define CHART_SOURCES_VERSION 1
+
+/**
+ * Songs of each loaded chart file
+ */
+class ChartSources {
+  std::map<std::string, std::vector<uint32_t>> files_;   // sorted ids of each file's songs
+  std::vector<uint32_t> refs_;    // number of files containing each song, by id
+  size_t songs_ = 0;              // songs in any file
+  ChartMembership membership_;    // gives songs their ids
+  uint64_t signature_ = 0;        // of the chart files, see Catalog::signature
+
+  // adds a reference to a song, returns true if it is the first
+  bool ref(uint32_t id) {
+    if (id >= refs_.size()) {
+      refs_.resize(membership_.size(), 0);
+    }
+    if (++refs_[id] == 1) {
+      ++songs_;
+      return true;
+    }
+    return false;
+  }
+
+  // drops a reference to a song, returns true if it was the last
+  bool unref(uint32_t id) {
+    if (--refs_[id] == 0) {
+      --songs_;
+      return true;
+    }
+    return false;
+  }
+
+  // changes to the library once a file's songs change from prev to next
+  std::vector<Mutation> diff(const std::vector<uint32_t>& prev, const std::vector<uint32_t>& next) {
+    std::vector<uint32_t> dropped, added;
+    std::set_difference(prev.begin(), prev.end(), next.begin(), next.end(),
+                        std::back_inserter(dropped));
+    std::set_difference(next.begin(), next.end(), prev.begin(), prev.end(),
+                        std::back_inserter(added));
+    std::vector<Mutation> out;
+    for (uint32_t id : dropped) {
+      if (unref(id)) {
+        out.push_back(Mutation(MUTATION_REMOVE, membership_.song(id)));
+      }
+    }
+    for (uint32_t id : added) {
+      if (ref(id)) {
+        out.push_back(Mutation(MUTATION_ADD, membership_.song(id)));
+      }
+    }
+    return out;
+  }
+
+  static void putUint(std::string& out, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+      out.push_back((char)((v >> (8*i)) & 0xFF));
+    }
+  }
+
+  static void putString(std::string& out, const std::string& str) {
+    putUint(out, str.size(), 4);
+    out.append(str);
+  }
+
+  // reads an integer, or fails once the input runs out
+  static bool getUint(const std::string& in, size_t& pos, int bytes, uint64_t& v) {
+    if (in.size() - pos < (size_t)bytes) {
+      return false;
+    }
+    v = 0;
+    for (int i = 0; i < bytes; ++i) {
+      v |= ((uint64_t)(uint8_t)in[pos++]) << (8*i);
+    }
+    return true;
+  }
+
+  static bool getString(const std::string& in, size_t& pos, std::string& str) {
+    uint64_t size;
+    if (!getUint(in, pos, 4, size) || in.size() - pos < size) {
+      return false;
+    }
+    str = in.substr(pos, (size_t)size);
+    pos += (size_t)size;
+    return true;
+  }
+
+ public:
+  /**
+   * Checks whether a file has been loaded
+   * @param name chart file name
+   * @return true if its songs are recorded
+   */
+  bool contains(const std::string& name) const {
+    return files_.find(name) != files_.end();
+  }
+
+  /**
+   * Names of the loaded files
+   */
+  std::vector<std::string> files() const {
+    std::vector<std::string> out;
+    for (const auto& file : files_) {
+      out.push_back(file.first);
+    }
+    return out;
+  }
+
+  /**
+   * Number of loaded files
+   */
+  size_t size() const {
+    return files_.size();
+  }
+
+  /**
+   * Number of distinct songs across all loaded files
+   */
+  size_t songs() const {
+    return songs_;
+  }
+
+  /**
+   * Replaces the songs loaded from a file
+   * @param name chart file name
+   * @param songs current songs in the file
+   * @return changes to apply to the library: songs now in no file are removed,
+   *         songs that were in no file are added
+   */
+  std::vector<Mutation> update(const std::string& name, const std::vector<Song>& songs) {
+    std::vector<uint32_t> next;
+    next.reserve(songs.size());
+    for (const auto& song : songs) {
+      next.push_back(membership_.id(song));
+    }
+    membership_.set(ChartMembership::chartName(name), next);
+    std::sort(next.begin(), next.end());
+    next.erase(std::unique(next.begin(), next.end()), next.end());
+
+    std::vector<uint32_t>& prev = files_[name];
+    std::vector<Mutation> out = diff(prev, next);
+    prev.swap(next);
+    return out;
+  }
+
+  /**
+   * Forgets a file that no longer exists
+   * @param name chart file name
+   * @return songs to remove from the library, that are now in no file
+   */
+  std::vector<Mutation> erase(const std::string& name) {
+    auto it = files_.find(name);
+    if (it == files_.end()) {
+      return std::vector<Mutation>();
+    }
+    std::vector<Mutation> out = diff(it->second, std::vector<uint32_t>());
+    files_.erase(it);
+    membership_.clear(ChartMembership::chartName(name));
+    return out;
+  }
+
+  /**
+   * Signature of the chart files the sources were loaded from, see
+   * Catalog::signature
+   */
+  uint64_t signature() const {
+    return signature_;
+  }
+
+  /**
+   * Records the signature of the chart files the sources were loaded from,
+   * taken before loading them
+   * @param signature chart files' signature
+   */
+  void setSignature(uint64_t signature) {
+    signature_ = signature;
+  }
+
+  /**
+   * Saves the songs of every loaded file and their ranks, with the signature of
+   * the chart files.  The file is written to a temporary file first, so an
+   * existing one is only replaced once complete.
+   * @param filename file to write
+   * @return true if successful
+   */
+  bool save(const std::string& filename) const {
+    std::string out;
+    putUint(out, CHART_SOURCES_MAGIC, 4);
+    putUint(out, CHART_SOURCES_VERSION, 4);
+    putUint(out, signature_, 8);
+    putUint(out, files_.size(), 4);
+    std::vector<const Song*> ranked;
+    for (const auto& file : files_) {
+      std::string chart = ChartMembership::chartName(file.first);
+      membership_.ranked(chart, ranked);
+      putString(out, file.first);
+      putUint(out, ranked.size(), 4);
+      for (const Song* song : ranked) {
+        putUint(out, membership_.rank(chart, *song), 4);
+        putString(out, song->artist);
+        putString(out, song->title);
+      }
+    }
+
+    std::string tmp = filename + ".tmp";
+    std::FILE* fout = std::fopen(tmp.c_str(), "wb");
+    if (fout == nullptr) {
+      return false;
+    }
+    bool success = std::fwrite(out.data(), 1, out.size(), fout) == out.size();
+    success &= std::fclose(fout) == 0;
+#ifdef _WIN32
+    // rename does not replace existing files on Windows
+    std::remove(filename.c_str());
+#endif
+    success = success && std::rename(tmp.c_str(), filename.c_str()) == 0;
+    if (!success) {
+      std::remove(tmp.c_str());
+    }
+    return success;
+  }
+
+  /**
+   * Replaces the loaded files with those saved, and their signature, to compare
+   * with that of the chart files now
+   * @param filename file written by save()
+   * @return false, leaving the sources unchanged, if the file is missing or damaged
+   */
+  bool load(const std::string& filename) {
+    std::ifstream fin(filename, std::ios::binary);
+    if (!fin.is_open()) {
+      return false;
+    }
+    std::ostringstream ss;
+    ss << fin.rdbuf();
+    std::string in = ss.str();
+
+    size_t pos = 0;
+    uint64_t magic, version, saved, nfiles;
+    if (!getUint(in, pos, 4, magic) || magic != CHART_SOURCES_MAGIC
+        || !getUint(in, pos, 4, version) || version != CHART_SOURCES_VERSION
+        || !getUint(in, pos, 8, saved) || !getUint(in, pos, 4, nfiles)) {
+      return false;
+    }
+
+    // a song listed again further down a chart takes up a rank without being kept,
+    // any song listed before it fills that rank
+    std::vector<std::pair<std::string, std::vector<Song>>> files;
+    for (uint64_t f = 0; f < nfiles; ++f) {
+      std::string name;
+      uint64_t count;
+      if (!getString(in, pos, name) || !getUint(in, pos, 4, count)) {
+        return false;
+      }
+      std::vector<Song> songs;
+      for (uint64_t i = 0; i < count; ++i) {
+        uint64_t rank;
+        std::string artist, title;
+        if (!getUint(in, pos, 4, rank) || rank <= songs.size()
+            || (songs.empty() && rank != 1)
+            || !getString(in, pos, artist) || !getString(in, pos, title)) {
+          return false;
+        }
+        while (songs.size() + 1 < rank) {
+          songs.push_back(songs.front());
+        }
+        songs.push_back(Song(artist, title));
+      }
+      files.push_back(std::make_pair(name, std::vector<Song>()));
+      files.back().second.swap(songs);
+    }
+
+    files_.clear();
+    refs_.clear();
+    songs_ = 0;
+    membership_ = ChartMembership();
+    for (const auto& file : files) {
+      update(file.first, file.second);
+    }
+    signature_ = saved;
+    return true;
+  }
+
+  /**
+   * Charts each loaded song is on, and its rank on each
+   */
+  const ChartMembership& membership() const {
+    return membership_;
+  }
+};
+
+#endif //LAB5_CHART_SOURCES_H
@@ -0,0 +1,316 @@
+/**
+ * @file
+ *
+ * This file contains the prefix index used to autocomplete artists and titles
+ * as they are typed.
+ *
+ * Keys are kept in a radix trie: each edge is labelled with a run of characters
+ * rather than a single one, so a chain of nodes with one child each is stored as
+ * a single node.  Matching is case-insensitive; each key remembers how it was
+ * spelled, and completes to its most common spelling.
+ *
+ * Every key has a weight, the number of songs with it, and every node caches the
+ * largest weight below it.  The top completions of a prefix are found best-first:
+ * the node the prefix leads to is expanded in order of cached weight, so only the
+ * branches that can still make the top k are visited, however many keys share
+ * the prefix.  Keys are added and removed one song at a time as the library
+ * changes, updating the cached weights along the path.
+ *
+ */
+#ifndef LAB5_COMPLETION_TRIE_H
+#define LAB5_COMPLETION_TRIE_H
+
+#include <cstdint>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <queue>
+#include <algorithm>
+
+// most completions returned for one prefix
+#define COMPLETION_MAX 100
+
+/**
+ * A completion of a prefix, and the number of songs it covers
+ */
+struct Completion {
+  std::string text;
+  uint32_t songs;
+};
+
+/**
+ * Radix trie of weighted keys, for top-k prefix completion
+ */
+class CompletionTrie {
+  struct Node {
+    std::string label;                            // characters on the edge into this node
+    std::vector<std::unique_ptr<Node>> children;  // sorted by first character
+    std::map<std::string, uint32_t> spellings;    // spelling -> songs, if a key ends here
+    uint32_t weight = 0;                          // songs with the key ending here
+    uint32_t best = 0;                            // largest weight in the subtree
+  };
+
+  // candidate in the best-first search, either a subtree or a key
+  struct Entry {
+    uint32_t weight;
+    std::string key;
+    const Node* node;
+    bool subtree;
+
+    // heaviest first, then alphabetical, keys before their own subtree
+    bool operator<(const Entry& other) const {
+      if (weight != other.weight) {
+        return weight < other.weight;
+      }
+      if (key != other.key) {
+        return key > other.key;
+      }
+      return subtree && !other.subtree;
+    }
+  };
+
+  Node root_;
+  size_t keys_;
+
+  static std::string fold(const std::string& str) {
+    std::string out = str;
+    for (char& c : out) {
+      c = (char)std::tolower((unsigned char)c);
+    }
+    return out;
+  }
+
+  static std::vector<std::unique_ptr<Node>>::iterator child(Node& node, char c) {
+    return std::lower_bound(node.children.begin(), node.children.end(), c,
+                            [](const std::unique_ptr<Node>& n, char c) { return n->label[0] < c; });
+  }
+
+  static void update(Node& node) {
+    node.best = node.weight;
+    for (const auto& c : node.children) {
+      node.best = std::max(node.best, c->best);
+    }
+  }
+
+  // most common spelling of the key ending at a node
+  static const std::string& spelling(const Node& node) {
+    auto best = node.spellings.begin();
+    for (auto it = node.spellings.begin(); it != node.spellings.end(); ++it) {
+      if (it->second > best->second) {
+        best = it;
+      }
+    }
+    return best->first;
+  }
+
+  // node whose keys all start with a prefix, which may end part way along the
+  // edge into it, and the key up to that node
+  const Node* descend(const std::string& prefix, std::string& path) const {
+    std::string key = fold(prefix);
+    const Node* node = &root_;
+    size_t pos = 0;
+    while (pos < key.size()) {
+      auto it = std::lower_bound(node->children.begin(), node->children.end(), key[pos],
+                                 [](const std::unique_ptr<Node>& n, char c) { return n->label[0] < c; });
+      if (it == node->children.end() || (*it)->label[0] != key[pos]) {
+        return nullptr;
+      }
+      const std::string& label = (*it)->label;
+      size_t n = std::min(label.size(), key.size() - pos);
+      if (key.compare(pos, n, label, 0, n) != 0) {
+        return nullptr;
+      }
+      pos += n;
+      path += label;
+      node = it->get();
+    }
+    return node;
+  }
+
+ public:
+  CompletionTrie() : root_(), keys_(0) {}
+
+  /**
+   * Adds one song with a key
+   * @param text artist or title
+   */
+  void add(const std::string& text) {
+    std::string key = fold(text);
+    std::vector<Node*> path(1, &root_);
+    size_t pos = 0;
+    while (pos < key.size()) {
+      Node& node = *path.back();
+      auto it = child(node, key[pos]);
+      if (it == node.children.end() || (*it)->label[0] != key[pos]) {
+        std::unique_ptr<Node> leaf(new Node());
+        leaf->label = key.substr(pos);
+        it = node.children.insert(it, std::move(leaf));
+        pos = key.size();
+      }
+      else {
+        // follow the edge as far as it matches, splitting it where it stops
+        const std::string& label = (*it)->label;
+        size_t n = 0;
+        while (n < label.size() && pos + n < key.size() && label[n] == key[pos + n]) {
+          ++n;
+        }
+        if (n < label.size()) {
+          std::unique_ptr<Node> split(new Node());
+          split->label = label.substr(0, n);
+          (*it)->label.erase(0, n);
+          split->best = (*it)->best;
+          split->children.push_back(std::move(*it));
+          *it = std::move(split);
+        }
+        pos += n;
+      }
+      path.push_back(it->get());
+    }
+
+    Node& end = *path.back();
+    if (end.weight == 0) {
+      ++keys_;
+    }
+    ++end.weight;
+    ++end.spellings[text];
+    for (Node* node : path) {
+      node->best = std::max(node->best, end.weight);
+    }
+  }
+
+  /**
+   * Removes one song with a key
+   * @param text artist or title, as it was added
+   * @return false if no song with the key was added
+   */
+  bool remove(const std::string& text) {
+    std::string key = fold(text);
+    std::vector<Node*> path(1, &root_);
+    size_t pos = 0;
+    while (pos < key.size()) {
+      Node& node = *path.back();
+      auto it = child(node, key[pos]);
+      if (it == node.children.end()
+          || key.compare(pos, (*it)->label.size(), (*it)->label) != 0) {
+        return false;
+      }
+      pos += (*it)->label.size();
+      path.push_back(it->get());
+    }
+
+    Node& end = *path.back();
+    auto spelt = end.spellings.find(text);
+    if (spelt == end.spellings.end()) {
+      return false;
+    }
+    if (--spelt->second == 0) {
+      end.spellings.erase(spelt);
+    }
+    if (--end.weight == 0) {
+      --keys_;
+    }
+
+    // prune empty leaves and merge nodes left with one child, then fix weights
+    for (size_t i = path.size(); i-- > 1;) {
+      Node& node = *path[i];
+      Node& parent = *path[i - 1];
+      if (node.weight == 0 && node.children.empty()) {
+        parent.children.erase(child(parent, node.label[0]));
+      }
+      else if (node.weight == 0 && node.children.size() == 1) {
+        std::unique_ptr<Node> only = std::move(node.children[0]);
+        only->label = node.label + only->label;
+        *child(parent, node.label[0]) = std::move(only);
+      }
+      else {
+        update(node);
+      }
+    }
+    update(root_);
+    return true;
+  }
+
+  /**
+   * Finds the keys starting with a prefix that most songs have
+   * @param prefix start of an artist or title, in any case
+   * @param count most completions to return, at most COMPLETION_MAX
+   * @return completions, most songs first, ties in alphabetical order
+   */
+  std::vector<Completion> complete(const std::string& prefix, size_t count) const {
+    std::vector<Completion> out;
+    count = std::min(count, (size_t)COMPLETION_MAX);
+    std::string path;
+    const Node* node = descend(prefix, path);
+    if (node == nullptr) {
+      return out;
+    }
+
+    std::priority_queue<Entry> queue;
+    queue.push(Entry{ node->best, path, node, true });
+    while (!queue.empty() && out.size() < count) {
+      Entry top = queue.top();
+      queue.pop();
+      if (!top.subtree) {
+        out.push_back(Completion{ spelling(*top.node), top.weight });
+        continue;
+      }
+      if (top.node->weight > 0) {
+        queue.push(Entry{ top.node->weight, top.key, top.node, false });
+      }
+      for (const auto& c : top.node->children) {
+        queue.push(Entry{ c->best, top.key + c->label, c.get(), true });
+      }
+    }
+    return out;
+  }
+
+  /**
+   * Visits the keys starting with a prefix, shortest first
+   * @param prefix start of an artist or title, in any case
+   * @param visit called with the most common spelling of each key, returning
+   *        false to stop
+   */
+  template <typename Visit>
+  void prefixed(const std::string& prefix, Visit visit) const {
+    std::string path;
+    const Node* node = descend(prefix, path);
+    if (node == nullptr) {
+      return;
+    }
+
+    // expand the subtree in order of key length, edges being of any length
+    using Entry = std::pair<size_t, const Node*>;
+    auto longer = [](const Entry& a, const Entry& b) { return a.first > b.first; };
+    std::priority_queue<Entry, std::vector<Entry>, decltype(longer)> queue(longer);
+    queue.push(Entry(path.size(), node));
+    while (!queue.empty()) {
+      Entry top = queue.top();
+      queue.pop();
+      if (top.second->weight > 0 && !visit(spelling(*top.second))) {
+        return;
+      }
+      for (const auto& c : top.second->children) {
+        queue.push(Entry(top.first + c->label.size(), c.get()));
+      }
+    }
+  }
+
+  /**
+   * Removes all keys
+   */
+  void clear() {
+    root_ = Node();
+    keys_ = 0;
+  }
+
+  /**
+   * Number of distinct keys, ignoring case
+   */
+  size_t size() const {
+    return keys_;
+  }
+};
+
+#endif //LAB5_COMPLETION_TRIE_H
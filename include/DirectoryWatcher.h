@@ -0,0 +1,153 @@
+/**
+ * @file
+ *
+ * This file contains a watcher reporting files that change in a directory, used by
+ * the server to reload chart files as they are updated.
+ *
+ * On Linux, inotify reports exactly which files were written, created, moved or
+ * deleted.  On Windows, a change notification only says that something in the
+ * directory changed, so every matching file is reported and callers are expected
+ * to skip files whose contents are unchanged.
+ *
+ */
+#ifndef LAB5_DIRECTORY_WATCHER_H
+#define LAB5_DIRECTORY_WATCHER_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <chrono>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Watches a directory for changes to files with a given suffix
+ */
+class DirectoryWatcher {
+  std::string dir_;
+  std::string suffix_;
+#ifdef _WIN32
+  HANDLE handle_;
+#else
+  int fd_;
+  int watch_;
+#endif
+
+  // prevent copies, the watch has a single owner
+  DirectoryWatcher(const DirectoryWatcher&);
+  DirectoryWatcher& operator=(const DirectoryWatcher&);
+
+  bool matches(const std::string& name) const {
+    return name.size() >= suffix_.size()
+        && name.compare(name.size() - suffix_.size(), suffix_.size(), suffix_) == 0;
+  }
+
+ public:
+  /**
+   * Starts watching a directory
+   * @param dir directory to watch
+   * @param suffix only files ending with this are reported
+   */
+  DirectoryWatcher(const std::string& dir, const std::string& suffix) :
+      dir_(dir), suffix_(suffix) {
+#ifdef _WIN32
+    handle_ = FindFirstChangeNotificationA(dir.c_str(), FALSE,
+        FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_SIZE);
+#else
+    fd_ = inotify_init1(IN_NONBLOCK);
+    watch_ = fd_ < 0 ? -1 : inotify_add_watch(fd_, dir.c_str(),
+        IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE);
+#endif
+  }
+
+  ~DirectoryWatcher() {
+#ifdef _WIN32
+    if (handle_ != INVALID_HANDLE_VALUE) {
+      FindCloseChangeNotification(handle_);
+    }
+#else
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+#endif
+  }
+
+  /**
+   * Checks whether the directory is being watched
+   */
+  bool valid() const {
+#ifdef _WIN32
+    return handle_ != INVALID_HANDLE_VALUE;
+#else
+    return watch_ >= 0;
+#endif
+  }
+
+  /**
+   * Waits for files to change
+   * @param changed names of changed files, relative to the directory
+   * @param timeout maximum time to wait
+   * @return true if any files changed
+   */
+  bool wait(std::vector<std::string>& changed, std::chrono::milliseconds timeout) {
+    changed.clear();
+    if (!valid()) {
+      return false;
+    }
+
+#ifdef _WIN32
+    if (WaitForSingleObject(handle_, (DWORD)timeout.count()) != WAIT_OBJECT_0) {
+      return false;
+    }
+    FindNextChangeNotification(handle_);
+
+    // no file names available, report every matching file
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((dir_ + "/*" + suffix_).c_str(), &data);
+    if (find != INVALID_HANDLE_VALUE) {
+      do {
+        if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+          changed.push_back(data.cFileName);
+        }
+      } while (FindNextFileA(find, &data));
+      FindClose(find);
+    }
+#else
+    struct pollfd pfd = { fd_, POLLIN, 0 };
+    if (poll(&pfd, 1, (int)timeout.count()) <= 0) {
+      return false;
+    }
+
+    // drain all pending events, reporting each file once
+    std::set<std::string> names;
+    alignas(struct inotify_event) char buff[4096];
+    ssize_t len;
+    while ((len = read(fd_, buff, sizeof(buff))) > 0) {
+      for (char* ptr = buff; ptr < buff + len; ) {
+        const struct inotify_event* event = (const struct inotify_event*)ptr;
+        if (event->len > 0 && !(event->mask & IN_ISDIR) && matches(event->name)) {
+          // a file being created isn't complete until it is closed
+          if (!(event->mask & IN_CREATE)) {
+            names.insert(event->name);
+          }
+        }
+        ptr += sizeof(struct inotify_event) + event->len;
+      }
+    }
+    changed.assign(names.begin(), names.end());
+#endif
+
+    return !changed.empty();
+  }
+};
+
+#endif //LAB5_DIRECTORY_WATCHER_H
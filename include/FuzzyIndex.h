@@ -0,0 +1,344 @@
+/**
+ * @file
+ *
+ * This file contains the index used to find artists and titles despite typos,
+ * e.g. "Imagin Dragons" for "Imagine Dragons".
+ *
+ * Each distinct artist (or title), ignoring case, is a key listing the ids of the
+ * songs that have it.  Keys are indexed by their trigrams, the runs of three
+ * characters of the key padded with two zero bytes on either side.  A key within edit
+ * distance d of a query shares all but at most 3d of the query's distinct
+ * trigrams, since each edit touches at most three of them.  A query only counts
+ * the trigrams it shares with the keys in its postings, and computes the edit
+ * distance to the few keys that share enough, rather than to every song.
+ *
+ * Queries too short for the count to rule anything out are checked against the
+ * keys of about the right length instead.
+ *
+ * Edit distances are computed bit-parallel (Myers' algorithm), 64 characters of
+ * the query at a time, so checking a key costs one pass over its characters.
+ *
+ * Keys are never dropped: a key whose songs have all been removed keeps its
+ * postings and is skipped, and is reused if a song with it is added again.
+ *
+ */
+#ifndef LAB5_FUZZY_INDEX_H
+#define LAB5_FUZZY_INDEX_H
+
+#include <cstdint>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+// largest edit distance a query may allow
+#define FUZZY_MAX_DISTANCE 3
+
+/**
+ * A key within the allowed distance of a query
+ */
+struct FuzzyMatch {
+  std::string key;                      // matched key, in lower case
+  uint32_t distance;
+  const std::vector<uint64_t>* songs;   // ids of the songs with the key, valid until
+                                        // the next change
+};
+
+/**
+ * Trigram index of distinct keys, for searches within an edit distance
+ */
+class FuzzyIndex {
+  struct Key {
+    std::string text;                   // in lower case
+    std::vector<uint64_t> songs;
+  };
+
+  std::vector<Key> keys_;
+  std::unordered_map<std::string, uint32_t> ids_;
+  std::unordered_map<uint32_t, std::vector<uint32_t>> grams_;   // trigram -> key ids
+  std::vector<std::vector<uint32_t>> lengths_;                  // length -> key ids
+  size_t live_;
+
+  /**
+   * Query compiled for bit-parallel edit distance
+   */
+  class Pattern {
+    const std::string& text_;
+    uint64_t peq_[256];
+
+   public:
+    explicit Pattern(const std::string& text) : text_(text), peq_() {
+      for (size_t i = 0; i < text.size() && i < 64; ++i) {
+        peq_[(uint8_t)text[i]] |= (uint64_t)1 << i;
+      }
+    }
+
+    /**
+     * Edit distance to a key
+     * @param key string to compare with
+     * @param max largest distance of interest
+     * @return edit distance, or something larger than max if it is
+     */
+    uint32_t distance(const std::string& key, uint32_t max) const {
+      size_t m = text_.size();
+      if (m == 0) {
+        return (uint32_t)key.size();
+      }
+      if (m > 64) {
+        return banded(key, max);
+      }
+      // Myers / Hyyro: one column of the distance matrix per character of the key
+      uint64_t pv = ~(uint64_t)0;
+      uint64_t mv = 0;
+      uint64_t last = (uint64_t)1 << (m - 1);
+      uint32_t score = (uint32_t)m;
+      for (char c : key) {
+        uint64_t eq = peq_[(uint8_t)c];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+        if (ph & last) {
+          ++score;
+        }
+        else if (mh & last) {
+          --score;
+        }
+        ph = (ph << 1) | 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+      }
+      return score;
+    }
+
+   private:
+    // long queries: the usual dynamic program, only within max of the diagonal
+    uint32_t banded(const std::string& key, uint32_t max) const {
+      size_t m = text_.size();
+      size_t n = key.size();
+      uint32_t far = max + 1;
+      if ((m > n ? m - n : n - m) > max) {
+        return far;
+      }
+      std::vector<uint32_t> row(n + 1), next(n + 1);
+      for (size_t j = 0; j <= n; ++j) {
+        row[j] = (uint32_t)std::min<size_t>(j, far);
+      }
+      for (size_t i = 1; i <= m; ++i) {
+        size_t lo = i > max ? i - max : 1;
+        size_t hi = std::min(n, i + max);
+        std::fill(next.begin(), next.end(), far);
+        next[0] = (uint32_t)std::min<size_t>(i, far);
+        for (size_t j = lo; j <= hi; ++j) {
+          uint32_t cost = text_[i - 1] == key[j - 1] ? 0 : 1;
+          next[j] = std::min({ row[j - 1] + cost, row[j] + 1, next[j - 1] + 1, far });
+        }
+        row.swap(next);
+      }
+      return row[n];
+    }
+  };
+
+  static std::string fold(const std::string& str) {
+    std::string out = str;
+    for (char& c : out) {
+      c = (char)std::tolower((unsigned char)c);
+    }
+    return out;
+  }
+
+  // distinct trigrams of a key, padded with two zero bytes on either side
+  static std::vector<uint32_t> trigrams(const std::string& key) {
+    std::string padded = std::string(2, '\0') + key + std::string(2, '\0');
+    std::vector<uint32_t> out;
+    for (size_t i = 0; i + 3 <= padded.size(); ++i) {
+      out.push_back((uint32_t)(uint8_t)padded[i] << 16 | (uint32_t)(uint8_t)padded[i + 1] << 8
+                    | (uint8_t)padded[i + 2]);
+    }
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+    return out;
+  }
+
+  void check(const Pattern& pattern, uint32_t id, uint32_t max,
+             std::vector<FuzzyMatch>& out) const {
+    const Key& key = keys_[id];
+    if (key.songs.empty()) {
+      return;
+    }
+    uint32_t distance = pattern.distance(key.text, max);
+    if (distance <= max) {
+      out.push_back(FuzzyMatch{ key.text, distance, &key.songs });
+    }
+  }
+
+ public:
+  FuzzyIndex() : keys_(), ids_(), grams_(), lengths_(), live_(0) {}
+
+  /**
+   * Adds a song with a key
+   * @param text artist or title
+   * @param song id of the song
+   */
+  void add(const std::string& text, uint64_t song) {
+    std::string key = fold(text);
+    auto it = ids_.find(key);
+    if (it == ids_.end()) {
+      uint32_t id = (uint32_t)keys_.size();
+      it = ids_.insert(std::make_pair(key, id)).first;
+      keys_.push_back(Key{ key, {} });
+      for (uint32_t gram : trigrams(key)) {
+        grams_[gram].push_back(id);
+      }
+      if (lengths_.size() <= key.size()) {
+        lengths_.resize(key.size() + 1);
+      }
+      lengths_[key.size()].push_back(id);
+    }
+    std::vector<uint64_t>& songs = keys_[it->second].songs;
+    if (songs.empty()) {
+      ++live_;
+    }
+    songs.push_back(song);
+  }
+
+  /**
+   * Removes a song with a key
+   * @param text artist or title
+   * @param song id of the song
+   * @return false if the song was not added with the key
+   */
+  bool remove(const std::string& text, uint64_t song) {
+    auto it = ids_.find(fold(text));
+    if (it == ids_.end()) {
+      return false;
+    }
+    std::vector<uint64_t>& songs = keys_[it->second].songs;
+    auto at = std::find(songs.begin(), songs.end(), song);
+    if (at == songs.end()) {
+      return false;
+    }
+    songs.erase(at);
+    if (songs.empty()) {
+      --live_;
+    }
+    return true;
+  }
+
+  /**
+   * Finds the keys within an edit distance of a query
+   * @param query artist or title, possibly misspelt, in any case
+   * @param max largest edit distance allowed, at most FUZZY_MAX_DISTANCE
+   * @return matching keys, in no particular order
+   */
+  std::vector<FuzzyMatch> search(const std::string& query, uint32_t max) const {
+    std::vector<FuzzyMatch> out;
+    max = std::min(max, (uint32_t)FUZZY_MAX_DISTANCE);
+    std::string q = fold(query);
+    Pattern pattern(q);
+
+    std::vector<uint32_t> grams = trigrams(q);
+    if (grams.size() <= 3*max) {
+      // too short for shared trigrams to rule anything out, compare similar lengths
+      size_t lo = q.size() > max ? q.size() - max : 0;
+      for (size_t len = lo; len <= q.size() + max && len < lengths_.size(); ++len) {
+        for (uint32_t id : lengths_[len]) {
+          check(pattern, id, max, out);
+        }
+      }
+      return out;
+    }
+
+    size_t needed = grams.size() - 3*max;
+    std::unordered_map<uint32_t, uint32_t> shared;
+    for (uint32_t gram : grams) {
+      auto it = grams_.find(gram);
+      if (it == grams_.end()) {
+        continue;
+      }
+      for (uint32_t id : it->second) {
+        if (++shared[id] == needed) {
+          size_t len = keys_[id].text.size();
+          if ((len > q.size() ? len - q.size() : q.size() - len) <= max) {
+            check(pattern, id, max, out);
+          }
+        }
+      }
+    }
+    return out;
+  }
+
+  /**
+   * Songs with a key
+   * @param text artist or title, in any case
+   * @return ids of the songs, valid until the next change, nullptr if none
+   */
+  const std::vector<uint64_t>* songs(const std::string& text) const {
+    auto it = ids_.find(fold(text));
+    if (it == ids_.end() || keys_[it->second].songs.empty()) {
+      return nullptr;
+    }
+    return &keys_[it->second].songs;
+  }
+
+  /**
+   * Visits the keys containing a string.  Only the keys posted under the rarest
+   * trigram of the string are checked, or every key if it is shorter than three.
+   * @param text part of an artist or title, in any case
+   * @param visit called with each key, in lower case, and the ids of its songs
+   */
+  template <typename Visit>
+  void containing(const std::string& text, Visit visit) const {
+    std::string part = fold(text);
+    const std::vector<uint32_t>* rarest = nullptr;
+    for (size_t i = 0; i + 3 <= part.size(); ++i) {
+      uint32_t gram = (uint32_t)(uint8_t)part[i] << 16 | (uint32_t)(uint8_t)part[i + 1] << 8
+                      | (uint8_t)part[i + 2];
+      auto it = grams_.find(gram);
+      if (it == grams_.end()) {
+        return;
+      }
+      if (rarest == nullptr || it->second.size() < rarest->size()) {
+        rarest = &it->second;
+      }
+    }
+    auto consider = [&](uint32_t id) {
+      const Key& key = keys_[id];
+      if (!key.songs.empty() && key.text.find(part) != std::string::npos) {
+        visit(key.text, key.songs);
+      }
+    };
+    if (rarest != nullptr) {
+      for (uint32_t id : *rarest) {
+        consider(id);
+      }
+    }
+    else {
+      for (uint32_t id = 0; id < keys_.size(); ++id) {
+        consider(id);
+      }
+    }
+  }
+
+  /**
+   * Removes all keys
+   */
+  void clear() {
+    keys_.clear();
+    ids_.clear();
+    grams_.clear();
+    lengths_.clear();
+    live_ = 0;
+  }
+
+  /**
+   * Number of distinct keys with songs, ignoring case
+   */
+  size_t size() const {
+    return live_;
+  }
+};
+
+#endif //LAB5_FUZZY_INDEX_H
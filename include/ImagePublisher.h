@@ -0,0 +1,192 @@
+/**
+ * @file
+ *
+ * This file contains the publishing of library images to read-only worker
+ * processes through shared memory.
+ *
+ * The primary places each image in a shared memory block of its own, named after
+ * its generation, and the newest generation in a control block that the workers
+ * map too.  When the library has changed it publishes the next generation, and
+ * drops the one before the previous: a worker that has just read the generation
+ * may still be mapping the previous one.  Workers check the generation as each
+ * request comes in and map the newest image when it has moved on.  A request keeps
+ * the image it started with, which stays mapped until it is done even once the
+ * primary has unlinked it.
+ *
+ * Workers therefore see a change once the primary has published an image with it,
+ * and not before.
+ *
+ */
+#ifndef LAB5_IMAGE_PUBLISHER_H
+#define LAB5_IMAGE_PUBLISHER_H
+
+#include "LibraryImage.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstring>
+
+/**
+ * Control block shared by the primary and its workers
+ */
+struct ImageControl {
+  std::atomic<bool> stop;             // set when the workers are to shut down
+  std::atomic<uint64_t> generation;   // newest image published, 0 before the first
+
+  ImageControl() : stop(false), generation(0) {}
+};
+
+/**
+ * Publishes library images for workers, in the primary
+ * @tparam SharedMemory named shared memory block, constructed from a name, a size and
+ *         whether it is read-only, with get() and unlink()
+ */
+template <typename SharedMemory>
+class ImagePublisher {
+  std::string name_;
+  ImageControl& control_;
+  std::unique_ptr<SharedMemory> current_;
+  std::unique_ptr<SharedMemory> previous_;
+
+ public:
+  /**
+   * Creates a publisher that has published nothing yet
+   * @param name base name of the images' shared memory blocks
+   * @param control control block, in shared memory
+   */
+  ImagePublisher(const std::string& name, ImageControl& control) :
+      name_(name), control_(control), current_(), previous_() {}
+
+  ImagePublisher(const ImagePublisher&) = delete;
+  ImagePublisher& operator=(const ImagePublisher&) = delete;
+
+  /**
+   * Name of the shared memory block of an image
+   * @param name base name of the images' shared memory blocks
+   * @param generation generation of the image
+   */
+  static std::string name(const std::string& name, uint64_t generation) {
+    return name + "_" + std::to_string(generation);
+  }
+
+  /**
+   * Publishes an image as the next generation, and drops the one before the previous
+   * @param image image, as built by LibraryImage::build
+   * @return generation of the image
+   */
+  uint64_t publish(const std::vector<char>& image) {
+    uint64_t generation = control_.generation + 1;
+    std::unique_ptr<SharedMemory> memory(new SharedMemory(name(name_, generation), image.size()));
+    std::memcpy(memory->get(), image.data(), image.size());
+    if (previous_ != nullptr) {
+      previous_->unlink();
+    }
+    previous_ = std::move(current_);
+    current_ = std::move(memory);
+    control_.generation = generation;
+    return generation;
+  }
+
+  /**
+   * Unlinks the images still published, once the workers have stopped
+   */
+  void unlink() {
+    if (previous_ != nullptr) {
+      previous_->unlink();
+    }
+    if (current_ != nullptr) {
+      current_->unlink();
+    }
+  }
+};
+
+/**
+ * Newest library image published by the primary, in a worker
+ * @tparam SharedMemory named shared memory block, as for ImagePublisher
+ */
+template <typename SharedMemory>
+class PublishedImage {
+  // a generation mapped, with the image in it
+  struct Mapped {
+    std::unique_ptr<SharedMemory> memory;
+    LibraryImage image;
+    uint64_t generation;
+  };
+
+  std::string name_;
+  const ImageControl& control_;
+  std::mutex mutex_;
+  std::shared_ptr<const Mapped> current_;
+  uint64_t seen_;           // newest generation tried, mapped or not
+
+  // maps a generation, learning its size from its header first
+  std::shared_ptr<const Mapped> map(uint64_t generation) const {
+    std::string name = ImagePublisher<SharedMemory>::name(name_, generation);
+    uint64_t size;
+    {
+      SharedMemory header(name, sizeof(LibraryImageHeader), true);
+      const LibraryImageHeader* h = (const LibraryImageHeader*)header.get();
+      if (h->magic != LIBRARY_IMAGE_MAGIC || h->size < sizeof(LibraryImageHeader)) {
+        return nullptr;
+      }
+      size = h->size;
+    }
+    std::shared_ptr<Mapped> mapped(new Mapped{
+        std::unique_ptr<SharedMemory>(new SharedMemory(name, (size_t)size, true)),
+        LibraryImage(), generation });
+    mapped->image = LibraryImage((const char*)mapped->memory->get(), (size_t)size);
+    if (!mapped->image.valid()) {
+      return nullptr;
+    }
+    return mapped;
+  }
+
+ public:
+  /**
+   * Creates a view of the images published, mapping none yet
+   * @param name base name of the images' shared memory blocks
+   * @param control control block, in shared memory
+   */
+  PublishedImage(const std::string& name, const ImageControl& control) :
+      name_(name), control_(control), mutex_(), current_(), seen_(0) {}
+
+  PublishedImage(const PublishedImage&) = delete;
+  PublishedImage& operator=(const PublishedImage&) = delete;
+
+  /**
+   * Newest image published, mapping it if the generation has moved on.  An image
+   * that is not valid is skipped, keeping the one mapped before until the next
+   * generation.
+   * @return image, valid for as long as the pointer is held, nullptr if none was
+   *         published yet
+   */
+  std::shared_ptr<const LibraryImage> current() {
+    uint64_t generation = control_.generation;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (generation != seen_) {
+      seen_ = generation;
+      std::shared_ptr<const Mapped> mapped = map(generation);
+      if (mapped != nullptr) {
+        current_ = mapped;
+      }
+    }
+    if (current_ == nullptr) {
+      return nullptr;
+    }
+    return std::shared_ptr<const LibraryImage>(current_, &current_->image);
+  }
+
+  /**
+   * Generation of the image last mapped, 0 if none
+   */
+  uint64_t generation() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return current_ == nullptr ? 0 : current_->generation;
+  }
+};
+
+#endif //LAB5_IMAGE_PUBLISHER_H
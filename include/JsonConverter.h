@@ -28,6 +28,24 @@ using JSON = nlohmann::json;
 #define MESSAGE_SEARCH "search"
 #define MESSAGE_SEARCH_RESPONSE "search_response"
 #define MESSAGE_GOODBYE "goodbye"
+#define MESSAGE_LYRICS_SEARCH "lyrics_search"
+#define MESSAGE_LYRICS_SEARCH_RESPONSE "lyrics_search_response"
+#define MESSAGE_GET_LYRICS "get_lyrics"
+#define MESSAGE_GET_LYRICS_RESPONSE "get_lyrics_response"
+#define MESSAGE_TOP_N "top_n"
+#define MESSAGE_TOP_N_RESPONSE "top_n_response"
+#define MESSAGE_CHART_HISTORY "chart_history"
+#define MESSAGE_CHART_HISTORY_RESPONSE "chart_history_response"
+#define MESSAGE_LOOKUP "lookup"
+#define MESSAGE_LOOKUP_RESPONSE "lookup_response"
+#define MESSAGE_AUTOCOMPLETE "autocomplete"
+#define MESSAGE_AUTOCOMPLETE_RESPONSE "autocomplete_response"
+#define MESSAGE_FUZZY_SEARCH "fuzzy_search"
+#define MESSAGE_FUZZY_SEARCH_RESPONSE "fuzzy_search_response"
+#define MESSAGE_RANKED_SEARCH "ranked_search"
+#define MESSAGE_RANKED_SEARCH_RESPONSE "ranked_search_response"
+#define MESSAGE_CANCEL "cancel"
+#define MESSAGE_CANCEL_RESPONSE "cancel_response"
 
 // other keys
 #define MESSAGE_TYPE "msg"
@@ -37,8 +55,48 @@ using JSON = nlohmann::json;
 #define MESSAGE_SONG "song"
 #define MESSAGE_SONG_ARTIST "artist"
 #define MESSAGE_SONG_TITLE "title"
+#define MESSAGE_SONG_ID "id"
+#define MESSAGE_SONG_IDS "ids"
+#define MESSAGE_SONG_ALBUM "album"
+#define MESSAGE_SONG_YEAR "year"
+#define MESSAGE_SONG_DURATION "duration"
+#define MESSAGE_SONG_GENRE "genre"
+#define MESSAGE_YEAR_MIN "year_min"
+#define MESSAGE_YEAR_MAX "year_max"
+#define MESSAGE_DURATION_MIN "duration_min"
+#define MESSAGE_DURATION_MAX "duration_max"
 #define MESSAGE_SONG_ARTIST_REGEX "artist_regex"
 #define MESSAGE_SONG_TITLE_REGEX "title_regex"
+#define MESSAGE_CHART_FILTER "charts"
+#define MESSAGE_LYRICS_QUERY "query"
+#define MESSAGE_LYRICS_SNIPPETS "snippets"
+#define MESSAGE_LYRICS "lyrics"
+#define MESSAGE_CHART "chart"
+#define MESSAGE_COUNT "count"
+#define MESSAGE_RANKS "ranks"
+#define MESSAGE_TRAJECTORY "trajectory"
+#define MESSAGE_HISTORY "history"
+#define MESSAGE_WEEKS "weeks"
+#define MESSAGE_PEAK "peak"
+#define MESSAGE_WEEKS_AT_PEAK "weeks_at_peak"
+#define MESSAGE_FIRST "first"
+#define MESSAGE_LAST "last"
+#define MESSAGE_LAST_RANK "last_rank"
+#define MESSAGE_POSITIONS "positions"
+#define MESSAGE_DATE "date"
+#define MESSAGE_RANK "rank"
+#define MESSAGE_FIELD "field"
+#define MESSAGE_PREFIX "prefix"
+#define MESSAGE_COMPLETIONS "completions"
+#define MESSAGE_TEXT "text"
+#define MESSAGE_SONGS "songs"
+#define MESSAGE_MAX_DISTANCE "max_distance"
+#define MESSAGE_DISTANCES "distances"
+#define MESSAGE_MATCHES "matches"
+#define MESSAGE_REQUEST "request"
+
+// names of the kinds of match of a ranked search, indexed by MatchKind
+static const char* const MESSAGE_MATCH_KINDS[] = { "", "fuzzy", "substring", "prefix", "exact" };
 
 /**
  * Handles all conversions to and from JSON
@@ -57,6 +115,30 @@ class JsonConverter {
     return j;
   }
 
+  /**
+   * Converts a song and its metadata to a JSON object, only including the
+   * metadata that is known
+   * @param song song to jsonify
+   * @param info metadata of the song
+   * @return JSON object representation
+   */
+  static JSON toJSON(const Song &song, const SongInfo &info) {
+    JSON j = toJSON(song);
+    if (!info.album.empty()) {
+      j[MESSAGE_SONG_ALBUM] = info.album;
+    }
+    if (info.year != 0) {
+      j[MESSAGE_SONG_YEAR] = info.year;
+    }
+    if (info.duration != 0) {
+      j[MESSAGE_SONG_DURATION] = info.duration;
+    }
+    if (!info.genre.empty()) {
+      j[MESSAGE_SONG_GENRE] = info.genre;
+    }
+    return j;
+  }
+
   /**
    * Converts a vector of songs to a JSON array of objects
    * @param songs vector of songs to jsonify
@@ -70,6 +152,28 @@ class JsonConverter {
     return j;
   }
 
+  /**
+   * Converts a vector of songs to a JSON array of objects, each with its metadata
+   * and id if given
+   * @param songs vector of songs to jsonify
+   * @param metadata metadata of each song, or empty
+   * @param ids id of each song, or empty
+   * @return JSON array representation
+   */
+  static JSON toJSON(const std::vector<Song> &songs, const std::vector<SongInfo> &metadata,
+                     const std::vector<uint64_t> &ids) {
+    JSON j = JSON::array();
+    for (size_t i = 0; i < songs.size(); ++i) {
+      JSON jsong = metadata.size() == songs.size() ? toJSON(songs[i], metadata[i])
+                                                   : toJSON(songs[i]);
+      if (ids.size() == songs.size()) {
+        jsong[MESSAGE_SONG_ID] = ids[i];
+      }
+      j.push_back(jsong);
+    }
+    return j;
+  }
+
   /**
    * Converts a vector of songs to a JSON array of objects
    * @param songs vector of songs to jsonify
@@ -83,6 +187,31 @@ class JsonConverter {
     return j;
   }
 
+  /**
+   * Converts the chart stats of a song to a JSON object
+   * @param stats stats to jsonify
+   * @return JSON object representation
+   */
+  static JSON toJSON(const ChartStats &stats) {
+    JSON j;
+    j[MESSAGE_CHART] = stats.chart;
+    j[MESSAGE_WEEKS] = stats.weeks;
+    j[MESSAGE_PEAK] = stats.peak;
+    j[MESSAGE_WEEKS_AT_PEAK] = stats.weeks_at_peak;
+    j[MESSAGE_FIRST] = ChartHistory::formatDate(stats.first);
+    j[MESSAGE_LAST] = ChartHistory::formatDate(stats.last);
+    j[MESSAGE_LAST_RANK] = stats.last_rank;
+    JSON positions = JSON::array();
+    for (const auto& position : stats.positions) {
+      JSON p;
+      p[MESSAGE_DATE] = ChartHistory::formatDate(position.date);
+      p[MESSAGE_RANK] = position.rank;
+      positions.push_back(p);
+    }
+    j[MESSAGE_POSITIONS] = positions;
+    return j;
+  }
+
   /**
    * Converts an "add" message to a JSON object
    * @param add message
@@ -91,7 +220,7 @@ class JsonConverter {
   static JSON toJSON(const AddMessage &add) {
     JSON j;
     j[MESSAGE_TYPE] = MESSAGE_ADD;
-    j[MESSAGE_SONG] = toJSON(add.song);
+    j[MESSAGE_SONG] = toJSON(add.song, add.info);
     return j;
   }
 
@@ -115,7 +244,13 @@ class JsonConverter {
   static JSON toJSON(const RemoveMessage &remove) {
 	  JSON j;
 	  j[MESSAGE_TYPE] = MESSAGE_REMOVE;
-	  j[MESSAGE_SONG] = toJSON(remove.song);
+	  if (remove.id != SONG_ID_NONE) {
+		  j[MESSAGE_SONG_ID] = remove.id;
+	  }
+	  // by id, the song is only sent back once it is known
+	  if (remove.id == SONG_ID_NONE || !remove.song.artist.empty() || !remove.song.title.empty()) {
+		  j[MESSAGE_SONG] = toJSON(remove.song);
+	  }
 	  return j;
   }
 
@@ -138,6 +273,25 @@ class JsonConverter {
     j[MESSAGE_TYPE] = MESSAGE_SEARCH;
     j[MESSAGE_SONG_ARTIST_REGEX] = search.artist_regex;
     j[MESSAGE_SONG_TITLE_REGEX] = search.title_regex;
+    if (!search.chart_filter.empty()) {
+      j[MESSAGE_CHART_FILTER] = search.chart_filter;
+    }
+    const SongInfoFilter& filter = search.info_filter;
+    if (filter.year_min != 0) {
+      j[MESSAGE_YEAR_MIN] = filter.year_min;
+    }
+    if (filter.year_max != 0) {
+      j[MESSAGE_YEAR_MAX] = filter.year_max;
+    }
+    if (filter.duration_min != 0) {
+      j[MESSAGE_DURATION_MIN] = filter.duration_min;
+    }
+    if (filter.duration_max != 0) {
+      j[MESSAGE_DURATION_MAX] = filter.duration_max;
+    }
+    if (search.request != REQUEST_ID_NONE) {
+      j[MESSAGE_REQUEST] = search.request;
+    }
     return j;
   }
 
@@ -152,7 +306,284 @@ class JsonConverter {
     j[MESSAGE_STATUS] = search_response.status;
     j[MESSAGE_INFO] = search_response.info;
     j[MESSAGE_SEARCH] = toJSON(search_response.search);
+    j[MESSAGE_SEARCH_RESULTS] = toJSON(search_response.results, search_response.metadata,
+                                       search_response.ids);
+    return j;
+  }
+
+  /**
+   * Converts a "lyrics search" message to a JSON object
+   * @param search message
+   * @return JSON object representation
+   */
+  static JSON toJSON(const LyricsSearchMessage &search) {
+    JSON j;
+    j[MESSAGE_TYPE] = MESSAGE_LYRICS_SEARCH;
+    j[MESSAGE_LYRICS_QUERY] = search.query;
+    return j;
+  }
+
+  /**
+   * Converts a "lyrics search" response message to a JSON object
+   * @param search_response message
+   * @return JSON object representation
+   */
+  static JSON toJSON(const LyricsSearchResponseMessage &search_response) {
+    JSON j;
+    j[MESSAGE_TYPE] = MESSAGE_LYRICS_SEARCH_RESPONSE;
+    j[MESSAGE_STATUS] = search_response.status;
+    j[MESSAGE_INFO] = search_response.info;
+    j[MESSAGE_LYRICS_SEARCH] = toJSON(search_response.search);
     j[MESSAGE_SEARCH_RESULTS] = toJSON(search_response.results);
+    j[MESSAGE_LYRICS_SNIPPETS] = search_response.snippets;
+    return j;
+  }
+
+  /**
+   * Converts a "get lyrics" message to a JSON object
+   * @param get message
+   * @return JSON object representation
+   */
+  static JSON toJSON(const GetLyricsMessage &get) {
+    JSON j;
+    j[MESSAGE_TYPE] = MESSAGE_GET_LYRICS;
+    j[MESSAGE_SONG] = toJSON(get.song);
+    return j;
+  }
+
+  /**
+   * Converts a "get lyrics" response message to a JSON object
+   * @param get_response message
+   * @return JSON object representation
+   */
+  static JSON toJSON(const GetLyricsResponseMessage &get_response) {
+    JSON j;
+    j[MESSAGE_TYPE] = MESSAGE_GET_LYRICS_RESPONSE;
+    j[MESSAGE_STATUS] = get_response.status;
+    j[MESSAGE_INFO] = get_response.info;
+    j[MESSAGE_GET_LYRICS] = toJSON(get_response.get);
+    j[MESSAGE_LYRICS] = get_response.lyrics;
+    return j;
+  }
+
+  /**
+   * Converts a "top n" message to a JSON object
+   * @param top message
+   * @return JSON object representation
+   */
+  static JSON toJSON(const TopNMessage &top) {
+    JSON j;
+    j[MESSAGE_TYPE] = MESSAGE_TOP_N;
+    j[MESSAGE_CHART] = top.chart;
+    j[MESSAGE_COUNT] = top.count;
+    j[MESSAGE_SONG_ARTIST_REGEX] = top.artist_regex;
+    j[MESSAGE_SONG_TITLE_REGEX] = top.title_regex;
+    if (top.request != REQUEST_ID_NONE) {
+      j[MESSAGE_REQUEST] = top.request;
+    }
+    return j;
+  }
+
+  /**
+   * Converts a "top n" response message to a JSON object
+   * @param top_response message
+   * @return JSON object representation
+   */
+  static JSON toJSON(const TopNResponseMessage &top_response) {
+    JSON j;
+    j[MESSAGE_TYPE] = MESSAGE_TOP_N_RESPONSE;
+    j[MESSAGE_STATUS] = top_response.status;
+    j[MESSAGE_INFO] = top_response.info;
+    j[MESSAGE_TOP_N] = toJSON(top_response.top);
+    j[MESSAGE_SEARCH_RESULTS] = toJSON(top_response.results);
+    j[MESSAGE_RANKS] = top_response.ranks;
+    return j;
+  }
+
+  /**
+   * Converts a "chart history" message to a JSON object
+   * @param history message
+   * @return JSON object representation
+   */
+  static JSON toJSON(const ChartHistoryMessage &history) {
+    JSON j;
+    j[MESSAGE_TYPE] = MESSAGE_CHART_HISTORY;
+    j[MESSAGE_SONG] = toJSON(history.song);
+    j[MESSAGE_TRAJECTORY] = history.trajectory;
+    return j;
+  }
+
+  /**
+   * Converts a "chart history" response message to a JSON object
+   * @param history_response message
+   * @return JSON object representation
+   */
+  static JSON toJSON(const ChartHistoryResponseMessage &history_response) {
+    JSON j;
+    j[MESSAGE_TYPE] = MESSAGE_CHART_HISTORY_RESPONSE;
+    j[MESSAGE_STATUS] = history_response.status;
+    j[MESSAGE_INFO] = history_response.info;
+    j[MESSAGE_CHART_HISTORY] = toJSON(history_response.history);
+    JSON charts = JSON::array();
+    for (const auto& stats : history_response.charts) {
+      charts.push_back(toJSON(stats));
+    }
+    j[MESSAGE_HISTORY] = charts;
+    return j;
+  }
+
+  /**
+   * Converts a "lookup" message to a JSON object
+   * @param lookup message
+   * @return JSON object representation
+   */
+  static JSON toJSON(const LookupMessage &lookup) {
+    JSON j;
+    j[MESSAGE_TYPE] = MESSAGE_LOOKUP;
+    j[MESSAGE_SONG_IDS] = lookup.ids;
+    return j;
+  }
+
+  /**
+   * Converts a "lookup" response message to a JSON object
+   * @param lookup_response message
+   * @return JSON object representation
+   */
+  static JSON toJSON(const LookupResponseMessage &lookup_response) {
+    JSON j;
+    j[MESSAGE_TYPE] = MESSAGE_LOOKUP_RESPONSE;
+    j[MESSAGE_STATUS] = lookup_response.status;
+    j[MESSAGE_INFO] = lookup_response.info;
+    j[MESSAGE_LOOKUP] = toJSON(lookup_response.lookup);
+    j[MESSAGE_SEARCH_RESULTS] = toJSON(lookup_response.results, lookup_response.metadata,
+                                       lookup_response.ids);
+    return j;
+  }
+
+  /**
+   * Converts an "autocomplete" message to a JSON object
+   * @param autocomplete message
+   * @return JSON object representation
+   */
+  static JSON toJSON(const AutocompleteMessage &autocomplete) {
+    JSON j;
+    j[MESSAGE_TYPE] = MESSAGE_AUTOCOMPLETE;
+    j[MESSAGE_FIELD] = autocomplete.field;
+    j[MESSAGE_PREFIX] = autocomplete.prefix;
+    j[MESSAGE_COUNT] = autocomplete.count;
+    return j;
+  }
+
+  /**
+   * Converts an "autocomplete" response message to a JSON object
+   * @param autocomplete_response message
+   * @return JSON object representation
+   */
+  static JSON toJSON(const AutocompleteResponseMessage &autocomplete_response) {
+    JSON j;
+    j[MESSAGE_TYPE] = MESSAGE_AUTOCOMPLETE_RESPONSE;
+    j[MESSAGE_STATUS] = autocomplete_response.status;
+    j[MESSAGE_INFO] = autocomplete_response.info;
+    j[MESSAGE_AUTOCOMPLETE] = toJSON(autocomplete_response.autocomplete);
+    JSON completions = JSON::array();
+    for (const auto& completion : autocomplete_response.completions) {
+      JSON jc;
+      jc[MESSAGE_TEXT] = completion.text;
+      jc[MESSAGE_SONGS] = completion.songs;
+      completions.push_back(jc);
+    }
+    j[MESSAGE_COMPLETIONS] = completions;
+    return j;
+  }
+
+  /**
+   * Converts a "fuzzy search" message to a JSON object
+   * @param search message
+   * @return JSON object representation
+   */
+  static JSON toJSON(const FuzzySearchMessage &search) {
+    JSON j;
+    j[MESSAGE_TYPE] = MESSAGE_FUZZY_SEARCH;
+    j[MESSAGE_SONG_ARTIST] = search.artist;
+    j[MESSAGE_SONG_TITLE] = search.title;
+    j[MESSAGE_MAX_DISTANCE] = search.max_distance;
+    return j;
+  }
+
+  /**
+   * Converts a "fuzzy search" response message to a JSON object
+   * @param search_response message
+   * @return JSON object representation
+   */
+  static JSON toJSON(const FuzzySearchResponseMessage &search_response) {
+    JSON j;
+    j[MESSAGE_TYPE] = MESSAGE_FUZZY_SEARCH_RESPONSE;
+    j[MESSAGE_STATUS] = search_response.status;
+    j[MESSAGE_INFO] = search_response.info;
+    j[MESSAGE_FUZZY_SEARCH] = toJSON(search_response.search);
+    j[MESSAGE_SEARCH_RESULTS] = toJSON(search_response.results, std::vector<SongInfo>(),
+                                       search_response.ids);
+    j[MESSAGE_DISTANCES] = search_response.distances;
+    return j;
+  }
+
+  /**
+   * Converts a "ranked search" message to a JSON object
+   * @param search message
+   * @return JSON object representation
+   */
+  static JSON toJSON(const RankedSearchMessage &search) {
+    JSON j;
+    j[MESSAGE_TYPE] = MESSAGE_RANKED_SEARCH;
+    j[MESSAGE_LYRICS_QUERY] = search.query;
+    j[MESSAGE_COUNT] = search.count;
+    return j;
+  }
+
+  /**
+   * Converts a "ranked search" response message to a JSON object
+   * @param search_response message
+   * @return JSON object representation
+   */
+  static JSON toJSON(const RankedSearchResponseMessage &search_response) {
+    JSON j;
+    j[MESSAGE_TYPE] = MESSAGE_RANKED_SEARCH_RESPONSE;
+    j[MESSAGE_STATUS] = search_response.status;
+    j[MESSAGE_INFO] = search_response.info;
+    j[MESSAGE_RANKED_SEARCH] = toJSON(search_response.search);
+    j[MESSAGE_SEARCH_RESULTS] = toJSON(search_response.results, std::vector<SongInfo>(),
+                                       search_response.ids);
+    JSON matches = JSON::array();
+    for (uint32_t kind : search_response.kinds) {
+      matches.push_back(MESSAGE_MATCH_KINDS[kind <= MATCH_EXACT ? kind : 0]);
+    }
+    j[MESSAGE_MATCHES] = matches;
+    return j;
+  }
+
+  /**
+   * Converts a "cancel" message to a JSON object
+   * @param cancel message
+   * @return JSON object representation
+   */
+  static JSON toJSON(const CancelMessage &cancel) {
+    JSON j;
+    j[MESSAGE_TYPE] = MESSAGE_CANCEL;
+    j[MESSAGE_REQUEST] = cancel.request;
+    return j;
+  }
+
+  /**
+   * Converts a "cancel" response message to a JSON object
+   * @param cancel_response message
+   * @return JSON object representation
+   */
+  static JSON toJSON(const CancelResponseMessage &cancel_response) {
+    JSON j;
+    j[MESSAGE_TYPE] = MESSAGE_CANCEL_RESPONSE;
+    j[MESSAGE_STATUS] = cancel_response.status;
+    j[MESSAGE_INFO] = cancel_response.info;
+    j[MESSAGE_CANCEL] = toJSON(cancel_response.cancel);
     return j;
   }
 
@@ -193,6 +624,60 @@ class JsonConverter {
       }
       case GOODBYE: {
         return toJSON((GoodbyeMessage &) msg);
+      }
+      case LYRICS_SEARCH: {
+        return toJSON((LyricsSearchMessage &) msg);
+      }
+      case LYRICS_SEARCH_RESPONSE: {
+        return toJSON((LyricsSearchResponseMessage &) msg);
+      }
+      case GET_LYRICS: {
+        return toJSON((GetLyricsMessage &) msg);
+      }
+      case GET_LYRICS_RESPONSE: {
+        return toJSON((GetLyricsResponseMessage &) msg);
+      }
+      case TOP_N: {
+        return toJSON((TopNMessage &) msg);
+      }
+      case TOP_N_RESPONSE: {
+        return toJSON((TopNResponseMessage &) msg);
+      }
+      case CHART_HISTORY: {
+        return toJSON((ChartHistoryMessage &) msg);
+      }
+      case CHART_HISTORY_RESPONSE: {
+        return toJSON((ChartHistoryResponseMessage &) msg);
+      }
+      case LOOKUP: {
+        return toJSON((LookupMessage &) msg);
+      }
+      case LOOKUP_RESPONSE: {
+        return toJSON((LookupResponseMessage &) msg);
+      }
+      case AUTOCOMPLETE: {
+        return toJSON((AutocompleteMessage &) msg);
+      }
+      case AUTOCOMPLETE_RESPONSE: {
+        return toJSON((AutocompleteResponseMessage &) msg);
+      }
+      case FUZZY_SEARCH: {
+        return toJSON((FuzzySearchMessage &) msg);
+      }
+      case FUZZY_SEARCH_RESPONSE: {
+        return toJSON((FuzzySearchResponseMessage &) msg);
+      }
+      case RANKED_SEARCH: {
+        return toJSON((RankedSearchMessage &) msg);
+      }
+      case RANKED_SEARCH_RESPONSE: {
+        return toJSON((RankedSearchResponseMessage &) msg);
+      }
+      case CANCEL: {
+        return toJSON((CancelMessage &) msg);
+      }
+      case CANCEL_RESPONSE: {
+        return toJSON((CancelResponseMessage &) msg);
       }
 	  case REMOVE: {
 		  return toJSON((RemoveMessage &)msg);
@@ -221,6 +706,28 @@ class JsonConverter {
     return Song(j[MESSAGE_SONG_ARTIST], j[MESSAGE_SONG_TITLE]);
   }
 
+  /**
+   * Reads the metadata of a song from its JSON object, any of which may be missing
+   * @param j JSON object
+   * @return SongInfo, empty if there is none
+   */
+  static SongInfo parseSongInfo(const JSON &j) {
+    SongInfo info;
+    if (j.count(MESSAGE_SONG_ALBUM) > 0) {
+      info.album = j[MESSAGE_SONG_ALBUM].get<std::string>();
+    }
+    if (j.count(MESSAGE_SONG_YEAR) > 0) {
+      info.year = j[MESSAGE_SONG_YEAR];
+    }
+    if (j.count(MESSAGE_SONG_DURATION) > 0) {
+      info.duration = j[MESSAGE_SONG_DURATION];
+    }
+    if (j.count(MESSAGE_SONG_GENRE) > 0) {
+      info.genre = j[MESSAGE_SONG_GENRE].get<std::string>();
+    }
+    return info;
+  }
+
   /**
    * Converts a JSON array representing a list of songs to a
    * vector of Song objects
@@ -237,6 +744,58 @@ class JsonConverter {
     return out;
   }
 
+  /**
+   * Reads the metadata of each song in a JSON array
+   * @param jsongs JSON array
+   * @return metadata of each song, or empty if none has any
+   */
+  static std::vector<SongInfo> parseSongInfos(const JSON &jsongs) {
+    std::vector<SongInfo> out;
+    bool any = false;
+    for (const auto& jsong : jsongs) {
+      out.push_back(parseSongInfo(jsong));
+      any |= !out.back().empty();
+    }
+    if (!any) {
+      out.clear();
+    }
+    return out;
+  }
+
+  /**
+   * Reads the id of each song in a JSON array
+   * @param jsongs JSON array
+   * @return id of each song, or empty if any is missing
+   */
+  static std::vector<uint64_t> parseSongIds(const JSON &jsongs) {
+    std::vector<uint64_t> out;
+    for (const auto& jsong : jsongs) {
+      if (jsong.count(MESSAGE_SONG_ID) == 0) {
+        return std::vector<uint64_t>();
+      }
+      out.push_back(jsong[MESSAGE_SONG_ID].get<uint64_t>());
+    }
+    return out;
+  }
+
+  /**
+   * Converts a JSON object representing the chart stats of a song to a ChartStats object
+   * @param j JSON object
+   * @return ChartStats
+   */
+  static ChartStats parseChartStats(const JSON &jstats) {
+    ChartStats stats{ jstats[MESSAGE_CHART], jstats[MESSAGE_WEEKS], jstats[MESSAGE_PEAK],
+                      jstats[MESSAGE_WEEKS_AT_PEAK], 0, 0, jstats[MESSAGE_LAST_RANK], {} };
+    ChartHistory::parseDate(jstats[MESSAGE_FIRST], stats.first);
+    ChartHistory::parseDate(jstats[MESSAGE_LAST], stats.last);
+    for (const auto& jp : jstats[MESSAGE_POSITIONS]) {
+      ChartPosition position{ 0, jp[MESSAGE_RANK] };
+      ChartHistory::parseDate(jp[MESSAGE_DATE], position.date);
+      stats.positions.push_back(position);
+    }
+    return stats;
+  }
+
   /**
    * Converts a JSON object representing an AddMessage to a AddMessage object
    * @param j JSON object
@@ -244,7 +803,7 @@ class JsonConverter {
    */
   static AddMessage parseAdd(const JSON &jadd) {
     Song song = parseSong(jadd[MESSAGE_SONG]);
-    return AddMessage(song);
+    return AddMessage(song, parseSongInfo(jadd[MESSAGE_SONG]));
   }
 
   /**
@@ -269,8 +828,15 @@ class JsonConverter {
   * @return RemoveMessage
   */
   static RemoveMessage parseRemove(const JSON &jremove) {
+	  uint64_t id = SONG_ID_NONE;
+	  if (jremove.count(MESSAGE_SONG_ID) > 0) {
+		  id = jremove[MESSAGE_SONG_ID].get<uint64_t>();
+	  }
+	  if (jremove.count(MESSAGE_SONG) == 0) {
+		  return RemoveMessage(id);
+	  }
 	  Song song = parseSong(jremove[MESSAGE_SONG]);
-	  return RemoveMessage(song);
+	  return RemoveMessage(song, id);
   }
 
   /**
@@ -293,7 +859,24 @@ class JsonConverter {
   static SearchMessage parseSearch(const JSON &jsearch) {
     std::string artist_regex = jsearch[MESSAGE_SONG_ARTIST_REGEX];
     std::string title_regex = jsearch[MESSAGE_SONG_TITLE_REGEX];
-    return SearchMessage(artist_regex, title_regex);
+    std::string chart_filter;
+    if (jsearch.count(MESSAGE_CHART_FILTER) > 0) {
+      chart_filter = jsearch[MESSAGE_CHART_FILTER];
+    }
+    uint32_t range[4] = { 0, 0, 0, 0 };
+    const char* keys[4] = { MESSAGE_YEAR_MIN, MESSAGE_YEAR_MAX,
+                            MESSAGE_DURATION_MIN, MESSAGE_DURATION_MAX };
+    for (int i = 0; i < 4; ++i) {
+      if (jsearch.count(keys[i]) > 0) {
+        range[i] = jsearch[keys[i]];
+      }
+    }
+    uint64_t request = REQUEST_ID_NONE;
+    if (jsearch.count(MESSAGE_REQUEST) > 0) {
+      request = jsearch[MESSAGE_REQUEST];
+    }
+    return SearchMessage(artist_regex, title_regex, chart_filter,
+                         SongInfoFilter(range[0], range[1], range[2], range[3]), request);
   }
 
   /**
@@ -304,9 +887,265 @@ class JsonConverter {
   static SearchResponseMessage parseSearchResponse(const JSON &jsearchr) {
     SearchMessage search = parseSearch(jsearchr[MESSAGE_SEARCH]);
     std::vector<Song> results = parseSongs(jsearchr[MESSAGE_SEARCH_RESULTS]);
+    std::vector<SongInfo> metadata = parseSongInfos(jsearchr[MESSAGE_SEARCH_RESULTS]);
+    std::vector<uint64_t> ids = parseSongIds(jsearchr[MESSAGE_SEARCH_RESULTS]);
+    std::string status = jsearchr[MESSAGE_STATUS];
+    std::string info = jsearchr[MESSAGE_INFO];
+    return SearchResponseMessage(search, results, status, info, metadata, ids);
+  }
+
+  /**
+   * Converts a JSON object representing a LyricsSearchMessage to a LyricsSearchMessage object
+   * @param j JSON object
+   * @return LyricsSearchMessage
+   */
+  static LyricsSearchMessage parseLyricsSearch(const JSON &jsearch) {
+    std::string query = jsearch[MESSAGE_LYRICS_QUERY];
+    return LyricsSearchMessage(query);
+  }
+
+  /**
+   * Converts a JSON object representing a LyricsSearchResponseMessage to a
+   * LyricsSearchResponseMessage object
+   * @param j JSON object
+   * @return LyricsSearchResponseMessage
+   */
+  static LyricsSearchResponseMessage parseLyricsSearchResponse(const JSON &jsearchr) {
+    LyricsSearchMessage search = parseLyricsSearch(jsearchr[MESSAGE_LYRICS_SEARCH]);
+    std::vector<Song> results = parseSongs(jsearchr[MESSAGE_SEARCH_RESULTS]);
+    std::vector<std::vector<std::string>> snippets = jsearchr[MESSAGE_LYRICS_SNIPPETS];
+    std::string status = jsearchr[MESSAGE_STATUS];
+    std::string info = jsearchr[MESSAGE_INFO];
+    return LyricsSearchResponseMessage(search, results, snippets, status, info);
+  }
+
+  /**
+   * Converts a JSON object representing a GetLyricsMessage to a GetLyricsMessage object
+   * @param j JSON object
+   * @return GetLyricsMessage
+   */
+  static GetLyricsMessage parseGetLyrics(const JSON &jget) {
+    Song song = parseSong(jget[MESSAGE_SONG]);
+    return GetLyricsMessage(song);
+  }
+
+  /**
+   * Converts a JSON object representing a GetLyricsResponseMessage to a
+   * GetLyricsResponseMessage object
+   * @param j JSON object
+   * @return GetLyricsResponseMessage
+   */
+  static GetLyricsResponseMessage parseGetLyricsResponse(const JSON &jgetr) {
+    GetLyricsMessage get = parseGetLyrics(jgetr[MESSAGE_GET_LYRICS]);
+    std::string lyrics = jgetr[MESSAGE_LYRICS];
+    std::string status = jgetr[MESSAGE_STATUS];
+    std::string info = jgetr[MESSAGE_INFO];
+    return GetLyricsResponseMessage(get, lyrics, status, info);
+  }
+
+  /**
+   * Converts a JSON object representing a TopNMessage to a TopNMessage object
+   * @param j JSON object
+   * @return TopNMessage
+   */
+  static TopNMessage parseTopN(const JSON &jtop) {
+    std::string chart = jtop[MESSAGE_CHART];
+    size_t count = jtop[MESSAGE_COUNT];
+    std::string artist_regex = jtop[MESSAGE_SONG_ARTIST_REGEX];
+    std::string title_regex = jtop[MESSAGE_SONG_TITLE_REGEX];
+    uint64_t request = REQUEST_ID_NONE;
+    if (jtop.count(MESSAGE_REQUEST) > 0) {
+      request = jtop[MESSAGE_REQUEST];
+    }
+    return TopNMessage(chart, count, artist_regex, title_regex, request);
+  }
+
+  /**
+   * Converts a JSON object representing a TopNResponseMessage to a
+   * TopNResponseMessage object
+   * @param j JSON object
+   * @return TopNResponseMessage
+   */
+  static TopNResponseMessage parseTopNResponse(const JSON &jtopr) {
+    TopNMessage top = parseTopN(jtopr[MESSAGE_TOP_N]);
+    std::vector<Song> results = parseSongs(jtopr[MESSAGE_SEARCH_RESULTS]);
+    std::vector<uint32_t> ranks = jtopr[MESSAGE_RANKS];
+    std::string status = jtopr[MESSAGE_STATUS];
+    std::string info = jtopr[MESSAGE_INFO];
+    return TopNResponseMessage(top, results, ranks, status, info);
+  }
+
+  /**
+   * Converts a JSON object representing a ChartHistoryMessage to a ChartHistoryMessage object
+   * @param j JSON object
+   * @return ChartHistoryMessage
+   */
+  static ChartHistoryMessage parseChartHistory(const JSON &jhistory) {
+    Song song = parseSong(jhistory[MESSAGE_SONG]);
+    bool trajectory = jhistory[MESSAGE_TRAJECTORY];
+    return ChartHistoryMessage(song, trajectory);
+  }
+
+  /**
+   * Converts a JSON object representing a ChartHistoryResponseMessage to a
+   * ChartHistoryResponseMessage object
+   * @param j JSON object
+   * @return ChartHistoryResponseMessage
+   */
+  static ChartHistoryResponseMessage parseChartHistoryResponse(const JSON &jhistoryr) {
+    ChartHistoryMessage history = parseChartHistory(jhistoryr[MESSAGE_CHART_HISTORY]);
+    std::vector<ChartStats> charts;
+    for (const auto& jstats : jhistoryr[MESSAGE_HISTORY]) {
+      charts.push_back(parseChartStats(jstats));
+    }
+    std::string status = jhistoryr[MESSAGE_STATUS];
+    std::string info = jhistoryr[MESSAGE_INFO];
+    return ChartHistoryResponseMessage(history, charts, status, info);
+  }
+
+  /**
+   * Converts a JSON object representing a LookupMessage to a LookupMessage object
+   * @param j JSON object
+   * @return LookupMessage
+   */
+  static LookupMessage parseLookup(const JSON &jlookup) {
+    std::vector<uint64_t> ids = jlookup[MESSAGE_SONG_IDS];
+    return LookupMessage(ids);
+  }
+
+  /**
+   * Converts a JSON object representing a LookupResponseMessage to a
+   * LookupResponseMessage object
+   * @param j JSON object
+   * @return LookupResponseMessage
+   */
+  static LookupResponseMessage parseLookupResponse(const JSON &jlookupr) {
+    LookupMessage lookup = parseLookup(jlookupr[MESSAGE_LOOKUP]);
+    std::vector<Song> results = parseSongs(jlookupr[MESSAGE_SEARCH_RESULTS]);
+    std::vector<uint64_t> ids = parseSongIds(jlookupr[MESSAGE_SEARCH_RESULTS]);
+    std::vector<SongInfo> metadata = parseSongInfos(jlookupr[MESSAGE_SEARCH_RESULTS]);
+    std::string status = jlookupr[MESSAGE_STATUS];
+    std::string info = jlookupr[MESSAGE_INFO];
+    return LookupResponseMessage(lookup, results, ids, status, info, metadata);
+  }
+
+  /**
+   * Converts a JSON object representing an AutocompleteMessage to an
+   * AutocompleteMessage object
+   * @param j JSON object
+   * @return AutocompleteMessage
+   */
+  static AutocompleteMessage parseAutocomplete(const JSON &jauto) {
+    std::string field = jauto[MESSAGE_FIELD];
+    std::string prefix = jauto[MESSAGE_PREFIX];
+    size_t count = jauto[MESSAGE_COUNT];
+    return AutocompleteMessage(field, prefix, count);
+  }
+
+  /**
+   * Converts a JSON object representing an AutocompleteResponseMessage to an
+   * AutocompleteResponseMessage object
+   * @param j JSON object
+   * @return AutocompleteResponseMessage
+   */
+  static AutocompleteResponseMessage parseAutocompleteResponse(const JSON &jautor) {
+    AutocompleteMessage autocomplete = parseAutocomplete(jautor[MESSAGE_AUTOCOMPLETE]);
+    std::vector<Completion> completions;
+    for (const auto& jc : jautor[MESSAGE_COMPLETIONS]) {
+      completions.push_back(Completion{ jc[MESSAGE_TEXT], jc[MESSAGE_SONGS] });
+    }
+    std::string status = jautor[MESSAGE_STATUS];
+    std::string info = jautor[MESSAGE_INFO];
+    return AutocompleteResponseMessage(autocomplete, completions, status, info);
+  }
+
+  /**
+   * Converts a JSON object representing a FuzzySearchMessage to a FuzzySearchMessage object
+   * @param j JSON object
+   * @return FuzzySearchMessage
+   */
+  static FuzzySearchMessage parseFuzzySearch(const JSON &jsearch) {
+    std::string artist = jsearch[MESSAGE_SONG_ARTIST];
+    std::string title = jsearch[MESSAGE_SONG_TITLE];
+    uint32_t max_distance = jsearch[MESSAGE_MAX_DISTANCE];
+    return FuzzySearchMessage(artist, title, max_distance);
+  }
+
+  /**
+   * Converts a JSON object representing a FuzzySearchResponseMessage to a
+   * FuzzySearchResponseMessage object
+   * @param j JSON object
+   * @return FuzzySearchResponseMessage
+   */
+  static FuzzySearchResponseMessage parseFuzzySearchResponse(const JSON &jsearchr) {
+    FuzzySearchMessage search = parseFuzzySearch(jsearchr[MESSAGE_FUZZY_SEARCH]);
+    std::vector<Song> results = parseSongs(jsearchr[MESSAGE_SEARCH_RESULTS]);
+    std::vector<uint64_t> ids = parseSongIds(jsearchr[MESSAGE_SEARCH_RESULTS]);
+    std::vector<uint32_t> distances = jsearchr[MESSAGE_DISTANCES];
     std::string status = jsearchr[MESSAGE_STATUS];
     std::string info = jsearchr[MESSAGE_INFO];
-    return SearchResponseMessage(search, results, status, info);
+    return FuzzySearchResponseMessage(search, results, distances, status, info, ids);
+  }
+
+  /**
+   * Converts a JSON object representing a RankedSearchMessage to a RankedSearchMessage object
+   * @param j JSON object
+   * @return RankedSearchMessage
+   */
+  static RankedSearchMessage parseRankedSearch(const JSON &jsearch) {
+    std::string query = jsearch[MESSAGE_LYRICS_QUERY];
+    size_t count = RANKED_SEARCH_DEFAULT;
+    if (jsearch.count(MESSAGE_COUNT) > 0) {
+      count = jsearch[MESSAGE_COUNT];
+    }
+    return RankedSearchMessage(query, count);
+  }
+
+  /**
+   * Converts a JSON object representing a RankedSearchResponseMessage to a
+   * RankedSearchResponseMessage object
+   * @param j JSON object
+   * @return RankedSearchResponseMessage
+   */
+  static RankedSearchResponseMessage parseRankedSearchResponse(const JSON &jsearchr) {
+    RankedSearchMessage search = parseRankedSearch(jsearchr[MESSAGE_RANKED_SEARCH]);
+    std::vector<Song> results = parseSongs(jsearchr[MESSAGE_SEARCH_RESULTS]);
+    std::vector<uint64_t> ids = parseSongIds(jsearchr[MESSAGE_SEARCH_RESULTS]);
+    std::vector<uint32_t> kinds;
+    for (const auto& jmatch : jsearchr[MESSAGE_MATCHES]) {
+      std::string name = jmatch;
+      uint32_t kind = MATCH_EXACT;
+      while (kind > 0 && name != MESSAGE_MATCH_KINDS[kind]) {
+        --kind;
+      }
+      kinds.push_back(kind);
+    }
+    std::string status = jsearchr[MESSAGE_STATUS];
+    std::string info = jsearchr[MESSAGE_INFO];
+    return RankedSearchResponseMessage(search, results, kinds, status, info, ids);
+  }
+
+  /**
+   * Converts a JSON object representing a CancelMessage to a CancelMessage object
+   * @param j JSON object
+   * @return CancelMessage
+   */
+  static CancelMessage parseCancel(const JSON &jcancel) {
+    uint64_t request = jcancel[MESSAGE_REQUEST];
+    return CancelMessage(request);
+  }
+
+  /**
+   * Converts a JSON object representing a CancelResponseMessage to a
+   * CancelResponseMessage object
+   * @param j JSON object
+   * @return CancelResponseMessage
+   */
+  static CancelResponseMessage parseCancelResponse(const JSON &jcancelr) {
+    CancelMessage cancel = parseCancel(jcancelr[MESSAGE_CANCEL]);
+    std::string status = jcancelr[MESSAGE_STATUS];
+    std::string info = jcancelr[MESSAGE_INFO];
+    return CancelResponseMessage(cancel, status, info);
   }
 
   /**
@@ -339,6 +1178,42 @@ class JsonConverter {
       return MessageType::SEARCH_RESPONSE;
     } else if (MESSAGE_GOODBYE == msg) {
       return MessageType::GOODBYE;
+    } else if (MESSAGE_LYRICS_SEARCH == msg) {
+      return MessageType::LYRICS_SEARCH;
+    } else if (MESSAGE_LYRICS_SEARCH_RESPONSE == msg) {
+      return MessageType::LYRICS_SEARCH_RESPONSE;
+    } else if (MESSAGE_GET_LYRICS == msg) {
+      return MessageType::GET_LYRICS;
+    } else if (MESSAGE_GET_LYRICS_RESPONSE == msg) {
+      return MessageType::GET_LYRICS_RESPONSE;
+    } else if (MESSAGE_TOP_N == msg) {
+      return MessageType::TOP_N;
+    } else if (MESSAGE_TOP_N_RESPONSE == msg) {
+      return MessageType::TOP_N_RESPONSE;
+    } else if (MESSAGE_CHART_HISTORY == msg) {
+      return MessageType::CHART_HISTORY;
+    } else if (MESSAGE_CHART_HISTORY_RESPONSE == msg) {
+      return MessageType::CHART_HISTORY_RESPONSE;
+    } else if (MESSAGE_LOOKUP == msg) {
+      return MessageType::LOOKUP;
+    } else if (MESSAGE_LOOKUP_RESPONSE == msg) {
+      return MessageType::LOOKUP_RESPONSE;
+    } else if (MESSAGE_AUTOCOMPLETE == msg) {
+      return MessageType::AUTOCOMPLETE;
+    } else if (MESSAGE_AUTOCOMPLETE_RESPONSE == msg) {
+      return MessageType::AUTOCOMPLETE_RESPONSE;
+    } else if (MESSAGE_FUZZY_SEARCH == msg) {
+      return MessageType::FUZZY_SEARCH;
+    } else if (MESSAGE_FUZZY_SEARCH_RESPONSE == msg) {
+      return MessageType::FUZZY_SEARCH_RESPONSE;
+    } else if (MESSAGE_RANKED_SEARCH == msg) {
+      return MessageType::RANKED_SEARCH;
+    } else if (MESSAGE_RANKED_SEARCH_RESPONSE == msg) {
+      return MessageType::RANKED_SEARCH_RESPONSE;
+    } else if (MESSAGE_CANCEL == msg) {
+      return MessageType::CANCEL;
+    } else if (MESSAGE_CANCEL_RESPONSE == msg) {
+      return MessageType::CANCEL_RESPONSE;
     }
     return MessageType::UNKNOWN;
   }
@@ -379,6 +1254,66 @@ class JsonConverter {
       case GOODBYE: {
         return std::unique_ptr<Message>(new GoodbyeMessage(parseGoodbye(jmsg)));
       }
+      case LYRICS_SEARCH: {
+        return std::unique_ptr<Message>(new LyricsSearchMessage(parseLyricsSearch(jmsg)));
+      }
+      case LYRICS_SEARCH_RESPONSE: {
+        return std::unique_ptr<Message>(
+            new LyricsSearchResponseMessage(parseLyricsSearchResponse(jmsg)));
+      }
+      case GET_LYRICS: {
+        return std::unique_ptr<Message>(new GetLyricsMessage(parseGetLyrics(jmsg)));
+      }
+      case GET_LYRICS_RESPONSE: {
+        return std::unique_ptr<Message>(
+            new GetLyricsResponseMessage(parseGetLyricsResponse(jmsg)));
+      }
+      case TOP_N: {
+        return std::unique_ptr<Message>(new TopNMessage(parseTopN(jmsg)));
+      }
+      case TOP_N_RESPONSE: {
+        return std::unique_ptr<Message>(new TopNResponseMessage(parseTopNResponse(jmsg)));
+      }
+      case CHART_HISTORY: {
+        return std::unique_ptr<Message>(new ChartHistoryMessage(parseChartHistory(jmsg)));
+      }
+      case CHART_HISTORY_RESPONSE: {
+        return std::unique_ptr<Message>(
+            new ChartHistoryResponseMessage(parseChartHistoryResponse(jmsg)));
+      }
+      case LOOKUP: {
+        return std::unique_ptr<Message>(new LookupMessage(parseLookup(jmsg)));
+      }
+      case LOOKUP_RESPONSE: {
+        return std::unique_ptr<Message>(new LookupResponseMessage(parseLookupResponse(jmsg)));
+      }
+      case AUTOCOMPLETE: {
+        return std::unique_ptr<Message>(new AutocompleteMessage(parseAutocomplete(jmsg)));
+      }
+      case AUTOCOMPLETE_RESPONSE: {
+        return std::unique_ptr<Message>(
+            new AutocompleteResponseMessage(parseAutocompleteResponse(jmsg)));
+      }
+      case FUZZY_SEARCH: {
+        return std::unique_ptr<Message>(new FuzzySearchMessage(parseFuzzySearch(jmsg)));
+      }
+      case FUZZY_SEARCH_RESPONSE: {
+        return std::unique_ptr<Message>(
+            new FuzzySearchResponseMessage(parseFuzzySearchResponse(jmsg)));
+      }
+      case RANKED_SEARCH: {
+        return std::unique_ptr<Message>(new RankedSearchMessage(parseRankedSearch(jmsg)));
+      }
+      case RANKED_SEARCH_RESPONSE: {
+        return std::unique_ptr<Message>(
+            new RankedSearchResponseMessage(parseRankedSearchResponse(jmsg)));
+      }
+      case CANCEL: {
+        return std::unique_ptr<Message>(new CancelMessage(parseCancel(jmsg)));
+      }
+      case CANCEL_RESPONSE: {
+        return std::unique_ptr<Message>(new CancelResponseMessage(parseCancelResponse(jmsg)));
+      }
     }
 
     return std::unique_ptr<Message>(nullptr);
@@ -21,8 +21,15 @@
  * The format of the JSON string is as follows:
  *
  *  ___str____: any quoted string
+ *  ___int____: any non-negative integer
+ *  ___bool___: true or false
+ *  ___date___: "YYYY-MM-DD"
+ *  ____id____: song id, a positive 64-bit integer, see SongIds
  *  __status__: "OK" or "ERROR"
- *  ___song___: { "title": __str__, "artist": __str__ }
+ *  ___song___: { "title": __str__, "artist": __str__, "album": __str__, "year": __int__,
+ *                "duration": __int__, "genre": __str__, "id": __id__ }
+ *              album, year, duration (in seconds) and genre only if known, id only
+ *              in results
  *  __<msg>___: message of type <msg>
  *
  * Adding a song:
@@ -31,19 +38,102 @@
  * Response to adding a song:
  *   { "msg": "add_response", "status": __status__, "info": __str__, "add": __add__ }
  *
- * Removing a song:
+ * Removing a song, given either the song or its id:
  *   { "msg": "remove", "song": __song__ }
+ *   { "msg": "remove", "id": __id__ }
  *
- * Response to removing a song:
+ * Response to removing a song, with both the song and its id once known:
  *   { "msg": "remove_response", "status": __status__, "info": __str__, "remove": __remove__ }
  *
- * Search for a song:
- *   { "msg": "search", "artist_regex": __str__, "title_regex": __str__ }
+ * Search for a song, optionally only among songs on some charts, e.g.
+ * "rock AND alternative" (see ChartMembership).  Expressions use the syntax of
+ * Regex; one it does not support, e.g. with a backreference, is an error:
+ *   { "msg": "search", "artist_regex": __str__, "title_regex": __str__,
+ *      "charts": __str__ (optional), "year_min": __int__, "year_max": __int__,
+ *      "duration_min": __int__, "duration_max": __int__ (optional, inclusive),
+ *      "request": __int__ (optional, to cancel it by) }
  *
- * Response to a search:
+ * Response to a search.  A search that runs out of time or work, or is cancelled,
+ * is an error, with the songs found before it stopped (see QueryBudget):
  *   { "msg": "search_response", "status": __status__, "info": __str__,
  *      "search": __search__, "results": [ __song__, ... ] }
  *
+ * Search song lyrics for words and "quoted phrases", see LyricsIndex:
+ *   { "msg": "lyrics_search", "query": __str__ }
+ *
+ * Response to a lyrics search, with the matching lines of each result:
+ *   { "msg": "lyrics_search_response", "status": __status__, "info": __str__,
+ *      "lyrics_search": __lyrics_search__, "results": [ __song__, ... ],
+ *      "snippets": [ [ __str__, ... ], ... ] }
+ *
+ * Get the lyrics of a song:
+ *   { "msg": "get_lyrics", "song": __song__ }
+ *
+ * Response to getting lyrics:
+ *   { "msg": "get_lyrics_response", "status": __status__, "info": __str__,
+ *      "get_lyrics": __get_lyrics__, "lyrics": __str__ }
+ *
+ * Top songs of a chart, optionally only those matching expressions:
+ *   { "msg": "top_n", "chart": __str__, "count": __int__,
+ *      "artist_regex": __str__, "title_regex": __str__, "request": __int__ (optional) }
+ *
+ * Response to top songs, in rank order with the rank of each, partial like a
+ * search's if stopped:
+ *   { "msg": "top_n_response", "status": __status__, "info": __str__,
+ *      "top_n": __top_n__, "results": [ __song__, ... ], "ranks": [ __int__, ... ] }
+ *
+ * How a song did on past charts, optionally with its rank in every snapshot:
+ *   { "msg": "chart_history", "song": __song__, "trajectory": __bool__ }
+ *
+ * Response to chart history, with stats for each chart the song has been on:
+ *   { "msg": "chart_history_response", "status": __status__, "info": __str__,
+ *      "chart_history": __chart_history__, "history": [ { "chart": __str__,
+ *      "weeks": __int__, "peak": __int__, "weeks_at_peak": __int__,
+ *      "first": __date__, "last": __date__, "last_rank": __int__,
+ *      "positions": [ { "date": __date__, "rank": __int__ }, ... ] }, ... ] }
+ *
+ * Look up songs by id:
+ *   { "msg": "lookup", "ids": [ __id__, ... ] }
+ *
+ * Response to a lookup, with the songs found in the order asked for:
+ *   { "msg": "lookup_response", "status": __status__, "info": __str__,
+ *      "lookup": __lookup__, "results": [ __song__, ... ] }
+ *
+ * Complete the start of an artist or title, case-insensitively:
+ *   { "msg": "autocomplete", "field": "artist" or "title", "prefix": __str__,
+ *      "count": __int__ }
+ *
+ * Response to autocompletion, the completions with most songs first:
+ *   { "msg": "autocomplete_response", "status": __status__, "info": __str__,
+ *      "autocomplete": __autocomplete__,
+ *      "completions": [ { "text": __str__, "songs": __int__ }, ... ] }
+ *
+ * Search for an artist and title despite typos, each within max_distance edits
+ * (at most 3), ignoring case; an empty artist or title matches any:
+ *   { "msg": "fuzzy_search", "artist": __str__, "title": __str__, "max_distance": __int__ }
+ *
+ * Response to a fuzzy search, closest first, with the edits to each result:
+ *   { "msg": "fuzzy_search_response", "status": __status__, "info": __str__,
+ *      "fuzzy_search": __fuzzy_search__, "results": [ __song__, ... ],
+ *      "distances": [ __int__, ... ] }
+ *
+ * Search artists and titles for free text, ignoring case, returning the best
+ * "count" matches (20 if missing, at most 1000), see RankedSearch:
+ *   { "msg": "ranked_search", "query": __str__, "count": __int__ }
+ *
+ * Response to a ranked search, best first, with how each result matched:
+ *   { "msg": "ranked_search_response", "status": __status__, "info": __str__,
+ *      "ranked_search": __ranked_search__, "results": [ __song__, ... ],
+ *      "matches": [ "exact" or "prefix" or "substring" or "fuzzy", ... ] }
+ *
+ * Cancel a running search or top songs request, sent on the same connection
+ * without waiting for its response:
+ *   { "msg": "cancel", "request": __int__ }
+ *
+ * Response to cancelling, an error if nothing with the id is running:
+ *   { "msg": "cancel_response", "status": __status__, "info": __str__,
+ *      "cancel": __cancel__ }
+ *
  * Goodbye:
  *   { "msg": "goodbye" }
  *
@@ -235,6 +325,7 @@ class JsonMusicLibraryApi : public MusicLibraryApi {
     if (!socket_.read_all(&id, 1) || id != JSON_ID) {
       return nullptr;
     }
+    notifyReceive();
 
     // if it is a JSON string, parse into a message
     JSON jmsg;
@@ -245,6 +336,14 @@ class JsonMusicLibraryApi : public MusicLibraryApi {
     return JsonConverter::parseMessage(jmsg);
   }
 
+  /**
+   * Closes the underlying socket
+   * @return true if successful, false if error
+   */
+  bool close() {
+    return socket_.close();
+  }
+
 };
 
 #endif //LAB4_MUSIC_LIBRARY_API_JSON_H
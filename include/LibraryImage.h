@@ -0,0 +1,651 @@
+/**
+ * @file
+ *
+ * This file contains a flat, read-only image of a music library.
+ *
+ * The image is a single contiguous block of memory that contains no pointers, so
+ * it can be placed in shared memory and used directly by several processes, or
+ * saved as a snapshot file and memory-mapped on the next startup.
+ *
+ * Layout (all offsets in bytes from the start of the image):
+ *   header
+ *   song records, sorted by artist then title (same order as MusicLibrary)
+ *   string table, each distinct artist/title stored once (or, for images written
+ *   one song at a time by a LibraryImageWriter, each artist once per run of songs)
+ *
+ * An image may also be a sorted run of an LsmStore, in which case a record can mark
+ * a song as removed (a tombstone) by setting the top bit of its title size.  Images
+ * of a whole library never contain tombstones.
+ *
+ * An image records how far into the WriteAheadLog the changes it holds reach, so
+ * the log records before that position need not be replayed on top of it.  Images of
+ * version 1 have a shorter header without it.
+ *
+ */
+#ifndef LAB5_LIBRARY_IMAGE_H
+#define LAB5_LIBRARY_IMAGE_H
+
+#include "Song.h"
+#include "Regex.h"
+#include "QueryBudget.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <utility>
+#include <unordered_map>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// identifies a library image, "MLIB"
+#define LIBRARY_IMAGE_MAGIC 0x42494C4D
+#define LIBRARY_IMAGE_VERSION 2
+
+// flag in a record's title size marking the song as removed
+#define LIBRARY_IMAGE_REMOVED 0x80000000u
+
+/**
+ * Header at the start of every image
+ */
+struct LibraryImageHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;          // total size of the image
+  uint64_t nsongs;        // number of song records
+  uint64_t records;       // offset of the song records
+  uint64_t strings;       // offset of the string table
+  uint64_t strings_size;  // size of the string table
+  uint64_t log_position;  // write-ahead log position covered, from version 2
+};
+
+// size of the header of an image of version 1
+#define LIBRARY_IMAGE_V1_HEADER offsetof(LibraryImageHeader, log_position)
+
+/**
+ * A song, with strings referenced by their location in the string table
+ */
+struct LibraryImageRecord {
+  uint32_t artist;
+  uint32_t artist_size;
+  uint32_t title;
+  uint32_t title_size;
+};
+
+/**
+ * Read-only view of a library image.  The view does not own the memory.
+ */
+class LibraryImage {
+  const char* data_;
+  const LibraryImageHeader* header_;
+  const LibraryImageRecord* records_;
+  const char* strings_;
+
+  // compare a string in the table to another string, like std::string::compare
+  static int compare(const char* a, size_t asize, const std::string& b) {
+    int c = std::memcmp(a, b.data(), std::min(asize, b.size()));
+    if (c != 0) {
+      return c;
+    }
+    return asize < b.size() ? -1 : (asize > b.size() ? 1 : 0);
+  }
+
+  static uint32_t titleSize(const LibraryImageRecord& r) {
+    return r.title_size & ~LIBRARY_IMAGE_REMOVED;
+  }
+
+  /**
+   * Lays out an image from entries sorted by song
+   * @param begin first entry
+   * @param end past the last entry
+   * @param songOf gets the song of an entry
+   * @param removedOf gets whether an entry is a tombstone
+   */
+  template <typename Iterator, typename SongOf, typename RemovedOf>
+  static std::vector<char> build(Iterator begin, Iterator end, SongOf songOf, RemovedOf removedOf) {
+
+    // lay out the string table, storing repeated strings once
+    std::vector<LibraryImageRecord> records;
+    records.reserve(std::distance(begin, end));
+    std::unordered_map<std::string, uint32_t> offsets;
+    std::string table;
+    auto intern = [&](const std::string& str) -> uint32_t {
+      auto it = offsets.find(str);
+      if (it != offsets.end()) {
+        return it->second;
+      }
+      uint32_t offset = (uint32_t)table.size();
+      table.append(str);
+      offsets.insert({str, offset});
+      return offset;
+    };
+    for (Iterator it = begin; it != end; ++it) {
+      const Song& song = songOf(*it);
+      LibraryImageRecord r;
+      r.artist = intern(song.artist);
+      r.artist_size = (uint32_t)song.artist.size();
+      r.title = intern(song.title);
+      r.title_size = (uint32_t)song.title.size();
+      if (removedOf(*it)) {
+        r.title_size |= LIBRARY_IMAGE_REMOVED;
+      }
+      records.push_back(r);
+    }
+
+    LibraryImageHeader header;
+    header.magic = LIBRARY_IMAGE_MAGIC;
+    header.version = LIBRARY_IMAGE_VERSION;
+    header.nsongs = records.size();
+    header.records = sizeof(LibraryImageHeader);
+    header.strings = header.records + records.size()*sizeof(LibraryImageRecord);
+    header.strings_size = table.size();
+    header.size = header.strings + table.size();
+    header.log_position = 0;
+
+    std::vector<char> out((size_t)header.size);
+    std::memcpy(out.data(), &header, sizeof(header));
+    if (!records.empty()) {
+      std::memcpy(out.data() + header.records, records.data(),
+                  records.size()*sizeof(LibraryImageRecord));
+    }
+    if (!table.empty()) {
+      std::memcpy(out.data() + header.strings, table.data(), table.size());
+    }
+    return out;
+  }
+
+ public:
+
+  /**
+   * Creates an empty, invalid view
+   */
+  LibraryImage() : data_(nullptr), header_(nullptr), records_(nullptr), strings_(nullptr) {}
+
+  /**
+   * Creates a view of an existing image
+   * @param data start of the image
+   * @param size number of bytes available at data
+   */
+  LibraryImage(const char* data, size_t size) :
+      data_(nullptr), header_(nullptr), records_(nullptr), strings_(nullptr) {
+
+    // make sure the image is complete before using it
+    if (data == nullptr || size < LIBRARY_IMAGE_V1_HEADER) {
+      return;
+    }
+    const LibraryImageHeader* header = (const LibraryImageHeader*)data;
+    if (header->magic != LIBRARY_IMAGE_MAGIC
+        || (header->version != 1 && header->version != LIBRARY_IMAGE_VERSION)
+        || (header->version != 1 && size < sizeof(LibraryImageHeader))
+        || header->size > size
+        || header->nsongs > header->size/sizeof(LibraryImageRecord)
+        || header->records > header->size
+        || header->records + header->nsongs*sizeof(LibraryImageRecord) > header->size
+        || header->strings > header->size
+        || header->strings_size > header->size - header->strings) {
+      return;
+    }
+
+    // every string must lie within the string table
+    const LibraryImageRecord* records = (const LibraryImageRecord*)(data + header->records);
+    for (uint64_t i=0; i<header->nsongs; ++i) {
+      const LibraryImageRecord& r = records[i];
+      if ((uint64_t)r.artist + r.artist_size > header->strings_size
+          || (uint64_t)r.title + titleSize(r) > header->strings_size) {
+        return;
+      }
+    }
+
+    data_ = data;
+    header_ = header;
+    records_ = records;
+    strings_ = data + header->strings;
+  }
+
+  /**
+   * Checks whether the view refers to a valid image
+   * @return true if valid
+   */
+  bool valid() const {
+    return data_ != nullptr;
+  }
+
+  /**
+   * Start of the image
+   */
+  const char* data() const {
+    return data_;
+  }
+
+  /**
+   * Total size of the image in bytes
+   */
+  size_t bytes() const {
+    return valid() ? (size_t)header_->size : 0;
+  }
+
+  /**
+   * Write-ahead log position the image covers
+   * @return position, 0 if none or for an image of version 1
+   */
+  uint64_t logPosition() const {
+    return valid() && header_->version != 1 ? header_->log_position : 0;
+  }
+
+  /**
+   * Records the write-ahead log position an image covers
+   * @param image image contents, from build()
+   * @param position log position, see WriteAheadLog::position
+   */
+  static void setLogPosition(std::vector<char>& image, uint64_t position) {
+    std::memcpy(image.data() + offsetof(LibraryImageHeader, log_position), &position,
+                sizeof(position));
+  }
+
+  /**
+   * Number of songs in the image
+   */
+  size_t size() const {
+    return valid() ? (size_t)header_->nsongs : 0;
+  }
+
+  /**
+   * Artist of the i'th song, not zero-terminated
+   */
+  const char* artist(size_t i, size_t& len) const {
+    len = records_[i].artist_size;
+    return strings_ + records_[i].artist;
+  }
+
+  /**
+   * Title of the i'th song, not zero-terminated
+   */
+  const char* title(size_t i, size_t& len) const {
+    len = titleSize(records_[i]);
+    return strings_ + records_[i].title;
+  }
+
+  /**
+   * Compares the songs of records in two images, like comparing the songs
+   * themselves, without copying them out
+   * @return negative, zero or positive as a's song is before, equal to or after b's
+   */
+  static int compare(const LibraryImage& a, size_t i, const LibraryImage& b, size_t j) {
+    size_t alen, blen;
+    const char* astr = a.artist(i, alen);
+    const char* bstr = b.artist(j, blen);
+    int c = std::memcmp(astr, bstr, std::min(alen, blen));
+    if (c == 0 && alen != blen) {
+      return alen < blen ? -1 : 1;
+    }
+    if (c != 0) {
+      return c;
+    }
+    astr = a.title(i, alen);
+    bstr = b.title(j, blen);
+    c = std::memcmp(astr, bstr, std::min(alen, blen));
+    if (c == 0 && alen != blen) {
+      return alen < blen ? -1 : 1;
+    }
+    return c;
+  }
+
+  /**
+   * Copies out the i'th song
+   * @param i index of song
+   * @return song
+   */
+  Song song(size_t i) const {
+    const LibraryImageRecord& r = records_[i];
+    return Song(std::string(strings_ + r.artist, r.artist_size),
+                std::string(strings_ + r.title, titleSize(r)));
+  }
+
+  /**
+   * Checks if the i'th song is a tombstone
+   */
+  bool removed(size_t i) const {
+    return (records_[i].title_size & LIBRARY_IMAGE_REMOVED) != 0;
+  }
+
+  /**
+   * Checks if the image contains a song and is not a tombstone
+   * @param song song to look for
+   * @return true if found
+   */
+  bool contains(const Song& song) const {
+    bool tombstone = false;
+    return lookup(song, tombstone) && !tombstone;
+  }
+
+  /**
+   * Looks for a record of a song, live or removed, using binary search
+   * @param song song to look for
+   * @param tombstone set to true if the record marks the song as removed
+   * @return true if the image has a record of the song
+   */
+  bool lookup(const Song& song, bool& tombstone) const {
+    size_t i = indexOf(song);
+    if (i == size()) {
+      return false;
+    }
+    tombstone = removed(i);
+    return true;
+  }
+
+  /**
+   * Finds the record of a song, live or removed, using binary search
+   * @param song song to look for
+   * @return index of the song, or size() if not found
+   */
+  size_t indexOf(const Song& song) const {
+    size_t lo = 0;
+    size_t hi = size();
+    while (lo < hi) {
+      size_t mid = lo + (hi-lo)/2;
+      const LibraryImageRecord& r = records_[mid];
+      int c = compare(strings_ + r.artist, r.artist_size, song.artist);
+      if (c == 0) {
+        c = compare(strings_ + r.title, titleSize(r), song.title);
+      }
+      if (c == 0) {
+        return mid;
+      } else if (c < 0) {
+        lo = mid+1;
+      } else {
+        hi = mid;
+      }
+    }
+    return size();
+  }
+
+  /**
+   * Finds songs in the image matching title and artist expressions,
+   * matching directly against the image strings.  Tombstones are skipped.
+   * @param artist_regex artist regular expression, see Regex
+   * @param title_regex title regular expression
+   * @param budget work the search may do, nullptr for no limit; once it runs out
+   *        the songs found so far are returned
+   * @return songs matching expressions, none if either is invalid
+   */
+  std::vector<Song> find(const std::string& artist_regex,
+                         const std::string& title_regex,
+                         QueryBudget* budget = nullptr) const {
+    std::vector<Song> out;
+
+    Regex aregex(artist_regex);
+    Regex tregex(title_regex);
+
+    for (size_t i=0; i<size(); ++i) {
+      const LibraryImageRecord& r = records_[i];
+      const char* artist = strings_ + r.artist;
+      const char* title = strings_ + r.title;
+      if (budget != nullptr && !budget->charge(r.artist_size + titleSize(r))) {
+        break;
+      }
+      if (!removed(i) && aregex.search(artist, artist + r.artist_size)
+          && tregex.search(title, title + titleSize(r))) {
+        out.push_back(song(i));
+      }
+    }
+
+    return out;
+  }
+
+  /**
+   * Builds an image from a sorted set of songs
+   * @param songs songs to store
+   * @return image contents
+   */
+  static std::vector<char> build(const std::set<Song>& songs) {
+    return build(songs.begin(), songs.end(),
+                 [](const Song& song) -> const Song& { return song; },
+                 [](const Song&) { return false; });
+  }
+
+  /**
+   * Builds a sorted run from songs and tombstones
+   * @param entries sorted songs, each with true if it is removed
+   * @return image contents
+   */
+  static std::vector<char> build(const std::map<Song, bool>& entries) {
+    return build(entries.begin(), entries.end(),
+                 [](const std::pair<const Song, bool>& e) -> const Song& { return e.first; },
+                 [](const std::pair<const Song, bool>& e) { return e.second; });
+  }
+
+  /**
+   * Builds a sorted run from songs and tombstones
+   * @param entries songs sorted without duplicates, each with true if it is removed
+   * @return image contents
+   */
+  static std::vector<char> build(const std::vector<std::pair<Song, bool>>& entries) {
+    return build(entries.begin(), entries.end(),
+                 [](const std::pair<Song, bool>& e) -> const Song& { return e.first; },
+                 [](const std::pair<Song, bool>& e) { return e.second; });
+  }
+
+  /**
+   * Forces a file written with stdio to stable storage
+   * @param file file open for writing
+   * @return true if successful
+   */
+  static bool sync(std::FILE* file) {
+    if (std::fflush(file) != 0) {
+      return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+  }
+
+  /**
+   * Saves an image as a snapshot file.  The image is written to a temporary
+   * file and synced first, so an existing snapshot is only replaced once the new
+   * one is complete on disk.
+   * @param image image contents, from build()
+   * @param filename snapshot file
+   * @return true if successful
+   */
+  static bool save(const std::vector<char>& image, const std::string& filename) {
+    std::string tmp = filename + ".tmp";
+    std::FILE* file = std::fopen(tmp.c_str(), "wb");
+    if (file == nullptr) {
+      return false;
+    }
+    bool success = std::fwrite(image.data(), 1, image.size(), file) == image.size()
+        && sync(file);
+    success &= std::fclose(file) == 0;
+#ifdef _WIN32
+    // rename does not replace existing files on Windows
+    std::remove(filename.c_str());
+#endif
+    success = success && std::rename(tmp.c_str(), filename.c_str()) == 0;
+    if (!success) {
+      std::remove(tmp.c_str());
+    }
+    return success;
+  }
+};
+
+/**
+ * Writes an image straight to a file, one song at a time in sorted order, so
+ * images larger than memory can be written.  Records are written as they come,
+ * and strings to a second temporary file that is appended once all records are
+ * in.  Only an artist shared by consecutive songs is stored once.
+ */
+class LibraryImageWriter {
+  std::string filename_;
+  std::string tmp_;
+  std::string strings_tmp_;
+  std::FILE* records_;
+  std::FILE* strings_;
+  uint64_t nsongs_;
+  uint64_t strings_size_;
+  std::string artist_;        // artist of the previous song
+  uint32_t artist_offset_;
+  bool failed_;
+
+  // appends a string to the string table, returning its offset
+  uint32_t put(const char* str, size_t len) {
+    if (strings_size_ + len > 0xFFFFFFFFu) {
+      failed_ = true;
+      return 0;
+    }
+    uint32_t offset = (uint32_t)strings_size_;
+    if (len > 0 && std::fwrite(str, 1, len, strings_) != len) {
+      failed_ = true;
+    }
+    strings_size_ += len;
+    return offset;
+  }
+
+  void discard() {
+    if (records_ != nullptr) {
+      std::fclose(records_);
+      records_ = nullptr;
+      std::remove(tmp_.c_str());
+    }
+    if (strings_ != nullptr) {
+      std::fclose(strings_);
+      strings_ = nullptr;
+      std::remove(strings_tmp_.c_str());
+    }
+  }
+
+  // prevent copies, the writer owns its files
+  LibraryImageWriter(const LibraryImageWriter&);
+  LibraryImageWriter& operator=(const LibraryImageWriter&);
+
+ public:
+  /**
+   * Starts writing an image.  The file is only replaced once the image is
+   * finished.
+   * @param filename file to write to
+   */
+  explicit LibraryImageWriter(const std::string& filename) :
+      filename_(filename), tmp_(filename + ".tmp"), strings_tmp_(filename + ".strings.tmp"),
+      records_(nullptr), strings_(nullptr), nsongs_(0), strings_size_(0), artist_(),
+      artist_offset_(0), failed_(false) {
+    records_ = std::fopen(tmp_.c_str(), "wb");
+    strings_ = std::fopen(strings_tmp_.c_str(), "w+b");
+    LibraryImageHeader header = LibraryImageHeader();
+    failed_ = records_ == nullptr || strings_ == nullptr
+        || std::fwrite(&header, sizeof(header), 1, records_) != 1;
+  }
+
+  ~LibraryImageWriter() {
+    discard();
+  }
+
+  /**
+   * Adds the next song, which must come after the previous one
+   * @param artist artist of the song
+   * @param artist_len length of the artist
+   * @param title title of the song
+   * @param title_len length of the title
+   * @param removed true to write a tombstone
+   * @return false if the image can't be written
+   */
+  bool add(const char* artist, size_t artist_len, const char* title, size_t title_len,
+           bool removed = false) {
+    if (failed_) {
+      return false;
+    }
+    if (nsongs_ == 0 || artist_.size() != artist_len
+        || std::memcmp(artist_.data(), artist, artist_len) != 0) {
+      artist_.assign(artist, artist_len);
+      artist_offset_ = put(artist, artist_len);
+    }
+    LibraryImageRecord r;
+    r.artist = artist_offset_;
+    r.artist_size = (uint32_t)artist_len;
+    r.title = put(title, title_len);
+    r.title_size = (uint32_t)title_len | (removed ? LIBRARY_IMAGE_REMOVED : 0);
+    failed_ = failed_ || std::fwrite(&r, sizeof(r), 1, records_) != 1;
+    ++nsongs_;
+    return !failed_;
+  }
+
+  /**
+   * Adds the next song, which must come after the previous one
+   * @param song song to add
+   * @param removed true to write a tombstone
+   * @return false if the image can't be written
+   */
+  bool add(const Song& song, bool removed = false) {
+    return add(song.artist.data(), song.artist.size(), song.title.data(), song.title.size(),
+               removed);
+  }
+
+  /**
+   * Appends the string table and header and syncs the image, then moves it into
+   * place
+   * @param log_position write-ahead log position the image covers
+   * @return true if successful
+   */
+  bool finish(uint64_t log_position = 0) {
+    if (failed_ || records_ == nullptr) {
+      discard();
+      return false;
+    }
+
+    LibraryImageHeader header;
+    header.magic = LIBRARY_IMAGE_MAGIC;
+    header.version = LIBRARY_IMAGE_VERSION;
+    header.nsongs = nsongs_;
+    header.records = sizeof(LibraryImageHeader);
+    header.strings = header.records + nsongs_*sizeof(LibraryImageRecord);
+    header.strings_size = strings_size_;
+    header.size = header.strings + strings_size_;
+    header.log_position = log_position;
+
+    bool success = std::fflush(strings_) == 0 && std::fseek(strings_, 0, SEEK_SET) == 0;
+    std::vector<char> buffer(1 << 16);
+    size_t n;
+    while (success && (n = std::fread(buffer.data(), 1, buffer.size(), strings_)) > 0) {
+      success = std::fwrite(buffer.data(), 1, n, records_) == n;
+    }
+    success = success && !std::ferror(strings_)
+        && std::fseek(records_, 0, SEEK_SET) == 0
+        && std::fwrite(&header, sizeof(header), 1, records_) == 1
+        && LibraryImage::sync(records_);
+    success &= std::fclose(records_) == 0;
+    records_ = nullptr;
+    std::fclose(strings_);
+    strings_ = nullptr;
+    std::remove(strings_tmp_.c_str());
+
+#ifdef _WIN32
+    // rename does not replace existing files on Windows
+    if (success) {
+      std::remove(filename_.c_str());
+    }
+#endif
+    success = success && std::rename(tmp_.c_str(), filename_.c_str()) == 0;
+    if (!success) {
+      std::remove(tmp_.c_str());
+    }
+    return success;
+  }
+
+  /**
+   * Number of songs added so far
+   */
+  uint64_t size() const {
+    return nsongs_;
+  }
+};
+
+#endif //LAB5_LIBRARY_IMAGE_H
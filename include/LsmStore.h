@@ -0,0 +1,885 @@
+/**
+ * @file
+ *
+ * This file contains a log-structured merge (LSM) storage engine for the music
+ * library, for write-heavy workloads on catalogs larger than memory.
+ *
+ * Recent changes go to an in-memory memtable, where a removed song is kept as a
+ * tombstone.  When the memtable fills up it is frozen and a background thread
+ * writes it to disk as an immutable sorted run: a library image (see LibraryImage)
+ * whose records may be tombstones.  Runs are memory-mapped and searched in place.
+ *
+ * Runs are compacted by size, keeping older runs larger than newer ones.  Starting
+ * from a run, a group takes in each next older run that is no larger than twice
+ * the whole group so far; once a group holds the set number of runs, it is merged
+ * into a single run.  A run is thus merged again only once the runs newer than it
+ * have grown to half its size, so each song is rewritten a few times each time
+ * its run doubles rather than on every merge.  When merging pairs, each run left
+ * is more than twice the size of the next newer one, so a lookup looks at a
+ * number of runs that grows with the logarithm of the store's size.  The merge streams the
+ * runs into the new run file one song at a time, so it needs memory for neither
+ * the runs nor the result.  Tombstones are dropped once a merge reaches the oldest
+ * run, since nothing older remains for them to hide.
+ *
+ * Newer levels take precedence: the memtable over frozen memtables, over runs from
+ * newest to oldest.  The first level with a record of a song decides whether it is
+ * in the library.
+ *
+ * Each run file is named after the range of sequence numbers it covers,
+ * run-<newest>-<oldest>.lsm, so runs left over from a merge that was interrupted
+ * can be recognized and deleted on the next open.  A run replacing the whole store
+ * covers every sequence number back to the first for the same reason.  A new run is
+ * synced to disk, along with its name in the directory, before any run it replaces
+ * is deleted.  The memtable is not written to
+ * disk until it is flushed; use a WriteAheadLog to keep unflushed changes.  Each run
+ * records the log position its changes reach, see setLogPosition, so the log can be
+ * cut down to the changes not yet in a run.
+ *
+ */
+#ifndef LAB5_LSM_STORE_H
+#define LAB5_LSM_STORE_H
+
+#include "Song.h"
+#include "LibraryImage.h"
+#include "MappedFile.h"
+#include "Regex.h"
+#include "QueryBudget.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define LSM_STORE_MEMTABLE_LIMIT 65536
+#define LSM_STORE_MAX_RUNS 4
+#define LSM_STORE_MAX_FROZEN 4
+
+/**
+ * Log-structured merge storage for a set of songs
+ */
+class LsmStore {
+  // songs changed since the last flush, mapped to true if removed
+  using Memtable = std::map<Song, bool>;
+
+  /**
+   * An immutable sorted run, mapped from disk.  The file is deleted once the
+   * run has been merged and is no longer being read.
+   */
+  struct Run {
+    uint64_t newest;
+    uint64_t oldest;
+    std::string path;
+    MappedFile file;
+    LibraryImage image;
+    bool obsolete;
+
+    Run(uint64_t newest, uint64_t oldest, const std::string& path) :
+        newest(newest), oldest(oldest), path(path), file(), image(), obsolete(false) {}
+
+    ~Run() {
+      file.close();
+      if (obsolete) {
+        std::remove(path.c_str());
+      }
+    }
+  };
+
+  std::string dir_;
+  size_t memtable_limit_;
+  size_t max_runs_;
+
+  mutable std::mutex mutex_;      // guards everything below
+  std::condition_variable cv_;
+  Memtable memtable_;
+  std::deque<std::shared_ptr<const Memtable>> frozen_;   // newest first
+  std::deque<uint64_t> frozen_logged_;    // log position each frozen memtable covers
+  uint64_t logged_;                       // log position the memtable covers
+  std::vector<std::shared_ptr<Run>> runs_;                // newest first
+  uint64_t next_seq_;
+  size_t size_;
+  bool running_;
+  bool busy_;                     // runs are being written or merged
+  std::thread worker_;
+  size_t flushes_;
+  size_t merges_;
+
+  // prevent copies, the store owns its files
+  LsmStore(const LsmStore&);
+  LsmStore& operator=(const LsmStore&);
+
+  std::string runPath(uint64_t newest, uint64_t oldest) const {
+    char name[64];
+    std::snprintf(name, sizeof(name), "run-%020llu-%020llu.lsm",
+                  (unsigned long long)newest, (unsigned long long)oldest);
+    return dir_ + "/" + name;
+  }
+
+  static void makeDirectory(const std::string& dir) {
+#ifdef _WIN32
+    _mkdir(dir.c_str());
+#else
+    mkdir(dir.c_str(), 0755);
+#endif
+  }
+
+  // makes the names of files written to the directory durable
+  bool syncDirectory() const {
+#ifdef _WIN32
+    return true;    // renames are durable once they return
+#else
+    int fd = ::open(dir_.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    bool success = fsync(fd) == 0;
+    ::close(fd);
+    return success;
+#endif
+  }
+
+  // lists the names of run files in the directory
+  std::vector<std::string> listRuns() const {
+    std::vector<std::string> out;
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((dir_ + "/run-*.lsm").c_str(), &data);
+    if (find != INVALID_HANDLE_VALUE) {
+      do {
+        out.push_back(data.cFileName);
+      } while (FindNextFileA(find, &data));
+      FindClose(find);
+    }
+#else
+    DIR* d = opendir(dir_.c_str());
+    if (d != nullptr) {
+      struct dirent* entry;
+      while ((entry = readdir(d)) != nullptr) {
+        std::string name = entry->d_name;
+        if (name.compare(0, 4, "run-") == 0 && name.size() > 4
+            && name.compare(name.size() - 4, 4, ".lsm") == 0) {
+          out.push_back(name);
+        }
+      }
+      closedir(d);
+    }
+#endif
+    return out;
+  }
+
+  /**
+   * Walks the records of several runs in song order.  Where more than one run
+   * has a record of a song, only that of the newest is visited.
+   */
+  class RunMerger {
+    std::vector<const LibraryImage*> images_;   // newest first
+    std::vector<size_t> pos_;
+    std::vector<size_t> heap_;                  // runs not yet exhausted
+
+    // heap order: smallest song first, the newest run first among equal songs
+    bool after(size_t a, size_t b) const {
+      int c = LibraryImage::compare(*images_[a], pos_[a], *images_[b], pos_[b]);
+      return c != 0 ? c > 0 : a > b;
+    }
+
+   public:
+    /**
+     * Starts merging runs
+     * @param runs runs to merge, newest first
+     */
+    template <typename Runs>
+    explicit RunMerger(const Runs& runs) : images_(), pos_(), heap_() {
+      for (const auto& run : runs) {
+        images_.push_back(&run->image);
+      }
+      pos_.assign(images_.size(), 0);
+      auto after = [this](size_t a, size_t b) { return this->after(a, b); };
+      for (size_t r = 0; r < images_.size(); ++r) {
+        if (images_[r]->size() > 0) {
+          heap_.push_back(r);
+          std::push_heap(heap_.begin(), heap_.end(), after);
+        }
+      }
+    }
+
+    /**
+     * Moves to the next song, skipping older records of it
+     * @param image set to the image holding the newest record of the song
+     * @param i set to the index of that record
+     * @return false once all runs are exhausted
+     */
+    bool next(const LibraryImage*& image, size_t& i) {
+      if (heap_.empty()) {
+        return false;
+      }
+      auto after = [this](size_t a, size_t b) { return this->after(a, b); };
+      size_t r = heap_.front();
+      image = images_[r];
+      i = pos_[r];
+      // pop every run at this song, the first popped is the newest
+      std::vector<size_t> popped;
+      while (!heap_.empty() && (popped.empty()
+             || LibraryImage::compare(*images_[heap_.front()], pos_[heap_.front()], *image, i) == 0)) {
+        std::pop_heap(heap_.begin(), heap_.end(), after);
+        popped.push_back(heap_.back());
+        heap_.pop_back();
+      }
+      for (size_t p : popped) {
+        if (++pos_[p] < images_[p]->size()) {
+          heap_.push_back(p);
+          std::push_heap(heap_.begin(), heap_.end(), after);
+        }
+      }
+      return true;
+    }
+  };
+
+  // maps a run that was written to disk
+  std::shared_ptr<Run> mapRun(uint64_t newest, uint64_t oldest) {
+    std::shared_ptr<Run> run = std::make_shared<Run>(newest, oldest, runPath(newest, oldest));
+    if (!run->file.open(run->path)) {
+      return nullptr;
+    }
+    run->image = LibraryImage(run->file.data(), run->file.size());
+    return run->image.valid() ? run : nullptr;
+  }
+
+  // writes a run to disk, durably, and maps it
+  std::shared_ptr<Run> writeRun(const std::vector<char>& image, uint64_t newest, uint64_t oldest) {
+    if (!LibraryImage::save(image, runPath(newest, oldest)) || !syncDirectory()) {
+      return nullptr;
+    }
+    return mapRun(newest, oldest);
+  }
+
+  // finds adjacent runs to merge, see the file comment, must hold mutex_
+  bool pickMerge(size_t& first, size_t& count) const {
+    size_t width = std::max((size_t)2, max_runs_);
+    for (size_t begin = 0; begin < runs_.size(); ++begin) {
+      uint64_t total = runs_[begin]->image.size();
+      size_t end = begin + 1;
+      while (end < runs_.size() && runs_[end]->image.size() <= 2 * total) {
+        total += runs_[end]->image.size();
+        ++end;
+      }
+      if (end - begin >= width) {
+        first = begin;
+        count = end - begin;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // log position covered by the runs, must hold mutex_
+  uint64_t logPositionLocked() const {
+    uint64_t logged = 0;
+    for (const auto& run : runs_) {
+      logged = std::max(logged, run->image.logPosition());
+    }
+    return logged;
+  }
+
+  // looks up a song through the levels older than the memtable, must hold mutex_
+  bool lookupFrozen(const Song& song, bool& tombstone) const {
+    for (const auto& table : frozen_) {
+      auto it = table->find(song);
+      if (it != table->end()) {
+        tombstone = it->second;
+        return true;
+      }
+    }
+    for (const auto& run : runs_) {
+      if (run->image.lookup(song, tombstone)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // checks if a song is in the store, must hold mutex_
+  bool containsLocked(const Song& song) const {
+    bool tombstone = false;
+    auto it = memtable_.find(song);
+    if (it != memtable_.end()) {
+      return !it->second;
+    }
+    return lookupFrozen(song, tombstone) && !tombstone;
+  }
+
+  // records a change, freezing the memtable once full, must hold mutex_
+  void put(std::unique_lock<std::mutex>& lock, const Song& song, bool removed) {
+    memtable_[song] = removed;
+    if (memtable_.size() < memtable_limit_) {
+      return;
+    }
+
+    // hold writers back if the background thread can't keep up
+    cv_.wait(lock, [this]() { return !running_ || frozen_.size() < LSM_STORE_MAX_FROZEN; });
+    frozen_.push_front(std::make_shared<const Memtable>(std::move(memtable_)));
+    frozen_logged_.push_front(logged_);
+    memtable_.clear();
+    if (running_) {
+      cv_.notify_all();
+    }
+    else {
+      flushLocked(lock);
+    }
+  }
+
+  // waits until no other thread is writing runs, then claims that job
+  void acquire(std::unique_lock<std::mutex>& lock) {
+    cv_.wait(lock, [this]() { return !busy_; });
+    busy_ = true;
+  }
+
+  void release() {
+    busy_ = false;
+    cv_.notify_all();
+  }
+
+  // writes all frozen memtables to runs, oldest first, then merges if needed
+  void flushLocked(std::unique_lock<std::mutex>& lock) {
+    acquire(lock);
+    while (!frozen_.empty()) {
+      std::shared_ptr<const Memtable> table = frozen_.back();
+      uint64_t logged = frozen_logged_.back();
+      uint64_t seq = next_seq_++;
+
+      lock.unlock();
+      std::vector<char> image = LibraryImage::build(*table);
+      LibraryImage::setLogPosition(image, logged);
+      std::shared_ptr<Run> run = writeRun(image, seq, seq);
+      lock.lock();
+
+      if (!run) {
+        std::cerr << "Failed to write run: " << runPath(seq, seq) << std::endl;
+        break;    // keep serving it from memory
+      }
+      runs_.insert(runs_.begin(), run);
+      frozen_.pop_back();
+      frozen_logged_.pop_back();
+      ++flushes_;
+      cv_.notify_all();
+    }
+    size_t first, count;
+    while (pickMerge(first, count) && mergeLocked(lock, first, count)) {
+      // a merged run may now fit in the group of an older run
+    }
+    release();
+  }
+
+  /**
+   * Merges adjacent runs into one, streaming them straight into the new run
+   * file.  Must hold mutex_ and have acquired the job.
+   * @param first index of the newest run to merge
+   * @param count number of runs to merge
+   * @return true if merged
+   */
+  bool mergeLocked(std::unique_lock<std::mutex>& lock, size_t first, size_t count) {
+    std::vector<std::shared_ptr<Run>> runs(runs_.begin() + first, runs_.begin() + first + count);
+    bool oldest = first + count == runs_.size();
+    uint64_t newest_seq = runs.front()->newest;
+    uint64_t oldest_seq = runs.back()->oldest;
+    uint64_t logged = 0;
+    for (const auto& run : runs) {
+      logged = std::max(logged, run->image.logPosition());
+    }
+    lock.unlock();
+
+    // the newest run with a song decides, tombstones still hide songs in older
+    // runs unless there are none
+    LibraryImageWriter writer(runPath(newest_seq, oldest_seq));
+    RunMerger merger(runs);
+    const LibraryImage* image;
+    size_t i;
+    bool written = true;
+    while (written && merger.next(image, i)) {
+      bool removed = image->removed(i);
+      if (removed && oldest) {
+        continue;
+      }
+      size_t alen, tlen;
+      const char* artist = image->artist(i, alen);
+      const char* title = image->title(i, tlen);
+      written = writer.add(artist, alen, title, tlen, removed);
+    }
+    std::shared_ptr<Run> run = written && writer.finish(logged) && syncDirectory()
+        ? mapRun(newest_seq, oldest_seq) : nullptr;
+
+    lock.lock();
+    if (!run) {
+      std::cerr << "Failed to merge runs in " << dir_ << std::endl;
+      return false;
+    }
+    // runs flushed during the merge are newer and were added in front
+    auto pos = std::find(runs_.begin(), runs_.end(), runs.front());
+    pos = runs_.erase(pos, pos + runs.size());
+    runs_.insert(pos, run);
+    for (auto& old : runs) {
+      // the merged run has the same name as a run covering a single sequence number
+      old->obsolete = old->path != run->path;
+    }
+    ++merges_;
+    return true;
+  }
+
+  // main loop of the background thread
+  void runWorker() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (running_) {
+      cv_.wait(lock, [this]() { return !running_ || !frozen_.empty(); });
+      flushLocked(lock);
+      if (!frozen_.empty()) {
+        cv_.wait_for(lock, std::chrono::seconds(1));   // failed to write, retry later
+      }
+    }
+  }
+
+ public:
+  /**
+   * Creates a store
+   * @param dir directory holding the sorted runs
+   * @param memtable_limit number of changes kept in memory before writing a run
+   * @param max_runs number of runs a group holds before it is merged, see the file
+   *        comment
+   */
+  LsmStore(const std::string& dir, size_t memtable_limit = LSM_STORE_MEMTABLE_LIMIT,
+           size_t max_runs = LSM_STORE_MAX_RUNS) :
+      dir_(dir), memtable_limit_(std::max((size_t)1, memtable_limit)),
+      max_runs_(std::max((size_t)1, max_runs)), mutex_(), cv_(), memtable_(), frozen_(),
+      frozen_logged_(), logged_(0), runs_(), next_seq_(1), size_(0), running_(false), busy_(false), worker_(), flushes_(0), merges_(0) {}
+
+  ~LsmStore() {
+    stop();
+  }
+
+  /**
+   * Opens the runs already in the directory, creating it if needed.  Runs made
+   * redundant by a merge that completed are deleted.
+   * @return true if successful
+   */
+  bool open() {
+    makeDirectory(dir_);
+
+    // newest first, dropping runs covered by a newer one
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    for (const auto& name : listRuns()) {
+      unsigned long long newest, oldest;
+      if (std::sscanf(name.c_str(), "run-%llu-%llu.lsm", &newest, &oldest) == 2) {
+        ranges.push_back(std::make_pair((uint64_t)newest, (uint64_t)oldest));
+      }
+    }
+    std::sort(ranges.begin(), ranges.end(),
+              [](const std::pair<uint64_t, uint64_t>& a, const std::pair<uint64_t, uint64_t>& b) {
+                return a.first != b.first ? a.first > b.first : a.second < b.second;
+              });
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    runs_.clear();
+    for (const auto& range : ranges) {
+      std::string path = runPath(range.first, range.second);
+      if (!runs_.empty() && range.first >= runs_.back()->oldest) {
+        std::remove(path.c_str());    // already merged into a newer run
+        continue;
+      }
+      std::shared_ptr<Run> run = std::make_shared<Run>(range.first, range.second, path);
+      if (run->file.open(path)) {
+        run->image = LibraryImage(run->file.data(), run->file.size());
+      }
+      if (!run->image.valid()) {
+        std::cerr << "Invalid run: " << path << std::endl;
+        return false;
+      }
+      runs_.push_back(run);
+    }
+    next_seq_ = runs_.empty() ? 1 : runs_.front()->newest + 1;
+    logged_ = logPositionLocked();
+
+    // count songs by merging the runs, the newest record of each song decides
+    size_ = 0;
+    RunMerger merger(runs_);
+    const LibraryImage* image;
+    size_t i;
+    while (merger.next(image, i)) {
+      if (!image->removed(i)) {
+        ++size_;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Starts writing and merging runs in the background
+   */
+  void start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_) {
+      return;
+    }
+    running_ = true;
+    worker_ = std::thread(&LsmStore::runWorker, this);
+  }
+
+  /**
+   * Stops the background thread, then writes any changes still in memory
+   */
+  void stop() {
+    std::thread worker;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_ = false;
+      worker.swap(worker_);
+    }
+    cv_.notify_all();
+    if (worker.joinable()) {
+      worker.join();
+    }
+    flush();
+  }
+
+  /**
+   * Writes the memtable and any frozen memtables to disk as runs, and merges
+   * the runs if there are too many
+   */
+  void flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!memtable_.empty()) {
+      frozen_.push_front(std::make_shared<const Memtable>(std::move(memtable_)));
+      frozen_logged_.push_front(logged_);
+      memtable_.clear();
+    }
+    flushLocked(lock);
+  }
+
+  /**
+   * Replaces the contents of the store with a batch of songs, written directly
+   * as a single run.  The runs it replaces are only deleted once it is on disk,
+   * and are recognized as replaced on the next open should they outlive a crash.
+   * @param songs songs to store, sorted without duplicates
+   * @return true if successful, false leaving the store as it was
+   */
+  bool build(const std::set<Song>& songs) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    acquire(lock);
+    uint64_t seq = next_seq_++;
+    uint64_t logged = logged_;
+    lock.unlock();
+    std::vector<char> image = LibraryImage::build(songs);
+    LibraryImage::setLogPosition(image, logged);
+    std::shared_ptr<Run> run = writeRun(image, seq, 1);
+    lock.lock();
+    release();
+    if (!run) {
+      std::cerr << "Failed to write run: " << runPath(seq, 1) << std::endl;
+      return false;
+    }
+
+    memtable_.clear();
+    frozen_.clear();
+    frozen_logged_.clear();
+    for (auto& old : runs_) {
+      old->obsolete = true;
+    }
+    runs_.assign(1, run);
+    size_ = songs.size();
+    return true;
+  }
+
+  /**
+   * Deletes the store: drops all songs, including those not yet written, and
+   * removes the run files and the directory.  The background thread must not
+   * be running.
+   * @return true if the directory was removed
+   */
+  bool destroy() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    acquire(lock);
+    memtable_.clear();
+    frozen_.clear();
+    frozen_logged_.clear();
+    for (auto& run : runs_) {
+      run->obsolete = true;   // deleted once no search is reading it
+    }
+    runs_.clear();
+    size_ = 0;
+    for (const auto& name : listRuns()) {
+      std::remove((dir_ + "/" + name).c_str());
+    }
+    release();
+#ifdef _WIN32
+    return _rmdir(dir_.c_str()) == 0;
+#else
+    return rmdir(dir_.c_str()) == 0;
+#endif
+  }
+
+  /**
+   * Adds a song
+   * @param song song to add
+   * @return true if added, false if already present
+   */
+  bool add(const Song& song) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (containsLocked(song)) {
+      return false;
+    }
+    put(lock, song, false);
+    ++size_;
+    return true;
+  }
+
+  /**
+   * Removes a song
+   * @param song song to remove
+   * @return true if removed, false if not present
+   */
+  bool remove(const Song& song) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!containsLocked(song)) {
+      return false;
+    }
+    // a song only ever added to the memtable needs no tombstone
+    bool tombstone = false;
+    if (!lookupFrozen(song, tombstone) || tombstone) {
+      memtable_.erase(song);
+    }
+    else {
+      put(lock, song, true);
+    }
+    --size_;
+    return true;
+  }
+
+  /**
+   * Checks if a song is present
+   * @param song song to look for
+   * @return true if found
+   */
+  bool contains(const Song& song) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return containsLocked(song);
+  }
+
+  /**
+   * Finds songs matching title and artist expressions.  The memtable is
+   * searched under the lock; frozen memtables and runs are immutable, and are
+   * searched after releasing it.
+   * @param artist_regex artist regular expression, see Regex
+   * @param title_regex title regular expression
+   * @param budget work the search may do, nullptr for no limit; once it runs out
+   *        the songs found so far are returned
+   * @return sorted songs matching expressions, none if either is invalid
+   */
+  std::vector<Song> find(const std::string& artist_regex,
+                         const std::string& title_regex,
+                         QueryBudget* budget = nullptr) const {
+    Regex aregex(artist_regex);
+    Regex tregex(title_regex);
+    auto matches = [&](const Song& song) {
+      if (budget != nullptr && !budget->charge(song.artist.size() + song.title.size())) {
+        return false;
+      }
+      return aregex.search(song.artist) && tregex.search(song.title);
+    };
+
+    // any newer record of a matching song also matches, so only matching
+    // memtable entries are needed to hide older ones
+    Memtable newest;
+    std::deque<std::shared_ptr<const Memtable>> frozen;
+    std::vector<std::shared_ptr<Run>> runs;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (const auto& entry : memtable_) {
+        if (matches(entry.first)) {
+          newest.insert(entry);
+        }
+      }
+      frozen = frozen_;
+      runs = runs_;
+    }
+
+    // checks whether a level newer than the given one has a record of a song
+    bool tombstone = false;
+    auto hidden = [&](const Song& song, size_t nfrozen, size_t nruns) {
+      if (newest.count(song) > 0) {
+        return true;
+      }
+      for (size_t i = 0; i < nfrozen; ++i) {
+        if (frozen[i]->count(song) > 0) {
+          return true;
+        }
+      }
+      for (size_t i = 0; i < nruns; ++i) {
+        if (runs[i]->image.lookup(song, tombstone)) {
+          return true;
+        }
+      }
+      return false;
+    };
+
+    std::set<Song> out;
+    for (const auto& entry : newest) {
+      if (!entry.second) {
+        out.insert(entry.first);
+      }
+    }
+    for (size_t f = 0; f < frozen.size(); ++f) {
+      for (const auto& entry : *frozen[f]) {
+        if (!entry.second && matches(entry.first) && !hidden(entry.first, f, 0)) {
+          out.insert(entry.first);
+        }
+      }
+    }
+    for (size_t r = 0; r < runs.size(); ++r) {
+      for (auto& song : runs[r]->image.find(artist_regex, title_regex, budget)) {
+        if (!hidden(song, frozen.size(), r)) {
+          out.insert(song);
+        }
+      }
+    }
+
+    return std::vector<Song>(out.begin(), out.end());
+  }
+
+  /**
+   * Number of songs present
+   */
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return size_;
+  }
+
+  /**
+   * Visits every song present, in order, without copying the store into
+   * memory.  Only the memtables are copied, the runs are merged as they are
+   * read.  Songs are visited as they were when called.
+   * @param visit called with each song
+   */
+  template <typename Visitor>
+  void forEach(Visitor visit) const {
+    // the changes in memory, the newest record of each song decides
+    Memtable changes;
+    std::vector<std::shared_ptr<Run>> runs;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      changes = memtable_;
+      for (const auto& table : frozen_) {
+        changes.insert(table->begin(), table->end());
+      }
+      runs = runs_;
+    }
+
+    // merge them with the runs
+    RunMerger merger(runs);
+    const LibraryImage* image = nullptr;
+    size_t i = 0;
+    bool more = merger.next(image, i);
+    auto change = changes.begin();
+    while (more || change != changes.end()) {
+      if (more && change != changes.end()) {
+        Song song = image->song(i);
+        if (song < change->first) {
+          if (!image->removed(i)) {
+            visit(song);
+          }
+          more = merger.next(image, i);
+          continue;
+        }
+        if (song == change->first) {
+          more = merger.next(image, i);   // hidden by the change
+        }
+      }
+      else if (more) {
+        if (!image->removed(i)) {
+          visit(image->song(i));
+        }
+        more = merger.next(image, i);
+        continue;
+      }
+      if (!change->second) {
+        visit(change->first);
+      }
+      ++change;
+    }
+  }
+
+  /**
+   * Retrieves a copy of all songs present
+   * @return sorted set of songs
+   */
+  std::set<Song> songs() const {
+    std::set<Song> out;
+    forEach([&out](const Song& song) { out.insert(out.end(), song); });
+    return out;
+  }
+
+  /**
+   * Records how far into the write-ahead log the changes made so far reach.  Call
+   * once they have been applied, so every change logged before the position is in
+   * the memtable or older levels.
+   * @param position log position, see WriteAheadLog::position
+   */
+  void setLogPosition(uint64_t position) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    logged_ = position;
+  }
+
+  /**
+   * Write-ahead log position the runs on disk cover: the log records before it
+   * need not be replayed, and can be dropped
+   * @return position, 0 if none
+   */
+  uint64_t logPosition() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return logPositionLocked();
+  }
+
+  /**
+   * Number of runs on disk
+   */
+  size_t runs() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return runs_.size();
+  }
+
+  /**
+   * Number of memtables written to disk so far
+   */
+  size_t flushes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return flushes_;
+  }
+
+  /**
+   * Number of times the runs have been merged
+   */
+  size_t merges() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return merges_;
+  }
+};
+
+#endif //LAB5_LSM_STORE_H
@@ -0,0 +1,716 @@
+/**
+ * @file
+ *
+ * This file contains the full-text index of song lyrics, used to find songs by
+ * words and phrases in their lyrics without scanning any lyric text at query time.
+ *
+ * Lyrics are loaded from a directory of text files named "Artist - Title.txt".  The
+ * text is split into words (runs of letters and digits, lowercased, with apostrophes
+ * dropped so "don't" matches "dont"), and each word maps to a postings list of the
+ * songs containing it, with the position and line of every occurrence.  Only the
+ * index is kept in memory; matches report line numbers, and the text of the lines
+ * is read from the lyrics store.
+ *
+ * Songs are known by their SongIds ids, the same ids the library gives them, so a
+ * match can be looked up in the library by id.  The index keeps the registry of
+ * its songs, in place of any table of its own.
+ *
+ * Postings format, for each song containing the word, in increasing song id order:
+ *   song id minus previous song id (varint), occurrences (varint),
+ *   size of the occurrences in bytes (varint),
+ *   occurrences, each: position minus previous position (varint),
+ *                      line minus previous line (varint)
+ *
+ * Positions count words from the start of the song, lines count from 0.  Varints
+ * store 7 bits per byte, least significant first, with the top bit set on every
+ * byte but the last.  Storing the size of the occurrences lets a search skip over
+ * songs without decoding them, and every LYRICS_SKIP_INTERVAL songs a skip pointer
+ * records where the postings continue, so that intersecting a rare word with a
+ * common one skips most of the common word's postings.
+ *
+ * Songs are best added in id order, as load does, so that each song's postings
+ * are appended; a song added out of order rewrites the postings of its words.
+ *
+ * Saved index format (see save), all numbers varints:
+ *   number of songs, number of words, then for each word:
+ *     word size, word, songs containing it, id of the last song,
+ *     number of skip pointers, each: song id, offset,
+ *     postings size, postings
+ *
+ * A saved index is read back by loading it with the songs it covers, without
+ * touching their lyrics.  The songs are registered in id order again, so the
+ * colliding songs among them get the same salted ids as when it was saved.
+ *
+ * Query syntax:
+ *   words            songs containing all of the words, anywhere
+ *   "a phrase"       the words next to each other, in order
+ *   "a phrase"~n     the words in order, with up to n other words between each
+ *
+ */
+#ifndef LAB5_LYRICS_INDEX_H
+#define LAB5_LYRICS_INDEX_H
+
+#include "Song.h"
+#include "SongIds.h"
+#include "LibraryImage.h"
+#include "Catalog.h"
+
+#include <cstdint>
+#include <cctype>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <iterator>
+
+#define LYRICS_FILE_SUFFIX ".txt"
+#define LYRICS_FILE_SEPARATOR " - "
+#define LYRICS_SKIP_INTERVAL 64
+#define LYRICS_MAX_SNIPPETS 3
+
+/**
+ * A song matching a lyrics search, with the numbers of the lines that matched
+ */
+struct LyricsMatch {
+  Song song;
+  std::vector<uint32_t> lines;    // counting from 0
+
+  LyricsMatch(const Song& song, const std::vector<uint32_t>& lines) :
+      song(song), lines(lines) {}
+};
+
+/**
+ * Inverted index from words to the songs whose lyrics contain them
+ */
+class LyricsIndex {
+  /**
+   * Where a block of postings starts
+   */
+  struct Skip {
+    uint64_t id;          // id of the last song before the block
+    uint32_t offset;      // byte offset of the block
+  };
+
+  /**
+   * Encoded postings of a single word
+   */
+  struct Postings {
+    uint32_t count;       // number of songs
+    uint64_t last;        // id of the last song, for delta encoding
+    std::string data;
+    std::vector<Skip> skips;
+  };
+
+  /**
+   * Reads through a postings list
+   */
+  class Cursor {
+    const Postings* postings_;
+    size_t pos_;          // start of the next song
+    size_t occurrences_;  // start of the current song's occurrences
+    size_t size_;         // size of the current song's occurrences
+    uint32_t count_;      // occurrences in the current song
+    uint64_t id_;
+    bool valid_;
+
+   public:
+    explicit Cursor(const Postings& postings) :
+        postings_(&postings), pos_(0), occurrences_(0), size_(0), count_(0), id_(0),
+        valid_(true) {
+      next();
+    }
+
+    bool valid() const {
+      return valid_;
+    }
+
+    uint64_t id() const {
+      return id_;
+    }
+
+    uint32_t count() const {
+      return count_;
+    }
+
+    /**
+     * Occurrences in the current song, still encoded
+     */
+    std::string encoded() const {
+      return postings_->data.substr(occurrences_, size_);
+    }
+
+    /**
+     * Moves on to the next song
+     */
+    void next() {
+      const std::string& data = postings_->data;
+      if (pos_ >= data.size()) {
+        valid_ = false;
+        return;
+      }
+      id_ += getVarint(data, pos_);
+      count_ = (uint32_t)getVarint(data, pos_);
+      size_ = (size_t)getVarint(data, pos_);
+      occurrences_ = pos_;
+      pos_ += size_;
+    }
+
+    /**
+     * Moves on to the first song with an id of at least target, following skip
+     * pointers past whole blocks of songs
+     */
+    void advance(uint64_t target) {
+      if (!valid_ || id_ >= target) {
+        return;
+      }
+      const std::vector<Skip>& skips = postings_->skips;
+      auto skip = std::lower_bound(skips.begin(), skips.end(), target,
+                                   [](const Skip& s, uint64_t t) { return s.id < t; });
+      if (skip != skips.begin()) {
+        --skip;   // last block starting before the target
+        if (skip->offset > pos_) {
+          pos_ = skip->offset;
+          id_ = skip->id;
+          next();
+        }
+      }
+      while (valid_ && id_ < target) {
+        next();
+      }
+    }
+
+    /**
+     * Decodes the occurrences in the current song
+     */
+    void occurrences(std::vector<uint32_t>& positions, std::vector<uint32_t>& lines) const {
+      positions.clear();
+      lines.clear();
+      size_t pos = occurrences_;
+      uint32_t position = 0;
+      uint32_t line = 0;
+      for (uint32_t i = 0; i < count_; ++i) {
+        position += (uint32_t)getVarint(postings_->data, pos);
+        line += (uint32_t)getVarint(postings_->data, pos);
+        positions.push_back(position);
+        lines.push_back(line);
+      }
+    }
+  };
+
+  /**
+   * Words that must appear in order, each within slop+1 positions of the last
+   */
+  struct Phrase {
+    std::vector<std::string> words;
+    uint32_t slop;
+  };
+
+  SongIds ids_;                                       // song id -> song
+  std::unordered_map<std::string, Postings> words_;
+  size_t bytes_;
+
+  static void putVarint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+      out.push_back((char)((v & 0x7F) | 0x80));
+      v >>= 7;
+    }
+    out.push_back((char)v);
+  }
+
+  static uint64_t getVarint(const std::string& in, size_t& pos) {
+    uint64_t v = 0;
+    for (int shift = 0; pos < in.size() && shift < 64; shift += 7) {
+      uint8_t b = (uint8_t)in[pos++];
+      v |= (uint64_t)(b & 0x7F) << shift;
+      if (!(b & 0x80)) {
+        break;
+      }
+    }
+    return v;
+  }
+
+  // reads a varint of a saved index, checking it ends within the data
+  static bool getVarint(const char* in, size_t size, size_t& pos, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (pos >= size) {
+        return false;
+      }
+      uint8_t b = (uint8_t)in[pos++];
+      v |= (uint64_t)(b & 0x7F) << shift;
+      if (!(b & 0x80)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // order to add songs in: by id, so each song's postings are appended, breaking
+  // ties the same way every time, so colliding songs are salted alike
+  static std::vector<size_t> idOrder(const std::vector<Song>& songs) {
+    std::vector<std::pair<uint64_t, size_t>> keys;
+    for (size_t i = 0; i < songs.size(); ++i) {
+      keys.push_back(std::make_pair(SongIds::hash(songs[i]), i));
+    }
+    std::sort(keys.begin(), keys.end(),
+              [&songs](const std::pair<uint64_t, size_t>& a, const std::pair<uint64_t, size_t>& b) {
+                return a.first != b.first ? a.first < b.first : songs[a.second] < songs[b.second];
+              });
+    std::vector<size_t> out;
+    for (const auto& key : keys) {
+      out.push_back(key.second);
+    }
+    return out;
+  }
+
+  // appends a song to a word's postings, the song having the highest id so far
+  static void append(Postings& postings, uint64_t id, uint32_t count, const std::string& encoded) {
+    if (postings.count > 0 && postings.count % LYRICS_SKIP_INTERVAL == 0) {
+      postings.skips.push_back(Skip{ postings.last, (uint32_t)postings.data.size() });
+    }
+    putVarint(postings.data, postings.count == 0 ? id : id - postings.last);
+    putVarint(postings.data, count);
+    putVarint(postings.data, encoded.size());
+    postings.data.append(encoded);
+    postings.last = id;
+    ++postings.count;
+  }
+
+  // rewrites a word's postings to take in a song with a lower id than the last
+  static void insert(Postings& postings, uint64_t id, uint32_t count, const std::string& encoded) {
+    Postings merged{ 0, 0, std::string(), std::vector<Skip>() };
+    bool inserted = false;
+    for (Cursor cursor(postings); cursor.valid(); cursor.next()) {
+      if (!inserted && id < cursor.id()) {
+        append(merged, id, count, encoded);
+        inserted = true;
+      }
+      append(merged, cursor.id(), cursor.count(), cursor.encoded());
+    }
+    if (!inserted) {
+      append(merged, id, count, encoded);
+    }
+    postings = std::move(merged);
+  }
+
+  // splits a query into phrases, single words being phrases of one word
+  static std::vector<Phrase> parseQuery(const std::string& query) {
+    std::vector<Phrase> out;
+    size_t i = 0;
+    while (i < query.size()) {
+      // unquoted words up to the next phrase
+      size_t open = std::min(query.find('"', i), query.size());
+      for (auto& word : tokenize(query.substr(i, open - i))) {
+        out.push_back(Phrase{ { word }, 0 });
+      }
+      if (open == query.size()) {
+        break;
+      }
+
+      size_t close = std::min(query.find('"', open + 1), query.size());
+      Phrase phrase{ tokenize(query.substr(open + 1, close - open - 1)), 0 };
+      i = std::min(close + 1, query.size());
+      if (i < query.size() && query[i] == '~') {
+        for (++i; i < query.size() && std::isdigit((unsigned char)query[i]); ++i) {
+          phrase.slop = std::min(phrase.slop*10 + (query[i] - '0'), (uint32_t)UINT16_MAX);
+        }
+      }
+      if (!phrase.words.empty()) {
+        out.push_back(phrase);
+      }
+    }
+    return out;
+  }
+
+  // finds where a phrase occurs in a song, returning the lines of each match
+  static void matchPhrase(const Phrase& phrase, const std::vector<size_t>& slots,
+                          const std::vector<std::vector<uint32_t>>& positions,
+                          const std::vector<std::vector<uint32_t>>& lines,
+                          std::set<uint32_t>& matched) {
+    const std::vector<uint32_t>& first = positions[slots[0]];
+    for (size_t start = 0; start < first.size(); ++start) {
+      // the nearest following occurrence of each word is always the best choice
+      uint32_t at = first[start];
+      bool found = true;
+      for (size_t w = 1; w < slots.size() && found; ++w) {
+        const std::vector<uint32_t>& next = positions[slots[w]];
+        auto it = std::upper_bound(next.begin(), next.end(), at);
+        found = it != next.end() && *it <= at + 1 + phrase.slop;
+        if (found) {
+          at = *it;
+          if (w + 1 == slots.size()) {
+            matched.insert(lines[slots[w]][it - next.begin()]);
+          }
+        }
+      }
+      if (found) {
+        matched.insert(lines[slots[0]][start]);
+      }
+    }
+  }
+
+ public:
+  LyricsIndex() : ids_(), words_(), bytes_(0) {}
+
+  /**
+   * Splits text into lowercase words
+   * @param text text to split
+   * @return words, in order
+   */
+  static std::vector<std::string> tokenize(const std::string& text) {
+    std::vector<std::string> out;
+    std::string word;
+    for (char c : text) {
+      if (std::isalnum((unsigned char)c)) {
+        word.push_back((char)std::tolower((unsigned char)c));
+      }
+      else if (c != '\'' && !word.empty()) {
+        out.push_back(word);
+        word.clear();
+      }
+    }
+    if (!word.empty()) {
+      out.push_back(word);
+    }
+    return out;
+  }
+
+  /**
+   * Works out the song from a lyrics file name, "Artist - Title.txt"
+   * @param name file name
+   * @param artist set to the song artist
+   * @param title set to the song title
+   * @return true if the name has the expected form
+   */
+  static bool parseName(const std::string& name, std::string& artist, std::string& title) {
+    const std::string separator = LYRICS_FILE_SEPARATOR;
+    const std::string suffix = LYRICS_FILE_SUFFIX;
+    size_t sep = name.find(separator);
+    if (name.size() < suffix.size() || sep == std::string::npos || sep == 0
+        || sep + separator.size() >= name.size() - suffix.size()) {
+      return false;
+    }
+    artist = name.substr(0, sep);
+    title = name.substr(sep + separator.size(), name.size() - suffix.size() - sep - separator.size());
+    return true;
+  }
+
+  /**
+   * Indexes the lyrics of a song, unless the song is indexed already
+   * @param song song the lyrics belong to
+   * @param text lyrics
+   */
+  void add(const Song& song, const std::string& text) {
+    if (ids_.id(song) != SONG_ID_NONE) {
+      return;
+    }
+    uint64_t id = ids_.add(song);
+
+    // positions and lines of every word
+    std::map<std::string, std::vector<std::pair<uint32_t, uint32_t>>> occurrences;
+    std::istringstream in(text);
+    std::string line;
+    uint32_t position = 0;
+    for (uint32_t number = 0; std::getline(in, line); ++number) {
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      for (auto& word : tokenize(line)) {
+        occurrences[word].push_back(std::make_pair(position++, number));
+      }
+    }
+
+    for (const auto& word : occurrences) {
+      std::string encoded;
+      uint32_t prev_position = 0;
+      uint32_t prev_line = 0;
+      for (const auto& occurrence : word.second) {
+        putVarint(encoded, occurrence.first - prev_position);
+        putVarint(encoded, occurrence.second - prev_line);
+        prev_position = occurrence.first;
+        prev_line = occurrence.second;
+      }
+
+      Postings& postings = words_[word.first];
+      bytes_ -= postings.data.size();
+      if (postings.count == 0 || id > postings.last) {
+        append(postings, id, (uint32_t)word.second.size(), encoded);
+      }
+      else {
+        insert(postings, id, (uint32_t)word.second.size(), encoded);
+      }
+      bytes_ += postings.data.size();
+    }
+  }
+
+  /**
+   * Indexes all lyrics files in a directory
+   * @param dir directory of "Artist - Title.txt" files
+   * @return number of songs indexed
+   */
+  size_t load(const std::string& dir) {
+    std::vector<Song> songs;
+    std::vector<std::string> names;
+    for (const auto& name : Catalog::list(dir, LYRICS_FILE_SUFFIX)) {
+      std::string artist, title;
+      if (!parseName(name, artist, title)) {
+        std::cerr << "Skipping lyrics file: " << name << std::endl;
+        continue;
+      }
+      songs.push_back(Song(artist, title));
+      names.push_back(name);
+    }
+
+    size_t count = 0;
+    for (size_t i : idOrder(songs)) {
+      std::ifstream fin(dir + "/" + names[i], std::ios::binary);
+      if (!fin.is_open()) {
+        std::cerr << "Skipping lyrics file: " << names[i] << std::endl;
+        continue;
+      }
+      std::ostringstream ss;
+      ss << fin.rdbuf();
+      add(songs[i], ss.str());
+      ++count;
+    }
+    return count;
+  }
+
+  /**
+   * Writes the index out, to be loaded back without the lyrics
+   * @param out saved index, appended to
+   */
+  void save(std::string& out) const {
+    putVarint(out, ids_.size());
+    putVarint(out, words_.size());
+    for (const auto& word : words_) {
+      const Postings& postings = word.second;
+      putVarint(out, word.first.size());
+      out.append(word.first);
+      putVarint(out, postings.count);
+      putVarint(out, postings.last);
+      putVarint(out, postings.skips.size());
+      for (const auto& skip : postings.skips) {
+        putVarint(out, skip.id);
+        putVarint(out, skip.offset);
+      }
+      putVarint(out, postings.data.size());
+      out.append(postings.data);
+    }
+  }
+
+  /**
+   * Loads an index written by save, replacing anything indexed
+   * @param songs the songs the saved index covers
+   * @param data saved index
+   * @param size size of the saved index in bytes
+   * @return true if the saved index is well-formed and covers exactly the songs
+   */
+  bool load(const LibraryImage& songs, const char* data, size_t size) {
+    clear();
+    std::vector<Song> all;
+    for (size_t i = 0; i < songs.size(); ++i) {
+      all.push_back(songs.song(i));
+    }
+    for (size_t i : idOrder(all)) {
+      ids_.add(all[i]);
+    }
+
+    size_t pos = 0;
+    uint64_t count, nwords;
+    bool valid = getVarint(data, size, pos, count) && getVarint(data, size, pos, nwords)
+        && count == ids_.size();
+    for (uint64_t w = 0; w < nwords && valid; ++w) {
+      uint64_t length, songs_count, last, nskips, bytes;
+      valid = getVarint(data, size, pos, length) && length <= size - pos;
+      if (!valid) {
+        break;
+      }
+      Postings& postings = words_[std::string(data + pos, (size_t)length)];
+      pos += (size_t)length;
+      valid = getVarint(data, size, pos, songs_count) && getVarint(data, size, pos, last)
+          && getVarint(data, size, pos, nskips) && nskips <= size - pos;
+      for (uint64_t k = 0; k < nskips && valid; ++k) {
+        uint64_t id, offset;
+        valid = getVarint(data, size, pos, id) && getVarint(data, size, pos, offset)
+            && offset <= UINT32_MAX;
+        if (valid) {
+          postings.skips.push_back(Skip{ id, (uint32_t)offset });
+        }
+      }
+      valid = valid && getVarint(data, size, pos, bytes) && bytes <= size - pos;
+      if (!valid) {
+        break;
+      }
+      postings.count = (uint32_t)songs_count;
+      postings.last = last;
+      postings.data.assign(data + pos, (size_t)bytes);
+      pos += (size_t)bytes;
+      bytes_ += postings.data.size();
+      for (const auto& skip : postings.skips) {
+        valid = valid && skip.offset < postings.data.size();
+      }
+    }
+    if (!valid || pos != size || words_.size() != nwords) {
+      clear();
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * Drops every song indexed
+   */
+  void clear() {
+    ids_.clear();
+    words_.clear();
+    bytes_ = 0;
+  }
+
+  /**
+   * Finds songs whose lyrics match a query
+   * @param query words and phrases to look for, see the query syntax above
+   * @param max_lines maximum number of matching lines returned per song
+   * @return matching songs, sorted, each with the numbers of its first matching lines
+   */
+  std::vector<LyricsMatch> search(const std::string& query,
+                                  size_t max_lines = LYRICS_MAX_SNIPPETS) const {
+    std::vector<LyricsMatch> out;
+
+    // one cursor per distinct word, rarest first so it drives the intersection
+    std::vector<Phrase> phrases = parseQuery(query);
+    std::vector<std::string> words;
+    for (const auto& phrase : phrases) {
+      words.insert(words.end(), phrase.words.begin(), phrase.words.end());
+    }
+    std::sort(words.begin(), words.end());
+    words.erase(std::unique(words.begin(), words.end()), words.end());
+    std::vector<const Postings*> lists;
+    for (const auto& word : words) {
+      auto it = words_.find(word);
+      if (it == words_.end()) {
+        return out;
+      }
+      lists.push_back(&it->second);
+    }
+    if (lists.empty()) {
+      return out;
+    }
+    std::vector<size_t> order(words.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+      order[i] = i;
+    }
+    std::sort(order.begin(), order.end(),
+              [&lists](size_t a, size_t b) { return lists[a]->count < lists[b]->count; });
+    std::vector<Cursor> cursors;
+    for (const auto* list : lists) {
+      cursors.push_back(Cursor(*list));
+    }
+
+    // cursor of each word of each phrase
+    std::vector<std::vector<size_t>> slots;
+    for (const auto& phrase : phrases) {
+      std::vector<size_t> slot;
+      for (const auto& word : phrase.words) {
+        slot.push_back(std::lower_bound(words.begin(), words.end(), word) - words.begin());
+      }
+      slots.push_back(slot);
+    }
+
+    std::vector<uint64_t> ids;
+    std::vector<std::vector<uint32_t>> found_lines;
+    std::vector<std::vector<uint32_t>> positions(words.size());
+    std::vector<std::vector<uint32_t>> lines(words.size());
+    Cursor& lead = cursors[order[0]];
+    while (lead.valid()) {
+      // bring every other word up to the lead word's song
+      uint64_t id = lead.id();
+      uint64_t target = id;
+      bool exhausted = false;
+      for (size_t k = 1; k < order.size() && !exhausted; ++k) {
+        Cursor& cursor = cursors[order[k]];
+        cursor.advance(id);
+        exhausted = !cursor.valid();
+        if (!exhausted) {
+          target = std::max(target, cursor.id());
+        }
+      }
+      if (exhausted) {
+        break;
+      }
+      if (target != id) {
+        lead.advance(target);
+        continue;
+      }
+
+      // all words are present, check the phrases
+      for (size_t w = 0; w < words.size(); ++w) {
+        cursors[w].occurrences(positions[w], lines[w]);
+      }
+      std::set<uint32_t> matched;
+      bool match = true;
+      for (size_t p = 0; p < phrases.size() && match; ++p) {
+        std::set<uint32_t> phrase_lines;
+        matchPhrase(phrases[p], slots[p], positions, lines, phrase_lines);
+        match = !phrase_lines.empty();
+        matched.insert(phrase_lines.begin(), phrase_lines.end());
+      }
+      if (match) {
+        auto end = matched.begin();
+        std::advance(end, std::min(max_lines, matched.size()));
+        ids.push_back(id);
+        found_lines.push_back(std::vector<uint32_t>(matched.begin(), end));
+      }
+      lead.next();
+    }
+
+    // sort by song
+    std::vector<size_t> sorted(ids.size());
+    for (size_t i = 0; i < sorted.size(); ++i) {
+      sorted[i] = i;
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [&](size_t a, size_t b) { return *ids_.song(ids[a]) < *ids_.song(ids[b]); });
+    for (size_t i : sorted) {
+      out.push_back(LyricsMatch(*ids_.song(ids[i]), found_lines[i]));
+    }
+    return out;
+  }
+
+  /**
+   * Number of songs indexed
+   */
+  size_t size() const {
+    return ids_.size();
+  }
+
+  /**
+   * Id of an indexed song, the same as the library gives it
+   * @param song song to look up
+   * @return id, SONG_ID_NONE if the song has no lyrics indexed
+   */
+  uint64_t id(const Song& song) const {
+    return ids_.id(song);
+  }
+
+  /**
+   * Number of distinct words indexed
+   */
+  size_t words() const {
+    return words_.size();
+  }
+
+  /**
+   * Total size of the encoded postings in bytes
+   */
+  size_t bytes() const {
+    return bytes_;
+  }
+};
+
+#endif //LAB5_LYRICS_INDEX_H
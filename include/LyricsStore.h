@@ -0,0 +1,509 @@
+/**
+ * @file
+ *
+ * This file contains the packed store of song lyrics, used to answer GET_LYRICS
+ * and show matching lines without opening a separate text file per request.
+ *
+ * All lyrics files of a directory are packed into a single file, which is then
+ * memory-mapped, so the corpus stays on disk and only the entries that are read
+ * are paged in.  Each entry is compressed; a bounded cache keeps recently used
+ * entries decompressed in memory.
+ *
+ * The pack also holds the lyrics index, saved when the pack is built, so that a
+ * server starting on an up-to-date pack loads the index without decompressing or
+ * tokenizing any lyrics.
+ *
+ * Pack file format (integers little endian, offsets from the start of the file):
+ *   header
+ *   songs, a LibraryImage of the songs with lyrics, sorted
+ *   entries, one per song in the same order:
+ *     offset in the data (8 bytes), compressed size (4 bytes), size (4 bytes)
+ *   index, the LyricsIndex of the lyrics as written by LyricsIndex::save
+ *   data, the compressed lyrics
+ *
+ * Compressed lyrics are a sequence of
+ *   literal count (varint), literal bytes, match length (varint),
+ *   match distance back into the output (varint, only if the length is non-zero)
+ * ending with a match length of zero.  Choruses and repeated lines become matches.
+ *
+ */
+#ifndef LAB5_LYRICS_STORE_H
+#define LAB5_LYRICS_STORE_H
+
+#include "Song.h"
+#include "LibraryImage.h"
+#include "MappedFile.h"
+#include "Catalog.h"
+#include "LyricsIndex.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+
+// identifies a lyrics pack, "MLYR"
+#define LYRICS_STORE_MAGIC 0x52594C4D
+#define LYRICS_STORE_VERSION 2
+#define LYRICS_STORE_CACHE_BYTES (8 << 20)
+#define LYRICS_STORE_MIN_MATCH 4
+#define LYRICS_STORE_MAX_DISTANCE 65535
+
+/**
+ * Header at the start of every pack
+ */
+struct LyricsStoreHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t signature;     // of the lyrics files the pack was built from
+  uint64_t size;          // total size of the pack
+  uint64_t songs;         // offset of the song image
+  uint64_t songs_size;    // size of the song image
+  uint64_t entries;       // offset of the entries
+  uint64_t data;          // offset of the compressed lyrics
+  uint64_t index;         // offset of the saved lyrics index
+  uint64_t index_size;    // size of the saved lyrics index
+};
+
+/**
+ * Location of the lyrics of one song
+ */
+struct LyricsStoreEntry {
+  uint64_t offset;
+  uint32_t compressed_size;
+  uint32_t size;
+};
+
+/**
+ * Read-only, memory-mapped store of song lyrics with a cache of decompressed entries
+ */
+class LyricsStore {
+  MappedFile file_;
+  const LyricsStoreHeader* header_;
+  LibraryImage songs_;
+  const LyricsStoreEntry* entries_;
+
+  // least recently used entry at the back
+  using CacheList = std::list<std::pair<size_t, std::shared_ptr<const std::string>>>;
+  size_t cache_limit_;
+  mutable std::mutex mutex_;      // guards the cache
+  mutable CacheList cache_;
+  mutable std::unordered_map<size_t, CacheList::iterator> cached_;
+  mutable size_t cache_bytes_;
+  mutable size_t hits_;
+  mutable size_t misses_;
+
+  // prevent copies, the mapping has a single owner
+  LyricsStore(const LyricsStore&);
+  LyricsStore& operator=(const LyricsStore&);
+
+  static void putVarint(std::string& out, uint32_t v) {
+    while (v >= 0x80) {
+      out.push_back((char)((v & 0x7F) | 0x80));
+      v >>= 7;
+    }
+    out.push_back((char)v);
+  }
+
+  static bool getVarint(const char* in, size_t size, size_t& pos, uint32_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+      if (pos >= size) {
+        return false;
+      }
+      uint8_t b = (uint8_t)in[pos++];
+      v |= (uint32_t)(b & 0x7F) << shift;
+      if (!(b & 0x80)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+ public:
+  /**
+   * Creates an empty store
+   * @param cache_limit maximum bytes of decompressed lyrics kept in memory
+   */
+  explicit LyricsStore(size_t cache_limit = LYRICS_STORE_CACHE_BYTES) :
+      file_(), header_(nullptr), songs_(), entries_(nullptr), cache_limit_(cache_limit),
+      mutex_(), cache_(), cached_(), cache_bytes_(0), hits_(0), misses_(0) {}
+
+  /**
+   * Compresses text, replacing repeated sequences with references back
+   * @param text text to compress
+   * @return compressed text
+   */
+  static std::string compress(const std::string& text) {
+    std::string out;
+    const char* in = text.data();
+    size_t n = text.size();
+    std::vector<int64_t> table(1 << 12, -1);   // last position of each hashed 4 bytes
+
+    size_t literals = 0;
+    size_t i = 0;
+    while (i + LYRICS_STORE_MIN_MATCH <= n) {
+      uint32_t h;
+      std::memcpy(&h, in + i, 4);
+      h = (h * 2654435761u) >> 20;
+      int64_t candidate = table[h];
+      table[h] = (int64_t)i;
+      if (candidate < 0 || i - candidate > LYRICS_STORE_MAX_DISTANCE
+          || std::memcmp(in + candidate, in + i, LYRICS_STORE_MIN_MATCH) != 0) {
+        ++i;
+        continue;
+      }
+
+      size_t length = LYRICS_STORE_MIN_MATCH;
+      while (i + length < n && in[candidate + length] == in[i + length]) {
+        ++length;
+      }
+      putVarint(out, (uint32_t)(i - literals));
+      out.append(in + literals, i - literals);
+      putVarint(out, (uint32_t)length);
+      putVarint(out, (uint32_t)(i - candidate));
+      i += length;
+      literals = i;
+    }
+    putVarint(out, (uint32_t)(n - literals));
+    out.append(in + literals, n - literals);
+    putVarint(out, 0);
+    return out;
+  }
+
+  /**
+   * Decompresses text
+   * @param in compressed text
+   * @param size compressed size
+   * @param raw_size size of the text once decompressed
+   * @param out decompressed text
+   * @return true if the compressed text is well-formed and of the right size
+   */
+  static bool decompress(const char* in, size_t size, size_t raw_size, std::string& out) {
+    out.clear();
+    out.reserve(raw_size);
+    size_t pos = 0;
+    for (;;) {
+      uint32_t literals, length, distance;
+      if (!getVarint(in, size, pos, literals) || literals > size - pos
+          || literals > raw_size - out.size()) {
+        return false;
+      }
+      out.append(in + pos, literals);
+      pos += literals;
+      if (!getVarint(in, size, pos, length)) {
+        return false;
+      }
+      if (length == 0) {
+        return out.size() == raw_size;
+      }
+      if (!getVarint(in, size, pos, distance) || distance == 0 || distance > out.size()
+          || length > raw_size - out.size()) {
+        return false;
+      }
+      // byte by byte, a match may overlap the bytes it produces
+      size_t from = out.size() - distance;
+      for (uint32_t k = 0; k < length; ++k) {
+        out.push_back(out[from + k]);
+      }
+    }
+  }
+
+  /**
+   * Computes a signature of the lyrics files in a directory from their names,
+   * sizes and modification times, to tell whether a pack is out of date without
+   * reading them.  An edit is noticed even if it keeps the size, unless it lands
+   * within the same second as the last one.
+   * @param dir directory of "Artist - Title.txt" files
+   * @return signature
+   */
+  static uint64_t signature(const std::string& dir) {
+    return Catalog::signature(dir, Catalog::list(dir, LYRICS_FILE_SUFFIX));
+  }
+
+  /**
+   * Packs all lyrics files in a directory, with their index.  The pack is written
+   * to a temporary file first, so an existing pack is only replaced once complete.
+   * @param dir directory of "Artist - Title.txt" files
+   * @param path pack file to write
+   * @return number of songs packed
+   */
+  static size_t build(const std::string& dir, const std::string& path) {
+    // songs in order, each with its file
+    std::map<Song, std::string> files;
+    for (const auto& name : Catalog::list(dir, LYRICS_FILE_SUFFIX)) {
+      std::string artist, title;
+      if (LyricsIndex::parseName(name, artist, title)) {
+        files.insert(std::make_pair(Song(artist, title), name));
+      }
+    }
+    std::set<Song> songs;
+    for (const auto& file : files) {
+      songs.insert(songs.end(), file.first);
+    }
+    std::vector<char> image = LibraryImage::build(songs);
+
+    // the index reads the files in an order of its own, so it is built ahead of the data
+    LyricsIndex index;
+    index.load(dir);
+    std::string saved;
+    index.save(saved);
+
+    LyricsStoreHeader header;
+    header.magic = LYRICS_STORE_MAGIC;
+    header.version = LYRICS_STORE_VERSION;
+    header.signature = signature(dir);
+    header.songs = sizeof(LyricsStoreHeader);
+    header.songs_size = image.size();
+    header.entries = (header.songs + image.size() + 7) / 8 * 8;
+    header.index = header.entries + files.size()*sizeof(LyricsStoreEntry);
+    header.index_size = saved.size();
+    header.data = header.index + saved.size();
+
+    // compressed lyrics are streamed out, entries and header are filled in last
+    std::string tmp = path + ".tmp";
+    std::FILE* out = std::fopen(tmp.c_str(), "wb");
+    if (out == nullptr) {
+      return 0;
+    }
+    std::vector<LyricsStoreEntry> entries;
+    bool success = std::fseek(out, (long)header.data, SEEK_SET) == 0;
+    uint64_t offset = 0;
+    for (const auto& file : files) {
+      std::ifstream fin(dir + "/" + file.second, std::ios::binary);
+      std::ostringstream ss;
+      ss << fin.rdbuf();
+      std::string compressed = compress(ss.str());
+      entries.push_back(LyricsStoreEntry{ offset, (uint32_t)compressed.size(),
+                                          (uint32_t)ss.str().size() });
+      success &= std::fwrite(compressed.data(), 1, compressed.size(), out) == compressed.size();
+      offset += compressed.size();
+    }
+    header.size = header.data + offset;
+
+    std::vector<char> front((size_t)header.data, 0);
+    std::memcpy(front.data(), &header, sizeof(header));
+    std::memcpy(front.data() + header.songs, image.data(), image.size());
+    if (!entries.empty()) {
+      std::memcpy(front.data() + header.entries, entries.data(),
+                  entries.size()*sizeof(LyricsStoreEntry));
+    }
+    std::memcpy(front.data() + header.index, saved.data(), saved.size());
+    success &= std::fseek(out, 0, SEEK_SET) == 0
+        && std::fwrite(front.data(), 1, front.size(), out) == front.size();
+    success &= std::fclose(out) == 0;
+#ifdef _WIN32
+    // rename does not replace existing files on Windows
+    std::remove(path.c_str());
+#endif
+    success = success && std::rename(tmp.c_str(), path.c_str()) == 0;
+    if (!success) {
+      std::remove(tmp.c_str());
+      return 0;
+    }
+    return files.size();
+  }
+
+  /**
+   * Maps a pack, checking that it is complete
+   * @param path pack file
+   * @return true if successful
+   */
+  bool open(const std::string& path) {
+    close();
+    if (!file_.open(path) || file_.size() < sizeof(LyricsStoreHeader)) {
+      close();
+      return false;
+    }
+    const char* data = file_.data();
+    const LyricsStoreHeader* header = (const LyricsStoreHeader*)data;
+    if (header->magic != LYRICS_STORE_MAGIC || header->version != LYRICS_STORE_VERSION
+        || header->size != file_.size() || header->songs > header->size
+        || header->songs_size > header->size - header->songs
+        || header->entries > header->size || header->data > header->size
+        || header->index > header->size || header->index_size > header->size - header->index) {
+      close();
+      return false;
+    }
+    LibraryImage songs(data + header->songs, (size_t)header->songs_size);
+    if (!songs.valid()
+        || header->entries + songs.size()*sizeof(LyricsStoreEntry) > header->data) {
+      close();
+      return false;
+    }
+    const LyricsStoreEntry* entries = (const LyricsStoreEntry*)(data + header->entries);
+    for (size_t i = 0; i < songs.size(); ++i) {
+      if (entries[i].offset + entries[i].compressed_size > header->size - header->data) {
+        close();
+        return false;
+      }
+    }
+
+    header_ = header;
+    songs_ = songs;
+    entries_ = entries;
+    return true;
+  }
+
+  /**
+   * Loads the lyrics index saved in the pack, without reading any lyrics
+   * @param index index to replace
+   * @return true if the saved index is well-formed
+   */
+  bool index(LyricsIndex& index) const {
+    return header_ != nullptr
+        && index.load(songs_, file_.data() + header_->index, (size_t)header_->index_size);
+  }
+
+  /**
+   * Unmaps the pack and empties the cache, the store must not be in use
+   */
+  void close() {
+    file_.close();
+    header_ = nullptr;
+    songs_ = LibraryImage();
+    entries_ = nullptr;
+    std::lock_guard<std::mutex> lock(mutex_);
+    cache_.clear();
+    cached_.clear();
+    cache_bytes_ = 0;
+  }
+
+  /**
+   * Signature of the lyrics files the pack was built from
+   */
+  uint64_t sourceSignature() const {
+    return header_ == nullptr ? 0 : header_->signature;
+  }
+
+  /**
+   * Number of songs in the pack
+   */
+  size_t size() const {
+    return songs_.size();
+  }
+
+  /**
+   * The i'th song in the pack, in sorted order
+   */
+  Song song(size_t i) const {
+    return songs_.song(i);
+  }
+
+  /**
+   * Decompresses the lyrics of the i'th song, bypassing the cache
+   * @param i index of song
+   * @param text lyrics
+   * @return true if successful
+   */
+  bool text(size_t i, std::string& text) const {
+    const LyricsStoreEntry& entry = entries_[i];
+    return decompress(file_.data() + header_->data + entry.offset, entry.compressed_size,
+                      entry.size, text);
+  }
+
+  /**
+   * Gets the lyrics of a song through the cache
+   * @param song song to look up
+   * @return lyrics, nullptr if the song has none
+   */
+  std::shared_ptr<const std::string> lyrics(const Song& song) const {
+    size_t i = songs_.indexOf(song);
+    if (i == songs_.size()) {
+      return nullptr;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = cached_.find(i);
+      if (it != cached_.end()) {
+        cache_.splice(cache_.begin(), cache_, it->second);
+        ++hits_;
+        return it->second->second;
+      }
+      ++misses_;
+    }
+
+    // decompress outside the lock, other threads may do the same entry
+    std::shared_ptr<std::string> out = std::make_shared<std::string>();
+    if (!text(i, *out)) {
+      return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (cached_.find(i) == cached_.end() && out->size() <= cache_limit_) {
+      cache_.push_front(std::make_pair(i, out));
+      cached_[i] = cache_.begin();
+      cache_bytes_ += out->size();
+      while (cache_bytes_ > cache_limit_) {
+        cache_bytes_ -= cache_.back().second->size();
+        cached_.erase(cache_.back().first);
+        cache_.pop_back();
+      }
+    }
+    return out;
+  }
+
+  /**
+   * Gets lines of a song's lyrics
+   * @param song song to look up
+   * @param numbers line numbers, counting from 0
+   * @return the lines that exist, in the order given
+   */
+  std::vector<std::string> lines(const Song& song, const std::vector<uint32_t>& numbers) const {
+    std::vector<std::string> out;
+    std::shared_ptr<const std::string> text = lyrics(song);
+    if (!text) {
+      return out;
+    }
+
+    std::vector<std::string> all;
+    std::istringstream in(*text);
+    std::string line;
+    while (std::getline(in, line)) {
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      all.push_back(line);
+    }
+    for (uint32_t number : numbers) {
+      if (number < all.size()) {
+        out.push_back(all[number]);
+      }
+    }
+    return out;
+  }
+
+  /**
+   * Bytes of decompressed lyrics in the cache
+   */
+  size_t cacheBytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return cache_bytes_;
+  }
+
+  /**
+   * Number of lookups answered from the cache
+   */
+  size_t hits() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return hits_;
+  }
+
+  /**
+   * Number of lookups that had to decompress
+   */
+  size_t misses() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return misses_;
+  }
+};
+
+#endif //LAB5_LYRICS_STORE_H
@@ -0,0 +1,143 @@
+/**
+ * @file
+ *
+ * This file contains a read-only memory mapping of a file, used to serve library
+ * snapshots directly from disk without reading them in.
+ *
+ */
+#ifndef LAB5_MAPPED_FILE_H
+#define LAB5_MAPPED_FILE_H
+
+#include <string>
+#include <cstddef>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Maps an entire file into memory, read-only.  The mapping is released when
+ * the object is destroyed.
+ */
+class MappedFile {
+  const char* data_;
+  size_t size_;
+#ifdef _WIN32
+  HANDLE file_;
+  HANDLE mapping_;
+#endif
+
+  // prevent copies, the mapping has a single owner
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+
+ public:
+  MappedFile() : data_(nullptr), size_(0)
+#ifdef _WIN32
+      , file_(INVALID_HANDLE_VALUE), mapping_(NULL)
+#endif
+  {}
+
+  ~MappedFile() {
+    close();
+  }
+
+  /**
+   * Maps a file
+   * @param filename file to map
+   * @return true if successful
+   */
+  bool open(const std::string& filename) {
+    close();
+#ifdef _WIN32
+    file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_ == INVALID_HANDLE_VALUE) {
+      return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0) {
+      close();
+      return false;
+    }
+    mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping_ == NULL) {
+      close();
+      return false;
+    }
+    data_ = (const char*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+    if (data_ == nullptr) {
+      close();
+      return false;
+    }
+    size_ = (size_t)size.QuadPart;
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      ::close(fd);
+      return false;
+    }
+    void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);   // the mapping keeps the file alive
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    data_ = (const char*)data;
+    size_ = (size_t)st.st_size;
+#endif
+    return true;
+  }
+
+  /**
+   * Releases the mapping
+   */
+  void close() {
+#ifdef _WIN32
+    if (data_ != nullptr) {
+      UnmapViewOfFile(data_);
+    }
+    if (mapping_ != NULL) {
+      CloseHandle(mapping_);
+      mapping_ = NULL;
+    }
+    if (file_ != INVALID_HANDLE_VALUE) {
+      CloseHandle(file_);
+      file_ = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (data_ != nullptr) {
+      munmap((void*)data_, size_);
+    }
+#endif
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+  /**
+   * Start of the mapped file, nullptr if not mapped
+   */
+  const char* data() const {
+    return data_;
+  }
+
+  /**
+   * Size of the mapped file
+   */
+  size_t size() const {
+    return size_;
+  }
+};
+
+#endif //LAB5_MAPPED_FILE_H
@@ -11,7 +11,15 @@
 #define LAB4_MUSIC_LIBRARY_MESSAGES_H
 
 #include "Song.h"
+#include "ChartHistory.h"
+#include "SongInfo.h"
+#include "SongIds.h"
+#include "CompletionTrie.h"
+#include "RankedSearch.h"
+#include "QueryBudget.h"
+#include <cstdint>
 #include <string>
+#include <vector>
 
 /**
  * Types of messages that can be sent between client/server
@@ -24,6 +32,24 @@ enum MessageType {
   SEARCH,
   SEARCH_RESPONSE,
   GOODBYE,
+  LYRICS_SEARCH,
+  LYRICS_SEARCH_RESPONSE,
+  GET_LYRICS,
+  GET_LYRICS_RESPONSE,
+  TOP_N,
+  TOP_N_RESPONSE,
+  CHART_HISTORY,
+  CHART_HISTORY_RESPONSE,
+  LOOKUP,
+  LOOKUP_RESPONSE,
+  AUTOCOMPLETE,
+  AUTOCOMPLETE_RESPONSE,
+  FUZZY_SEARCH,
+  FUZZY_SEARCH_RESPONSE,
+  RANKED_SEARCH,
+  RANKED_SEARCH_RESPONSE,
+  CANCEL,
+  CANCEL_RESPONSE,
   UNKNOWN
 };
 
@@ -55,8 +81,9 @@ class ResponseMessage : public Message {
 class AddMessage : public Message {
  public:
   const Song song;
+  const SongInfo info;    // optional metadata
 
-  AddMessage(const Song& song)  : song(song) {}
+  AddMessage(const Song& song, const SongInfo& info = SongInfo()) : song(song), info(info) {}
 
   MessageType type() const {
     return MessageType::ADD;
@@ -83,13 +110,15 @@ class AddResponseMessage : public ResponseMessage {
 //=======================================================
 
 /**
- * Remove a song from the library
+ * Remove a song from the library, given either the song or its id
  */
 class RemoveMessage : public Message {
  public:
   const Song song;
+  const uint64_t id;      // see SongIds, SONG_ID_NONE to remove by song
 
-  RemoveMessage(const Song& song) : song(song) {}
+  RemoveMessage(const Song& song, uint64_t id = SONG_ID_NONE) : song(song), id(id) {}
+  explicit RemoveMessage(uint64_t id) : song("", ""), id(id) {}
 
   MessageType type() const {
     return MessageType::REMOVE;
@@ -112,15 +141,22 @@ class RemoveResponseMessage : public ResponseMessage {
 };
 
 /**
- * Search the library using regular expressions
+ * Search the library using regular expressions, optionally only among the songs
+ * on some charts
  */
 class SearchMessage : public Message {
  public:
   const std::string artist_regex;
   const std::string title_regex;
+  const std::string chart_filter;   // see ChartMembership, empty for all songs
+  const SongInfoFilter info_filter; // ranges of metadata, empty for all songs
+  const uint64_t request;           // client's id to cancel it by, REQUEST_ID_NONE if none
 
-  SearchMessage(const std::string& artist_regex, const std::string& title_regex) :
-      artist_regex(artist_regex), title_regex(title_regex) {}
+  SearchMessage(const std::string& artist_regex, const std::string& title_regex,
+    const std::string& chart_filter = "", const SongInfoFilter& info_filter = SongInfoFilter(),
+    uint64_t request = REQUEST_ID_NONE) :
+      artist_regex(artist_regex), title_regex(title_regex), chart_filter(chart_filter),
+      info_filter(info_filter), request(request) {}
 
   MessageType type() const {
     return MessageType::SEARCH;
@@ -134,16 +170,336 @@ class SearchResponseMessage : public ResponseMessage {
  public:
   const SearchMessage search;
   const std::vector<Song> results;
+  const std::vector<SongInfo> metadata;   // of each result, or empty if none has any
+  const std::vector<uint64_t> ids;        // of each result, or empty if not known
 
   SearchResponseMessage(const SearchMessage& search, const std::vector<Song>& results,
-    const std::string& status, const std::string& info = "" ) :
-      ResponseMessage(status, info), search(search), results(results) {}
+    const std::string& status, const std::string& info = "",
+    const std::vector<SongInfo>& metadata = std::vector<SongInfo>(),
+    const std::vector<uint64_t>& ids = std::vector<uint64_t>()) :
+      ResponseMessage(status, info), search(search), results(results), metadata(metadata),
+      ids(ids) {}
 
   MessageType type() const {
     return MessageType::SEARCH_RESPONSE;
   }
 };
 
+/**
+ * Search song lyrics for words and phrases
+ */
+class LyricsSearchMessage : public Message {
+ public:
+  const std::string query;
+
+  LyricsSearchMessage(const std::string& query) : query(query) {}
+
+  MessageType type() const {
+    return MessageType::LYRICS_SEARCH;
+  }
+};
+
+/**
+ * Response to a lyrics search, with the matching lines of each song
+ */
+class LyricsSearchResponseMessage : public ResponseMessage {
+ public:
+  const LyricsSearchMessage search;
+  const std::vector<Song> results;
+  const std::vector<std::vector<std::string>> snippets;   // lines matched in each result
+
+  LyricsSearchResponseMessage(const LyricsSearchMessage& search, const std::vector<Song>& results,
+    const std::vector<std::vector<std::string>>& snippets,
+    const std::string& status, const std::string& info = "") :
+      ResponseMessage(status, info), search(search), results(results), snippets(snippets) {}
+
+  MessageType type() const {
+    return MessageType::LYRICS_SEARCH_RESPONSE;
+  }
+};
+
+/**
+ * Get the lyrics of a song
+ */
+class GetLyricsMessage : public Message {
+ public:
+  const Song song;
+
+  GetLyricsMessage(const Song& song) : song(song) {}
+
+  MessageType type() const {
+    return MessageType::GET_LYRICS;
+  }
+};
+
+/**
+ * Response to getting the lyrics of a song
+ */
+class GetLyricsResponseMessage : public ResponseMessage {
+ public:
+  const GetLyricsMessage get;
+  const std::string lyrics;
+
+  GetLyricsResponseMessage(const GetLyricsMessage& get, const std::string& lyrics,
+    const std::string& status, const std::string& info = "") :
+      ResponseMessage(status, info), get(get), lyrics(lyrics) {}
+
+  MessageType type() const {
+    return MessageType::GET_LYRICS_RESPONSE;
+  }
+};
+
+/**
+ * Get the top songs of a chart, optionally only those matching regular expressions
+ */
+class TopNMessage : public Message {
+ public:
+  const std::string chart;
+  const size_t count;
+  const std::string artist_regex;
+  const std::string title_regex;
+  const uint64_t request;           // client's id to cancel it by, REQUEST_ID_NONE if none
+
+  TopNMessage(const std::string& chart, size_t count,
+    const std::string& artist_regex = "", const std::string& title_regex = "",
+    uint64_t request = REQUEST_ID_NONE) :
+      chart(chart), count(count), artist_regex(artist_regex), title_regex(title_regex),
+      request(request) {}
+
+  MessageType type() const {
+    return MessageType::TOP_N;
+  }
+};
+
+/**
+ * Response to getting the top songs of a chart, in rank order
+ */
+class TopNResponseMessage : public ResponseMessage {
+ public:
+  const TopNMessage top;
+  const std::vector<Song> results;
+  const std::vector<uint32_t> ranks;    // rank of each result on the chart
+
+  TopNResponseMessage(const TopNMessage& top, const std::vector<Song>& results,
+    const std::vector<uint32_t>& ranks, const std::string& status, const std::string& info = "") :
+      ResponseMessage(status, info), top(top), results(results), ranks(ranks) {}
+
+  MessageType type() const {
+    return MessageType::TOP_N_RESPONSE;
+  }
+};
+
+/**
+ * Get how a song did on past charts
+ */
+class ChartHistoryMessage : public Message {
+ public:
+  const Song song;
+  const bool trajectory;    // also send the rank in every snapshot
+
+  ChartHistoryMessage(const Song& song, bool trajectory = false) :
+      song(song), trajectory(trajectory) {}
+
+  MessageType type() const {
+    return MessageType::CHART_HISTORY;
+  }
+};
+
+/**
+ * Response to getting the chart history of a song, with stats for each chart
+ */
+class ChartHistoryResponseMessage : public ResponseMessage {
+ public:
+  const ChartHistoryMessage history;
+  const std::vector<ChartStats> charts;
+
+  ChartHistoryResponseMessage(const ChartHistoryMessage& history,
+    const std::vector<ChartStats>& charts,
+    const std::string& status, const std::string& info = "") :
+      ResponseMessage(status, info), history(history), charts(charts) {}
+
+  MessageType type() const {
+    return MessageType::CHART_HISTORY_RESPONSE;
+  }
+};
+
+/**
+ * Look up songs by their ids
+ */
+class LookupMessage : public Message {
+ public:
+  const std::vector<uint64_t> ids;
+
+  LookupMessage(const std::vector<uint64_t>& ids) : ids(ids) {}
+
+  MessageType type() const {
+    return MessageType::LOOKUP;
+  }
+};
+
+/**
+ * Response to looking up songs, with the songs found in the order asked for.
+ * Ids not in the library are left out.
+ */
+class LookupResponseMessage : public ResponseMessage {
+ public:
+  const LookupMessage lookup;
+  const std::vector<Song> results;
+  const std::vector<uint64_t> ids;        // of each result
+  const std::vector<SongInfo> metadata;   // of each result, or empty if none has any
+
+  LookupResponseMessage(const LookupMessage& lookup, const std::vector<Song>& results,
+    const std::vector<uint64_t>& ids, const std::string& status, const std::string& info = "",
+    const std::vector<SongInfo>& metadata = std::vector<SongInfo>()) :
+      ResponseMessage(status, info), lookup(lookup), results(results), ids(ids),
+      metadata(metadata) {}
+
+  MessageType type() const {
+    return MessageType::LOOKUP_RESPONSE;
+  }
+};
+
+/**
+ * Complete the start of an artist or title
+ */
+class AutocompleteMessage : public Message {
+ public:
+  const std::string field;    // "artist" or "title"
+  const std::string prefix;
+  const size_t count;
+
+  AutocompleteMessage(const std::string& field, const std::string& prefix, size_t count) :
+      field(field), prefix(prefix), count(count) {}
+
+  MessageType type() const {
+    return MessageType::AUTOCOMPLETE;
+  }
+};
+
+/**
+ * Response to autocompletion, most common completions first
+ */
+class AutocompleteResponseMessage : public ResponseMessage {
+ public:
+  const AutocompleteMessage autocomplete;
+  const std::vector<Completion> completions;
+
+  AutocompleteResponseMessage(const AutocompleteMessage& autocomplete,
+    const std::vector<Completion>& completions,
+    const std::string& status, const std::string& info = "") :
+      ResponseMessage(status, info), autocomplete(autocomplete), completions(completions) {}
+
+  MessageType type() const {
+    return MessageType::AUTOCOMPLETE_RESPONSE;
+  }
+};
+
+/**
+ * Search the library for an artist and title despite typos
+ */
+class FuzzySearchMessage : public Message {
+ public:
+  const std::string artist;       // empty to match any
+  const std::string title;        // empty to match any
+  const uint32_t max_distance;    // edits allowed in each, see FuzzyIndex
+
+  FuzzySearchMessage(const std::string& artist, const std::string& title, uint32_t max_distance) :
+      artist(artist), title(title), max_distance(max_distance) {}
+
+  MessageType type() const {
+    return MessageType::FUZZY_SEARCH;
+  }
+};
+
+/**
+ * Response to a fuzzy search, closest songs first
+ */
+class FuzzySearchResponseMessage : public ResponseMessage {
+ public:
+  const FuzzySearchMessage search;
+  const std::vector<Song> results;
+  const std::vector<uint32_t> distances;  // edits from the search to each result
+  const std::vector<uint64_t> ids;        // of each result, or empty if not known
+
+  FuzzySearchResponseMessage(const FuzzySearchMessage& search, const std::vector<Song>& results,
+    const std::vector<uint32_t>& distances, const std::string& status, const std::string& info = "",
+    const std::vector<uint64_t>& ids = std::vector<uint64_t>()) :
+      ResponseMessage(status, info), search(search), results(results), distances(distances),
+      ids(ids) {}
+
+  MessageType type() const {
+    return MessageType::FUZZY_SEARCH_RESPONSE;
+  }
+};
+
+/**
+ * Search the library for free text in artists and titles, best matches first
+ */
+class RankedSearchMessage : public Message {
+ public:
+  const std::string query;
+  const size_t count;         // number of results wanted
+
+  RankedSearchMessage(const std::string& query, size_t count = RANKED_SEARCH_DEFAULT) :
+      query(query), count(count) {}
+
+  MessageType type() const {
+    return MessageType::RANKED_SEARCH;
+  }
+};
+
+/**
+ * Response to a ranked search, best matches first
+ */
+class RankedSearchResponseMessage : public ResponseMessage {
+ public:
+  const RankedSearchMessage search;
+  const std::vector<Song> results;
+  const std::vector<uint32_t> kinds;      // MatchKind of each result
+  const std::vector<uint64_t> ids;        // of each result, or empty if not known
+
+  RankedSearchResponseMessage(const RankedSearchMessage& search, const std::vector<Song>& results,
+    const std::vector<uint32_t>& kinds, const std::string& status, const std::string& info = "",
+    const std::vector<uint64_t>& ids = std::vector<uint64_t>()) :
+      ResponseMessage(status, info), search(search), results(results), kinds(kinds), ids(ids) {}
+
+  MessageType type() const {
+    return MessageType::RANKED_SEARCH_RESPONSE;
+  }
+};
+
+/**
+ * Cancel a running search, given the request id it was sent with.  It is sent on
+ * the connection running the search, while the search runs; other connections'
+ * searches are never affected.
+ */
+class CancelMessage : public Message {
+ public:
+  const uint64_t request;
+
+  explicit CancelMessage(uint64_t request) : request(request) {}
+
+  MessageType type() const {
+    return MessageType::CANCEL;
+  }
+};
+
+/**
+ * Response to cancelling a search; the search itself answers with what it found
+ */
+class CancelResponseMessage : public ResponseMessage {
+ public:
+  const CancelMessage cancel;
+
+  CancelResponseMessage(const CancelMessage& cancel, const std::string& status,
+    const std::string& info = "") :
+      ResponseMessage(status, info), cancel(cancel) {}
+
+  MessageType type() const {
+    return MessageType::CANCEL_RESPONSE;
+  }
+};
+
 /**
  * Goodbye message
  */
@@ -3,50 +3,361 @@
  *
  * This contains the data structure for storing the music library locally in memory.
  *
+ * The library can optionally sit on top of a read-only base image, e.g. a snapshot
+ * file mapped into memory.  Songs in the base image are served directly from it;
+ * songs added afterwards are kept in memory, and removed base songs are remembered
+ * in a set of tombstones.
+ *
+ * Alternatively, the library can be backed by an LsmStore, for catalogs that are
+ * too large or change too often to keep in memory.  All operations are then passed
+ * on to the store.
+ *
+ * Optional song metadata (album, year, duration, genre) is kept in columns next to
+ * the songs, see SongInfoColumns, wherever the songs themselves are stored.
+ *
+ * Every song is also registered with a stable 64-bit id, see SongIds, so it can be
+ * looked up or removed by id.  The registry holds the one in-memory copy of each
+ * song in the library, which the in-memory set of songs points to, and a copy of
+ * those served from a base image or a store.
+ *
+ * Artists and titles of the songs in the library are kept in CompletionTries, so
+ * they can be autocompleted as they are typed without searching every song, and in
+ * FuzzyIndexes, so they can be found despite typos.  Together they answer ranked
+ * free-text searches, see RankedSearch, without scanning the library.
+ *
+ * The ids and indexes of songs served from a base image or a store are only built
+ * the first time they are needed, so attaching a snapshot or a store copies none of
+ * its songs until songs are looked up by id, completed or found by fuzzy or ranked
+ * search.  They are kept in memory whatever stores the songs, so they can also be
+ * turned off, see setIndexing, e.g. for a library backed by an LsmStore that should
+ * not need memory for every song's artist and title.  Songs then have no ids, and
+ * can't be completed or found by fuzzy or ranked searches.
+ *
  */
 #ifndef LAB4_MUSIC_LIBRARY_H
 #define LAB4_MUSIC_LIBRARY_H
 
 #include "Song.h"
+#include "LibraryImage.h"
+#include "LsmStore.h"
+#include "SongInfo.h"
+#include "SongIds.h"
+#include "CompletionTrie.h"
+#include "FuzzyIndex.h"
+#include "RankedSearch.h"
+#include "Regex.h"
+#include "QueryBudget.h"
 #include <vector>
 #include <set>
-#include <regex>
+#include <unordered_map>
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <atomic>
+#include <mutex>
 
 // Stores a list of songs
 class MusicLibrary {
-  // private vector
-  std::set<Song> songs_;
+  // orders songs held by the id registry by value, and looks them up by value
+  struct SongOrder {
+    using is_transparent = void;
+    bool operator()(const Song* a, const Song* b) const { return *a < *b; }
+    bool operator()(const Song* a, const Song& b) const { return *a < b; }
+    bool operator()(const Song& a, const Song* b) const { return a < *b; }
+  };
+
+  // songs not in the base image, held by ids_
+  std::set<const Song*, SongOrder> songs_;
+
+  // optional read-only base, and songs removed from it
+  LibraryImage base_;
+  std::set<Song> removed_;
+
+  // optional storage engine holding all songs instead
+  LsmStore* store_ = nullptr;
+
+  // optional metadata, kept for songs even while they are removed
+  SongInfoColumns info_;
+
+  // ids of the songs in the library, holding the songs themselves; built on first
+  // use for songs served from a base image or store, see ensureIndexed
+  mutable SongIds ids_;
+
+  // artists and titles of the songs in the library, for autocompletion
+  mutable CompletionTrie artists_;
+  mutable CompletionTrie titles_;
+
+  // artists and titles of the songs in the library, for typo-tolerant searches
+  mutable FuzzyIndex fuzzy_artists_;
+  mutable FuzzyIndex fuzzy_titles_;
+
+  // whether songs are given ids and indexed, see setIndexing
+  bool indexing_ = true;
+
+  // number of changes to the songs in the library, see version
+  uint64_t version_ = 0;
+
+  // whether the ids and indexes cover the songs attached from a base image or
+  // store yet; until then only songs kept in memory have ids, and nothing is indexed
+  mutable std::atomic<bool> built_{ true };
+  mutable std::mutex build_mutex_;
+
+  bool ready() const {
+    return indexing_ && built_;
+  }
+
+  // keeps the ids, autocompletion tries and fuzzy indexes in step with the songs in
+  // the library.  Songs kept in memory are registered with ids_ even while not
+  // indexing, as it holds them.
+  const Song* held(const Song& song) {
+    uint64_t id = ids_.add(song);
+    if (ready()) {
+      index(song, id);
+    }
+    return ids_.song(id);
+  }
+  void indexed(const Song& song) {
+    if (ready()) {
+      index(song, ids_.add(song));
+    }
+  }
+  void index(const Song& song, uint64_t id) const {
+    artists_.add(song.artist);
+    titles_.add(song.title);
+    fuzzy_artists_.add(song.artist, id);
+    fuzzy_titles_.add(song.title, id);
+  }
+  void unindexed(const Song& song) {
+    if (ready()) {
+      uint64_t id = ids_.id(song);
+      artists_.remove(song.artist);
+      titles_.remove(song.title);
+      fuzzy_artists_.remove(song.artist, id);
+      fuzzy_titles_.remove(song.title, id);
+    }
+    ids_.remove(song);
+  }
+
+  // gives ids to and indexes the songs of an attached base image or store, and those
+  // kept in memory, the first time they are needed.  Readers may call it at once;
+  // the first builds while the others wait.
+  void ensureIndexed() const {
+    if (!indexing_ || built_) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(build_mutex_);
+    if (built_) {
+      return;
+    }
+    for (const Song* song : songs_) {
+      index(*song, ids_.id(*song));
+    }
+    if (store_ != nullptr) {
+      store_->forEach([this](const Song& song) {
+        index(song, ids_.add(song));
+      });
+    }
+    for (size_t i=0; i<base_.size(); ++i) {
+      Song song = base_.song(i);
+      if (removed_.count(song) == 0) {
+        index(song, ids_.add(song));
+      }
+    }
+    built_ = true;
+  }
+
+  // drops the in-memory songs, ids, autocompletion tries and fuzzy indexes before
+  // the library is replaced
+  void clearIndexes() {
+    built_ = true;
+    songs_.clear();
+    ids_.clear();
+    artists_.clear();
+    titles_.clear();
+    fuzzy_artists_.clear();
+    fuzzy_titles_.clear();
+  }
+
+  // sorts a batch of songs (which can't be moved) by address, dropping duplicates
+  static std::vector<const Song*> sortUnique(const std::vector<Song>& songs) {
+    std::vector<const Song*> sorted;
+    sorted.reserve(songs.size());
+    for (const Song& song : songs) {
+      sorted.push_back(&song);
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [](const Song* a, const Song* b) { return *a < *b; });
+    sorted.erase(std::unique(sorted.begin(), sorted.end(),
+                             [](const Song* a, const Song* b) { return *a == *b; }),
+                 sorted.end());
+    return sorted;
+  }
+
+  // checks if a song is present in the base image and not removed
+  bool inBase(const Song& song) const {
+    return base_.valid() && base_.contains(song) && removed_.count(song) == 0;
+  }
 
  public:
 
+  /**
+   * Turns the ids, autocompletion tries and fuzzy indexes on or off, from the next
+   * time the contents of the library are replaced by attach() or build()
+   * @param indexing false to keep no ids or indexes
+   */
+  void setIndexing(bool indexing) {
+    indexing_ = indexing;
+  }
+
+  /**
+   * Checks if songs have ids and are indexed, see setIndexing
+   * @return true if songs can be looked up by id, completed and found by fuzzy and
+   *         ranked searches
+   */
+  bool indexing() const {
+    return indexing_;
+  }
+
+  /**
+   * Counts the changes to the songs in the library, so a copy of them, such as an
+   * image published for other processes, can tell when it is out of date
+   * @return number of songs added or removed and contents replaced so far
+   */
+  uint64_t version() const {
+    return version_;
+  }
+
+  /**
+   * Replaces the contents of the library with a read-only base image.  The
+   * image memory is not copied and must outlive the library, and its songs are
+   * only given ids and indexed once first needed.
+   * @param base image to serve songs from
+   */
+  void attach(const LibraryImage& base) {
+    clearIndexes();
+    removed_.clear();
+    base_ = base;
+    store_ = nullptr;
+    built_ = base_.size() == 0;
+    ++version_;
+  }
+
+  /**
+   * Stores the library in an LsmStore, replacing its current contents with
+   * those of the store.  The store must outlive the library.  Unless indexing is
+   * turned off, every song is registered and indexed in memory once first needed,
+   * reading the store one song at a time.
+   * @param store storage engine to pass all operations on to
+   */
+  void attach(LsmStore& store) {
+    clearIndexes();
+    removed_.clear();
+    base_ = LibraryImage();
+    store_ = &store;
+    built_ = false;
+    ++version_;
+  }
+
   /**
    * Adds a song to the music library
    * @param song song info to add
    * @return true if added, false if already exists
    */
   bool add(const Song& song) {
-    // try to add element to the set
-    auto elem = songs_.insert(song);
-    return elem.second;
+    if (store_ != nullptr) {
+      if (!store_->add(song)) {
+        return false;
+      }
+    }
+    else if (base_.valid() && base_.contains(song)) {
+      // a removed base song is restored by dropping its tombstone
+      if (removed_.erase(song) == 0) {
+        return false;
+      }
+    }
+    else {
+      // try to add element to the set
+      auto hint = songs_.lower_bound(song);
+      if (hint != songs_.end() && **hint == song) {
+        return false;
+      }
+      songs_.emplace_hint(hint, held(song));
+      ++version_;
+      return true;
+    }
+    indexed(song);
+    ++version_;
+    return true;
   }
 
   /**
-   * Adds songs to the music library
-   * @param songs song info to add
+   * Adds songs to the music library.  The batch is sorted and deduplicated
+   * once, then inserted in order so each insertion is positioned directly.
+   * @param songs song info to add, in any order and possibly with duplicates
    * @return number of songs added
    */
   size_t add(const std::vector<Song>& songs) {
     size_t count = 0;
 
-    for (const Song& song : songs) {
-      if (add(song)) {
+    std::vector<const Song*> sorted = sortUnique(songs);
+    if (base_.valid() || store_ != nullptr) {
+      // base songs need to be checked one at a time
+      for (const Song* song : sorted) {
+        if (add(*song)) {
+          ++count;
+        }
+      }
+      return count;
+    }
+
+    for (const Song* song : sorted) {
+      auto hint = songs_.lower_bound(*song);
+      if (hint == songs_.end() || **hint != *song) {
+        songs_.emplace_hint(hint, held(*song));
         ++count;
       }
     }
+    if (count > 0) {
+      ++version_;
+    }
 
     return count;
   }
 
+  /**
+   * Replaces the contents of the music library with a batch of songs.  The
+   * batch is sorted and deduplicated once, and the library is then built in
+   * a single linear pass.
+   * @param songs song info to store, in any order and possibly with duplicates
+   * @return number of songs in the library
+   */
+  size_t build(const std::vector<Song>& songs) {
+    ++version_;
+    if (store_ != nullptr) {
+      std::set<Song> sorted;
+      for (const Song* song : sortUnique(songs)) {
+        sorted.emplace_hint(sorted.end(), *song);
+      }
+      store_->build(sorted);
+      clearIndexes();
+      for (const Song& song : sorted) {
+        indexed(song);
+      }
+      return store_->size();
+    }
+
+    clearIndexes();
+    removed_.clear();
+    base_ = LibraryImage();
+
+    // sorted input, so every song goes right at the end
+    for (const Song* song : sortUnique(songs)) {
+      songs_.emplace_hint(songs_.end(), held(*song));
+    }
+
+    return songs_.size();
+  }
+
   /**
    * Removes a song from the music library
    * @param song song info to remove
@@ -56,11 +367,25 @@ class MusicLibrary {
 
     //=================================
     // TODO: Remove song from database
-	  size_t num = songs_.erase(song);
-	  if (num == 0)
-		  return false;
-	  else
-		  return true;
+	  bool removed;
+	  if (store_ != nullptr) {
+		  removed = store_->remove(song);
+	  }
+	  else {
+		  auto it = songs_.find(song);
+		  if (it == songs_.end()) {
+			  removed = inBase(song) && removed_.insert(song).second;
+		  }
+		  else {
+			  songs_.erase(it);
+			  removed = true;
+		  }
+	  }
+	  if (removed) {
+		  unindexed(song);
+		  ++version_;
+	  }
+	  return removed;
 	  
     //=================================
 
@@ -90,12 +415,19 @@ class MusicLibrary {
 
   /**
    * Finds songs in the database matching title and artist expressions
-   * @param artist_regex artist regular expression
+   * @param artist_regex artist regular expression, see Regex
    * @param title_regex title regular expression
-   * @return set of songs matching expressions
+   * @param budget work the search may do, nullptr for no limit; once it runs out
+   *        the songs found so far are returned
+   * @return set of songs matching expressions, none if either is invalid
    */
   std::vector<Song> find(const std::string& artist_regex,
-                         const std::string& title_regex) const {
+                         const std::string& title_regex,
+                         QueryBudget* budget = nullptr) const {
+    if (store_ != nullptr) {
+      return store_->find(artist_regex, title_regex, budget);
+    }
+
     std::vector<Song> out;
 
     //=====================================================
@@ -103,25 +435,305 @@ class MusicLibrary {
     //=====================================================
 
     // compile regular expressions
-    std::regex aregex(artist_regex);
-	std::regex tregex(title_regex);
+    Regex aregex(artist_regex);
+    Regex tregex(title_regex);
 
     // search through songs for titles and artists matching search expressions
-    for (const auto& song : songs_) {
-      if (std::regex_search(song.artist, aregex) && std::regex_search(song.title, tregex)) {
-        out.push_back(song);
+    for (const Song* song : songs_) {
+      if (budget != nullptr && !budget->charge(song->artist.size() + song->title.size())) {
+        break;
+      }
+      if (aregex.search(song->artist) && tregex.search(song->title)) {
+        out.push_back(*song);
       }
     }
 
+    // merge in base matches, keeping results sorted
+    if (base_.valid()) {
+      std::vector<Song> base;
+      for (auto& song : base_.find(artist_regex, title_regex, budget)) {
+        if (removed_.count(song) == 0) {
+          base.push_back(song);
+        }
+      }
+      std::vector<Song> merged;
+      merged.reserve(out.size() + base.size());
+      std::merge(out.begin(), out.end(), base.begin(), base.end(), std::back_inserter(merged));
+      return merged;
+    }
+
+    return out;
+  }
+
+  /**
+   * Finds songs among a list of candidates, e.g. those on some charts, that are in
+   * the library and match title and artist expressions
+   * @param candidates songs to consider
+   * @param artist_regex artist regular expression
+   * @param title_regex title regular expression
+   * @param limit maximum number of songs, the search stops once reached
+   * @param budget work the search may do, nullptr for no limit; once it runs out
+   *        the songs found so far are returned
+   * @return songs matching expressions, in the order of the candidates
+   */
+  std::vector<Song> find(const std::vector<const Song*>& candidates,
+                         const std::string& artist_regex,
+                         const std::string& title_regex,
+                         size_t limit = std::numeric_limits<size_t>::max(),
+                         QueryBudget* budget = nullptr) const {
+    std::vector<Song> out;
+    Regex aregex(artist_regex);
+    Regex tregex(title_regex);
+    for (const Song* song : candidates) {
+      if (out.size() >= limit) {
+        break;
+      }
+      if (budget != nullptr && !budget->charge(song->artist.size() + song->title.size())) {
+        break;
+      }
+      if (contains(*song) && aregex.search(song->artist) && tregex.search(song->title)) {
+        out.push_back(*song);
+      }
+    }
     return out;
   }
 
   /**
-   * Retrieves the unmodifiable list of songs
-   * @return internal set of songs
+   * Sets the metadata of a song
+   * @param song song to describe
+   * @param info metadata, empty to clear it
+   */
+  void setInfo(const Song& song, const SongInfo& info) {
+    info_.set(song, info);
+  }
+
+  /**
+   * Gets the metadata of a song
+   * @param song song to look up
+   * @return metadata, empty if none
+   */
+  SongInfo info(const Song& song) const {
+    return info_.get(song);
+  }
+
+  /**
+   * Finds songs whose metadata is in range, to pass on to find() as candidates
+   * @param filter ranges of metadata to match
+   * @param candidates matching songs, sorted, including songs no longer in the
+   *        library, valid until the next change
+   */
+  void select(const SongInfoFilter& filter, std::vector<const Song*>& candidates) const {
+    info_.select(filter, candidates);
+  }
+
+  /**
+   * Stable id of a song
+   * @param song song to look up
+   * @return id, SONG_ID_NONE if the song is not in the library or indexing is off
+   */
+  uint64_t id(const Song& song) const {
+    ensureIndexed();
+    return indexing_ ? ids_.id(song) : SONG_ID_NONE;
+  }
+
+  /**
+   * Finds a song by its id
+   * @param id song id
+   * @return song, valid until it is removed, nullptr if no song in the library
+   *         has the id or indexing is off
+   */
+  const Song* song(uint64_t id) const {
+    ensureIndexed();
+    return indexing_ ? ids_.song(id) : nullptr;
+  }
+
+  /**
+   * Completes the start of an artist or title, most common first
+   * @param artist true to complete artists, false for titles
+   * @param prefix start of the artist or title, in any case
+   * @param count most completions to return
+   * @return completions, with the number of songs in the library having each
+   */
+  std::vector<Completion> complete(bool artist, const std::string& prefix, size_t count) const {
+    ensureIndexed();
+    return (artist ? artists_ : titles_).complete(prefix, count);
+  }
+
+  /**
+   * Finds songs whose artist and title are each within an edit distance of the
+   * ones given, ignoring case, e.g. despite typos
+   * @param artist artist to match, empty to match any
+   * @param title title to match, empty to match any
+   * @param max_distance largest edit distance allowed in each, at most FUZZY_MAX_DISTANCE
+   * @param distances set to the total edit distance of each result
+   * @return matching songs, closest first, nothing if both artist and title are empty
    */
-  const std::set<Song>& songs() const {
-    return songs_;
+  std::vector<Song> fuzzyFind(const std::string& artist, const std::string& title,
+                              uint32_t max_distance, std::vector<uint32_t>& distances) const {
+    ensureIndexed();
+    std::unordered_map<uint64_t, uint32_t> found;   // song id -> distance
+    if (!artist.empty()) {
+      for (const FuzzyMatch& match : fuzzy_artists_.search(artist, max_distance)) {
+        for (uint64_t id : *match.songs) {
+          found[id] = match.distance;
+        }
+      }
+    }
+    if (!title.empty()) {
+      std::unordered_map<uint64_t, uint32_t> both;
+      for (const FuzzyMatch& match : fuzzy_titles_.search(title, max_distance)) {
+        for (uint64_t id : *match.songs) {
+          if (artist.empty()) {
+            both[id] = match.distance;
+          }
+          else {
+            auto it = found.find(id);
+            if (it != found.end()) {
+              both[id] = it->second + match.distance;
+            }
+          }
+        }
+      }
+      found.swap(both);
+    }
+
+    std::vector<std::pair<uint32_t, const Song*>> ranked;
+    ranked.reserve(found.size());
+    for (const auto& entry : found) {
+      ranked.push_back(std::make_pair(entry.second, ids_.song(entry.first)));
+    }
+    std::sort(ranked.begin(), ranked.end(),
+              [](const std::pair<uint32_t, const Song*>& a, const std::pair<uint32_t, const Song*>& b) {
+                return a.first != b.first ? a.first < b.first : *a.second < *b.second;
+              });
+    std::vector<Song> out;
+    out.reserve(ranked.size());
+    distances.clear();
+    for (const auto& entry : ranked) {
+      out.push_back(*entry.second);
+      distances.push_back(entry.first);
+    }
+    return out;
+  }
+
+  /**
+   * Finds the songs best matching free text in their artist or title, ranked
+   * exact, prefix, substring, then fuzzy matches.  Each kind of match is only
+   * looked for while it could still make the top results.
+   * @param query text to look for, in any case
+   * @param count number of results, at most RANKED_SEARCH_MAX
+   * @return best matches first, songs valid until the next change
+   */
+  std::vector<RankedMatch> rankedFind(const std::string& query, size_t count) const {
+    ensureIndexed();
+    TopK top(std::min(count, (size_t)RANKED_SEARCH_MAX));
+    if (query.empty()) {
+      return top.sorted();
+    }
+    std::string folded = query;
+    for (char& c : folded) {
+      c = (char)std::tolower((unsigned char)c);
+    }
+    const CompletionTrie* tries[2] = { &artists_, &titles_ };
+    const FuzzyIndex* indexes[2] = { &fuzzy_artists_, &fuzzy_titles_ };
+    auto offer = [&](uint32_t kind, uint32_t extra, const std::vector<uint64_t>* songs) {
+      if (songs != nullptr) {
+        for (uint64_t id : *songs) {
+          top.offer(RankedMatch{ kind, extra, ids_.song(id), id });
+        }
+      }
+    };
+
+    for (const FuzzyIndex* index : indexes) {
+      offer(MATCH_EXACT, 0, index->songs(folded));
+    }
+
+    // prefix matches come shortest first, so stop at the first that can't make it
+    for (int f = 0; f < 2; ++f) {
+      tries[f]->prefixed(folded, [&](const std::string& text) {
+        uint32_t extra = (uint32_t)(text.size() - folded.size());
+        if (extra == 0) {
+          return true;
+        }
+        if (!top.wanted(MATCH_PREFIX, extra)) {
+          return false;
+        }
+        offer(MATCH_PREFIX, extra, indexes[f]->songs(text));
+        return true;
+      });
+    }
+
+    if (top.wanted(MATCH_SUBSTRING, 0)) {
+      for (const FuzzyIndex* index : indexes) {
+        index->containing(folded, [&](const std::string& key, const std::vector<uint64_t>& songs) {
+          uint32_t extra = (uint32_t)(key.size() - folded.size());
+          if (key.compare(0, folded.size(), folded) != 0 && top.wanted(MATCH_SUBSTRING, extra)) {
+            offer(MATCH_SUBSTRING, extra, &songs);
+          }
+        });
+      }
+    }
+
+    if (top.wanted(MATCH_FUZZY, 1)) {
+      uint32_t edits = folded.size() < 5 ? 1 : 2;
+      for (const FuzzyIndex* index : indexes) {
+        for (const FuzzyMatch& match : index->search(folded, edits)) {
+          if (match.distance > 0 && top.wanted(MATCH_FUZZY, match.distance)) {
+            offer(MATCH_FUZZY, match.distance, match.songs);
+          }
+        }
+      }
+    }
+
+    return top.sorted();
+  }
+
+  /**
+   * Checks if a song is in the library
+   * @param song song to look for
+   * @return true if found
+   */
+  bool contains(const Song& song) const {
+    if (store_ != nullptr) {
+      return store_->contains(song);
+    }
+    return songs_.find(song) != songs_.end() || inBase(song);
+  }
+
+  /**
+   * Number of songs in the library
+   */
+  size_t size() const {
+    if (store_ != nullptr) {
+      return store_->size();
+    }
+    return songs_.size() + base_.size() - removed_.size();
+  }
+
+  /**
+   * Retrieves a copy of all songs in the library, including those
+   * served from the base image
+   * @return sorted set of songs
+   */
+  std::set<Song> songs() const {
+    if (store_ != nullptr) {
+      return store_->songs();
+    }
+    std::set<Song> out;
+    for (const Song* song : songs_) {
+      out.emplace_hint(out.end(), *song);
+    }
+    if (!base_.valid()) {
+      return out;
+    }
+
+    for (size_t i=0; i<base_.size(); ++i) {
+      Song song = base_.song(i);
+      if (removed_.count(song) == 0) {
+        out.insert(out.end(), song);
+      }
+    }
+    return out;
   }
 };
 
@@ -11,6 +11,7 @@
 #define LAB4_MUSIC_LIBRARY_API_H
 
 #include <memory>
+#include <functional>
 #include "Message.h"
 
 /**
@@ -18,8 +19,36 @@
  * the program.
  */
 class MusicLibraryApi {
+ public:
+  /**
+   * Called once the first byte of an incoming message has arrived
+   */
+  using ReceiveListener = std::function<void()>;
+
+ private:
+  ReceiveListener listener_;
+
+ protected:
+  /**
+   * Notifies the listener that a message has started arriving
+   */
+  void notifyReceive() {
+    if (listener_) {
+      listener_();
+    }
+  }
+
  public:
 
+  /**
+   * Sets a listener to be notified whenever a message starts arriving,
+   * e.g. to time out clients that send partial requests
+   * @param listener receive listener
+   */
+  void setReceiveListener(const ReceiveListener& listener) {
+    listener_ = listener;
+  }
+
   /**
    * Sends a message
    * @param msg message to write
@@ -36,6 +65,14 @@ class MusicLibraryApi {
    */
   virtual std::unique_ptr<Message> recvMessage() = 0;
 
+  /**
+   * Closes the connection.  Any pending or future recvMessage()
+   * will fail.
+   *
+   * @return true if successful, false if error
+   */
+  virtual bool close() = 0;
+
 };
 
 #endif //LAB4_MUSIC_LIBRARY_API_H
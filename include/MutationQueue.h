@@ -0,0 +1,293 @@
+/**
+ * @file
+ *
+ * This file contains the queue used to group library mutations coming from many
+ * client sessions into batches.
+ *
+ * Sessions submit their ADD/REMOVE operations to the queue and wait for the result.
+ * An ADD carries the song's metadata along, so the song and its metadata land in the
+ * same batch, and are logged together.
+ * A single applier thread drains everything that has accumulated, applies it to the
+ * library under one lock acquisition, then completes each session's request.  Under
+ * many concurrent writers this amortizes the locking (and any persistence) cost over
+ * the whole batch.
+ *
+ * If the batch listener fails (e.g. the batch could not be logged), none of the
+ * batch is applied and each waiting session gets an exception instead of a result.
+ * Mutations submitted while the applier is not running fail the same way.
+ *
+ */
+#ifndef LAB5_MUTATION_QUEUE_H
+#define LAB5_MUTATION_QUEUE_H
+
+#include "Song.h"
+#include "SongInfo.h"
+#include "MusicLibrary.h"
+
+#include <vector>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <future>
+#include <thread>
+#include <functional>
+#include <stdexcept>
+
+/**
+ * Types of mutations that can be applied to the library
+ */
+enum MutationType {
+  MUTATION_ADD,
+  MUTATION_REMOVE
+};
+
+/**
+ * A single queued change to the library
+ */
+struct Mutation {
+  MutationType type;
+  Song song;
+  SongInfo info;          // metadata of an added song, empty if none
+
+  Mutation(MutationType type, const Song& song, const SongInfo& info = SongInfo()) :
+      type(type), song(song), info(info) {}
+
+  /**
+   * Applies the change to a library.  An added song gets its metadata set, if it
+   * has any, only if it was not in the library yet.
+   * @param lib library to modify
+   * @return true if the library changed
+   */
+  bool apply(MusicLibrary& lib) const {
+    if (type == MUTATION_REMOVE) {
+      return lib.remove(song);
+    }
+    if (!lib.add(song)) {
+      return false;
+    }
+    if (!info.empty()) {
+      lib.setInfo(song, info);
+    }
+    return true;
+  }
+};
+
+/**
+ * Groups mutations from concurrent sessions and applies them in batches
+ */
+class MutationQueue {
+ public:
+  /**
+   * Called by the applier thread with each batch before it is applied
+   * to the library, e.g. to persist the batch with a single write.
+   * Returns false if the batch must not be applied.
+   */
+  using BatchListener = std::function<bool(const std::vector<Mutation>&)>;
+
+  /**
+   * Called by the applier thread with each batch once it is applied, still
+   * holding the library lock, e.g. to note how far the log is reflected in the
+   * library.
+   */
+  using AppliedListener = std::function<void(const std::vector<Mutation>&)>;
+
+ private:
+  // a submitted mutation waiting for its batch to land
+  struct Pending {
+    Mutation mutation;
+    std::promise<bool> result;
+
+    Pending(const Mutation& mutation) : mutation(mutation), result() {}
+  };
+
+  MusicLibrary& lib_;
+  std::shared_timed_mutex& lib_mutex_;  // guards lib_, shared with readers
+  BatchListener listener_;
+  AppliedListener applied_listener_;
+
+  std::mutex mutex_;             // guards everything below
+  std::condition_variable cv_;
+  std::vector<Pending> pending_;
+  bool running_;
+  std::thread applier_;
+
+  size_t batches_;               // statistics
+  size_t applied_;
+
+  /**
+   * Main loop of the applier thread: waits for mutations, then applies
+   * everything that has accumulated as one batch
+   */
+  void run() {
+    std::vector<Pending> batch;
+    std::vector<Mutation> mutations;
+    std::vector<bool> results;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (running_ || !pending_.empty()) {
+      cv_.wait(lock, [&](){ return !running_ || !pending_.empty(); });
+      if (pending_.empty()) {
+        continue;
+      }
+
+      // take ownership of the entire queue, letting sessions keep submitting
+      batch.clear();
+      batch.swap(pending_);
+      lock.unlock();
+
+      mutations.clear();
+      for (const auto& p : batch) {
+        mutations.push_back(p.mutation);
+      }
+      if (listener_ && !listener_(mutations)) {
+        for (auto& p : batch) {
+          p.result.set_exception(std::make_exception_ptr(
+              std::runtime_error("Failed to persist change")));
+        }
+        lock.lock();
+        continue;
+      }
+
+      // apply the whole batch under a single library lock
+      results.clear();
+      {
+        std::lock_guard<std::shared_timed_mutex> liblock(lib_mutex_);
+        for (const auto& m : mutations) {
+          results.push_back(m.apply(lib_));
+        }
+        if (applied_listener_) {
+          applied_listener_(mutations);
+        }
+      }
+
+      // complete each session's request
+      for (size_t i=0; i<batch.size(); ++i) {
+        batch[i].result.set_value(results[i]);
+      }
+
+      lock.lock();
+      ++batches_;
+      applied_ += batch.size();
+    }
+  }
+
+ public:
+  /**
+   * Creates a queue applying mutations to the given library
+   * @param lib library to modify
+   * @param lib_mutex reader/writer lock protecting the library, taken
+   *                  exclusively while a batch is applied
+   */
+  MutationQueue(MusicLibrary& lib, std::shared_timed_mutex& lib_mutex) :
+      lib_(lib), lib_mutex_(lib_mutex), listener_(), applied_listener_(), mutex_(), cv_(), pending_(),
+      running_(false), applier_(), batches_(0), applied_(0) {}
+
+  ~MutationQueue() {
+    stop();
+  }
+
+  /**
+   * Sets the listener called with each batch before it is applied.
+   * Must be called before start().
+   * @param listener batch listener
+   */
+  void setBatchListener(const BatchListener& listener) {
+    listener_ = listener;
+  }
+
+  /**
+   * Sets the listener called with each batch once it is applied.
+   * Must be called before start().
+   * @param listener applied batch listener
+   */
+  void setAppliedListener(const AppliedListener& listener) {
+    applied_listener_ = listener;
+  }
+
+  /**
+   * Starts the applier thread
+   */
+  void start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!running_) {
+      running_ = true;
+      applier_ = std::thread(&MutationQueue::run, this);
+    }
+  }
+
+  /**
+   * Stops the applier thread once all queued mutations have been applied
+   */
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_ = false;
+    }
+    cv_.notify_all();
+    if (applier_.joinable()) {
+      applier_.join();
+    }
+  }
+
+  /**
+   * Queues a mutation to be applied with the next batch
+   * @param mutation change to apply
+   * @return future holding the result of the library operation, or an
+   *         exception if the applier thread is not running
+   */
+  std::future<bool> submit(const Mutation& mutation) {
+    std::future<bool> out;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!running_) {
+        std::promise<bool> stopped;
+        stopped.set_exception(std::make_exception_ptr(
+            std::runtime_error("Library changes are not being applied")));
+        return stopped.get_future();
+      }
+      pending_.emplace_back(mutation);
+      out = pending_.back().result.get_future();
+    }
+    cv_.notify_one();
+    return out;
+  }
+
+  /**
+   * Adds a song, waiting for its batch to be applied
+   * @param song song to add
+   * @param info metadata of the song, set if it is added
+   * @return true if added, false if already exists
+   * @throws std::runtime_error if the batch failed to persist or the queue is stopped
+   */
+  bool add(const Song& song, const SongInfo& info = SongInfo()) {
+    return submit(Mutation(MUTATION_ADD, song, info)).get();
+  }
+
+  /**
+   * Removes a song, waiting for its batch to be applied
+   * @param song song to remove
+   * @return true if removed, false if not in library
+   * @throws std::runtime_error if the batch failed to persist or the queue is stopped
+   */
+  bool remove(const Song& song) {
+    return submit(Mutation(MUTATION_REMOVE, song)).get();
+  }
+
+  /**
+   * Number of batches applied so far
+   */
+  size_t batches() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return batches_;
+  }
+
+  /**
+   * Number of mutations applied so far
+   */
+  size_t applied() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return applied_;
+  }
+};
+
+#endif //LAB5_MUTATION_QUEUE_H
@@ -0,0 +1,238 @@
+/**
+ * @file
+ *
+ * This file contains the limits on the work a single search may do, and the
+ * registry through which a running search is cancelled.
+ *
+ * A search that scans the library holds the library lock for as long as it runs,
+ * so one expensive search holds up every change queued behind it.  Each search is
+ * given a budget: a deadline, a number of songs it may look at, and a number of
+ * expression steps, one per character matched (a Regex takes at most one step per
+ * character).  The scan charges the budget one song at a time and stops as soon
+ * as it runs out, keeping what it has found so far.
+ *
+ * Every search is registered while it runs, under the session running it and the
+ * request id the client sent it with.  A CANCEL for that id on the same session
+ * stops it at the next song it looks at; request ids are chosen by clients, so
+ * another session's CANCEL never reaches it.
+ *
+ */
+#ifndef LAB5_QUERY_BUDGET_H
+#define LAB5_QUERY_BUDGET_H
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <utility>
+
+// request id of a search that cannot be cancelled
+#define REQUEST_ID_NONE 0
+// songs scanned between looks at the clock
+#define QUERY_CLOCK_INTERVAL 64
+
+/**
+ * Work left to a single search
+ */
+class QueryBudget {
+  std::chrono::steady_clock::time_point deadline_;
+  uint64_t max_songs_;                  // 0 for no limit
+  uint64_t max_steps_;                  // 0 for no limit
+  uint64_t songs_;
+  uint64_t steps_;
+  std::atomic<const char*> stopped_;    // why the search was stopped, nullptr if not
+
+  bool stop(const char* reason) {
+    const char* none = nullptr;
+    stopped_.compare_exchange_strong(none, reason);
+    return false;
+  }
+
+ public:
+  /**
+   * Creates a budget without limits, which can still be cancelled
+   */
+  QueryBudget() : QueryBudget(std::chrono::steady_clock::duration::zero(), 0, 0) {}
+
+  /**
+   * Creates a budget starting now
+   * @param timeout time the search may take, zero for no limit
+   * @param max_songs songs it may look at, 0 for no limit
+   * @param max_steps expression steps it may take, 0 for no limit
+   */
+  QueryBudget(std::chrono::steady_clock::duration timeout, uint64_t max_songs, uint64_t max_steps) :
+      deadline_(timeout > std::chrono::steady_clock::duration::zero()
+                ? std::chrono::steady_clock::now() + timeout
+                : std::chrono::steady_clock::time_point::max()),
+      max_songs_(max_songs), max_steps_(max_steps), songs_(0), steps_(0), stopped_(nullptr) {}
+
+  QueryBudget(const QueryBudget&) = delete;
+  QueryBudget& operator=(const QueryBudget&) = delete;
+
+  /**
+   * Charges for looking at one more song.  Only the thread running the search
+   * may charge.
+   * @param steps expression steps matching the song may take, e.g. the length
+   *        of its artist and title
+   * @return false if the budget is exhausted and the song should not be looked at
+   */
+  bool charge(size_t steps) {
+    if (stopped_.load() != nullptr) {
+      return false;
+    }
+    if (max_songs_ != 0 && songs_ >= max_songs_) {
+      return stop("song limit reached");
+    }
+    if (max_steps_ != 0 && steps_ + steps > max_steps_) {
+      return stop("expression step limit reached");
+    }
+    if (songs_ % QUERY_CLOCK_INTERVAL == 0 && std::chrono::steady_clock::now() >= deadline_) {
+      return stop("time limit reached");
+    }
+    ++songs_;
+    steps_ += steps;
+    return true;
+  }
+
+  /**
+   * Stops the search at the next song, from any thread
+   */
+  void cancel() {
+    stop("cancelled");
+  }
+
+  /**
+   * Checks whether the search was stopped before it finished
+   */
+  bool exhausted() const {
+    return stopped_.load() != nullptr;
+  }
+
+  /**
+   * Why the search was stopped
+   * @return reason, nullptr if it was not
+   */
+  const char* reason() const {
+    return stopped_.load();
+  }
+
+  /**
+   * Songs looked at so far
+   */
+  uint64_t songs() const {
+    return songs_;
+  }
+
+  /**
+   * Expression steps charged so far
+   */
+  uint64_t steps() const {
+    return steps_;
+  }
+};
+
+/**
+ * Running searches, by session and request id, and the limits new ones get
+ */
+class QueryRegistry {
+  using Key = std::pair<int, uint64_t>;   // session, request
+
+  std::mutex mutex_;
+  std::multimap<Key, QueryBudget*> running_;
+  std::chrono::steady_clock::duration timeout_;
+  uint64_t max_songs_;
+  uint64_t max_steps_;
+
+ public:
+  /**
+   * A search registered for its lifetime, with its budget
+   */
+  class Query {
+    QueryRegistry& registry_;
+    QueryBudget budget_;
+    std::multimap<Key, QueryBudget*>::iterator entry_;
+
+   public:
+    /**
+     * Starts a search, with the registry's limits from now on
+     * @param registry registry to add the search to
+     * @param session session running the search
+     * @param request client's id for the request, REQUEST_ID_NONE if it cannot be cancelled
+     *        by the client
+     */
+    Query(QueryRegistry& registry, int session, uint64_t request) :
+        registry_(registry), budget_(registry.timeout_, registry.max_songs_, registry.max_steps_),
+        entry_() {
+      std::lock_guard<std::mutex> lock(registry_.mutex_);
+      entry_ = registry_.running_.emplace(Key(session, request), &budget_);
+    }
+
+    ~Query() {
+      std::lock_guard<std::mutex> lock(registry_.mutex_);
+      registry_.running_.erase(entry_);
+    }
+
+    Query(const Query&) = delete;
+    Query& operator=(const Query&) = delete;
+
+    /**
+     * Budget to charge while searching
+     */
+    QueryBudget& budget() {
+      return budget_;
+    }
+  };
+
+  /**
+   * Creates a registry whose searches have no limits
+   */
+  QueryRegistry() : QueryRegistry(std::chrono::steady_clock::duration::zero(), 0, 0) {}
+
+  /**
+   * Creates a registry limiting its searches
+   * @param timeout time a search may take, zero for no limit
+   * @param max_songs songs a search may look at, 0 for no limit
+   * @param max_steps expression steps a search may take, 0 for no limit
+   */
+  QueryRegistry(std::chrono::steady_clock::duration timeout, uint64_t max_songs, uint64_t max_steps) :
+      mutex_(), running_(), timeout_(timeout), max_songs_(max_songs), max_steps_(max_steps) {}
+
+  /**
+   * Cancels a session's searches running with a request id
+   * @param session session that sent the request
+   * @param request client's id for the request
+   * @return false if none is running
+   */
+  bool cancel(int session, uint64_t request) {
+    if (request == REQUEST_ID_NONE) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto range = running_.equal_range(Key(session, request));
+    for (auto it = range.first; it != range.second; ++it) {
+      it->second->cancel();
+    }
+    return range.first != range.second;
+  }
+
+  /**
+   * Cancels every running search, e.g. when shutting down
+   */
+  void cancelAll() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& query : running_) {
+      query.second->cancel();
+    }
+  }
+
+  /**
+   * Number of searches running
+   */
+  size_t running() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return running_.size();
+  }
+};
+
+#endif //LAB5_QUERY_BUDGET_H
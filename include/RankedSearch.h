@@ -0,0 +1,144 @@
+/**
+ * @file
+ *
+ * This file contains how matches of a free-text search are ranked, and the
+ * collector that keeps the best k of them.
+ *
+ * A song matches a query through its artist or its title, whichever matches
+ * better.  Matches are ranked by kind, best first:
+ *   exact       the artist or title is the query, ignoring case
+ *   prefix      it starts with the query
+ *   substring   it contains the query
+ *   fuzzy       it is within a few edits of the query, see FuzzyIndex
+ * then by how far off they are: the letters beyond the query for prefix and
+ * substring matches, the edits for fuzzy ones.  Ties go in artist/title order.
+ *
+ * Matches are gathered one kind at a time, best kind first, into a bounded heap.
+ * Once the heap holds k matches, anything the next kind could offer ranks below
+ * all of them, so the search stops without looking at it.
+ *
+ */
+#ifndef LAB5_RANKED_SEARCH_H
+#define LAB5_RANKED_SEARCH_H
+
+#include "Song.h"
+
+#include <cstdint>
+#include <vector>
+#include <unordered_set>
+#include <algorithm>
+
+// results of a ranked search, unless asked for more
+#define RANKED_SEARCH_DEFAULT 20
+// most results of a ranked search
+#define RANKED_SEARCH_MAX 1000
+
+/**
+ * Kinds of match, better kinds larger
+ */
+enum MatchKind {
+  MATCH_FUZZY = 1,
+  MATCH_SUBSTRING = 2,
+  MATCH_PREFIX = 3,
+  MATCH_EXACT = 4
+};
+
+/**
+ * A song matching a ranked search
+ */
+struct RankedMatch {
+  uint32_t kind;      // MatchKind
+  uint32_t extra;     // letters beyond the query, or edits
+  const Song* song;
+  uint64_t id;
+};
+
+/**
+ * Bounded heap of the best k matches
+ */
+class TopK {
+  size_t k_;
+  std::vector<RankedMatch> heap_;     // worst match on top
+  std::unordered_set<uint64_t> kept_; // songs in the heap
+
+  // true if a ranks above b
+  static bool better(const RankedMatch& a, const RankedMatch& b) {
+    if (a.kind != b.kind) {
+      return a.kind > b.kind;
+    }
+    if (a.extra != b.extra) {
+      return a.extra < b.extra;
+    }
+    return *a.song < *b.song;
+  }
+
+ public:
+  /**
+   * Creates an empty collector
+   * @param k number of matches to keep
+   */
+  explicit TopK(size_t k) : k_(k), heap_(), kept_() {
+    heap_.reserve(k);
+  }
+
+  /**
+   * Checks whether a match of some kind and distance could still make the top k,
+   * ignoring ties, so whether there is any point looking for one
+   * @param kind MatchKind
+   * @param extra letters beyond the query, or edits
+   */
+  bool wanted(uint32_t kind, uint32_t extra) const {
+    if (k_ == 0) {
+      return false;
+    }
+    if (heap_.size() < k_) {
+      return true;
+    }
+    const RankedMatch& worst = heap_.front();
+    return kind > worst.kind || (kind == worst.kind && extra <= worst.extra);
+  }
+
+  /**
+   * Offers a match.  A song offered more than once, e.g. through both its artist
+   * and its title, is kept at its best match.
+   * @param match match to keep if it is among the best k
+   */
+  void offer(const RankedMatch& match) {
+    if (!wanted(match.kind, match.extra)) {
+      return;
+    }
+    if (kept_.count(match.id) > 0) {
+      auto it = std::find_if(heap_.begin(), heap_.end(),
+                             [&](const RankedMatch& m) { return m.id == match.id; });
+      if (better(match, *it)) {
+        *it = match;
+        std::make_heap(heap_.begin(), heap_.end(), better);
+      }
+      return;
+    }
+    if (heap_.size() < k_) {
+      heap_.push_back(match);
+      std::push_heap(heap_.begin(), heap_.end(), better);
+      kept_.insert(match.id);
+    }
+    else if (better(match, heap_.front())) {
+      std::pop_heap(heap_.begin(), heap_.end(), better);
+      kept_.erase(heap_.back().id);
+      heap_.back() = match;
+      std::push_heap(heap_.begin(), heap_.end(), better);
+      kept_.insert(match.id);
+    }
+  }
+
+  /**
+   * The best matches
+   * @return up to k matches, best first
+   */
+  std::vector<RankedMatch> sorted() const {
+    std::vector<RankedMatch> out(heap_);
+    std::sort(out.begin(), out.end(), better);
+    return out;
+  }
+};
+
+#endif //LAB5_RANKED_SEARCH_H
@@ -0,0 +1,805 @@
+/**
+ * @file
+ *
+ * This file contains the regular expressions used to search artists and titles.
+ *
+ * std::regex backtracks, so a pattern such as "(a*)*b" takes exponential time
+ * on a long enough artist, all the while holding the library lock.  Patterns are
+ * instead compiled to a Thompson NFA and run as a DFA built lazily: each DFA
+ * state is the set of NFA states the text could be in, and is only worked out
+ * the first time the search reaches it.  Every character then costs one table
+ * lookup, or one pass over the NFA when a new state has to be built, so a search
+ * is linear in the length of the text whatever the pattern.  The cache of DFA
+ * states is bounded; once full it is thrown away and rebuilt as needed.
+ *
+ * The syntax is the ECMAScript syntax std::regex defaults to, without the parts
+ * that need backtracking:
+ *   literals and escapes     a \. \\ \t \n \xHH
+ *   any character            .
+ *   classes                  [abc] [a-z] [^0-9] \d \D \w \W \s \S
+ *   anchors                  ^ $
+ *   groups                   (...) (?:...) a|b
+ *   repetition               * + ? {n} {n,} {n,m}, also lazy *? etc.
+ * Backreferences, lookahead and word boundaries are rejected with an error
+ * rather than run slowly, as are inline flags and the [:alpha:], [=a=] and [.a.]
+ * forms inside classes, rather than matched differently from std::regex.  Matching is by byte, like std::regex on a string,
+ * and searches for a match anywhere in the text, like std::regex_search.
+ *
+ */
+#ifndef LAB5_REGEX_H
+#define LAB5_REGEX_H
+
+#include <cstdint>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <bitset>
+#include <map>
+#include <algorithm>
+
+// largest count in a {n,m} repetition
+#define REGEX_MAX_REPEAT 1000
+// most NFA states a pattern may compile to
+#define REGEX_MAX_STATES 20000
+// most DFA states cached before the cache is thrown away
+#define REGEX_MAX_DFA_STATES 2000
+
+/**
+ * Regular expression compiled for linear-time searching
+ */
+class Regex {
+  using ByteSet = std::bitset<256>;
+
+  // parsed pattern
+  struct Node {
+    enum Type { SET, EMPTY, CONCAT, ALT, REPEAT, BOL, EOL } type;
+    ByteSet set;                // SET: bytes matched
+    std::vector<Node> kids;     // CONCAT, ALT: parts; REPEAT: the repeated node
+    int min = 0;                // REPEAT: least repetitions
+    int max = 0;                // REPEAT: most repetitions, -1 if unbounded
+
+    explicit Node(Type t) : type(t), set(), kids() {}
+  };
+
+  // NFA state; BYTES consumes a byte, the others are followed without one
+  struct State {
+    enum Type { BYTES, SPLIT, EMPTY, BOL, EOL, MATCH } type;
+    int set;                    // BYTES: index into sets_
+    int out;
+    int out1;                   // SPLIT: second way out
+  };
+
+  // NFA under construction: a start state and its dangling ways out, each a
+  // state and whether it is out1
+  struct Fragment {
+    int start;
+    std::vector<std::pair<int, bool>> outs;
+  };
+
+  // DFA state: the NFA states it stands for, only those that consume a byte,
+  // wait for the end of the text or match
+  struct DState {
+    std::vector<int> states;
+    bool match;                 // a match ends before the next byte
+    int end;                    // a match ends at the end of the text: -1 unknown, 0, 1
+    std::vector<int> next;      // byte class -> DFA state, -1 not built yet
+  };
+
+  std::string error_;
+  std::vector<State> nfa_;
+  std::vector<ByteSet> sets_;
+  int start_nfa_;
+  bool empty_match_;            // matches the empty text
+
+  uint8_t classes_[256];        // byte -> class of bytes no pattern set tells apart
+  int nclasses_;
+
+  mutable std::vector<DState> dfa_;
+  mutable std::map<std::vector<int>, int> known_;
+  mutable int start_;           // DFA state at the start of the text, -1 not built
+  mutable std::vector<uint32_t> marks_;
+  mutable uint32_t mark_;
+
+  //=============================================================
+  // Parsing
+  //=============================================================
+
+  class Parser {
+    const std::string& p_;
+    size_t pos_;
+    std::string& error_;
+
+    bool fail(const std::string& msg) {
+      if (error_.empty()) {
+        error_ = msg + " at position " + std::to_string(pos_);
+      }
+      return false;
+    }
+
+    bool more() const {
+      return pos_ < p_.size();
+    }
+
+    char peek() const {
+      return p_[pos_];
+    }
+
+    static ByteSet range(int lo, int hi) {
+      ByteSet out;
+      for (int c = lo; c <= hi; ++c) {
+        out.set(c);
+      }
+      return out;
+    }
+
+    static int first(const ByteSet& set) {
+      int c = 0;
+      while (c < 255 && !set.test(c)) {
+        ++c;
+      }
+      return c;
+    }
+
+    static ByteSet digits() {
+      return range('0', '9');
+    }
+
+    static ByteSet word() {
+      return range('a', 'z') | range('A', 'Z') | digits() | range('_', '_');
+    }
+
+    static ByteSet space() {
+      return range(' ', ' ') | range('\t', '\r');
+    }
+
+    static int hex(char c) {
+      if (c >= '0' && c <= '9') return c - '0';
+      if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+      if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+      return -1;
+    }
+
+    // escape after a backslash, either a single byte or a class
+    bool escape(bool in_class, ByteSet& set, bool& single) {
+      if (!more()) {
+        return fail("trailing backslash");
+      }
+      char c = p_[pos_++];
+      single = true;
+      int byte = -1;
+      switch (c) {
+        case 'd': set = digits(); single = false; return true;
+        case 'D': set = ~digits(); single = false; return true;
+        case 'w': set = word(); single = false; return true;
+        case 'W': set = ~word(); single = false; return true;
+        case 's': set = space(); single = false; return true;
+        case 'S': set = ~space(); single = false; return true;
+        case 't': byte = '\t'; break;
+        case 'n': byte = '\n'; break;
+        case 'r': byte = '\r'; break;
+        case 'f': byte = '\f'; break;
+        case 'v': byte = '\v'; break;
+        case '0': byte = 0; break;
+        case 'b':
+          if (!in_class) {
+            return fail("word boundaries are not supported");
+          }
+          byte = '\b';
+          break;
+        case 'B':
+          return fail("word boundaries are not supported");
+        case 'x': {
+          int hi = pos_ < p_.size() ? hex(p_[pos_]) : -1;
+          int lo = pos_ + 1 < p_.size() ? hex(p_[pos_ + 1]) : -1;
+          if (hi < 0 || lo < 0) {
+            return fail("bad \\x escape");
+          }
+          pos_ += 2;
+          byte = hi*16 + lo;
+          break;
+        }
+        default:
+          if (c >= '1' && c <= '9') {
+            return fail("backreferences are not supported");
+          }
+          if (std::isalnum((unsigned char)c)) {
+            return fail(std::string("unknown escape \\") + c);
+          }
+          byte = (uint8_t)c;
+      }
+      set.reset();
+      set.set(byte);
+      return true;
+    }
+
+    // bracket expression, after the '['
+    bool bracket(ByteSet& set) {
+      bool negate = more() && peek() == '^';
+      if (negate) {
+        ++pos_;
+      }
+      set.reset();
+      while (more() && peek() != ']') {
+        ByteSet item;
+        bool single = true;
+        int lo;
+        if (peek() == '\\') {
+          ++pos_;
+          if (!escape(true, item, single)) {
+            return false;
+          }
+          lo = single ? first(item) : -1;
+        }
+        else if (peek() == '[' && pos_ + 1 < p_.size()
+                 && (p_[pos_ + 1] == ':' || p_[pos_ + 1] == '=' || p_[pos_ + 1] == '.')) {
+          // std::regex gives these a meaning, don't quietly match them as plain sets
+          char kind = p_[pos_ + 1];
+          return fail(kind == ':' ? "character class names are not supported"
+                      : kind == '=' ? "equivalence classes are not supported"
+                      : "collating elements are not supported");
+        }
+        else {
+          lo = (uint8_t)p_[pos_++];
+          item.set(lo);
+        }
+        // a range, unless the '-' ends the class
+        if (single && pos_ + 1 < p_.size() && peek() == '-' && p_[pos_ + 1] != ']') {
+          ++pos_;
+          ByteSet end;
+          int hi;
+          if (peek() == '\\') {
+            ++pos_;
+            bool end_single = true;
+            if (!escape(true, end, end_single)) {
+              return false;
+            }
+            if (!end_single) {
+              return fail("bad range in class");
+            }
+            hi = first(end);
+          }
+          else {
+            hi = (uint8_t)p_[pos_++];
+          }
+          if (hi < lo) {
+            return fail("bad range in class");
+          }
+          item = range(lo, hi);
+        }
+        set |= item;
+      }
+      if (!more()) {
+        return fail("missing ]");
+      }
+      ++pos_;
+      if (negate) {
+        set.flip();
+      }
+      return true;
+    }
+
+    // decimal number in a {n,m}
+    bool number(int& n) {
+      size_t begin = pos_;
+      n = 0;
+      while (more() && peek() >= '0' && peek() <= '9') {
+        n = std::min(n*10 + (peek() - '0'), REGEX_MAX_REPEAT + 1);
+        ++pos_;
+      }
+      return pos_ > begin;
+    }
+
+    bool atom(Node& out) {
+      char c = p_[pos_++];
+      switch (c) {
+        case '(': {
+          if (more() && peek() == '?') {
+            char kind = pos_ + 1 < p_.size() ? p_[pos_ + 1] : '\0';
+            if (kind == ':') {
+              pos_ += 2;
+            }
+            else if (kind == '=' || kind == '!' || kind == '<') {
+              return fail("lookaround is not supported");
+            }
+            else {
+              return fail("inline flags are not supported");
+            }
+          }
+          if (!alternation(out)) {
+            return false;
+          }
+          if (!more() || peek() != ')') {
+            return fail("missing )");
+          }
+          ++pos_;
+          return true;
+        }
+        case '[':
+          out = Node(Node::SET);
+          return bracket(out.set);
+        case '.':
+          out = Node(Node::SET);
+          out.set.set();
+          out.set.reset('\n');
+          out.set.reset('\r');
+          return true;
+        case '^':
+          out = Node(Node::BOL);
+          return true;
+        case '$':
+          out = Node(Node::EOL);
+          return true;
+        case '\\': {
+          out = Node(Node::SET);
+          bool single;
+          return escape(false, out.set, single);
+        }
+        case '*': case '+': case '?': case '{':
+          --pos_;
+          return fail("nothing to repeat");
+        case ')':
+          --pos_;
+          return fail("unmatched )");
+        default:
+          out = Node(Node::SET);
+          out.set.set((uint8_t)c);
+          return true;
+      }
+    }
+
+    bool repetition(Node& out) {
+      if (!atom(out)) {
+        return false;
+      }
+      bool repeated = false;
+      while (more()) {
+        int min, max;
+        char c = peek();
+        if (c == '*') {
+          min = 0; max = -1;
+        }
+        else if (c == '+') {
+          min = 1; max = -1;
+        }
+        else if (c == '?') {
+          min = 0; max = 1;
+        }
+        else if (c == '{') {
+          ++pos_;
+          if (!number(min)) {
+            return fail("bad {n,m}");
+          }
+          max = min;
+          if (more() && peek() == ',') {
+            ++pos_;
+            if (!number(max)) {
+              max = -1;
+            }
+          }
+          if (!more() || peek() != '}') {
+            return fail("bad {n,m}");
+          }
+          if (min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT) {
+            return fail("repetition count over " + std::to_string(REGEX_MAX_REPEAT));
+          }
+          if (max >= 0 && max < min) {
+            return fail("bad {n,m}");
+          }
+        }
+        else {
+          break;
+        }
+        if (repeated) {
+          return fail("nothing to repeat");
+        }
+        ++pos_;
+        // lazy and greedy repetition match the same texts
+        if (more() && peek() == '?') {
+          ++pos_;
+        }
+        Node rep(Node::REPEAT);
+        rep.min = min;
+        rep.max = max;
+        rep.kids.push_back(std::move(out));
+        out = std::move(rep);
+        repeated = true;
+      }
+      return true;
+    }
+
+    bool concatenation(Node& out) {
+      out = Node(Node::CONCAT);
+      while (more() && peek() != '|' && peek() != ')') {
+        Node part(Node::EMPTY);
+        if (!repetition(part)) {
+          return false;
+        }
+        out.kids.push_back(std::move(part));
+      }
+      return true;
+    }
+
+   public:
+    Parser(const std::string& pattern, std::string& error) : p_(pattern), pos_(0), error_(error) {}
+
+    bool alternation(Node& out) {
+      Node first(Node::EMPTY);
+      if (!concatenation(first)) {
+        return false;
+      }
+      if (!more() || peek() != '|') {
+        out = std::move(first);
+        return true;
+      }
+      out = Node(Node::ALT);
+      out.kids.push_back(std::move(first));
+      while (more() && peek() == '|') {
+        ++pos_;
+        Node next(Node::EMPTY);
+        if (!concatenation(next)) {
+          return false;
+        }
+        out.kids.push_back(std::move(next));
+      }
+      return true;
+    }
+
+    bool parse(Node& out) {
+      if (!alternation(out)) {
+        return false;
+      }
+      if (more()) {
+        return fail("unmatched )");
+      }
+      return true;
+    }
+  };
+
+  //=============================================================
+  // Compiling
+  //=============================================================
+
+  int state(State::Type type, int set = -1) {
+    nfa_.push_back(State{ type, set, -1, -1 });
+    return (int)nfa_.size() - 1;
+  }
+
+  void patch(const Fragment& frag, int to) {
+    for (const auto& out : frag.outs) {
+      (out.second ? nfa_[out.first].out1 : nfa_[out.first].out) = to;
+    }
+  }
+
+  // one way in and out, for parts that match nothing
+  Fragment empty() {
+    int s = state(State::EMPTY);
+    return Fragment{ s, { { s, false } } };
+  }
+
+  // one fragment, then the other
+  Fragment sequence(Fragment first, Fragment second) {
+    patch(first, second.start);
+    first.outs = std::move(second.outs);
+    return first;
+  }
+
+  bool compile(const Node& node, Fragment& out) {
+    if (nfa_.size() > REGEX_MAX_STATES) {
+      error_ = "pattern is too large";
+      return false;
+    }
+    switch (node.type) {
+      case Node::SET: {
+        sets_.push_back(node.set);
+        int s = state(State::BYTES, (int)sets_.size() - 1);
+        out = Fragment{ s, { { s, false } } };
+        return true;
+      }
+      case Node::EMPTY:
+        out = empty();
+        return true;
+      case Node::BOL:
+      case Node::EOL: {
+        int s = state(node.type == Node::BOL ? State::BOL : State::EOL);
+        out = Fragment{ s, { { s, false } } };
+        return true;
+      }
+      case Node::CONCAT: {
+        out = empty();
+        for (const Node& kid : node.kids) {
+          Fragment next;
+          if (!compile(kid, next)) {
+            return false;
+          }
+          out = sequence(std::move(out), std::move(next));
+        }
+        return true;
+      }
+      case Node::ALT: {
+        // a chain of splits, one per alternative but the last
+        std::vector<Fragment> alts(node.kids.size());
+        for (size_t i = 0; i < node.kids.size(); ++i) {
+          if (!compile(node.kids[i], alts[i])) {
+            return false;
+          }
+        }
+        out = std::move(alts.back());
+        for (size_t i = alts.size() - 1; i-- > 0;) {
+          int s = state(State::SPLIT);
+          nfa_[s].out = alts[i].start;
+          nfa_[s].out1 = out.start;
+          out.start = s;
+          out.outs.insert(out.outs.end(), alts[i].outs.begin(), alts[i].outs.end());
+        }
+        return true;
+      }
+      case Node::REPEAT: {
+        const Node& kid = node.kids[0];
+        out = empty();
+        for (int i = 0; i < node.min; ++i) {
+          Fragment copy;
+          if (!compile(kid, copy)) {
+            return false;
+          }
+          out = sequence(std::move(out), std::move(copy));
+        }
+        if (node.max < 0) {
+          // loop back through a split that can also leave
+          Fragment body;
+          if (!compile(kid, body)) {
+            return false;
+          }
+          int s = state(State::SPLIT);
+          nfa_[s].out = body.start;
+          patch(body, s);
+          out = sequence(std::move(out), Fragment{ s, { { s, true } } });
+          return true;
+        }
+        // x{0,k} as (x(x(...)?)?)?, so each copy can be skipped to the end
+        std::vector<std::pair<int, bool>> skips;
+        for (int i = node.min; i < node.max; ++i) {
+          Fragment body;
+          if (!compile(kid, body)) {
+            return false;
+          }
+          int s = state(State::SPLIT);
+          nfa_[s].out = body.start;
+          skips.push_back(std::make_pair(s, true));
+          out = sequence(std::move(out), Fragment{ s, { { s, false } } });
+          out = sequence(std::move(out), std::move(body));
+        }
+        out.outs.insert(out.outs.end(), skips.begin(), skips.end());
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // splits bytes into classes that every set either wholly contains or not
+  void classify() {
+    std::fill(classes_, classes_ + 256, 0);
+    nclasses_ = 1;
+    for (const ByteSet& set : sets_) {
+      // a class becomes two if the set takes some of its bytes but not all
+      int split[256][2];
+      for (int c = 0; c < nclasses_; ++c) {
+        split[c][0] = split[c][1] = -1;
+      }
+      int n = 0;
+      for (int b = 0; b < 256; ++b) {
+        int& to = split[classes_[b]][set.test(b) ? 1 : 0];
+        if (to < 0) {
+          to = n++;
+        }
+        classes_[b] = (uint8_t)to;
+      }
+      nclasses_ = n;
+    }
+  }
+
+  //=============================================================
+  // Searching
+  //=============================================================
+
+  // follows the states reachable without consuming a byte, keeping those that
+  // consume one, wait for the end or match; true if a match is reachable
+  bool closure(std::vector<int>& stack, bool at_start, bool at_end, std::vector<int>& out) const {
+    if (++mark_ == 0) {
+      std::fill(marks_.begin(), marks_.end(), 0);
+      mark_ = 1;
+    }
+    bool match = false;
+    while (!stack.empty()) {
+      int s = stack.back();
+      stack.pop_back();
+      if (s < 0 || marks_[s] == mark_) {
+        continue;
+      }
+      marks_[s] = mark_;
+      const State& st = nfa_[s];
+      switch (st.type) {
+        case State::BYTES:
+          out.push_back(s);
+          break;
+        case State::SPLIT:
+          stack.push_back(st.out1);
+          stack.push_back(st.out);
+          break;
+        case State::EMPTY:
+          stack.push_back(st.out);
+          break;
+        case State::BOL:
+          if (at_start) {
+            stack.push_back(st.out);
+          }
+          break;
+        case State::EOL:
+          if (at_end) {
+            stack.push_back(st.out);
+          }
+          else {
+            out.push_back(s);
+          }
+          break;
+        case State::MATCH:
+          out.push_back(s);
+          match = true;
+          break;
+      }
+    }
+    std::sort(out.begin(), out.end());
+    return match;
+  }
+
+  void flush() const {
+    dfa_.clear();
+    known_.clear();
+    start_ = -1;
+  }
+
+  int intern(std::vector<int>& states, bool match) const {
+    auto it = known_.find(states);
+    if (it != known_.end()) {
+      return it->second;
+    }
+    int id = (int)dfa_.size();
+    known_.emplace(states, id);
+    dfa_.push_back(DState{ std::move(states), match, -1, std::vector<int>(nclasses_, -1) });
+    return id;
+  }
+
+  int start() const {
+    if (start_ < 0) {
+      std::vector<int> stack(1, start_nfa_), states;
+      bool match = closure(stack, true, false, states);
+      start_ = intern(states, match);
+    }
+    return start_;
+  }
+
+  // DFA state after a byte, building it if need be
+  int step(int from, uint8_t byte) const {
+    // a match may also begin after the byte
+    std::vector<int> stack(1, start_nfa_), states;
+    for (int s : dfa_[from].states) {
+      const State& st = nfa_[s];
+      if (st.type == State::BYTES && sets_[st.set].test(byte)) {
+        stack.push_back(st.out);
+      }
+    }
+    bool match = closure(stack, false, false, states);
+    if (dfa_.size() >= REGEX_MAX_DFA_STATES) {
+      flush();
+      return intern(states, match);
+    }
+    int to = intern(states, match);
+    dfa_[from].next[classes_[byte]] = to;
+    return to;
+  }
+
+  bool matchesAtEnd(int s) const {
+    DState& d = dfa_[s];
+    if (d.end < 0) {
+      std::vector<int> stack, states;
+      for (int n : d.states) {
+        if (nfa_[n].type == State::EOL) {
+          stack.push_back(n);
+        }
+      }
+      d.end = closure(stack, false, true, states) ? 1 : 0;
+    }
+    return d.end == 1;
+  }
+
+ public:
+  /**
+   * Creates an expression matching every text
+   */
+  Regex() : Regex(std::string()) {}
+
+  /**
+   * Compiles an expression
+   * @param pattern regular expression, see the syntax above
+   */
+  explicit Regex(const std::string& pattern)
+      : error_(), nfa_(), sets_(), start_nfa_(-1), empty_match_(false), classes_(),
+        nclasses_(0), dfa_(), known_(), start_(-1), marks_(), mark_(0) {
+    Node root(Node::EMPTY);
+    Parser parser(pattern, error_);
+    Fragment frag;
+    if (!parser.parse(root) || !compile(root, frag)) {
+      nfa_.clear();
+      sets_.clear();
+      return;
+    }
+    patch(frag, state(State::MATCH));
+    start_nfa_ = frag.start;
+    marks_.assign(nfa_.size(), 0);
+    classify();
+
+    std::vector<int> stack(1, start_nfa_), states;
+    empty_match_ = closure(stack, true, true, states);
+  }
+
+  /**
+   * Checks whether the pattern compiled
+   */
+  bool valid() const {
+    return error_.empty();
+  }
+
+  /**
+   * Why the pattern did not compile
+   * @return error message, empty if it did
+   */
+  const std::string& error() const {
+    return error_;
+  }
+
+  /**
+   * Checks whether the expression matches anywhere in a text
+   * @param begin start of the text
+   * @param end end of the text
+   * @return true if it matches, false if not or the pattern is invalid
+   */
+  bool search(const char* begin, const char* end) const {
+    if (!valid()) {
+      return false;
+    }
+    if (begin == end) {
+      return empty_match_;
+    }
+    int s = start();
+    for (const char* p = begin; p != end; ++p) {
+      if (dfa_[s].match) {
+        return true;
+      }
+      int next = dfa_[s].next[classes_[(uint8_t)*p]];
+      s = next >= 0 ? next : step(s, (uint8_t)*p);
+    }
+    return dfa_[s].match || matchesAtEnd(s);
+  }
+
+  /**
+   * Checks whether the expression matches anywhere in a text
+   * @param text text to search
+   * @return true if it matches, false if not or the pattern is invalid
+   */
+  bool search(const std::string& text) const {
+    return search(text.data(), text.data() + text.size());
+  }
+
+  /**
+   * Checks whether a pattern compiles
+   * @param pattern regular expression
+   * @param error set to why not
+   * @return true if it does
+   */
+  static bool check(const std::string& pattern, std::string& error) {
+    Regex regex(pattern);
+    error = regex.error();
+    return regex.valid();
+  }
+};
+
+#endif //LAB5_REGEX_H
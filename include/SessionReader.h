@@ -0,0 +1,137 @@
+/**
+ * @file
+ *
+ * This file contains the reader that receives a client's messages ahead of the
+ * session handling them.
+ *
+ * Each session's messages are read on a thread of their own, so that a CANCEL sent
+ * on the same connection stops the search it names while the session is still
+ * busy with it.  The session answers the CANCEL in turn, after the search.
+ *
+ * Once a message has arrived in full it no longer counts against the read timeout,
+ * so requests sent ahead while a long search runs don't get the connection closed.
+ * At most SESSION_READ_AHEAD messages are held waiting for the session; after that
+ * the reader stops reading until the session catches up, leaving further messages
+ * on the connection.  A CANCEL sent behind more requests than that is only seen
+ * once the session has handled enough of them.
+ *
+ */
+#ifndef LAB5_SESSION_READER_H
+#define LAB5_SESSION_READER_H
+
+#include "MusicLibraryApi.h"
+#include "SessionRegistry.h"
+#include "QueryBudget.h"
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+// messages received ahead of the session before the reader waits for it
+#define SESSION_READ_AHEAD 8
+
+/**
+ * Reads a session's messages on a thread of its own, cancelling searches as soon
+ * as a CANCEL for them arrives
+ */
+class SessionReader {
+  // a message read, with whether it cancelled a running search
+  struct Received {
+    std::unique_ptr<Message> msg;
+    bool cancelled;
+  };
+
+  MusicLibraryApi& api_;
+  SessionRegistry::Session& session_;
+  QueryRegistry& queries_;
+  int id_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Received> received_;   // a null message once the connection ends
+  bool stopped_;
+  std::thread thread_;
+
+  void run() {
+    for (;;) {
+      std::unique_ptr<Message> msg = api_.recvMessage();
+      if (msg != nullptr) {
+        session_.received();
+      }
+      bool cancelled = false;
+      if (msg != nullptr && msg->type() == MessageType::CANCEL) {
+        cancelled = queries_.cancel(id_, ((CancelMessage&)(*msg)).request);
+      }
+      bool end = msg == nullptr || msg->type() == MessageType::GOODBYE;
+
+      std::unique_lock<std::mutex> lock(mutex_);
+      received_.push_back(Received{ std::move(msg), cancelled });
+      cv_.notify_all();
+      if (end) {
+        return;
+      }
+      // leave further messages on the connection until the session catches up
+      cv_.wait(lock, [this]() { return stopped_ || received_.size() < SESSION_READ_AHEAD; });
+      if (stopped_) {
+        return;
+      }
+    }
+  }
+
+ public:
+  /**
+   * Starts reading
+   * @param api session's communication layer
+   * @param session session's registration, told when a message has arrived in full
+   * @param queries registry of running searches
+   * @param id session id
+   */
+  SessionReader(MusicLibraryApi& api, SessionRegistry::Session& session, QueryRegistry& queries,
+                int id) :
+      api_(api), session_(session), queries_(queries), id_(id), mutex_(), cv_(), received_(),
+      stopped_(false), thread_() {
+    thread_ = std::thread(&SessionReader::run, this);
+  }
+
+  /**
+   * Closes the connection, ending any read in progress, and stops reading
+   */
+  ~SessionReader() {
+    api_.close();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  SessionReader(const SessionReader&) = delete;
+  SessionReader& operator=(const SessionReader&) = delete;
+
+  /**
+   * Waits for the next message
+   * @param cancelled set to whether a CANCEL stopped a running search
+   * @return message, nullptr once the connection ended
+   */
+  std::unique_ptr<Message> next(bool& cancelled) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return !received_.empty(); });
+    std::unique_ptr<Message> msg = std::move(received_.front().msg);
+    cancelled = received_.front().cancelled;
+    received_.pop_front();
+    cv_.notify_all();
+    return msg;
+  }
+
+  /**
+   * Number of messages received and not yet taken by the session
+   */
+  size_t pending() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return received_.size();
+  }
+};
+
+#endif //LAB5_SESSION_READER_H
@@ -0,0 +1,234 @@
+/**
+ * @file
+ *
+ * This file contains the registry of connected client sessions, used by the server
+ * to drain connections when shutting down.
+ *
+ * Each session is either idle (waiting for the next request) or busy (handling a
+ * request).  When draining starts, idle sessions are closed right away, while busy
+ * sessions are allowed to finish and send their current response before closing.
+ *
+ * Optionally, sessions are also closed when they sit idle for too long between
+ * requests, or take too long to send a request once it has started arriving.  Each
+ * session has a single pending timer in a TimerWheel that is moved as the session
+ * changes state.  The read timeout runs from the first byte of a request until the
+ * whole request has arrived, even if the session is busy with an earlier one.
+ *
+ */
+#ifndef LAB5_SESSION_REGISTRY_H
+#define LAB5_SESSION_REGISTRY_H
+
+#include "MusicLibraryApi.h"
+#include "TimerWheel.h"
+
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+/**
+ * Keeps track of all connected client sessions
+ */
+class SessionRegistry {
+  // state of a single session
+  struct Entry {
+    MusicLibraryApi* api;
+    bool busy;
+    TimerWheel::TimerId timer;   // 0 if none pending
+    uint64_t armed;              // bumped each time the timer changes
+    const char* waiting;         // what the timer is waiting for
+  };
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::map<int, Entry> sessions_;
+  bool draining_;
+
+  TimerWheel* timers_;
+  std::chrono::steady_clock::duration idle_timeout_;   // zero to disable
+  std::chrono::steady_clock::duration read_timeout_;   // zero to disable
+
+  // sets the session's timer to close it after the timeout, must hold mutex_
+  void arm(int id, Entry& entry, std::chrono::steady_clock::duration timeout,
+           const char* waiting) {
+    if (timers_ == nullptr) {
+      return;
+    }
+    if (timeout <= std::chrono::steady_clock::duration::zero()) {
+      disarm(entry);
+      return;
+    }
+    entry.waiting = waiting;
+    if (entry.timer == 0 || !timers_->reschedule(entry.timer, timeout)) {
+      uint64_t armed = ++entry.armed;
+      entry.timer = timers_->schedule(timeout, [this, id, armed]() { expire(id, armed); });
+    }
+  }
+
+  // cancels the session's timer, must hold mutex_
+  void disarm(Entry& entry) {
+    if (timers_ != nullptr && entry.timer != 0) {
+      timers_->cancel(entry.timer);
+      entry.timer = 0;
+      ++entry.armed;
+    }
+  }
+
+  // called from the timer wheel when a session's timer fires, ignoring
+  // timers that were replaced while the callback was on its way
+  void expire(int id, uint64_t armed) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto session = sessions_.find(id);
+    if (session != sessions_.end() && session->second.armed == armed) {
+      std::cout << "Client " << id << " timed out waiting for "
+                << session->second.waiting << std::endl;
+      session->second.timer = 0;
+      session->second.api->close();
+    }
+  }
+
+ public:
+
+  /**
+   * Registers a session for its lifetime, and tracks whether it is busy
+   * handling a request
+   */
+  class Session {
+    SessionRegistry& registry_;
+    MusicLibraryApi& api_;
+    int id_;
+
+   public:
+    /**
+     * Registers the session as idle.  If the registry is already draining,
+     * the connection is closed immediately.
+     * @param registry registry to add the session to
+     * @param api session's communication layer
+     * @param id session id
+     */
+    Session(SessionRegistry& registry, MusicLibraryApi& api, int id) :
+        registry_(registry), api_(api), id_(id) {
+      std::lock_guard<std::mutex> lock(registry_.mutex_);
+      Entry& entry = registry_.sessions_[id_];
+      entry = Entry{&api, false, 0, 0, ""};
+      if (registry_.draining_) {
+        api.close();
+      }
+      registry_.arm(id_, entry, registry_.idle_timeout_, "a request");
+      api.setReceiveListener([this]() { receiving(); });
+    }
+
+    ~Session() {
+      api_.setReceiveListener(nullptr);
+      {
+        std::lock_guard<std::mutex> lock(registry_.mutex_);
+        registry_.disarm(registry_.sessions_[id_]);
+        registry_.sessions_.erase(id_);
+      }
+      registry_.cv_.notify_all();
+    }
+
+    /**
+     * Marks the session as receiving a request, which must arrive
+     * completely within the read timeout
+     */
+    void receiving() {
+      std::lock_guard<std::mutex> lock(registry_.mutex_);
+      registry_.arm(id_, registry_.sessions_[id_], registry_.read_timeout_,
+                    "the rest of a request");
+    }
+
+    /**
+     * Marks a request as received in full, so the read timeout no longer
+     * applies.  The session is busy with it, or with an earlier request.
+     */
+    void received() {
+      std::lock_guard<std::mutex> lock(registry_.mutex_);
+      registry_.disarm(registry_.sessions_[id_]);
+    }
+
+    /**
+     * Marks the session as busy handling a request
+     */
+    void busy() {
+      std::lock_guard<std::mutex> lock(registry_.mutex_);
+      Entry& entry = registry_.sessions_[id_];
+      entry.busy = true;
+      registry_.disarm(entry);
+    }
+
+    /**
+     * Marks the session as idle, waiting for the next request
+     * @return false if the registry is draining and the session should close
+     */
+    bool idle() {
+      std::lock_guard<std::mutex> lock(registry_.mutex_);
+      Entry& entry = registry_.sessions_[id_];
+      entry.busy = false;
+      registry_.arm(id_, entry, registry_.idle_timeout_, "a request");
+      return !registry_.draining_;
+    }
+  };
+
+  /**
+   * Creates a registry without timeouts
+   */
+  SessionRegistry() : mutex_(), cv_(), sessions_(), draining_(false), timers_(nullptr),
+      idle_timeout_(), read_timeout_() {}
+
+  /**
+   * Creates a registry that closes stale sessions
+   * @param timers timer wheel used to track timeouts, must outlive the registry's sessions
+   * @param idle_timeout maximum time between requests, zero for no limit
+   * @param read_timeout maximum time to receive a request once it has started, zero for no limit
+   */
+  SessionRegistry(TimerWheel& timers, std::chrono::steady_clock::duration idle_timeout,
+                  std::chrono::steady_clock::duration read_timeout) :
+      mutex_(), cv_(), sessions_(), draining_(false), timers_(&timers),
+      idle_timeout_(idle_timeout), read_timeout_(read_timeout) {}
+
+  /**
+   * Starts draining: idle sessions are closed, busy sessions close once
+   * their current request completes, and new sessions are refused
+   */
+  void drain() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    draining_ = true;
+    for (auto& session : sessions_) {
+      if (!session.second.busy) {
+        session.second.api->close();
+      }
+    }
+  }
+
+  /**
+   * Closes every remaining session, busy or not
+   */
+  void closeAll() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& session : sessions_) {
+      session.second.api->close();
+    }
+  }
+
+  /**
+   * Waits until all sessions have ended
+   * @param deadline time to give up waiting
+   * @return true if all sessions ended, false if the deadline passed
+   */
+  bool waitUntil(std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return cv_.wait_until(lock, deadline, [&](){ return sessions_.empty(); });
+  }
+
+  /**
+   * Number of connected sessions
+   */
+  size_t active() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return sessions_.size();
+  }
+};
+
+#endif //LAB5_SESSION_REGISTRY_H
@@ -0,0 +1,207 @@
+/**
+ * @file
+ *
+ * This file contains the stable 64-bit ids of songs, so clients can refer to a
+ * song by a number rather than by its artist and title.
+ *
+ * The id of a song is a 64-bit FNV-1a hash of its artist and title.  It is the
+ * same on every run of the server, so it needs no storing, and looking a song up
+ * by id is a single hash probe.  Should two songs ever hash to the same id, which
+ * happens about once in 2^32 songs, the one registered first keeps it and the
+ * other takes its hash salted with 1, or 2 if that is taken too, and so on.  The
+ * salt is kept with the song's record.  An id once given is never moved to another
+ * song: a removed song keeps its record, as a tombstone, while any salted song
+ * may have walked past it, so it gets the same id back when added again.  Only
+ * the salted ids of colliding songs depend on the order songs were registered in,
+ * and may differ after a restart.
+ *
+ * The registry holds the one copy of each registered song.  Id 0 means no song.
+ *
+ */
+#ifndef LAB5_SONG_IDS_H
+#define LAB5_SONG_IDS_H
+
+#include "Song.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#define SONG_ID_NONE 0
+
+/**
+ * Registry of the ids of the songs in a library
+ */
+class SongIds {
+  // a song that has, or had, an id
+  struct Record {
+    std::unique_ptr<const Song> song;
+    uint32_t salt;          // number of ids taken by other songs before this one
+    bool present;           // false once removed, kept as a tombstone
+  };
+
+  std::unordered_map<uint64_t, Record> records_;   // id -> song
+  uint64_t mask_;
+  size_t size_;             // songs present
+  size_t salted_;           // records with a salt, which lookups may walk past others to
+
+  static void mix(uint64_t& h, const std::string& str) {
+    for (char c : str) {
+      h ^= (uint8_t)c;
+      h *= 1099511628211ull;
+    }
+  }
+
+  // id of a song for a salt, cut to the registry's width
+  uint64_t slot(const Song& song, uint32_t salt) const {
+    uint64_t id = hash(song, salt) & mask_;
+    return id == SONG_ID_NONE ? 1 : id;
+  }
+
+  // finds a song's record, or the id a new record for it would get
+  std::unordered_map<uint64_t, Record>::const_iterator find(const Song& song, uint64_t& id,
+                                                            uint32_t& salt) const {
+    for (salt = 0;; ++salt) {
+      id = slot(song, salt);
+      auto it = records_.find(id);
+      if (it == records_.end() || *it->second.song == song) {
+        return it;
+      }
+    }
+  }
+
+ public:
+  /**
+   * Creates an empty registry
+   * @param bits width of the ids, fewer than 64 only to exercise collisions in tests
+   */
+  explicit SongIds(unsigned bits = 64) :
+      records_(), mask_(bits >= 64 ? ~0ull : (1ull << bits) - 1), size_(0), salted_(0) {}
+
+  /**
+   * Works out the id of a song for a salt
+   * @param song song to hash
+   * @param salt 0 for the id the song normally has, or the number of ids taken
+   *        before it
+   * @return hash of the artist, title and salt, never 0
+   */
+  static uint64_t hash(const Song& song, uint32_t salt = 0) {
+    uint64_t h = 14695981039346656037ull;
+    mix(h, song.artist);
+    h ^= 0xFF;                     // never part of UTF-8, so "ab"+"c" differs from "a"+"bc"
+    h *= 1099511628211ull;
+    mix(h, song.title);
+    if (salt != 0) {
+      h ^= 0xFE;
+      h *= 1099511628211ull;
+      mix(h, std::string((const char*)&salt, sizeof(salt)));
+    }
+    return h == SONG_ID_NONE ? 1 : h;
+  }
+
+  /**
+   * Registers a song, giving it an id if it never had one
+   * @param song song to register
+   * @return id of the song
+   */
+  uint64_t add(const Song& song) {
+    uint64_t id;
+    uint32_t salt;
+    auto found = find(song, id, salt);
+    if (found == records_.end()) {
+      records_.emplace(id, Record{ std::unique_ptr<const Song>(new Song(song)), salt, true });
+      if (salt != 0) {
+        ++salted_;
+      }
+      ++size_;
+    }
+    else if (!found->second.present) {
+      records_.find(id)->second.present = true;
+      ++size_;
+    }
+    return id;
+  }
+
+  /**
+   * Drops a song, e.g. once it is removed from the library.  Its record stays
+   * behind as a tombstone, keeping its id, if any song has a salted id.
+   * @param song song to drop
+   * @return false if the song was not registered
+   */
+  bool remove(const Song& song) {
+    uint64_t id;
+    uint32_t salt;
+    auto found = find(song, id, salt);
+    if (found == records_.end() || !found->second.present) {
+      return false;
+    }
+    --size_;
+    if (salted_ == 0) {
+      records_.erase(found);
+    }
+    else {
+      records_.find(id)->second.present = false;
+    }
+    return true;
+  }
+
+  /**
+   * Id of a registered song
+   * @param song song to look up
+   * @return id, SONG_ID_NONE if the song is not registered
+   */
+  uint64_t id(const Song& song) const {
+    uint64_t id;
+    uint32_t salt;
+    auto found = find(song, id, salt);
+    return found != records_.end() && found->second.present ? id : SONG_ID_NONE;
+  }
+
+  /**
+   * Song with an id
+   * @param id id to look up
+   * @return song, valid until it is dropped, nullptr if unknown
+   */
+  const Song* song(uint64_t id) const {
+    auto it = records_.find(id);
+    return it == records_.end() || !it->second.present ? nullptr : it->second.song.get();
+  }
+
+  /**
+   * Salt of a registered song's id
+   * @param id id of the song
+   * @return number of ids taken by other songs before it, 0 if none or unknown
+   */
+  uint32_t salt(uint64_t id) const {
+    auto it = records_.find(id);
+    return it == records_.end() ? 0 : it->second.salt;
+  }
+
+  /**
+   * Drops every song and tombstone
+   */
+  void clear() {
+    records_.clear();
+    size_ = 0;
+    salted_ = 0;
+  }
+
+  /**
+   * Number of songs registered
+   */
+  size_t size() const {
+    return size_;
+  }
+};
+
+/**
+ * Hashes songs like their ids, for unordered containers of songs
+ */
+struct SongHash {
+  size_t operator()(const Song& song) const {
+    return (size_t)SongIds::hash(song);
+  }
+};
+
+#endif //LAB5_SONG_IDS_H
@@ -0,0 +1,223 @@
+/**
+ * @file
+ *
+ * This file contains the optional metadata of songs (album, year, duration and
+ * genre), kept apart from Song so songs without metadata cost nothing extra.
+ *
+ * Metadata is stored column-wise: every song with metadata gets a small integer id
+ * and each field is a column indexed by it.  Albums and genres are dictionary
+ * encoded, so each column entry is a 32-bit code.  The numeric columns also have
+ * an index of (value, id) pairs sorted by value, so a narrow range is answered by
+ * binary search, while a wide one is a sequential scan of the column.
+ *
+ */
+#ifndef LAB5_SONG_INFO_H
+#define LAB5_SONG_INFO_H
+
+#include "Song.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <limits>
+
+// a range covering more than 1/SONG_INFO_SCAN_FRACTION of the songs is scanned
+#define SONG_INFO_SCAN_FRACTION 8
+
+/**
+ * Optional metadata of a song, empty or zero when unknown
+ */
+struct SongInfo {
+  std::string album;
+  uint32_t year;
+  uint32_t duration;      // seconds
+  std::string genre;
+
+  SongInfo(const std::string& album = "", uint32_t year = 0, uint32_t duration = 0,
+           const std::string& genre = "") :
+      album(album), year(year), duration(duration), genre(genre) {}
+
+  /**
+   * Checks whether no field is known
+   */
+  bool empty() const {
+    return album.empty() && year == 0 && duration == 0 && genre.empty();
+  }
+};
+
+/**
+ * Inclusive ranges of numeric metadata, 0 meaning unbounded
+ */
+struct SongInfoFilter {
+  uint32_t year_min;
+  uint32_t year_max;
+  uint32_t duration_min;
+  uint32_t duration_max;
+
+  SongInfoFilter(uint32_t year_min = 0, uint32_t year_max = 0,
+                 uint32_t duration_min = 0, uint32_t duration_max = 0) :
+      year_min(year_min), year_max(year_max),
+      duration_min(duration_min), duration_max(duration_max) {}
+
+  /**
+   * Checks whether the filter lets every song through
+   */
+  bool empty() const {
+    return year_min == 0 && year_max == 0 && duration_min == 0 && duration_max == 0;
+  }
+};
+
+/**
+ * Column store of song metadata
+ */
+class SongInfoColumns {
+  /**
+   * Numeric column with a sorted index of its known values
+   */
+  struct Column {
+    std::vector<uint32_t> values;                         // id -> value, 0 if unknown
+    std::vector<std::pair<uint32_t, uint32_t>> sorted;    // (value, id) of known values
+
+    void set(uint32_t id, uint32_t value) {
+      if (values[id] != 0) {
+        auto it = std::lower_bound(sorted.begin(), sorted.end(), std::make_pair(values[id], id));
+        sorted.erase(it);
+      }
+      values[id] = value;
+      if (value != 0) {
+        auto pair = std::make_pair(value, id);
+        sorted.insert(std::lower_bound(sorted.begin(), sorted.end(), pair), pair);
+      }
+    }
+
+    // ids with a value in [lo, hi], as flags
+    void select(uint32_t lo, uint32_t hi, std::vector<uint8_t>& match) const {
+      auto begin = std::lower_bound(sorted.begin(), sorted.end(), std::make_pair(lo, (uint32_t)0));
+      auto end = std::upper_bound(begin, sorted.end(),
+                                  std::make_pair(hi, std::numeric_limits<uint32_t>::max()));
+      if ((size_t)(end - begin) * SONG_INFO_SCAN_FRACTION > values.size()) {
+        // most songs match, a branch-free pass over the column beats chasing the index
+        const uint32_t* v = values.data();
+        uint8_t* m = match.data();
+        for (size_t i = 0; i < values.size(); ++i) {
+          m[i] &= (uint8_t)((v[i] >= lo) & (v[i] <= hi));
+        }
+        return;
+      }
+      std::vector<uint8_t> found(match.size(), 0);
+      for (auto it = begin; it != end; ++it) {
+        found[it->second] = 1;
+      }
+      for (size_t i = 0; i < match.size(); ++i) {
+        match[i] &= found[i];
+      }
+    }
+  };
+
+  std::map<Song, uint32_t> ids_;
+  std::vector<Song> songs_;                   // id -> song
+  std::vector<uint32_t> albums_;              // id -> code
+  std::vector<uint32_t> genres_;              // id -> code
+  Column years_;
+  Column durations_;
+  std::vector<std::string> strings_;          // code -> album or genre, 0 is ""
+  std::map<std::string, uint32_t> codes_;
+
+  uint32_t code(const std::string& str) {
+    if (str.empty()) {
+      return 0;
+    }
+    auto it = codes_.find(str);
+    if (it != codes_.end()) {
+      return it->second;
+    }
+    uint32_t code = (uint32_t)strings_.size();
+    strings_.push_back(str);
+    codes_.insert(std::make_pair(str, code));
+    return code;
+  }
+
+ public:
+  SongInfoColumns() : ids_(), songs_(), albums_(), genres_(), years_(), durations_(),
+      strings_(1), codes_() {}
+
+  /**
+   * Sets the metadata of a song, replacing any it had
+   * @param song song to describe
+   * @param info metadata, empty to clear it
+   */
+  void set(const Song& song, const SongInfo& info) {
+    auto it = ids_.find(song);
+    if (it == ids_.end()) {
+      if (info.empty()) {
+        return;
+      }
+      it = ids_.insert(std::make_pair(song, (uint32_t)songs_.size())).first;
+      songs_.push_back(song);
+      albums_.push_back(0);
+      genres_.push_back(0);
+      years_.values.push_back(0);
+      durations_.values.push_back(0);
+    }
+    uint32_t id = it->second;
+    albums_[id] = code(info.album);
+    genres_[id] = code(info.genre);
+    years_.set(id, info.year);
+    durations_.set(id, info.duration);
+  }
+
+  /**
+   * Gets the metadata of a song
+   * @param song song to look up
+   * @return metadata, empty if none
+   */
+  SongInfo get(const Song& song) const {
+    auto it = ids_.find(song);
+    if (it == ids_.end()) {
+      return SongInfo();
+    }
+    uint32_t id = it->second;
+    return SongInfo(strings_[albums_[id]], years_.values[id], durations_.values[id],
+                    strings_[genres_[id]]);
+  }
+
+  /**
+   * Finds the songs whose metadata is in range.  Songs missing a filtered field
+   * never match.
+   * @param filter ranges to match
+   * @param songs matching songs, sorted, valid until the next change
+   */
+  void select(const SongInfoFilter& filter, std::vector<const Song*>& songs) const {
+    songs.clear();
+    std::vector<uint8_t> match(songs_.size(), 1);
+    if (filter.year_min != 0 || filter.year_max != 0) {
+      years_.select(std::max(filter.year_min, 1u),
+                    filter.year_max == 0 ? std::numeric_limits<uint32_t>::max() : filter.year_max,
+                    match);
+    }
+    if (filter.duration_min != 0 || filter.duration_max != 0) {
+      durations_.select(std::max(filter.duration_min, 1u),
+                        filter.duration_max == 0 ? std::numeric_limits<uint32_t>::max()
+                                                 : filter.duration_max,
+                        match);
+    }
+    for (size_t i = 0; i < match.size(); ++i) {
+      if (match[i]) {
+        songs.push_back(&songs_[i]);
+      }
+    }
+    std::sort(songs.begin(), songs.end(),
+              [](const Song* a, const Song* b) { return *a < *b; });
+  }
+
+  /**
+   * Number of songs with metadata
+   */
+  size_t size() const {
+    return songs_.size();
+  }
+};
+
+#endif //LAB5_SONG_INFO_H
@@ -0,0 +1,241 @@
+/**
+ * @file
+ *
+ * This file contains a hierarchical timer wheel, used by the server to expire idle
+ * and slow client connections.
+ *
+ * Time is divided into ticks of fixed resolution.  Timers are kept in LEVELS wheels
+ * of SLOTS slots each: level 0 holds timers due within SLOTS ticks, level 1 within
+ * SLOTS^2 ticks, and so on.  Whenever the lower wheel wraps around, the next slot of
+ * the wheel above is cascaded down.  Scheduling, rescheduling and cancelling a timer
+ * are all O(1), independent of the number of timers.
+ *
+ */
+#ifndef LAB5_TIMER_WHEEL_H
+#define LAB5_TIMER_WHEEL_H
+
+#include <cstdint>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+/**
+ * Hierarchical timer wheel
+ */
+class TimerWheel {
+ public:
+  using Callback = std::function<void()>;
+  using TimerId = uint64_t;
+
+  static const int SLOT_BITS = 6;
+  static const int SLOTS = 1 << SLOT_BITS;
+  static const int LEVELS = 4;
+
+ private:
+  // a scheduled timer
+  struct Timer {
+    TimerId id;
+    uint64_t expires;   // tick at which the timer fires
+    Callback callback;
+  };
+
+  // where a timer currently lives
+  struct Location {
+    int level;
+    int slot;
+    std::list<Timer>::iterator it;
+  };
+
+  std::chrono::steady_clock::duration resolution_;
+  std::chrono::steady_clock::time_point start_;
+  uint64_t now_;                       // current tick
+  TimerId next_id_;
+  std::list<Timer> wheels_[LEVELS][SLOTS];
+  std::unordered_map<TimerId, Location> index_;
+
+  std::mutex mutex_;                   // guards all of the above
+  std::condition_variable cv_;
+  bool running_;
+  std::thread thread_;
+
+  // number of ticks until the given delay has passed, at least one
+  uint64_t ticks(std::chrono::steady_clock::duration delay) const {
+    uint64_t t = (uint64_t)((delay + resolution_ - std::chrono::steady_clock::duration(1))/resolution_);
+    const uint64_t max = ((uint64_t)1 << (SLOT_BITS*LEVELS)) - 1;
+    return t < 1 ? 1 : (t > max ? max : t);
+  }
+
+  // moves the timer at it from the given list into the slot matching its expiry
+  void place(std::list<Timer>& from, std::list<Timer>::iterator it) {
+    uint64_t delta = it->expires > now_ ? it->expires - now_ : 0;
+    int level = 0;
+    while (level < LEVELS-1 && delta >= ((uint64_t)1 << (SLOT_BITS*(level+1)))) {
+      ++level;
+    }
+    int slot = (int)((it->expires >> (SLOT_BITS*level)) & (SLOTS-1));
+
+    std::list<Timer>& to = wheels_[level][slot];
+    to.splice(to.end(), from, it);
+    index_[it->id] = Location{level, slot, it};
+  }
+
+  // advances by one tick, collecting the callbacks of timers that are now due
+  void tick(std::vector<Callback>& due) {
+    ++now_;
+
+    // cascade higher wheels whose lower wheel just wrapped around
+    for (int level = 1; level < LEVELS; ++level) {
+      if ((now_ & (((uint64_t)1 << (SLOT_BITS*level)) - 1)) != 0) {
+        break;
+      }
+      int slot = (int)((now_ >> (SLOT_BITS*level)) & (SLOTS-1));
+      std::list<Timer> cascade;
+      cascade.swap(wheels_[level][slot]);
+      while (!cascade.empty()) {
+        place(cascade, cascade.begin());
+      }
+    }
+
+    std::list<Timer>& slot = wheels_[0][now_ & (SLOTS-1)];
+    for (auto& timer : slot) {
+      due.push_back(std::move(timer.callback));
+      index_.erase(timer.id);
+    }
+    slot.clear();
+  }
+
+  // main loop of the background thread
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (running_) {
+      cv_.wait_for(lock, resolution_);
+      lock.unlock();
+      advance(std::chrono::steady_clock::now());
+      lock.lock();
+    }
+  }
+
+ public:
+  /**
+   * Creates a timer wheel
+   * @param resolution duration of a single tick
+   */
+  TimerWheel(std::chrono::steady_clock::duration resolution) :
+      resolution_(resolution), start_(std::chrono::steady_clock::now()), now_(0),
+      next_id_(1), wheels_(), index_(), mutex_(), cv_(), running_(false), thread_() {}
+
+  ~TimerWheel() {
+    stop();
+  }
+
+  /**
+   * Schedules a callback
+   * @param delay time until the callback should run
+   * @param callback function to call, from the thread calling advance()
+   * @return id of the timer
+   */
+  TimerId schedule(std::chrono::steady_clock::duration delay, const Callback& callback) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    TimerId id = next_id_++;
+    std::list<Timer> tmp;
+    tmp.push_back(Timer{id, now_ + ticks(delay), callback});
+    place(tmp, tmp.begin());
+    return id;
+  }
+
+  /**
+   * Moves a pending timer to fire after a new delay
+   * @param id timer to move
+   * @param delay new time until the callback should run
+   * @return true if moved, false if the timer already fired or was cancelled
+   */
+  bool reschedule(TimerId id, std::chrono::steady_clock::duration delay) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto loc = index_.find(id);
+    if (loc == index_.end()) {
+      return false;
+    }
+    Location l = loc->second;
+    l.it->expires = now_ + ticks(delay);
+    place(wheels_[l.level][l.slot], l.it);
+    return true;
+  }
+
+  /**
+   * Cancels a pending timer
+   * @param id timer to cancel
+   * @return true if cancelled, false if the timer already fired or was cancelled
+   */
+  bool cancel(TimerId id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto loc = index_.find(id);
+    if (loc == index_.end()) {
+      return false;
+    }
+    wheels_[loc->second.level][loc->second.slot].erase(loc->second.it);
+    index_.erase(loc);
+    return true;
+  }
+
+  /**
+   * Advances the wheel up to the given time, running all timers that are due
+   * @param now current time
+   * @return number of timers that fired
+   */
+  size_t advance(std::chrono::steady_clock::time_point now) {
+    std::vector<Callback> due;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      uint64_t target = (uint64_t)((now - start_)/resolution_);
+      while (now_ < target) {
+        tick(due);
+      }
+    }
+
+    // run callbacks without holding the lock, so they may use the wheel
+    for (auto& callback : due) {
+      callback();
+    }
+    return due.size();
+  }
+
+  /**
+   * Number of pending timers
+   */
+  size_t size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return index_.size();
+  }
+
+  /**
+   * Starts a background thread advancing the wheel once per tick
+   */
+  void start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!running_) {
+      running_ = true;
+      thread_ = std::thread(&TimerWheel::run, this);
+    }
+  }
+
+  /**
+   * Stops the background thread.  Pending timers are kept.
+   */
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_ = false;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+};
+
+#endif //LAB5_TIMER_WHEEL_H
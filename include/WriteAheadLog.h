@@ -0,0 +1,607 @@
+/**
+ * @file
+ *
+ * This file contains an append-only write-ahead log of library mutations, used to
+ * make changes made by clients survive a server restart.
+ *
+ * File format:
+ *   magic (4 bytes, "MWAL"), version (4 bytes), start (8 bytes)
+ *   records, each:
+ *     payload size (4 bytes), CRC-32 of payload (4 bytes), payload
+ *   payload:
+ *     type (1 byte), artist size (4 bytes), artist, title size (4 bytes), title,
+ *     then for an added song with metadata:
+ *       album size (4 bytes), album, year (4 bytes), duration (4 bytes),
+ *       genre size (4 bytes), genre
+ *
+ * All integers are little endian.
+ *
+ * A record's log position is the number of record bytes logged before it since the
+ * log was created, and start is the position of the first record in the file.  A
+ * checkpoint drops the records before a position, once the changes they made are
+ * kept elsewhere, by rewriting the log to start there.  Snapshots and LsmStore runs
+ * record the position they cover, so the records before it are skipped on replay,
+ * and can be dropped.
+ *
+ * Logs of versions 1 and 2 have no start and begin at position 0, and those of
+ * version 1 have no metadata.  They are rewritten in this version once appended to.  A record that is incomplete or fails its checksum
+ * (e.g. from a crash in the middle of a write) ends the log; it and anything after
+ * it are discarded when the log is replayed.
+ *
+ */
+#ifndef LAB5_WRITE_AHEAD_LOG_H
+#define LAB5_WRITE_AHEAD_LOG_H
+
+#include "Song.h"
+#include "MusicLibrary.h"
+#include "MutationQueue.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#define WRITE_AHEAD_LOG_MAGIC 0x4C41574D    // "MWAL"
+#define WRITE_AHEAD_LOG_VERSION 3
+#define WRITE_AHEAD_LOG_HEADER 16           // size of the header of this version
+#define WRITE_AHEAD_LOG_MAX_RECORD (1 << 24)
+
+/**
+ * When appended records are forced to stable storage
+ */
+enum WalSyncPolicy {
+  WAL_SYNC_EVERY,     // after every record
+  WAL_SYNC_BATCH,     // after every appended batch
+  WAL_SYNC_INTERVAL   // periodically, from a background thread
+};
+
+/**
+ * Append-only, checksummed log of library mutations
+ */
+class WriteAheadLog {
+  std::string path_;
+  WalSyncPolicy policy_;
+  std::chrono::milliseconds interval_;
+
+  std::mutex mutex_;              // guards everything below
+  std::condition_variable cv_;
+  std::FILE* file_;
+  uint64_t start_;                // log position of the first record in the file
+  bool dirty_;                    // written but not yet synced
+  std::thread syncer_;
+
+  /**
+   * Computes the CRC-32 (IEEE) of a block of data
+   */
+  static uint32_t crc32(const char* data, size_t size) {
+    static uint32_t table[256] = {0};
+    static std::once_flag init;
+    std::call_once(init, []() {
+      for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) {
+          c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+        }
+        table[i] = c;
+      }
+    });
+
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i) {
+      crc = table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+  }
+
+  static void putUint32(std::string& out, uint32_t v) {
+    for (int i = 0; i < 4; ++i) {
+      out.push_back((char)((v >> (8*i)) & 0xFF));
+    }
+  }
+
+  static uint32_t getUint32(const char* in) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) {
+      v |= ((uint32_t)(uint8_t)in[i]) << (8*i);
+    }
+    return v;
+  }
+
+  static void putUint64(std::string& out, uint64_t v) {
+    putUint32(out, (uint32_t)v);
+    putUint32(out, (uint32_t)(v >> 32));
+  }
+
+  static uint64_t getUint64(const char* in) {
+    return getUint32(in) | ((uint64_t)getUint32(in + 4) << 32);
+  }
+
+  static std::string header(uint64_t start) {
+    std::string out;
+    putUint32(out, WRITE_AHEAD_LOG_MAGIC);
+    putUint32(out, WRITE_AHEAD_LOG_VERSION);
+    putUint64(out, start);
+    return out;
+  }
+
+  /**
+   * Encodes a mutation as a complete log record
+   */
+  static void encode(std::string& out, const Mutation& mutation) {
+    std::string payload;
+    payload.push_back((char)mutation.type);
+    putUint32(payload, (uint32_t)mutation.song.artist.size());
+    payload.append(mutation.song.artist);
+    putUint32(payload, (uint32_t)mutation.song.title.size());
+    payload.append(mutation.song.title);
+    if (mutation.type == MUTATION_ADD && !mutation.info.empty()) {
+      putUint32(payload, (uint32_t)mutation.info.album.size());
+      payload.append(mutation.info.album);
+      putUint32(payload, mutation.info.year);
+      putUint32(payload, mutation.info.duration);
+      putUint32(payload, (uint32_t)mutation.info.genre.size());
+      payload.append(mutation.info.genre);
+    }
+
+    putUint32(out, (uint32_t)payload.size());
+    putUint32(out, crc32(payload.data(), payload.size()));
+    out.append(payload);
+  }
+
+  // reads a size-prefixed string from a payload, advancing pos past it
+  static bool getString(const std::string& payload, size_t& pos, std::string& str) {
+    if (payload.size() - pos < 4) {
+      return false;
+    }
+    uint32_t size = getUint32(&payload[pos]);
+    pos += 4;
+    if (size > payload.size() - pos) {
+      return false;
+    }
+    str.assign(payload, pos, size);
+    pos += size;
+    return true;
+  }
+
+  /**
+   * Decodes a record payload
+   * @return true if well-formed
+   */
+  static bool decode(const std::string& payload, MutationType& type,
+                     std::string& artist, std::string& title, SongInfo& info) {
+    size_t pos = 0;
+    if (payload.empty()) {
+      return false;
+    }
+    type = (MutationType)payload[pos++];
+    if (type != MUTATION_ADD && type != MUTATION_REMOVE) {
+      return false;
+    }
+    if (!getString(payload, pos, artist) || !getString(payload, pos, title)) {
+      return false;
+    }
+    info = SongInfo();
+    if (pos == payload.size()) {
+      return true;
+    }
+    if (type != MUTATION_ADD || !getString(payload, pos, info.album)
+        || payload.size() - pos < 8) {
+      return false;
+    }
+    info.year = getUint32(&payload[pos]);
+    info.duration = getUint32(&payload[pos + 4]);
+    pos += 8;
+    return getString(payload, pos, info.genre) && pos == payload.size();
+  }
+
+  // forces data written to a file to disk
+  static bool syncFile(std::FILE* file) {
+    if (std::fflush(file) != 0) {
+      return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+  }
+
+  // forces written data to disk, must hold mutex_
+  bool sync() {
+    if (file_ == nullptr) {
+      return false;
+    }
+    bool success = syncFile(file_);
+    dirty_ = false;
+    return success;
+  }
+
+  // reads the file header, of this version or an older one
+  static bool readHeader(std::FILE* file, uint32_t& version, uint64_t& start) {
+    char header[WRITE_AHEAD_LOG_HEADER];
+    if (std::fread(header, 1, 8, file) != 8 || getUint32(header) != WRITE_AHEAD_LOG_MAGIC) {
+      return false;
+    }
+    version = getUint32(header + 4);
+    start = 0;
+    if (version == 1 || version == 2) {
+      return true;
+    }
+    if (version != WRITE_AHEAD_LOG_VERSION || std::fread(header + 8, 1, 8, file) != 8) {
+      return false;
+    }
+    start = getUint64(header + 8);
+    return true;
+  }
+
+  // size of the header of a log of a version
+  static long headerSize(uint32_t version) {
+    return version < 3 ? 8 : WRITE_AHEAD_LOG_HEADER;
+  }
+
+  /**
+   * Replaces the log file with one of this version that starts at a position and
+   * holds the records from an offset in the current file on.  Should a crash keep
+   * the new file from replacing the current one, the current one is still a good
+   * log, with the same positions.  Must hold mutex_, with the log closed.
+   * @param offset offset of the first record to keep
+   * @param start log position of that record
+   * @return true if replaced
+   */
+  bool rewrite(long offset, uint64_t start) {
+    std::string tmp = path_ + ".tmp";
+    std::FILE* in = std::fopen(path_.c_str(), "rb");
+    std::FILE* out = std::fopen(tmp.c_str(), "wb");
+    std::string head = header(start);
+    bool success = in != nullptr && out != nullptr && std::fseek(in, offset, SEEK_SET) == 0
+        && std::fwrite(head.data(), 1, head.size(), out) == head.size();
+    std::vector<char> buffer(1 << 16);
+    size_t n;
+    while (success && (n = std::fread(buffer.data(), 1, buffer.size(), in)) > 0) {
+      success = std::fwrite(buffer.data(), 1, n, out) == n;
+    }
+    success = success && !std::ferror(in) && syncFile(out);
+    if (in != nullptr) {
+      std::fclose(in);
+    }
+    if (out != nullptr) {
+      success &= std::fclose(out) == 0;
+    }
+#ifdef _WIN32
+    // rename does not replace existing files on Windows
+    if (success) {
+      std::remove(path_.c_str());
+    }
+#endif
+    success = success && std::rename(tmp.c_str(), path_.c_str()) == 0;
+    if (!success) {
+      std::remove(tmp.c_str());
+    }
+    return success;
+  }
+
+  // cuts the file to the given size
+  static bool truncate(std::FILE* file, long size) {
+#ifdef _WIN32
+    return _chsize_s(_fileno(file), size) == 0;
+#else
+    return ftruncate(fileno(file), size) == 0;
+#endif
+  }
+
+  /**
+   * Cuts a failed append back off the log, so the next append follows the last
+   * complete batch rather than a torn record.  The file is reopened to drop
+   * anything still buffered.  If the log can't be cut, it is closed and later
+   * appends fail.  Must hold mutex_.
+   * @param size size of the log before the failed append
+   */
+  void rollback(long size) {
+    std::fclose(file_);
+    file_ = nullptr;
+    dirty_ = false;
+    std::FILE* file = std::fopen(path_.c_str(), "r+b");
+    bool success = file != nullptr && truncate(file, size) && syncFile(file);
+    if (file != nullptr) {
+      std::fclose(file);
+    }
+    if (success) {
+      file_ = std::fopen(path_.c_str(), "ab");
+    }
+    if (file_ != nullptr) {
+      std::fseek(file_, 0, SEEK_END);
+    }
+    if (file_ == nullptr) {
+      std::cerr << "Failed to recover log after a failed write, closing: " << path_ << std::endl;
+    }
+  }
+
+  // main loop of the interval sync thread
+  void runSyncer() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (file_ != nullptr) {
+      cv_.wait_for(lock, interval_);
+      if (dirty_) {
+        sync();
+      }
+    }
+  }
+
+ public:
+  /**
+   * Creates a log
+   * @param path file to write to
+   * @param policy when to force records to disk
+   * @param interval time between syncs for WAL_SYNC_INTERVAL
+   */
+  WriteAheadLog(const std::string& path, WalSyncPolicy policy = WAL_SYNC_BATCH,
+                std::chrono::milliseconds interval = std::chrono::seconds(1)) :
+      path_(path), policy_(policy), interval_(interval), mutex_(), cv_(),
+      file_(nullptr), start_(0), dirty_(false), syncer_() {}
+
+  ~WriteAheadLog() {
+    close();
+  }
+
+  /**
+   * Replays the log into a library, applying each mutation in order.  A torn
+   * or corrupt tail is cut off so new records follow the last good one.
+   *
+   * @param lib library to apply mutations to
+   * @param from log position the library already covers, e.g. as loaded from a
+   *        snapshot, skipping the records before it
+   * @return number of records replayed
+   */
+  size_t replay(MusicLibrary& lib, uint64_t from = 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::FILE* file = std::fopen(path_.c_str(), "r+b");
+    if (file == nullptr) {
+      return 0;   // no log yet
+    }
+
+    uint32_t version;
+    uint64_t position;
+    if (!readHeader(file, version, position)) {
+      // leave files we don't recognize untouched, open() will refuse them
+      std::fclose(file);
+      return 0;
+    }
+    if (position > from) {
+      std::cerr << "Log starts at position " << position << ", after the library's "
+                << from << ": changes in between were checkpointed elsewhere and are "
+                << "missing: " << path_ << std::endl;
+    }
+
+    size_t count = 0;
+    long good = headerSize(version);
+    char prefix[8];
+    std::string payload;
+    std::string artist, title;
+    SongInfo info;
+    MutationType type;
+    while (std::fread(prefix, 1, 8, file) == 8) {
+      uint32_t size = getUint32(prefix);
+      uint32_t crc = getUint32(prefix + 4);
+      if (size > WRITE_AHEAD_LOG_MAX_RECORD) {
+        break;
+      }
+      payload.resize(size);
+      if (size > 0 && std::fread(&payload[0], 1, size, file) != size) {
+        break;
+      }
+      if (crc32(payload.data(), payload.size()) != crc
+          || !decode(payload, type, artist, title, info)) {
+        break;
+      }
+
+      position += 8 + size;
+      if (position > from) {
+        Mutation(type, Song(artist, title), info).apply(lib);
+        ++count;
+      }
+      good = std::ftell(file);
+    }
+
+    // discard anything after the last complete record
+    std::fseek(file, 0, SEEK_END);
+    if (std::ftell(file) != good) {
+      std::cerr << "Discarding " << (std::ftell(file) - good)
+                << " bytes of incomplete log: " << path_ << std::endl;
+      truncate(file, good);
+    }
+    std::fclose(file);
+
+    return count;
+  }
+
+  /**
+   * Opens the log for appending, creating it if needed
+   * @param start log position a new log starts at, that the library already covers,
+   *        so positions keep growing should the log have been deleted
+   * @return true if successful, false if the file can't be written or is not a log
+   */
+  bool open(uint64_t start = 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_ != nullptr) {
+      return true;
+    }
+
+    // refuse to append to something that isn't a log, and rewrite an older log in
+    // this version, its records are still read the same
+    start_ = start;
+    std::FILE* existing = std::fopen(path_.c_str(), "rb");
+    if (existing != nullptr) {
+      std::fseek(existing, 0, SEEK_END);
+      long size = std::ftell(existing);
+      std::fseek(existing, 0, SEEK_SET);
+      uint32_t version = WRITE_AHEAD_LOG_VERSION;
+      bool valid = size == 0 || readHeader(existing, version, start_);
+      std::fclose(existing);
+      if (!valid) {
+        std::cerr << "Not a write-ahead log: " << path_ << std::endl;
+        return false;
+      }
+      // a log ending before the library's changes is covered entirely, and new
+      // records must follow on from the library
+      long offset = headerSize(version);
+      bool covered = size != 0 && start_ + (uint64_t)(size - offset) < start;
+      if (covered) {
+        offset = size;
+        start_ = start;
+      }
+      if (size != 0 && (version != WRITE_AHEAD_LOG_VERSION || covered)
+          && !rewrite(offset, start_)) {
+        std::cerr << "Failed to rewrite write-ahead log: " << path_ << std::endl;
+        return false;
+      }
+    }
+
+    file_ = std::fopen(path_.c_str(), "ab");
+    if (file_ == nullptr) {
+      return false;
+    }
+    std::fseek(file_, 0, SEEK_END);
+    if (std::ftell(file_) == 0) {
+      std::string head = header(start_);
+      std::fwrite(head.data(), 1, head.size(), file_);
+      sync();
+    }
+
+    if (policy_ == WAL_SYNC_INTERVAL) {
+      syncer_ = std::thread(&WriteAheadLog::runSyncer, this);
+    }
+    return true;
+  }
+
+  /**
+   * Appends a batch of mutations with a single write.  A batch is logged
+   * entirely or not at all: if any part of it fails, whatever was written of
+   * it, even records already synced, is cut off again.
+   * @param batch mutations to log
+   * @return true if written (and synced, depending on the policy)
+   */
+  bool append(const std::vector<Mutation>& batch) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_ == nullptr) {
+      return false;
+    }
+    long start = std::ftell(file_);
+    if (start < 0) {
+      return false;
+    }
+
+    bool success = true;
+    if (policy_ == WAL_SYNC_EVERY) {
+      std::string record;
+      for (const auto& mutation : batch) {
+        record.clear();
+        encode(record, mutation);
+        if (std::fwrite(record.data(), 1, record.size(), file_) != record.size()
+            || !sync()) {
+          success = false;
+          break;
+        }
+      }
+    } else {
+      std::string records;
+      for (const auto& mutation : batch) {
+        encode(records, mutation);
+      }
+      success = std::fwrite(records.data(), 1, records.size(), file_) == records.size();
+      dirty_ = true;
+      if (success && policy_ == WAL_SYNC_BATCH) {
+        success = sync();
+      } else if (success) {
+        // interval policy: at least hand the data to the OS right away
+        success = std::fflush(file_) == 0;
+      }
+    }
+
+    if (!success) {
+      rollback(start);
+    }
+    return success;
+  }
+
+  /**
+   * Log position just past the last record appended
+   * @return position, 0 if the log is not open
+   */
+  uint64_t position() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_ == nullptr) {
+      return 0;
+    }
+    return start_ + (uint64_t)(std::ftell(file_) - WRITE_AHEAD_LOG_HEADER);
+  }
+
+  /**
+   * Drops the records before a position, once the changes they made are kept
+   * elsewhere, e.g. in a snapshot or LsmStore runs that record the position.  The
+   * log is rewritten to start there, holding only the records after it.
+   * @param position log position covered, from position()
+   * @return true if the log now starts at the position or later
+   */
+  bool checkpoint(uint64_t position) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (file_ == nullptr) {
+      return false;
+    }
+    if (position <= start_) {
+      return true;
+    }
+    long size = std::ftell(file_);
+    if (size < WRITE_AHEAD_LOG_HEADER
+        || position > start_ + (uint64_t)(size - WRITE_AHEAD_LOG_HEADER) || !sync()) {
+      return false;
+    }
+
+    std::fclose(file_);
+    file_ = nullptr;
+    bool success = rewrite(WRITE_AHEAD_LOG_HEADER + (long)(position - start_), position);
+    if (success) {
+      start_ = position;
+    }
+    file_ = std::fopen(path_.c_str(), "ab");
+    if (file_ == nullptr) {
+      std::cerr << "Failed to reopen log after a checkpoint, closing: " << path_ << std::endl;
+      return false;
+    }
+    std::fseek(file_, 0, SEEK_END);
+    return success;
+  }
+
+  /**
+   * Syncs and closes the log
+   */
+  void close() {
+    std::thread syncer;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (file_ != nullptr) {
+        sync();
+        std::fclose(file_);
+        file_ = nullptr;
+      }
+      syncer.swap(syncer_);   // may have stopped already if a failed write closed the log
+    }
+    cv_.notify_all();
+    if (syncer.joinable()) {
+      syncer.join();
+    }
+  }
+};
+
+#endif //LAB5_WRITE_AHEAD_LOG_H
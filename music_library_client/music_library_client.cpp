@@ -4,6 +4,12 @@
 * The Music Library Client connects to a remote server and provides an interface
 * for adding, removing, and searching for songs in the server database
 *
+* Usage:
+*   music_library_client [port]
+*
+* The port defaults to MUSIC_LIBRARY_SERVER_PORT.  Read-only worker processes
+* of the server listen on the following ports.
+*
 */
 
 #include "MusicLibrary.h"
@@ -11,13 +17,22 @@
 
 #include <cpen333/process/socket.h>
 
+#include <algorithm>
 #include <iostream>
 #include <limits>
+#include <sstream>
+#include <string>
 
 static const char CLIENT_ADD = '1';
 static const char CLIENT_REMOVE = '2';
 static const char CLIENT_SEARCH = '3';
-static const char CLIENT_QUIT = '4';
+static const char CLIENT_LYRICS_SEARCH = '4';
+static const char CLIENT_GET_LYRICS = '5';
+static const char CLIENT_TOP_N = '6';
+static const char CLIENT_CHART_HISTORY = '7';
+static const char CLIENT_LOOKUP = '8';
+static const char CLIENT_AUTOCOMPLETE = '9';
+static const char CLIENT_QUIT = '0';
 
 // print menu options
 void print_menu() {
@@ -28,28 +43,71 @@ void print_menu() {
 	std::cout << " (1) Add Song" << std::endl;
 	std::cout << " (2) Remove Song" << std::endl;
 	std::cout << " (3) Search" << std::endl;
-	std::cout << " (4) Quit" << std::endl;
+	std::cout << " (4) Search Lyrics" << std::endl;
+	std::cout << " (5) Get Lyrics" << std::endl;
+	std::cout << " (6) Top Songs" << std::endl;
+	std::cout << " (7) Chart History" << std::endl;
+	std::cout << " (8) Look Up Songs" << std::endl;
+	std::cout << " (9) Autocomplete" << std::endl;
+	std::cout << " (0) Quit" << std::endl;
 	std::cout << "=========================================" << std::endl;
 	std::cout << "Enter number: ";
 	std::cout.flush();
 
 }
 
+// reads a number, 0 if blank or invalid
+uint32_t read_number() {
+	std::string line;
+	std::getline(std::cin, line);
+	try {
+		return (uint32_t)std::stoul(line);
+	}
+	catch (std::exception &) {
+		return 0;
+	}
+}
+
+// prints the known metadata of a song
+void print_info(const SongInfo &info) {
+	if (!info.album.empty()) {
+		std::cout << " [" << info.album << "]";
+	}
+	if (info.year != 0) {
+		std::cout << " (" << info.year << ")";
+	}
+	if (info.duration != 0) {
+		std::cout << " " << info.duration / 60 << ":" << (info.duration % 60 < 10 ? "0" : "")
+			<< info.duration % 60;
+	}
+	if (!info.genre.empty()) {
+		std::cout << " " << info.genre;
+	}
+}
+
 // add a song to remote server
 void do_add(MusicLibraryApi &api) {
 
-	std::string artist, title;
+	std::string artist, title, album, genre;
 
-	// collect artist and title
+	// collect artist and title, and optional metadata
 	std::cout << std::endl << "Add Song" << std::endl;
 	std::cout << "   Artist: ";
 	std::getline(std::cin, artist);
 	std::cout << "   Title:  ";
 	std::getline(std::cin, title);
+	std::cout << "   Album (optional):              ";
+	std::getline(std::cin, album);
+	std::cout << "   Year (optional):               ";
+	uint32_t year = read_number();
+	std::cout << "   Duration in seconds (optional): ";
+	uint32_t duration = read_number();
+	std::cout << "   Genre (optional):              ";
+	std::getline(std::cin, genre);
 
 	// send message to server and wait for response
 	Song song(artist, title);
-	AddMessage msg(song);
+	AddMessage msg(song, SongInfo(album, year, duration, genre));
 	if (api.sendMessage(msg)) {
 		// get response
 		std::unique_ptr<Message> msgr = api.recvMessage();
@@ -75,21 +133,35 @@ void do_remove(MusicLibraryApi &api) {
 
 	std::string artist, title;
 
-	// collect artist and title
+	// collect artist and title, or the id of the song
 	std::cout << std::endl << "Remove Song" << std::endl;
-	std::cout << "   Artist: ";
+	std::cout << "   Artist (or #id): ";
 	std::getline(std::cin, artist);
-	std::cout << "   Title:  ";
-	std::getline(std::cin, title);
+	uint64_t song_id = SONG_ID_NONE;
+	if (!artist.empty() && artist[0] == '#') {
+		try {
+			song_id = std::stoull(artist.substr(1));
+		}
+		catch (std::exception &) {
+			std::cout << "   Invalid id " << artist << std::endl;
+			return;
+		}
+	}
+	else {
+		std::cout << "   Title:  ";
+		std::getline(std::cin, title);
+	}
 
 	// send message to server and wait for response
-	Song song(artist, title);
-	RemoveMessage msg(song);
+	RemoveMessage msg = song_id != SONG_ID_NONE ? RemoveMessage(song_id) : RemoveMessage(Song(artist, title));
 	if (api.sendMessage(msg)) {
 		// get response
 		std::unique_ptr<Message> msgr = api.recvMessage();
 		RemoveResponseMessage& resp = (RemoveResponseMessage&)(*msgr);
 
+		// by id, the response names the song that was removed
+		std::string song = song_id != SONG_ID_NONE && resp.remove.song.artist.empty()
+			? artist : resp.remove.song.toString();
 		if (resp.status == MESSAGE_STATUS_OK) {
 			std::cout << std::endl << "   \"" << song << "\" removed successfull." << std::endl;
 		}
@@ -99,19 +171,93 @@ void do_remove(MusicLibraryApi &api) {
 	}
 }
 
+// search for songs despite typos in their artist or title
+void do_fuzzy_search(MusicLibraryApi &api, const std::string &artist, const std::string &title) {
+
+	// one edit per five letters, at least one
+	size_t longest = std::max(artist.size(), title.size());
+	FuzzySearchMessage msg(artist, title, (uint32_t)std::min<size_t>(1 + longest / 5, 3));
+	if (api.sendMessage(msg)) {
+		std::unique_ptr<Message> msgr = api.recvMessage();
+		FuzzySearchResponseMessage& resp = (FuzzySearchResponseMessage&)(*msgr);
+
+		if (resp.status == MESSAGE_STATUS_OK) {
+			std::cout << std::endl << "   Close matches:" << std::endl;
+			for (size_t i = 0; i < resp.results.size(); ++i) {
+				std::cout << "      ";
+				if (i < resp.ids.size()) {
+					std::cout << "#" << resp.ids[i] << " ";
+				}
+				std::cout << resp.results[i];
+				if (i < resp.distances.size()) {
+					std::cout << " (" << resp.distances[i] << " edits)";
+				}
+				std::cout << std::endl;
+			}
+		}
+		else {
+			std::cout << std::endl << "   Fuzzy search \"" << artist << " - " << title
+				<< "\" failed: " << resp.info << std::endl;
+		}
+	}
+}
+
+// search for the best matches of free text in artists and titles
+void do_ranked_search(MusicLibraryApi &api, const std::string &query) {
+	static const char *kinds[] = { "", "close", "contains", "starts with", "exact" };
+
+	RankedSearchMessage msg(query);
+	if (api.sendMessage(msg)) {
+		std::unique_ptr<Message> msgr = api.recvMessage();
+		RankedSearchResponseMessage& resp = (RankedSearchResponseMessage&)(*msgr);
+
+		if (resp.status == MESSAGE_STATUS_OK) {
+			std::cout << std::endl << "   Best matches:" << std::endl;
+			for (size_t i = 0; i < resp.results.size(); ++i) {
+				std::cout << "      ";
+				if (i < resp.ids.size()) {
+					std::cout << "#" << resp.ids[i] << " ";
+				}
+				std::cout << resp.results[i];
+				if (i < resp.kinds.size() && resp.kinds[i] <= MATCH_EXACT) {
+					std::cout << " (" << kinds[resp.kinds[i]] << ")";
+				}
+				std::cout << std::endl;
+			}
+		}
+		else {
+			std::cout << std::endl << "   Search \"" << query << "\" failed: " << resp.info << std::endl;
+		}
+	}
+
+	std::cout << std::endl;
+}
+
 // search for songs on server
 void do_search(MusicLibraryApi &api) {
-	std::string artist_regex, title_regex;
+	std::string query, artist_regex, title_regex, chart_filter;
 
-	// collect regular expressions for song search
+	// free text is searched for directly, otherwise collect regular expressions
 	std::cout << std::endl << "Search for Songs" << std::endl;
+	std::cout << "   Search for (blank to use expressions): ";
+	std::getline(std::cin, query);
+	if (!query.empty()) {
+		do_ranked_search(api, query);
+		return;
+	}
 	std::cout << "   Artist Expression: ";
 	std::getline(std::cin, artist_regex);
 	std::cout << "   Title Expression:  ";
 	std::getline(std::cin, title_regex);
+	std::cout << "   Charts (e.g. rock AND alternative, blank for all): ";
+	std::getline(std::cin, chart_filter);
+	std::cout << "   From year (blank for any): ";
+	uint32_t year_min = read_number();
+	std::cout << "   To year (blank for any):   ";
+	uint32_t year_max = read_number();
 
 	// send search message and wait for response
-	SearchMessage msg(artist_regex, title_regex);
+	SearchMessage msg(artist_regex, title_regex, chart_filter, SongInfoFilter(year_min, year_max));
 	if (api.sendMessage(msg)) {
 		// get response
 		std::unique_ptr<Message> msgr = api.recvMessage();
@@ -119,13 +265,272 @@ void do_search(MusicLibraryApi &api) {
 
 		if (resp.status == MESSAGE_STATUS_OK) {
 			std::cout << std::endl << "   Results:" << std::endl;
-			for (const auto& song : resp.results) {
-				std::cout << "      " << song << std::endl;
+			for (size_t i = 0; i < resp.results.size(); ++i) {
+				std::cout << "      ";
+				if (i < resp.ids.size()) {
+					std::cout << "#" << resp.ids[i] << " ";
+				}
+				std::cout << resp.results[i];
+				if (i < resp.metadata.size()) {
+					print_info(resp.metadata[i]);
+				}
+				std::cout << std::endl;
+			}
+
+			// nothing found, perhaps the names were misspelt
+			if (resp.results.empty() && chart_filter.empty() && !(artist_regex.empty() && title_regex.empty())) {
+				std::string fuzzy;
+				std::cout << "   No songs found, look for close matches (y/n): ";
+				std::getline(std::cin, fuzzy);
+				if (fuzzy == "y" || fuzzy == "Y") {
+					do_fuzzy_search(api, artist_regex, title_regex);
+				}
 			}
 		}
 		else {
 			std::cout << std::endl << "   Search \"" << artist_regex << " - "
 				<< title_regex << "\" failed: " << resp.info << std::endl;
+
+			// a search stopped part way still sends what it found
+			for (const auto &song : resp.results) {
+				std::cout << "      " << song << std::endl;
+			}
+		}
+	}
+
+	std::cout << std::endl;
+}
+
+// search for songs by words in their lyrics
+void do_lyrics_search(MusicLibraryApi &api) {
+	std::string query;
+
+	std::cout << std::endl << "Search Lyrics" << std::endl;
+	std::cout << "   Words or \"phrase\": ";
+	std::getline(std::cin, query);
+
+	// send search message and wait for response
+	LyricsSearchMessage msg(query);
+	if (api.sendMessage(msg)) {
+		std::unique_ptr<Message> msgr = api.recvMessage();
+		LyricsSearchResponseMessage& resp = (LyricsSearchResponseMessage&)(*msgr);
+
+		if (resp.status == MESSAGE_STATUS_OK) {
+			std::cout << std::endl << "   Results:" << std::endl;
+			for (size_t i = 0; i < resp.results.size(); ++i) {
+				std::cout << "      " << resp.results[i] << std::endl;
+				if (i < resp.snippets.size()) {
+					for (const auto& line : resp.snippets[i]) {
+						std::cout << "         \"" << line << "\"" << std::endl;
+					}
+				}
+			}
+		}
+		else {
+			std::cout << std::endl << "   Lyrics search \"" << query << "\" failed: "
+				<< resp.info << std::endl;
+		}
+	}
+
+	std::cout << std::endl;
+}
+
+// show the lyrics of a song
+void do_get_lyrics(MusicLibraryApi &api) {
+
+	std::string artist, title;
+
+	// collect artist and title
+	std::cout << std::endl << "Get Lyrics" << std::endl;
+	std::cout << "   Artist: ";
+	std::getline(std::cin, artist);
+	std::cout << "   Title:  ";
+	std::getline(std::cin, title);
+
+	// send message to server and wait for response
+	Song song(artist, title);
+	GetLyricsMessage msg(song);
+	if (api.sendMessage(msg)) {
+		std::unique_ptr<Message> msgr = api.recvMessage();
+		GetLyricsResponseMessage& resp = (GetLyricsResponseMessage&)(*msgr);
+
+		if (resp.status == MESSAGE_STATUS_OK) {
+			std::cout << std::endl << "   " << song << std::endl << std::endl << resp.lyrics << std::endl;
+		}
+		else {
+			std::cout << std::endl << "   Getting lyrics of \"" << song << "\" failed: "
+				<< resp.info << std::endl;
+		}
+	}
+
+	std::cout << std::endl;
+}
+
+// list the top songs of a chart
+void do_top_n(MusicLibraryApi &api) {
+	std::string chart, count, artist_regex, title_regex;
+
+	std::cout << std::endl << "Top Songs" << std::endl;
+	std::cout << "   Chart (e.g. rock):  ";
+	std::getline(std::cin, chart);
+	std::cout << "   Number of Songs:    ";
+	std::getline(std::cin, count);
+	std::cout << "   Artist Expression:  ";
+	std::getline(std::cin, artist_regex);
+	std::cout << "   Title Expression:   ";
+	std::getline(std::cin, title_regex);
+
+	size_t n = 10;
+	try {
+		n = std::stoul(count);
+	}
+	catch (std::exception &) {
+		std::cout << "   Showing the top " << n << std::endl;
+	}
+
+	// send message to server and wait for response
+	TopNMessage msg(chart, n, artist_regex, title_regex);
+	if (api.sendMessage(msg)) {
+		std::unique_ptr<Message> msgr = api.recvMessage();
+		TopNResponseMessage& resp = (TopNResponseMessage&)(*msgr);
+
+		if (resp.status == MESSAGE_STATUS_OK) {
+			std::cout << std::endl << "   Results:" << std::endl;
+			for (size_t i = 0; i < resp.results.size(); ++i) {
+				std::cout << "      ";
+				if (i < resp.ranks.size()) {
+					std::cout << "#" << resp.ranks[i] << " ";
+				}
+				std::cout << resp.results[i] << std::endl;
+			}
+		}
+		else {
+			std::cout << std::endl << "   Top songs of \"" << chart << "\" failed: "
+				<< resp.info << std::endl;
+			for (size_t i = 0; i < resp.results.size() && i < resp.ranks.size(); ++i) {
+				std::cout << "      #" << resp.ranks[i] << " " << resp.results[i] << std::endl;
+			}
+		}
+	}
+
+	std::cout << std::endl;
+}
+
+// show how a song did on past charts
+void do_chart_history(MusicLibraryApi &api) {
+
+	std::string artist, title, weekly;
+
+	std::cout << std::endl << "Chart History" << std::endl;
+	std::cout << "   Artist: ";
+	std::getline(std::cin, artist);
+	std::cout << "   Title:  ";
+	std::getline(std::cin, title);
+	std::cout << "   Show every week (y/n): ";
+	std::getline(std::cin, weekly);
+
+	// send message to server and wait for response
+	Song song(artist, title);
+	ChartHistoryMessage msg(song, weekly == "y" || weekly == "Y");
+	if (api.sendMessage(msg)) {
+		std::unique_ptr<Message> msgr = api.recvMessage();
+		ChartHistoryResponseMessage& resp = (ChartHistoryResponseMessage&)(*msgr);
+
+		if (resp.status == MESSAGE_STATUS_OK) {
+			std::cout << std::endl << "   " << song << std::endl;
+			if (resp.charts.empty()) {
+				std::cout << "      Never charted" << std::endl;
+			}
+			for (const auto& stats : resp.charts) {
+				std::cout << "      " << stats.chart << ": " << stats.weeks << " weeks, peak #"
+					<< stats.peak << " (" << stats.weeks_at_peak << " weeks), "
+					<< ChartHistory::formatDate(stats.first) << " to "
+					<< ChartHistory::formatDate(stats.last) << std::endl;
+				for (const auto& position : stats.positions) {
+					std::cout << "         " << ChartHistory::formatDate(position.date)
+						<< "  #" << position.rank << std::endl;
+				}
+			}
+		}
+		else {
+			std::cout << std::endl << "   Chart history of \"" << song << "\" failed: "
+				<< resp.info << std::endl;
+		}
+	}
+
+	std::cout << std::endl;
+}
+
+// look up songs by their ids
+void do_lookup(MusicLibraryApi &api) {
+	std::string line;
+
+	std::cout << std::endl << "Look Up Songs" << std::endl;
+	std::cout << "   Ids (separated by spaces): ";
+	std::getline(std::cin, line);
+
+	std::vector<uint64_t> ids;
+	std::istringstream in(line);
+	std::string word;
+	while (in >> word) {
+		try {
+			ids.push_back(std::stoull(word[0] == '#' ? word.substr(1) : word));
+		}
+		catch (std::exception &) {
+			std::cout << "   Skipping invalid id " << word << std::endl;
+		}
+	}
+
+	// send message to server and wait for response
+	LookupMessage msg(ids);
+	if (api.sendMessage(msg)) {
+		std::unique_ptr<Message> msgr = api.recvMessage();
+		LookupResponseMessage& resp = (LookupResponseMessage&)(*msgr);
+
+		if (resp.status == MESSAGE_STATUS_OK) {
+			std::cout << std::endl << "   Found " << resp.results.size() << " of " << ids.size()
+				<< ":" << std::endl;
+			for (size_t i = 0; i < resp.results.size(); ++i) {
+				std::cout << "      #" << resp.ids[i] << " " << resp.results[i];
+				if (i < resp.metadata.size()) {
+					print_info(resp.metadata[i]);
+				}
+				std::cout << std::endl;
+			}
+		}
+		else {
+			std::cout << std::endl << "   Lookup failed: " << resp.info << std::endl;
+		}
+	}
+
+	std::cout << std::endl;
+}
+
+// complete the start of an artist or title
+void do_autocomplete(MusicLibraryApi &api) {
+	std::string field, prefix;
+
+	std::cout << std::endl << "Autocomplete" << std::endl;
+	std::cout << "   Artist or title (a/t): ";
+	std::getline(std::cin, field);
+	std::cout << "   Start of name:         ";
+	std::getline(std::cin, prefix);
+
+	// send message to server and wait for response
+	AutocompleteMessage msg(field == "t" || field == "T" ? MESSAGE_SONG_TITLE : MESSAGE_SONG_ARTIST,
+		prefix, 10);
+	if (api.sendMessage(msg)) {
+		std::unique_ptr<Message> msgr = api.recvMessage();
+		AutocompleteResponseMessage& resp = (AutocompleteResponseMessage&)(*msgr);
+
+		if (resp.status == MESSAGE_STATUS_OK) {
+			std::cout << std::endl << "   Completions:" << std::endl;
+			for (const auto& completion : resp.completions) {
+				std::cout << "      " << completion.text << " (" << completion.songs << " songs)" << std::endl;
+			}
+		}
+		else {
+			std::cout << std::endl << "   Autocomplete \"" << prefix << "\" failed: " << resp.info << std::endl;
 		}
 	}
 
@@ -141,10 +546,14 @@ void do_goodbye(MusicLibraryApi &api) {
 	std::cout << std::endl;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
 
 	// start client
-	cpen333::process::socket socket("localhost", MUSIC_LIBRARY_SERVER_PORT);
+	int port = MUSIC_LIBRARY_SERVER_PORT;
+	if (argc > 1) {
+		port = std::stoi(argv[1]);
+	}
+	cpen333::process::socket socket("localhost", port);
 	std::cout << "Client connecting...";
 	std::cout.flush();
 
@@ -175,6 +584,24 @@ int main() {
 			case CLIENT_SEARCH:
 				do_search(api);
 				break;
+			case CLIENT_LYRICS_SEARCH:
+				do_lyrics_search(api);
+				break;
+			case CLIENT_GET_LYRICS:
+				do_get_lyrics(api);
+				break;
+			case CLIENT_TOP_N:
+				do_top_n(api);
+				break;
+			case CLIENT_CHART_HISTORY:
+				do_chart_history(api);
+				break;
+			case CLIENT_LOOKUP:
+				do_lookup(api);
+				break;
+			case CLIENT_AUTOCOMPLETE:
+				do_autocomplete(api);
+				break;
 			case CLIENT_QUIT:
 				do_goodbye(api);
 				break;
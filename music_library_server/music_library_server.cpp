@@ -4,6 +4,76 @@
 * This is the main server process.  When it starts it listens for clients.  It then
 * accepts remote commands for modifying/viewing the music database.
 *
+* Usage:
+*   music_library_server                   single read/write server
+*   music_library_server --workers <n>     also start n read-only worker processes,
+*                                          which see changes a second or more late
+*
+* With --workers, the primary process builds an image of the catalog in shared
+* memory and starts worker processes that map it read-only.  Worker i serves
+* SEARCH requests on port MUSIC_LIBRARY_SERVER_PORT+1+i, while the primary keeps
+* serving all requests on MUSIC_LIBRARY_SERVER_PORT.  The primary publishes a new
+* image once the library has changed, checking every MUSIC_LIBRARY_PUBLISH_INTERVAL
+* (1 s), and workers switch to it for their next request.  Until then workers answer
+* from the image before: a change made through the primary reaches them after up to
+* the interval plus the time taken to build the image, over a second per million
+* songs.
+*
+* Options:
+*   --drain-timeout <s>   seconds to let in-flight requests finish on shutdown (10)
+*   --idle-timeout <s>    close clients idle for this many seconds, 0 to disable (300)
+*   --read-timeout <s>    close clients taking longer to send a request, 0 to disable (10)
+*   --query-timeout <s>   stop searches running longer, 0 to disable (5)
+*   --query-songs <n>     stop searches after looking at n songs, 0 to disable (0)
+*   --query-steps <n>     stop searches after n expression steps, 0 to disable (0)
+*   --wal <file>          log client changes to file, replayed on startup (disabled).
+*                         With --lsm, changes are dropped from the log once the store
+*                         has written them to disk.
+*   --wal-sync <policy>   when to sync the log: every, batch or interval (batch)
+*   --wal-interval <s>    seconds between syncs for the interval policy (1)
+*   --data <dir>          directory to load chart files (*.json) from (data)
+*   --cache <dir>         directory caching parsed chart files and their manifest,
+*                         unchanged files are not parsed again (<data>/cache)
+*   --no-cache            always parse every chart file
+*   --watch               reload chart files as they are added, changed or deleted in
+*                         the data directory, while serving.  With --snapshot or --lsm
+*                         the songs added or dropped are logged like client changes.
+*   --snapshot <file>     serve the catalog from a memory-mapped snapshot instead of
+*                         building it from the JSON data files, if the snapshot exists.
+*                         The charts each song is on are read from <file>.charts, or
+*                         from the data files if any has changed since, taking in the
+*                         songs added to or dropped from them.
+*   --write-snapshot <file>  load the catalog (and log), save it as a snapshot, with
+*                         the charts of its songs in <file>.charts, and exit.  The
+*                         changes in the log are dropped from it, so later runs take
+*                         them from the snapshot, with --snapshot <file>.
+*   --lyrics <dir>        directory of lyrics files, "Artist - Title.txt" (<data>/lyrics)
+*   --history <dir>       directory of dated chart snapshots saved by
+*                         billboard_downloader.py (<data>/history)
+*   --lyrics-pack <file>  packed lyrics and their index, rebuilt when the lyrics
+*                         files change (<cache>/lyrics.pack)
+*   --lsm <dir>           keep the library in a log-structured merge store in dir, for
+*                         write-heavy use and catalogs larger than memory.  The data
+*                         files are only added to the store if it is empty, otherwise
+*                         only read for the charts each song is on, kept in <dir>.charts,
+*                         and for the songs added to or dropped from them.  Songs are not
+*                         kept in memory, so they have no ids and can't be looked up,
+*                         removed by id, completed, or found by fuzzy or ranked search.
+*
+* Replaying the log is idempotent, so a log may be replayed on top of a snapshot that
+* already includes some or all of its changes.  Snapshots and the store record how
+* far into the log they reach, and only the changes logged after that are replayed.
+*
+* On SIGINT/SIGTERM the server stops accepting connections, closes idle sessions,
+* lets busy sessions finish their current request (up to the drain timeout), then
+* applies any pending library changes before exiting.
+*
+* A search or top songs request that hits a query limit, or is cancelled by a
+* CANCEL for its request id sent on the same connection while it runs, stops and
+* answers with the songs found so far.  Each session's messages are read ahead on
+* a thread of its own, so the CANCEL is seen while the session is busy, see
+* SessionReader.
+*
 */
 
 #include <fstream>
@@ -12,36 +82,285 @@
 #include <thread>
 #include <memory>
 #include <mutex>
+#include <shared_mutex>
+#include <cstring>
+#include <csignal>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <new>
 
 #include "MusicLibrary.h"
+#include "LibraryImage.h"
+#include "MutationQueue.h"
+#include "SessionRegistry.h"
+#include "SessionReader.h"
+#include "TimerWheel.h"
+#include "WriteAheadLog.h"
+#include "MappedFile.h"
+#include "ChartSources.h"
+#include "ChartHistory.h"
+#include "DirectoryWatcher.h"
+#include "LsmStore.h"
+#include "LyricsIndex.h"
+#include "LyricsStore.h"
+#include "Catalog.h"
+#include "QueryBudget.h"
 #include "JsonMusicLibraryApi.h"
+#include "ImagePublisher.h"
 
 #include <cpen333/process/socket.h>
 #include <cpen333\process\mutex.h>
+#include <cpen333/process/shared_memory.h>
+#include <cpen333/process/subprocess.h>
+
+// base name of the shared memory blocks holding the library images in multi-process
+// mode, each followed by its generation
+#define MUSIC_LIBRARY_IMAGE_NAME "music_library_image"
+// name of the shared memory block through which the primary tells its workers of new
+// images and stops them
+#define MUSIC_LIBRARY_CONTROL_NAME "music_library_control"
+// how often the primary checks whether to publish a new image for its workers
+#define MUSIC_LIBRARY_PUBLISH_INTERVAL std::chrono::seconds(1)
+
+// ending of the file next to a snapshot or store recording the songs of each chart
+// file, as the library last took them in
+#define CHARTS_SUFFIX ".charts"
+
+// resolution of the timer wheel tracking client timeouts
+#define SESSION_TIMER_RESOLUTION std::chrono::milliseconds(100)
+
+/**
+* Connection and query handling options, shared by the primary and worker processes
+*/
+struct ServerOptions {
+	std::chrono::milliseconds drain_timeout = std::chrono::seconds(10);
+	std::chrono::milliseconds idle_timeout = std::chrono::seconds(300);
+	std::chrono::milliseconds read_timeout = std::chrono::seconds(10);
+	std::chrono::milliseconds query_timeout = std::chrono::seconds(5);
+	uint64_t query_songs = 0;
+	uint64_t query_steps = 0;
+
+	/**
+	* Parses an option if recognized
+	* @param argc number of arguments
+	* @param argv arguments
+	* @param i index of the option, advanced past its value
+	* @return true if the option was recognized
+	*/
+	bool parse(int argc, char* argv[], int &i) {
+		if (i + 1 >= argc) {
+			return false;
+		}
+		std::chrono::milliseconds* target = nullptr;
+		uint64_t* limit = nullptr;
+		if (std::strcmp(argv[i], "--drain-timeout") == 0) {
+			target = &drain_timeout;
+		}
+		else if (std::strcmp(argv[i], "--idle-timeout") == 0) {
+			target = &idle_timeout;
+		}
+		else if (std::strcmp(argv[i], "--read-timeout") == 0) {
+			target = &read_timeout;
+		}
+		else if (std::strcmp(argv[i], "--query-timeout") == 0) {
+			target = &query_timeout;
+		}
+		else if (std::strcmp(argv[i], "--query-songs") == 0) {
+			limit = &query_songs;
+		}
+		else if (std::strcmp(argv[i], "--query-steps") == 0) {
+			limit = &query_steps;
+		}
+		else {
+			return false;
+		}
+		if (limit != nullptr) {
+			*limit = std::stoull(argv[++i]);
+			return true;
+		}
+		*target = std::chrono::milliseconds((long long)(std::stod(argv[++i]) * 1000));
+		return true;
+	}
+
+	/**
+	* Converts the options back to command-line arguments
+	* @return arguments
+	*/
+	std::vector<std::string> args() const {
+		return { "--drain-timeout", std::to_string(drain_timeout.count() / 1000.0),
+			"--idle-timeout", std::to_string(idle_timeout.count() / 1000.0),
+			"--read-timeout", std::to_string(read_timeout.count() / 1000.0),
+			"--query-timeout", std::to_string(query_timeout.count() / 1000.0),
+			"--query-songs", std::to_string(query_songs),
+			"--query-steps", std::to_string(query_steps) };
+	}
+};
+
+// set from the signal handler when the server is asked to shut down
+static std::atomic<bool> shutdown_requested(false);
+
+/**
+* Signal handler for shutdown requests
+*/
+void request_shutdown(int) {
+	shutdown_requested = true;
+}
+
+/**
+* Installs the shutdown handler and starts a thread that closes the server
+* socket once shutdown is requested, unblocking the accept loop
+*
+* @param server server socket
+* @param stop optional flag set by another process to request shutdown
+* @return watcher thread, to be joined after the accept loop exits
+*/
+std::thread watch_shutdown(cpen333::process::socket_server &server,
+	const std::atomic<bool> *stop = nullptr) {
+	std::signal(SIGINT, request_shutdown);
+	std::signal(SIGTERM, request_shutdown);
+#ifdef SIGBREAK
+	std::signal(SIGBREAK, request_shutdown);
+#endif
+
+	return std::thread([&server, stop]() {
+		while (!shutdown_requested) {
+			if (stop != nullptr && stop->load()) {
+				shutdown_requested = true;
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+		server.close();
+	});
+}
+
+/**
+* Threads serving client connections.  Threads are joined once they finish,
+* and all of them before the server tears down the state they share.
+*/
+class ServiceThreads {
+	struct Entry {
+		std::thread thread;
+		std::atomic<bool> done;
+		Entry() : thread(), done(false) {}
+	};
+	std::list<Entry> threads_;
+
+public:
+	/**
+	* Starts a thread running the body, joining any threads that finished
+	* @param body function to run, may be move-only
+	*/
+	template<typename Body>
+	void start(Body body) {
+		reap();
+		threads_.emplace_back();
+		std::atomic<bool> *done = &threads_.back().done;
+		threads_.back().thread = std::thread([done](Body body) {
+			body();
+			*done = true;
+		}, std::move(body));
+	}
+
+	/**
+	* Joins the threads that finished
+	*/
+	void reap() {
+		for (auto it = threads_.begin(); it != threads_.end();) {
+			if (it->done) {
+				it->thread.join();
+				it = threads_.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+	}
+
+	/**
+	* Waits for every thread to finish
+	*/
+	void join() {
+		for (auto &entry : threads_) {
+			entry.thread.join();
+		}
+		threads_.clear();
+	}
+};
+
+/**
+* Drains all client sessions: idle sessions are closed right away, busy ones
+* may finish their current request until the deadline, after which any
+* remaining connections are closed and their searches cancelled.  Returns once
+* every service thread has exited, so the state they share can be torn down.
+*
+* @param sessions connected sessions
+* @param queries running searches
+* @param threads service threads
+* @param timeout time allowed for in-flight requests
+*/
+void drain_sessions(SessionRegistry &sessions, QueryRegistry &queries, ServiceThreads &threads,
+	std::chrono::milliseconds timeout) {
+	sessions.drain();
+	if (!sessions.waitUntil(std::chrono::steady_clock::now() + timeout)) {
+		std::cout << "Closing " << sessions.active()
+			<< " sessions still busy after drain timeout" << std::endl;
+		sessions.closeAll();
+		queries.cancelAll();
+	}
+	threads.join();
+}
+
+/**
+* Describes why a search stopped before it finished
+*
+* @param budget exhausted budget of the search
+* @return message for the client
+*/
+std::string stopped_info(const QueryBudget &budget) {
+	return std::string("Search stopped (") + budget.reason() + ") after "
+		+ std::to_string(budget.songs()) + " songs, results are partial";
+}
+
+// answer to requests needing song ids or indexes while the library keeps none
+#define NOT_INDEXED_INFO "Songs are not indexed on this server (--lsm)"
 
 /**
 * Main thread function for handling communication with a single remote
 * client.
 *
 * @param lib shared library
+* @param mutex reader/writer lock protecting the shared library
+* @param mutations queue through which all library changes are applied
+* @param sources charts each song was loaded from, protected by mutex
+* @param history past chart positions, immutable while serving
+* @param lyrics index of song lyrics, immutable while serving
+* @param lyrics_store packed song lyrics
+* @param sessions registry of connected sessions
+* @param queries registry of running searches, limiting and cancelling them
 * @param api communication interface layer
 * @param id client id for printing messages to the console
 */
-void service(MusicLibrary &lib, MusicLibraryApi &&api, int id) {
-
-	//=========================================================
-	// TODO: Implement thread safety
-	//cpen333::process::mutex mutex_("Mutex");
-	std::mutex mutex_;
-	//=========================================================
+void service(MusicLibrary &lib, std::shared_timed_mutex &mutex,
+	MutationQueue &mutations, const ChartSources &sources, const ChartHistory &history,
+	const LyricsIndex &lyrics, const LyricsStore &lyrics_store,
+	SessionRegistry &sessions, QueryRegistry &queries, MusicLibraryApi &&api, int id) {
 
+	SessionRegistry::Session session(sessions, api, id);
+	SessionReader reader(api, session, queries, id);
 	std::cout << "Client " << id << " connected" << std::endl;
 
 	// receive message
-	std::unique_ptr<Message> msg = api.recvMessage();
+	bool cancelled = false;
+	std::unique_ptr<Message> msg = reader.next(cancelled);
 
 	// continue while we don't have an error
 	while (msg != nullptr) {
+		session.busy();
 
 		// react and respond to message
 		MessageType type = msg->type();
@@ -52,11 +371,14 @@ void service(MusicLibrary &lib, MusicLibraryApi &&api, int id) {
 			AddMessage &add = (AddMessage &)(*msg);
 			std::cout << "Client " << id << " adding song: " << add.song << std::endl;
 
-			// add song to library
+			// add song to library, waiting for its batch to be applied
 			bool success = false;
-			{
-				std::lock_guard<decltype(mutex_)> lock(mutex_);
-				success = lib.add(add.song);
+			try {
+				success = mutations.add(add.song, add.info);
+			}
+			catch (std::runtime_error &exc) {
+				api.sendMessage(AddResponseMessage(add, MESSAGE_STATUS_ERROR, exc.what()));
+				break;
 			}
 
 			// send response
@@ -74,15 +396,40 @@ void service(MusicLibrary &lib, MusicLibraryApi &&api, int id) {
 			//====================================================
 			// TODO: Implement "remove" functionality
 			//====================================================
+			RemoveMessage &request = (RemoveMessage &)(*msg);
+
+			// a song given by id is looked up first, and sent back with the response
+			if (request.id != SONG_ID_NONE && !lib.indexing()) {
+				api.sendMessage(RemoveResponseMessage(request, MESSAGE_STATUS_ERROR, NOT_INDEXED_INFO));
+				break;
+			}
+			if (request.id != SONG_ID_NONE) {
+				std::unique_ptr<Song> song;
+				{
+					std::shared_lock<std::shared_timed_mutex> lock(mutex);
+					const Song *found = lib.song(request.id);
+					if (found != nullptr) {
+						song.reset(new Song(*found));
+					}
+				}
+				if (song == nullptr) {
+					api.sendMessage(RemoveResponseMessage(request, MESSAGE_STATUS_ERROR,
+						"No song with id " + std::to_string(request.id)));
+					break;
+				}
+				msg.reset(new RemoveMessage(*song, request.id));
+			}
 			RemoveMessage &remove = (RemoveMessage &)(*msg);
 			std::cout << "Client " << id << " removing song: " << remove.song << std::endl;
 
-			// remove song from library
+			// remove song from library, waiting for its batch to be applied
 			bool success = false;
-			// implement threa safety when trying to remove song from library
-			{
-				std::lock_guard<decltype(mutex_)> lock(mutex_);
-				success = lib.remove(remove.song);
+			try {
+				success = mutations.remove(remove.song);
+			}
+			catch (std::runtime_error &exc) {
+				api.sendMessage(RemoveResponseMessage(remove, MESSAGE_STATUS_ERROR, exc.what()));
+				break;
 			}
 
 			// send response
@@ -101,18 +448,315 @@ void service(MusicLibrary &lib, MusicLibraryApi &&api, int id) {
 			SearchMessage &search = (SearchMessage &)(*msg);
 
 			std::cout << "Client " << id << " searching for: "
-				<< search.artist_regex << " - " << search.title_regex << std::endl;
+				<< search.artist_regex << " - " << search.title_regex;
+			if (!search.chart_filter.empty()) {
+				std::cout << " on " << search.chart_filter;
+			}
+			std::cout << std::endl;
 
-			// search library
+			// patterns are checked up front, so a bad one is reported rather than
+			// matching nothing
+			std::string error;
+			if (!Regex::check(search.artist_regex, error) || !Regex::check(search.title_regex, error)) {
+				api.sendMessage(SearchResponseMessage(search, {}, MESSAGE_STATUS_ERROR,
+					"Invalid expression: " + error));
+				break;
+			}
+
+			// search library, concurrently with other readers, narrowing down to the
+			// songs on the requested charts and in the requested ranges before
+			// matching any expressions, until the search runs out of budget
+			QueryRegistry::Query query(queries, id, search.request);
 			std::vector<Song> results;
+			std::vector<SongInfo> metadata;
+			std::vector<uint64_t> ids;
+			bool valid = true;
 			{
-				std::lock_guard<decltype(mutex_)> lock(mutex_);
-				results = lib.find(search.artist_regex, search.title_regex);
+				std::shared_lock<std::shared_timed_mutex> lock(mutex);
+				std::vector<const Song*> candidates;
+				if (!search.chart_filter.empty()) {
+					valid = sources.membership().select(search.chart_filter, candidates);
+				}
+				if (valid && !search.info_filter.empty()) {
+					std::vector<const Song*> ranged;
+					lib.select(search.info_filter, ranged);
+					if (search.chart_filter.empty()) {
+						candidates.swap(ranged);
+					}
+					else {
+						std::vector<const Song*> both;
+						std::set_intersection(candidates.begin(), candidates.end(),
+							ranged.begin(), ranged.end(), std::back_inserter(both),
+							[](const Song *a, const Song *b) { return *a < *b; });
+						candidates.swap(both);
+					}
+				}
+
+				if (search.chart_filter.empty() && search.info_filter.empty()) {
+					results = lib.find(search.artist_regex, search.title_regex, &query.budget());
+				}
+				else if (valid) {
+					results = lib.find(candidates, search.artist_regex, search.title_regex,
+						std::numeric_limits<size_t>::max(), &query.budget());
+				}
+
+				bool any = false;
+				for (const auto &song : results) {
+					metadata.push_back(lib.info(song));
+					any |= !metadata.back().empty();
+					if (lib.indexing()) {
+						ids.push_back(lib.id(song));
+					}
+				}
+				if (!any) {
+					metadata.clear();
+				}
 			}
 
 			// send response
-			api.sendMessage(SearchResponseMessage(search, results, MESSAGE_STATUS_OK));
+			if (valid && query.budget().exhausted()) {
+				std::cout << "Client " << id << " " << stopped_info(query.budget()) << std::endl;
+				api.sendMessage(SearchResponseMessage(search, results, MESSAGE_STATUS_ERROR,
+					stopped_info(query.budget()), metadata, ids));
+			}
+			else if (valid) {
+				api.sendMessage(SearchResponseMessage(search, results, MESSAGE_STATUS_OK, "",
+					metadata, ids));
+			}
+			else {
+				api.sendMessage(SearchResponseMessage(search, results, MESSAGE_STATUS_ERROR,
+					"Invalid chart filter or unknown chart: " + search.chart_filter));
+			}
+
+			break;
+		}
+		case MessageType::LYRICS_SEARCH: {
+			LyricsSearchMessage &search = (LyricsSearchMessage &)(*msg);
+			std::cout << "Client " << id << " searching lyrics for: " << search.query << std::endl;
+
+			// the index is immutable, only songs still in the library are returned
+			std::vector<LyricsMatch> matches = lyrics.search(search.query);
+			std::vector<const LyricsMatch*> kept;
+			{
+				std::shared_lock<std::shared_timed_mutex> lock(mutex);
+				for (const auto &match : matches) {
+					if (lib.contains(match.song)) {
+						kept.push_back(&match);
+					}
+				}
+			}
+
+			// matching lines are read from the pack outside the library lock
+			std::vector<Song> results;
+			std::vector<std::vector<std::string>> snippets;
+			for (const auto *match : kept) {
+				results.push_back(match->song);
+				snippets.push_back(lyrics_store.lines(match->song, match->lines));
+			}
+			api.sendMessage(LyricsSearchResponseMessage(search, results, snippets, MESSAGE_STATUS_OK));
+			break;
+		}
+		case MessageType::GET_LYRICS: {
+			GetLyricsMessage &get = (GetLyricsMessage &)(*msg);
+			std::cout << "Client " << id << " getting lyrics of: " << get.song << std::endl;
+
+			bool found = false;
+			{
+				std::shared_lock<std::shared_timed_mutex> lock(mutex);
+				found = lib.contains(get.song);
+			}
+			std::shared_ptr<const std::string> text;
+			if (found) {
+				text = lyrics_store.lyrics(get.song);
+			}
+
+			if (!found) {
+				api.sendMessage(GetLyricsResponseMessage(get, "", MESSAGE_STATUS_ERROR,
+					"Song was not found in library"));
+			}
+			else if (!text) {
+				api.sendMessage(GetLyricsResponseMessage(get, "", MESSAGE_STATUS_ERROR,
+					"No lyrics for song"));
+			}
+			else {
+				api.sendMessage(GetLyricsResponseMessage(get, *text, MESSAGE_STATUS_OK));
+			}
+			break;
+		}
+		case MessageType::TOP_N: {
+			TopNMessage &top = (TopNMessage &)(*msg);
+			std::cout << "Client " << id << " getting top " << top.count << " of " << top.chart
+				<< std::endl;
+
+			std::string error;
+			if (!Regex::check(top.artist_regex, error) || !Regex::check(top.title_regex, error)) {
+				api.sendMessage(TopNResponseMessage(top, {}, {}, MESSAGE_STATUS_ERROR,
+					"Invalid expression: " + error));
+				break;
+			}
+
+			// walk the chart in rank order, stopping as soon as enough songs match
+			QueryRegistry::Query query(queries, id, top.request);
+			std::vector<Song> results;
+			std::vector<uint32_t> ranks;
+			bool valid = false;
+			{
+				std::shared_lock<std::shared_timed_mutex> lock(mutex);
+				std::vector<const Song*> ranked;
+				valid = sources.membership().ranked(top.chart, ranked);
+				if (valid) {
+					results = lib.find(ranked, top.artist_regex, top.title_regex, top.count,
+						&query.budget());
+					for (const auto &song : results) {
+						ranks.push_back(sources.membership().rank(top.chart, song));
+					}
+				}
+			}
+
+			if (valid && query.budget().exhausted()) {
+				std::cout << "Client " << id << " " << stopped_info(query.budget()) << std::endl;
+				api.sendMessage(TopNResponseMessage(top, results, ranks, MESSAGE_STATUS_ERROR,
+					stopped_info(query.budget())));
+			}
+			else if (valid) {
+				api.sendMessage(TopNResponseMessage(top, results, ranks, MESSAGE_STATUS_OK));
+			}
+			else {
+				api.sendMessage(TopNResponseMessage(top, results, ranks, MESSAGE_STATUS_ERROR,
+					"Unknown chart: " + top.chart));
+			}
+			break;
+		}
+		case MessageType::CHART_HISTORY: {
+			ChartHistoryMessage &get = (ChartHistoryMessage &)(*msg);
+			std::cout << "Client " << id << " getting chart history of: " << get.song << std::endl;
+
+			// the history is immutable, answered from its aggregates without locking
+			api.sendMessage(ChartHistoryResponseMessage(get, history.stats(get.song, get.trajectory),
+				MESSAGE_STATUS_OK));
+			break;
+		}
+		case MessageType::LOOKUP: {
+			LookupMessage &lookup = (LookupMessage &)(*msg);
+			std::cout << "Client " << id << " looking up " << lookup.ids.size() << " songs" << std::endl;
+			if (!lib.indexing()) {
+				api.sendMessage(LookupResponseMessage(lookup, {}, {}, MESSAGE_STATUS_ERROR, NOT_INDEXED_INFO));
+				break;
+			}
+
+			// one hash probe per id, ids no longer in the library are left out
+			std::vector<Song> results;
+			std::vector<uint64_t> found;
+			std::vector<SongInfo> metadata;
+			bool any = false;
+			{
+				std::shared_lock<std::shared_timed_mutex> lock(mutex);
+				for (uint64_t song_id : lookup.ids) {
+					const Song *song = lib.song(song_id);
+					if (song != nullptr) {
+						results.push_back(*song);
+						found.push_back(song_id);
+						metadata.push_back(lib.info(*song));
+						any |= !metadata.back().empty();
+					}
+				}
+			}
+			if (!any) {
+				metadata.clear();
+			}
+
+			api.sendMessage(LookupResponseMessage(lookup, results, found, MESSAGE_STATUS_OK, "", metadata));
+			break;
+		}
+		case MessageType::AUTOCOMPLETE: {
+			AutocompleteMessage &autocomplete = (AutocompleteMessage &)(*msg);
 
+			// called on every keystroke, so not logged
+			bool artist = autocomplete.field == MESSAGE_SONG_ARTIST;
+			if (!artist && autocomplete.field != MESSAGE_SONG_TITLE) {
+				api.sendMessage(AutocompleteResponseMessage(autocomplete, {}, MESSAGE_STATUS_ERROR,
+					"Can only complete \"" MESSAGE_SONG_ARTIST "\" or \"" MESSAGE_SONG_TITLE "\""));
+				break;
+			}
+			if (!lib.indexing()) {
+				api.sendMessage(AutocompleteResponseMessage(autocomplete, {}, MESSAGE_STATUS_ERROR,
+					NOT_INDEXED_INFO));
+				break;
+			}
+			std::vector<Completion> completions;
+			{
+				std::shared_lock<std::shared_timed_mutex> lock(mutex);
+				completions = lib.complete(artist, autocomplete.prefix, autocomplete.count);
+			}
+			api.sendMessage(AutocompleteResponseMessage(autocomplete, completions, MESSAGE_STATUS_OK));
+			break;
+		}
+		case MessageType::FUZZY_SEARCH: {
+			FuzzySearchMessage &search = (FuzzySearchMessage &)(*msg);
+			std::cout << "Client " << id << " fuzzy searching for: "
+				<< search.artist << " - " << search.title << std::endl;
+
+			if (search.artist.empty() && search.title.empty()) {
+				api.sendMessage(FuzzySearchResponseMessage(search, {}, {}, MESSAGE_STATUS_ERROR,
+					"Fuzzy search needs an artist or a title"));
+				break;
+			}
+			if (!lib.indexing()) {
+				api.sendMessage(FuzzySearchResponseMessage(search, {}, {}, MESSAGE_STATUS_ERROR,
+					NOT_INDEXED_INFO));
+				break;
+			}
+
+			// only the distinct artists and titles sharing enough trigrams are compared
+			std::vector<Song> results;
+			std::vector<uint32_t> distances;
+			std::vector<uint64_t> ids;
+			{
+				std::shared_lock<std::shared_timed_mutex> lock(mutex);
+				results = lib.fuzzyFind(search.artist, search.title, search.max_distance, distances);
+				for (const auto &song : results) {
+					ids.push_back(lib.id(song));
+				}
+			}
+			api.sendMessage(FuzzySearchResponseMessage(search, results, distances, MESSAGE_STATUS_OK, "", ids));
+			break;
+		}
+		case MessageType::RANKED_SEARCH: {
+			RankedSearchMessage &search = (RankedSearchMessage &)(*msg);
+			std::cout << "Client " << id << " ranked searching for: " << search.query << std::endl;
+			if (!lib.indexing()) {
+				api.sendMessage(RankedSearchResponseMessage(search, {}, {}, MESSAGE_STATUS_ERROR,
+					NOT_INDEXED_INFO));
+				break;
+			}
+
+			// only as many matches as asked for are collected, from the indexes
+			std::vector<Song> results;
+			std::vector<uint32_t> kinds;
+			std::vector<uint64_t> ids;
+			{
+				std::shared_lock<std::shared_timed_mutex> lock(mutex);
+				for (const RankedMatch &match : lib.rankedFind(search.query, search.count)) {
+					results.push_back(*match.song);
+					kinds.push_back(match.kind);
+					ids.push_back(match.id);
+				}
+			}
+			api.sendMessage(RankedSearchResponseMessage(search, results, kinds, MESSAGE_STATUS_OK, "", ids));
+			break;
+		}
+		case MessageType::CANCEL: {
+			// the search was cancelled as soon as this arrived, the session answers
+			// once it is done with the search
+			CancelMessage &cancel = (CancelMessage &)(*msg);
+			std::cout << "Client " << id << " cancelled request " << cancel.request << std::endl;
+			if (cancelled) {
+				api.sendMessage(CancelResponseMessage(cancel, MESSAGE_STATUS_OK));
+			}
+			else {
+				api.sendMessage(CancelResponseMessage(cancel, MESSAGE_STATUS_ERROR,
+					"No running request " + std::to_string(cancel.request)));
+			}
 			break;
 		}
 		case MessageType::GOODBYE: {
@@ -125,60 +769,837 @@ void service(MusicLibrary &lib, MusicLibraryApi &&api, int id) {
 		}
 		}
 
-		// receive next message
-		msg = api.recvMessage();
+		// receive next message, unless the server is shutting down
+		if (!session.idle()) {
+			std::cout << "Client " << id << " closed for shutdown" << std::endl;
+			return;
+		}
+		msg = reader.next(cancelled);
+	}
+}
+
+/**
+* Thread function for handling communication with a single remote client in
+* a read-only worker process.  Searches are answered directly from the newest
+* library image published, changes are rejected.
+*
+* @param images library images published by the primary
+* @param sessions registry of connected sessions
+* @param queries registry of running searches, limiting and cancelling them
+* @param api communication interface layer
+* @param id client id for printing messages to the console
+*/
+void service_readonly(PublishedImage<cpen333::process::shared_memory> &images,
+	SessionRegistry &sessions,
+	QueryRegistry &queries, MusicLibraryApi &&api, int id) {
+
+	SessionRegistry::Session session(sessions, api, id);
+	SessionReader reader(api, session, queries, id);
+	std::cout << "Client " << id << " connected" << std::endl;
+
+	// receive message
+	bool cancelled = false;
+	std::unique_ptr<Message> msg = reader.next(cancelled);
+
+	// continue while we don't have an error
+	while (msg != nullptr) {
+		session.busy();
+
+		// react and respond to message
+		MessageType type = msg->type();
+		switch (type) {
+		case MessageType::ADD: {
+			AddMessage &add = (AddMessage &)(*msg);
+			api.sendMessage(AddResponseMessage(add, MESSAGE_STATUS_ERROR,
+				"Server is a read-only worker"));
+			break;
+		}
+		case MessageType::REMOVE: {
+			RemoveMessage &remove = (RemoveMessage &)(*msg);
+			api.sendMessage(RemoveResponseMessage(remove, MESSAGE_STATUS_ERROR,
+				"Server is a read-only worker"));
+			break;
+		}
+		case MessageType::SEARCH: {
+			SearchMessage &search = (SearchMessage &)(*msg);
+
+			std::cout << "Client " << id << " searching for: "
+				<< search.artist_regex << " - " << search.title_regex << std::endl;
+			if (!search.chart_filter.empty() || !search.info_filter.empty()) {
+				api.sendMessage(SearchResponseMessage(search, {}, MESSAGE_STATUS_ERROR,
+					"Charts and metadata are only filtered by the primary server"));
+				break;
+			}
+			std::string error;
+			if (!Regex::check(search.artist_regex, error) || !Regex::check(search.title_regex, error)) {
+				api.sendMessage(SearchResponseMessage(search, {}, MESSAGE_STATUS_ERROR,
+					"Invalid expression: " + error));
+				break;
+			}
+
+			// image is immutable, no locking required, and stays mapped while held
+			std::shared_ptr<const LibraryImage> image = images.current();
+			QueryRegistry::Query query(queries, id, search.request);
+			std::vector<Song> results = image->find(search.artist_regex, search.title_regex,
+				&query.budget());
+			if (query.budget().exhausted()) {
+				std::cout << "Client " << id << " " << stopped_info(query.budget()) << std::endl;
+				api.sendMessage(SearchResponseMessage(search, results, MESSAGE_STATUS_ERROR,
+					stopped_info(query.budget())));
+			}
+			else {
+				api.sendMessage(SearchResponseMessage(search, results, MESSAGE_STATUS_OK));
+			}
+			break;
+		}
+		case MessageType::LYRICS_SEARCH: {
+			LyricsSearchMessage &search = (LyricsSearchMessage &)(*msg);
+			api.sendMessage(LyricsSearchResponseMessage(search, {}, {}, MESSAGE_STATUS_ERROR,
+				"Lyrics are only searched by the primary server"));
+			break;
+		}
+		case MessageType::GET_LYRICS: {
+			GetLyricsMessage &get = (GetLyricsMessage &)(*msg);
+			api.sendMessage(GetLyricsResponseMessage(get, "", MESSAGE_STATUS_ERROR,
+				"Lyrics are only served by the primary server"));
+			break;
+		}
+		case MessageType::TOP_N: {
+			TopNMessage &top = (TopNMessage &)(*msg);
+			api.sendMessage(TopNResponseMessage(top, {}, {}, MESSAGE_STATUS_ERROR,
+				"Charts are only ranked by the primary server"));
+			break;
+		}
+		case MessageType::CHART_HISTORY: {
+			ChartHistoryMessage &get = (ChartHistoryMessage &)(*msg);
+			api.sendMessage(ChartHistoryResponseMessage(get, {}, MESSAGE_STATUS_ERROR,
+				"Chart history is only kept by the primary server"));
+			break;
+		}
+		case MessageType::LOOKUP: {
+			LookupMessage &lookup = (LookupMessage &)(*msg);
+			api.sendMessage(LookupResponseMessage(lookup, {}, {}, MESSAGE_STATUS_ERROR,
+				"Songs are only looked up by id by the primary server"));
+			break;
+		}
+		case MessageType::AUTOCOMPLETE: {
+			AutocompleteMessage &autocomplete = (AutocompleteMessage &)(*msg);
+			api.sendMessage(AutocompleteResponseMessage(autocomplete, {}, MESSAGE_STATUS_ERROR,
+				"Autocompletion is only served by the primary server"));
+			break;
+		}
+		case MessageType::FUZZY_SEARCH: {
+			FuzzySearchMessage &search = (FuzzySearchMessage &)(*msg);
+			api.sendMessage(FuzzySearchResponseMessage(search, {}, {}, MESSAGE_STATUS_ERROR,
+				"Fuzzy searches are only served by the primary server"));
+			break;
+		}
+		case MessageType::RANKED_SEARCH: {
+			RankedSearchMessage &search = (RankedSearchMessage &)(*msg);
+			api.sendMessage(RankedSearchResponseMessage(search, {}, {}, MESSAGE_STATUS_ERROR,
+				"Ranked searches are only served by the primary server"));
+			break;
+		}
+		case MessageType::CANCEL: {
+			CancelMessage &cancel = (CancelMessage &)(*msg);
+			std::cout << "Client " << id << " cancelled request " << cancel.request << std::endl;
+			if (cancelled) {
+				api.sendMessage(CancelResponseMessage(cancel, MESSAGE_STATUS_OK));
+			}
+			else {
+				api.sendMessage(CancelResponseMessage(cancel, MESSAGE_STATUS_ERROR,
+					"No running request " + std::to_string(cancel.request)));
+			}
+			break;
+		}
+		case MessageType::GOODBYE: {
+			std::cout << "Client " << id << " closing" << std::endl;
+			return;
+		}
+		default: {
+			std::cout << "Client " << id << " sent invalid message" << std::endl;
+		}
+		}
+
+		// receive next message, unless the server is shutting down
+		if (!session.idle()) {
+			std::cout << "Client " << id << " closed for shutdown" << std::endl;
+			return;
+		}
+		msg = reader.next(cancelled);
+	}
+}
+
+/**
+* Main function of a read-only worker process: maps the library images
+* published by the primary and serves searches from the newest
+*
+* @param index worker index, determines the port
+* @param options connection handling options
+* @return process exit code
+*/
+int run_worker(int index, const ServerOptions &options) {
+
+	// the primary tells its workers of new images and stops them through shared memory
+	cpen333::process::shared_memory control_memory(MUSIC_LIBRARY_CONTROL_NAME,
+		sizeof(ImageControl), true);
+	const ImageControl &control = *(const ImageControl*)control_memory.get();
+	PublishedImage<cpen333::process::shared_memory> images(MUSIC_LIBRARY_IMAGE_NAME, control);
+	std::shared_ptr<const LibraryImage> image = images.current();
+	if (image == nullptr) {
+		std::cerr << "Worker " << index << " failed to map library image" << std::endl;
+		return 1;
+	}
+
+	cpen333::process::socket_server server(MUSIC_LIBRARY_SERVER_PORT + 1 + index);
+	server.open();
+	std::cout << "Worker " << index << " serving " << image->size()
+		<< " songs on port " << server.port() << std::endl;
+	image.reset();
+
+	// close stale client connections
+	TimerWheel timers(SESSION_TIMER_RESOLUTION);
+	timers.start();
+	SessionRegistry sessions(timers, options.idle_timeout, options.read_timeout);
+	QueryRegistry queries(options.query_timeout, options.query_songs, options.query_steps);
+	ServiceThreads threads;
+
+	std::thread watcher = watch_shutdown(server, &control.stop);
+
+	int idCounter = 0;
+	cpen333::process::socket client;
+	while (!shutdown_requested) {
+		if (server.accept(client)) {
+			JsonMusicLibraryApi api(std::move(client));
+			int id = idCounter++;
+			threads.start([&images, &sessions, &queries, api = std::move(api), id]() mutable {
+				service_readonly(images, sessions, queries, std::move(api), id);
+			});
+		}
+	}
+	watcher.join();
+
+	drain_sessions(sessions, queries, threads, options.drain_timeout);
+	timers.stop();
+	std::cout << "Worker " << index << " stopped" << std::endl;
+	return 0;
+}
+
+/**
+* Load the songs of all chart files in the catalog.  Files are loaded concurrently
+* by a pool of threads, one file at a time per thread.  Unchanged files are read
+* from the catalog's cache rather than parsed.
+*
+* @param catalog chart files to load
+* @param sources records the songs loaded from each file
+* @param songs if not null, receives the songs of all files, in file order
+* @param changes if not null, receives the changes to the library since the files
+*        were last recorded in sources, including files that no longer exist
+* @return number of files loaded
+*/
+size_t load_charts(Catalog &catalog, ChartSources &sources, std::vector<Song> *songs,
+	std::vector<Mutation> *changes = nullptr) {
+
+	std::vector<std::string> filenames = catalog.scan();
+	std::vector<std::vector<Song>> parsed(filenames.size());
+	std::atomic<size_t> next(0);
+	std::atomic<size_t> cached(0);
+
+	size_t nthreads = std::max(1u, std::thread::hardware_concurrency());
+	nthreads = std::min(nthreads, filenames.size());
+	std::vector<std::thread> pool;
+	for (size_t t = 0; t < nthreads; ++t) {
+		pool.push_back(std::thread([&]() {
+			bool from_cache = false;
+			for (size_t i = next++; i < filenames.size(); i = next++) {
+				if (catalog.load(filenames[i], parsed[i], from_cache) && from_cache) {
+					++cached;
+				}
+			}
+		}));
+	}
+	for (auto &thread : pool) {
+		thread.join();
+	}
+	catalog.saveManifest();
+
+	// merge per-file results, in file order
+	if (songs != nullptr) {
+		size_t total = 0;
+		for (const auto &file : parsed) {
+			total += file.size();
+		}
+		songs->reserve(songs->size() + total);
+	}
+	for (size_t i = 0; i < parsed.size(); ++i) {
+		if (songs != nullptr) {
+			for (const auto &song : parsed[i]) {
+				songs->push_back(song);
+			}
+		}
+		std::vector<Mutation> diff = sources.update(filenames[i], parsed[i]);
+		std::vector<Song>().swap(parsed[i]);
+		for (size_t j = 0; changes != nullptr && j < diff.size(); ++j) {
+			changes->push_back(diff[j]);
+		}
+	}
+	for (const auto &name : sources.files()) {
+		if (!std::binary_search(filenames.begin(), filenames.end(), name)) {
+			std::vector<Mutation> diff = sources.erase(name);
+			for (size_t j = 0; changes != nullptr && j < diff.size(); ++j) {
+				changes->push_back(diff[j]);
+			}
+		}
+	}
+
+	std::cout << "Loaded " << filenames.size() << " chart files (" << cached
+		<< " unchanged, from cache)" << std::endl;
+	return filenames.size();
+}
+
+/**
+* Load songs from all chart files in the catalog into the music library, built
+* from all files in a single bulk build
+*
+* @param lib music library
+* @param catalog chart files to load
+* @param sources records the songs loaded from each file
+* @return number of files loaded
+*/
+size_t load_catalog(MusicLibrary &lib, Catalog &catalog, ChartSources &sources) {
+	std::vector<Song> songs;
+	size_t nfiles = load_charts(catalog, sources, &songs);
+	lib.build(songs);
+	return nfiles;
+}
+
+/**
+* Load dated chart snapshots into the chart history.  Snapshots are added in name
+* order, so the snapshots of each chart are added oldest first.
+*
+* @param history chart history
+* @param dir directory of "<chart file>.<YYYY-MM-DD>.json" files
+* @return number of snapshots loaded
+*/
+size_t load_history(ChartHistory &history, const std::string &dir) {
+	size_t count = 0;
+	for (const auto &name : Catalog::list(dir, CHART_HISTORY_SUFFIX)) {
+		std::string file;
+		uint32_t date;
+		std::ifstream fin(dir + "/" + name);
+		if (!ChartHistory::parseName(name, file, date) || !fin.is_open()) {
+			std::cerr << "Skipping chart snapshot: " << name << std::endl;
+			continue;
+		}
+		try {
+			std::vector<Song> songs = JsonConverter::parseSongs(JSON::parse(fin));
+			if (history.add(ChartMembership::chartName(file), date, songs)) {
+				++count;
+			}
+		}
+		catch (std::exception &exc) {
+			std::cerr << "Skipping chart snapshot " << name << ": " << exc.what() << std::endl;
+		}
 	}
+	return count;
 }
 
 /**
-* Load songs from a JSON file and add them to the music library
+* Reload chart files that changed on disk.  Only files whose contents changed are
+* parsed again.  The songs added to or dropped from each file are compared with
+* those previously loaded from it, and the chart membership is updated under a
+* single lock acquisition, so searches only wait for the update itself rather than
+* the parsing.
+*
+* If the library keeps its songs across restarts, in a snapshot or a store, the
+* resulting changes to the library go through the mutation queue, so they are
+* logged and applied like any client's, and the sources are saved once the log
+* holds them.  Otherwise the changes are applied along with the membership and not
+* logged, as the chart files themselves are loaded again on the next start.
+*
 * @param lib music library
-* @param filename file to load
+* @param mutex reader/writer lock protecting the shared library
+* @param mutations queue to apply the changes through, nullptr to apply them directly
+* @param catalog chart files
+* @param sources songs previously loaded from each file, protected by mutex
+* @param charts_path file to save the sources to, empty to not save them
+* @param changed names of files that may have changed
+* @return number of changes applied to the library
 */
-void load_songs(MusicLibrary &lib, const std::string& filename) {
+size_t reload_charts(MusicLibrary &lib, std::shared_timed_mutex &mutex, MutationQueue *mutations,
+	Catalog &catalog, ChartSources &sources, const std::string &charts_path,
+	const std::vector<std::string> &changed) {
 
-	// parse from file stream
-	std::ifstream fin(filename);
-	if (fin.is_open()) {
-		JSON j;
-		fin >> j;
-		std::vector<Song> songs = JsonConverter::parseSongs(j);
-		lib.add(songs);
+	// parse outside the lock, this thread is the only one changing the sources
+	uint64_t signature = catalog.signature();
+	std::vector<std::string> names;
+	std::vector<std::vector<Song>> contents;
+	std::vector<bool> deleted;
+	for (const auto &name : changed) {
+		std::vector<Song> songs;
+		if (!std::ifstream(catalog.path(name)).is_open()) {
+			deleted.push_back(true);   // deleted or moved away
+		}
+		else {
+			bool cached = false;
+			if (!catalog.load(name, songs, cached)) {
+				continue;   // keep the previous contents, e.g. a half-written file
+			}
+			if (cached && sources.contains(name)) {
+				continue;   // contents unchanged since it was loaded
+			}
+			deleted.push_back(false);
+		}
+		names.push_back(name);
+		contents.push_back(std::vector<Song>());
+		contents.back().swap(songs);
 	}
-	else {
-		std::cerr << "Failed to open file: " << filename << std::endl;
+	size_t nfiles = names.size();
+	if (nfiles == 0) {
+		return 0;
+	}
+	catalog.saveManifest();
+
+	size_t applied = 0;
+	std::vector<Mutation> diff;
+	{
+		std::lock_guard<std::shared_timed_mutex> lock(mutex);
+		for (size_t i = 0; i < nfiles; ++i) {
+			std::vector<Mutation> file_diff = deleted[i] ? sources.erase(names[i])
+				: sources.update(names[i], contents[i]);
+			for (auto &mutation : file_diff) {
+				diff.push_back(std::move(mutation));
+			}
+		}
+		sources.setSignature(signature);
+		for (size_t i = 0; mutations == nullptr && i < diff.size(); ++i) {
+			if (diff[i].apply(lib)) {
+				++applied;
+			}
+		}
 	}
 
+	// submitted at once, so they are applied in as few batches as possible
+	if (mutations != nullptr) {
+		std::vector<std::future<bool>> results;
+		for (const auto &mutation : diff) {
+			results.push_back(mutations->submit(mutation));
+		}
+		try {
+			for (auto &result : results) {
+				if (result.get()) {
+					++applied;
+				}
+			}
+		}
+		catch (std::runtime_error &exc) {
+			// not logged, so dropped like the changes of clients in the same batch
+			std::cerr << "Failed to apply reloaded charts: " << exc.what() << std::endl;
+			return applied;
+		}
+	}
+	if (!charts_path.empty() && !sources.save(charts_path)) {
+		std::cerr << "Failed to save charts: " << charts_path << std::endl;
+	}
+
+	size_t nsongs = 0;
+	{
+		std::shared_lock<std::shared_timed_mutex> lock(mutex);
+		nsongs = lib.size();
+	}
+
+	std::cout << "Reloaded " << nfiles << " chart files: " << applied << " changes, "
+		<< nsongs << " songs" << std::endl;
+	return applied;
 }
 
-int main() {
-
-	// load  data
-	std::vector<std::string> filenames = {
-		"data/billboard_hot_100.json",
-		"data/billboard_greatest_hot_100.json",
-		"data/billboard_adult_contemporary.json",
-		"data/billboard_adult_pop.json",
-		"data/billboard_alternative.json",
-		"data/billboard_country.json",
-		"data/billboard_electronic.json",
-		"data/billboard_jazz.json",
-		"data/billboard_r&b.json",
-		"data/billboard_rap.json",
-		"data/billboard_rock.json",
-	};
+/**
+* Start watching the data directory, reloading chart files as they change until
+* shutdown is requested
+*
+* @param lib music library
+* @param mutex reader/writer lock protecting the shared library
+* @param mutations queue to apply changes through, nullptr to apply them directly
+* @param catalog chart files
+* @param sources songs previously loaded from each file
+* @param charts_path file to save the sources to after each reload, empty to not save them
+* @param dir data directory
+* @return thread watching the directory
+*/
+std::thread watch_charts(MusicLibrary &lib, std::shared_timed_mutex &mutex, MutationQueue *mutations,
+	Catalog &catalog, ChartSources &sources, const std::string &charts_path, const std::string &dir) {
+
+	return std::thread([&lib, &mutex, mutations, &catalog, &sources, charts_path, dir]() {
+		DirectoryWatcher watcher(dir, ".json");
+		if (!watcher.valid()) {
+			std::cerr << "Failed to watch data directory: " << dir << std::endl;
+			return;
+		}
+		std::vector<std::string> changed;
+		while (!shutdown_requested) {
+			if (watcher.wait(changed, std::chrono::milliseconds(500))) {
+				changed.erase(std::remove(changed.begin(), changed.end(),
+					std::string(CATALOG_MANIFEST)), changed.end());
+				reload_charts(lib, mutex, mutations, catalog, sources, charts_path, changed);
+			}
+		}
+	});
+}
+
+/**
+* Start publishing a new library image for the workers whenever the library has
+* changed, checking every MUSIC_LIBRARY_PUBLISH_INTERVAL until shutdown is requested
+*
+* @param lib music library
+* @param mutex reader/writer lock protecting the shared library
+* @param publisher publisher of the images
+* @param version version of the library in the image published last
+* @return thread publishing the images
+*/
+std::thread publish_images(MusicLibrary &lib, std::shared_timed_mutex &mutex,
+	ImagePublisher<cpen333::process::shared_memory> &publisher, uint64_t version) {
+
+	return std::thread([&lib, &mutex, &publisher, version]() mutable {
+		auto next = std::chrono::steady_clock::now() + MUSIC_LIBRARY_PUBLISH_INTERVAL;
+		while (!shutdown_requested) {
+			if (std::chrono::steady_clock::now() < next) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+				continue;
+			}
+			next += MUSIC_LIBRARY_PUBLISH_INTERVAL;
+
+			std::vector<char> image;
+			size_t nsongs;
+			{
+				std::shared_lock<std::shared_timed_mutex> lock(mutex);
+				if (lib.version() == version) {
+					continue;
+				}
+				version = lib.version();
+				image = LibraryImage::build(lib.songs());
+				nsongs = lib.size();
+			}
+			uint64_t generation = publisher.publish(image);
+			std::cout << "Published " << nsongs << " songs (" << image.size()
+				<< " bytes) for the workers as image " << generation << std::endl;
+		}
+	});
+}
+
+int main(int argc, char* argv[]) {
+
+	// parse command-line options
+	int nworkers = 0;
+	ServerOptions options;
+	std::string wal_path;
+	WalSyncPolicy wal_sync = WAL_SYNC_BATCH;
+	std::chrono::milliseconds wal_interval = std::chrono::seconds(1);
+	std::string snapshot_path;
+	std::string lsm_dir;
+	std::string lyrics_dir;
+	std::string lyrics_pack;
+	std::string history_dir;
+	std::string write_snapshot_path;
+	std::string data_dir = "data";
+	std::string cache_dir;
+	bool use_cache = true;
+	bool watch = false;
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--worker") == 0 && i + 1 < argc) {
+			return run_worker(std::stoi(argv[i + 1]), options);
+		}
+		else if (std::strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+			nworkers = std::stoi(argv[++i]);
+		}
+		else if (options.parse(argc, argv, i)) {
+			continue;
+		}
+		else if (std::strcmp(argv[i], "--wal") == 0 && i + 1 < argc) {
+			wal_path = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--wal-sync") == 0 && i + 1 < argc) {
+			std::string policy = argv[++i];
+			if (policy == "every") {
+				wal_sync = WAL_SYNC_EVERY;
+			}
+			else if (policy == "batch") {
+				wal_sync = WAL_SYNC_BATCH;
+			}
+			else if (policy == "interval") {
+				wal_sync = WAL_SYNC_INTERVAL;
+			}
+			else {
+				std::cerr << "Unknown log sync policy: " << policy << std::endl;
+				return 1;
+			}
+		}
+		else if (std::strcmp(argv[i], "--wal-interval") == 0 && i + 1 < argc) {
+			wal_interval = std::chrono::milliseconds((long long)(std::stod(argv[++i]) * 1000));
+		}
+		else if (std::strcmp(argv[i], "--data") == 0 && i + 1 < argc) {
+			data_dir = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+			cache_dir = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--no-cache") == 0) {
+			use_cache = false;
+		}
+		else if (std::strcmp(argv[i], "--watch") == 0) {
+			watch = true;
+		}
+		else if (std::strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+			snapshot_path = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--write-snapshot") == 0 && i + 1 < argc) {
+			write_snapshot_path = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--lsm") == 0 && i + 1 < argc) {
+			lsm_dir = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--lyrics") == 0 && i + 1 < argc) {
+			lyrics_dir = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--history") == 0 && i + 1 < argc) {
+			history_dir = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--lyrics-pack") == 0 && i + 1 < argc) {
+			lyrics_pack = argv[++i];
+		}
+		else {
+			std::cerr << "Unknown option: " << argv[i] << std::endl;
+			return 1;
+		}
+	}
+
+	// chart files, discovered in the data directory
+	if (!use_cache) {
+		cache_dir.clear();
+	}
+	else if (cache_dir.empty()) {
+		cache_dir = data_dir + "/cache";
+	}
+	Catalog catalog(data_dir, cache_dir);
+	uint64_t chart_signature = catalog.signature();   // before any file is read
+	auto boot_start = std::chrono::steady_clock::now();
 
 	MusicLibrary lib;       // main shared music library
+	std::shared_timed_mutex mutex;  // protects the shared library
+	ChartSources sources;   // songs loaded from each chart file
+
+	// keep the library in an LSM store, the data files are only loaded into an empty one
+	LsmStore store(lsm_dir);
+	if (!lsm_dir.empty()) {
+		if (!store.open()) {
+			std::cerr << "Failed to open store: " << lsm_dir << std::endl;
+			return 1;
+		}
+		lib.setIndexing(false);
+		lib.attach(store);
+		std::cout << "Opened " << lib.size() << " songs in " << store.runs() << " runs from "
+			<< lsm_dir << std::endl;
+	}
+
+	// serve directly from a mapped snapshot if we have one, otherwise parse the data files
+	MappedFile snapshot;
+	LibraryImage snapshot_image;
+	if (lsm_dir.empty() && !snapshot_path.empty() && snapshot.open(snapshot_path)) {
+		snapshot_image = LibraryImage(snapshot.data(), snapshot.size());
+		if (!snapshot_image.valid()) {
+			std::cerr << "Ignoring invalid snapshot: " << snapshot_path << std::endl;
+			snapshot.close();
+		}
+	}
+	// serve what the store kept from previous runs, or the snapshot
+	bool from_store = !lsm_dir.empty() && store.runs() > 0;
+	if (!from_store && snapshot_image.valid()) {
+		lib.attach(snapshot_image);
+		std::cout << "Mapped " << lib.size() << " songs from " << snapshot_path << std::endl;
+	}
+
+	// a library kept across restarts keeps the charts it took in next to it, to take
+	// in whatever changed in the chart files since
+	std::string charts_path;
+	if (!lsm_dir.empty()) {
+		charts_path = lsm_dir;
+		while (charts_path.size() > 1 && charts_path.back() == '/') {
+			charts_path.pop_back();
+		}
+		charts_path += CHARTS_SUFFIX;
+	}
+	else if (snapshot_image.valid()) {
+		charts_path = snapshot_path + CHARTS_SUFFIX;
+	}
+	bool charts_saved = (from_store || snapshot_image.valid()) && sources.load(charts_path);
+	std::vector<Mutation> chart_changes;
+	if (charts_saved && sources.signature() == chart_signature) {
+		// the chart files are unchanged, so are the charts the songs are on
+		std::cout << "Read charts of " << sources.songs() << " songs in " << sources.size()
+			<< " files from " << charts_path << std::endl;
+	}
+	else if (from_store || snapshot_image.valid()) {
+		// the library already holds the chart songs, only record which charts they
+		// are on, for chart filters, top songs and reloads, and what changed since
+		// the charts were saved
+		size_t nfiles = load_charts(catalog, sources, nullptr, charts_saved ? &chart_changes : nullptr);
+		std::cout << "Recorded charts of " << sources.songs() << " songs from " << nfiles
+			<< " files, " << chart_changes.size() << " changes since last run" << std::endl;
+	}
+	else {
+		// load music library files
+		auto load_start = std::chrono::steady_clock::now();
+		size_t nfiles = load_catalog(lib, catalog, sources);
+		std::chrono::duration<double> load_time = std::chrono::steady_clock::now() - load_start;
+		std::cout << "Loaded " << lib.size() << " songs from " << nfiles
+			<< " files in " << load_time.count() << " s" << std::endl;
+	}
+	sources.setSignature(chart_signature);
+
+	// past charts, kept as rank trajectories
+	if (history_dir.empty()) {
+		history_dir = data_dir + "/history";
+	}
+	ChartHistory history;
+	size_t nsnapshots = load_history(history, history_dir);
+	std::cout << "Loaded " << nsnapshots << " chart snapshots (" << history.entries()
+		<< " positions of " << history.size() << " songs, " << history.bytes() << " bytes)"
+		<< std::endl;
+
+	// pack song lyrics and their index into a single mapped file, repacking when the
+	// lyrics files change, and load the index from it, searched without touching the
+	// lyric text
+	if (lyrics_dir.empty()) {
+		lyrics_dir = data_dir + "/lyrics";
+	}
+	if (lyrics_pack.empty()) {
+		lyrics_pack = (cache_dir.empty() ? data_dir : cache_dir) + "/lyrics.pack";
+	}
+	LyricsStore lyrics_store;
+	LyricsIndex lyrics;
+	if (!lyrics_store.open(lyrics_pack)
+		|| lyrics_store.sourceSignature() != LyricsStore::signature(lyrics_dir)
+		|| !lyrics_store.index(lyrics)) {
+		size_t packed = LyricsStore::build(lyrics_dir, lyrics_pack);
+		if (!lyrics_store.open(lyrics_pack) || !lyrics_store.index(lyrics)) {
+			std::cerr << "Failed to pack lyrics: " << lyrics_pack << std::endl;
+			return 1;
+		}
+		std::cout << "Packed lyrics of " << packed << " songs into " << lyrics_pack << std::endl;
+	}
+	std::cout << "Loaded lyrics index of " << lyrics.size() << " songs (" << lyrics.words()
+		<< " words, " << lyrics.bytes() << " bytes of postings)" << std::endl;
+
+	// all client changes to the library are grouped and applied by a single thread
+	MutationQueue mutations(lib, mutex);
+
+	// replay changes made in previous runs that the library does not hold yet, then
+	// log each batch before it is applied
+	WriteAheadLog wal(wal_path, wal_sync, wal_interval);
+	uint64_t logged = !lsm_dir.empty() ? store.logPosition()
+		: snapshot_image.valid() ? snapshot_image.logPosition() : 0;
+	if (!wal_path.empty()) {
+		size_t replayed = wal.replay(lib, logged);
+		std::cout << "Replayed " << replayed << " changes from " << wal_path << std::endl;
+		if (!wal.open(logged)) {
+			std::cerr << "Failed to open log: " << wal_path << std::endl;
+			return 1;
+		}
+		bool lsm = !lsm_dir.empty();
+		mutations.setBatchListener([&wal, &store, lsm](const std::vector<Mutation> &batch) {
+			// drop the changes the store has written to disk since the last batch
+			if (lsm && !wal.checkpoint(store.logPosition())) {
+				std::cerr << "Failed to checkpoint log" << std::endl;
+			}
+			return wal.append(batch);
+		});
+		if (lsm) {
+			mutations.setAppliedListener([&wal, &store](const std::vector<Mutation> &) {
+				store.setLogPosition(wal.position());
+			});
+		}
+	}
+
+	// take in the chart changes the library missed, logged like any change, after
+	// those made in previous runs
+	if (!chart_changes.empty()) {
+		if (!wal_path.empty() && !wal.append(chart_changes)) {
+			std::cerr << "Failed to log chart changes: " << wal_path << std::endl;
+			return 1;
+		}
+		for (const auto &mutation : chart_changes) {
+			mutation.apply(lib);
+		}
+	}
+	if (!lsm_dir.empty() && !wal_path.empty()) {
+		store.setLogPosition(wal.position());
+	}
+
+	// the charts are saved whenever the log holds the changes they led to; a store
+	// holds them once it has written everything, at shutdown
+	bool save_charts = !charts_path.empty() && !wal_path.empty();
+	if (save_charts && !sources.save(charts_path)) {
+		std::cerr << "Failed to save charts: " << charts_path << std::endl;
+	}
 
-							// load music library files
-	for (const auto &filename : filenames) {
-		load_songs(lib, filename);
+	// save the current catalog and exit
+	if (!write_snapshot_path.empty()) {
+		std::vector<char> image = LibraryImage::build(lib.songs());
+		LibraryImage::setLogPosition(image, wal.position());
+		if (!LibraryImage::save(image, write_snapshot_path)) {
+			std::cerr << "Failed to write snapshot: " << write_snapshot_path << std::endl;
+			return 1;
+		}
+		if (!sources.save(write_snapshot_path + CHARTS_SUFFIX)) {
+			std::cerr << "Failed to write snapshot charts: " << write_snapshot_path
+				<< CHARTS_SUFFIX << std::endl;
+			return 1;
+		}
+		std::cout << "Wrote " << lib.size() << " songs (" << image.size() << " bytes) to "
+			<< write_snapshot_path << std::endl;
+		// the snapshot holds the changes logged so far
+		if (!wal_path.empty() && !wal.checkpoint(wal.position())) {
+			std::cerr << "Failed to checkpoint log: " << wal_path << std::endl;
+		}
+		return 0;
+	}
+
+	mutations.start();
+	if (!lsm_dir.empty()) {
+		store.start();
+	}
+
+	// publish the catalog in shared memory and start the read-only workers
+	std::unique_ptr<cpen333::process::shared_memory> control_memory;
+	ImageControl *control = nullptr;
+	std::unique_ptr<ImagePublisher<cpen333::process::shared_memory>> publisher;
+	std::thread republisher;
+	std::vector<std::unique_ptr<cpen333::process::subprocess>> workers;
+	if (nworkers > 0) {
+		control_memory.reset(new cpen333::process::shared_memory(MUSIC_LIBRARY_CONTROL_NAME,
+			sizeof(ImageControl)));
+		control = new (control_memory->get()) ImageControl();
+		publisher.reset(new ImagePublisher<cpen333::process::shared_memory>(
+			MUSIC_LIBRARY_IMAGE_NAME, *control));
+		std::vector<char> image = LibraryImage::build(lib.songs());
+		publisher->publish(image);
+		std::cout << "Published " << lib.size() << " songs (" << image.size()
+			<< " bytes) for " << nworkers << " workers" << std::endl;
+		republisher = publish_images(lib, mutex, *publisher, lib.version());
+
+		for (int i = 0; i < nworkers; ++i) {
+			std::vector<std::string> args = options.args();
+			args.insert(args.begin(), argv[0]);
+			args.insert(args.end(), { "--worker", std::to_string(i) });
+			workers.emplace_back(new cpen333::process::subprocess(args));
+		}
 	}
 
 	// start server
 	cpen333::process::socket_server server(MUSIC_LIBRARY_SERVER_PORT);
 	server.open();
-	std::cout << "Server started on port " << server.port() << std::endl;
+	std::chrono::duration<double> boot_time = std::chrono::steady_clock::now() - boot_start;
+	std::cout << "Server started on port " << server.port() << " in " << boot_time.count()
+		<< " s" << std::endl;
 
 	//===============================================================
 	// TODO: Modify to allow multiple client-server connections
@@ -188,22 +1609,75 @@ int main() {
 	//       - Send the API wrapper to the service(...) function
 	//         to run in a new detached thread
 	//===============================================================
+	// close stale client connections
+	TimerWheel timers(SESSION_TIMER_RESOLUTION);
+	timers.start();
+	SessionRegistry sessions(timers, options.idle_timeout, options.read_timeout);
+	QueryRegistry queries(options.query_timeout, options.query_songs, options.query_steps);
+	ServiceThreads threads;
+	std::thread watcher = watch_shutdown(server);
+
+	// pick up new and updated chart files while serving
+	std::thread reloader;
+	if (watch) {
+		reloader = watch_charts(lib, mutex, charts_path.empty() ? nullptr : &mutations, catalog,
+			sources, save_charts ? charts_path : std::string(), data_dir);
+	}
+
 	int idCounter = 0;
 	cpen333::process::socket client;
-	while (true) {
+	while (!shutdown_requested) {
 		if (server.accept(client)) {
 			// create API handler
 			JsonMusicLibraryApi api(std::move(client));
-			// service client-server communication		
-			//service(lib, std::move(api), 0);
-			auto serviceThread = std::thread(service, std::ref(lib), std::move(api), idCounter); // create service routine in a separate thread
-			serviceThread.detach(); // detach serivce service routine thread
-			idCounter++; // increment id counter
+			// service client-server communication in a separate thread,
+			// joined before the shared library is torn down
+			int id = idCounter++;
+			threads.start([&, api = std::move(api), id]() mutable {
+				service(lib, mutex, mutations, sources, history, lyrics, lyrics_store, sessions,
+					queries, std::move(api), id);
+			});
 		}
 	}
 
-	// close server
-	server.close();
+	// server socket was closed by the watcher, drain remaining clients while
+	// the workers drain theirs
+	watcher.join();
+	if (reloader.joinable()) {
+		reloader.join();
+	}
+	if (republisher.joinable()) {
+		republisher.join();
+	}
+	if (control != nullptr) {
+		control->stop = true;
+	}
+	std::cout << "Shutting down, draining " << sessions.active() << " sessions" << std::endl;
+	auto drain_start = std::chrono::steady_clock::now();
+	drain_sessions(sessions, queries, threads, options.drain_timeout);
+	timers.stop();
+
+	// apply and persist any pending library changes
+	mutations.stop();
+	store.stop();
+	if (!lsm_dir.empty() && !wal_path.empty() && !wal.checkpoint(store.logPosition())) {
+		std::cerr << "Failed to checkpoint log: " << wal_path << std::endl;
+	}
+	wal.close();
+	if (!lsm_dir.empty() && !sources.save(charts_path)) {
+		std::cerr << "Failed to save charts: " << charts_path << std::endl;
+	}
+
+	std::chrono::duration<double> drain_time = std::chrono::steady_clock::now() - drain_start;
+	std::cout << "Drained in " << drain_time.count() << " s" << std::endl;
+
+	for (auto &worker : workers) {
+		worker->join();
+	}
+	if (publisher) {
+		publisher->unlink();
+		control_memory->unlink();
+	}
 
 	return 0;
 }
\ No newline at end of file
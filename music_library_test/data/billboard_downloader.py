@@ -1,8 +1,13 @@
 import billboard
+import datetime
 import json
+import os
+
+# dated copies of every chart are kept here, for the server's chart history
+HISTORY_DIR = 'history'
 
 # downloads the billboard chart from a billboard url lug (i.e. https://www.billboard.com/charts/lug)
-#   and writes the results to a file
+#   and writes the results to a file, plus a copy named after the chart date in HISTORY_DIR
 def download_chart(lug, file):
     chart = billboard.ChartData(lug)
     songs = []
@@ -15,6 +20,13 @@ def download_chart(lug, file):
     ff.write(jj_str)
     ff.close()
 
+    date = chart.date or datetime.date.today().isoformat()
+    if not os.path.isdir(HISTORY_DIR):
+        os.makedirs(HISTORY_DIR)
+    ff = open(os.path.join(HISTORY_DIR, file[:-len('.json')] + '.' + date + '.json'), 'w')
+    ff.write(jj_str)
+    ff.close()
+
 
 # download a bunch of charts
 download_chart('hot-100', 'billboard_hot_100.json')
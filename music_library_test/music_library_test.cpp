@@ -1,11 +1,40 @@
 #include "TestException.h"
 
 #include <MusicLibrary.h>
+#include <MutationQueue.h>
+#include <LibraryImage.h>
+#include <ImagePublisher.h>
+#include <SessionRegistry.h>
+#include <SessionReader.h>
+#include <TimerWheel.h>
+#include <WriteAheadLog.h>
+#include <MappedFile.h>
+#include <LsmStore.h>
+#include <Catalog.h>
+#include <ChartSources.h>
+#include <LyricsIndex.h>
+#include <LyricsStore.h>
 #include <JsonConverter.h>
+#include <Regex.h>
+#include <QueryBudget.h>
 
 #include <iostream>
+#include <iomanip>
 #include <fstream>
 #include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <shared_mutex>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <regex>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
 
 /**
 * Tries adding a song to the library, then checks if it
@@ -130,34 +159,2050 @@ void testFindSongs(const MusicLibrary& lib,
 	}
 }
 
-void setupLibrary(MusicLibrary& lib) {
+/**
+* Bulk builds a library from an unsorted batch containing duplicates, then
+* bulk adds a second overlapping batch.  If successful, the library holds
+* each distinct song exactly once.
+*
+* @param lib library providing the songs to use
+* @throws TestException if the library contents are wrong
+*/
+void testBulkBuild(const MusicLibrary& lib) {
+
+	// reversed, with every song twice
+	std::set<Song> expected = lib.songs();
+	std::vector<Song> batch;
+	for (auto it = expected.rbegin(); it != expected.rend(); ++it) {
+		batch.push_back(*it);
+		batch.push_back(*it);
+	}
+
+	MusicLibrary built;
+	if (built.build(batch) != expected.size() || built.songs() != expected) {
+		throw TestException("Library not properly bulk built");
+	}
+
+	std::vector<Song> more = { { "Bulk Artist", "B" }, batch.front(), { "Bulk Artist", "A" },
+		{ "Bulk Artist", "B" } };
+	size_t added = built.add(more);
+	if (added != 2 || built.size() != expected.size() + 2
+		|| !built.contains(Song("Bulk Artist", "A"))) {
+		throw TestException("Batch not properly added: " + std::to_string(added) + " added");
+	}
+}
+
+/**
+* Loads a chart file through a cached catalog three times: first parsed, then
+* unchanged from the cache, then after modifying it.  If successful, the cache
+* is used only while the file is unchanged, and always gives the same songs.
+*
+* @throws TestException if the cache is used incorrectly
+*/
+void testCatalogCache() {
+
+	const std::string dir = "test_catalog";
+	const std::string cache = dir + "/cache";
+	const std::string chart = dir + "/chart.json";
+	Catalog::makeDirectory(dir);
+
+	std::vector<Song> expected = { { "Toto", "Africa" }, { "a-ha", "Take On Me" } };
+	{
+		std::ofstream fout(chart);
+		fout << JsonConverter::toJSON(expected);
+	}
+
+	for (int pass = 0; pass < 3; ++pass) {
+		if (pass == 2) {
+			expected.push_back(Song("Journey", "Separate Ways"));
+			std::ofstream fout(chart);
+			fout << JsonConverter::toJSON(expected);
+		}
+
+		// new catalog each pass, like a server restart
+		Catalog catalog(dir, cache);
+		std::vector<std::string> files = catalog.scan();
+		if (files != std::vector<std::string>{ "chart.json" }) {
+			throw TestException("Catalog did not discover chart file");
+		}
+		std::vector<Song> songs;
+		bool cached = false;
+		if (!catalog.load(files[0], songs, cached) || cached != (pass == 1)) {
+			throw TestException("Chart cache used incorrectly on pass " + std::to_string(pass));
+		}
+		if (songs.size() != expected.size()
+			|| !std::equal(songs.begin(), songs.end(), expected.begin())) {
+			throw TestException("Chart songs differ on pass " + std::to_string(pass));
+		}
+		catalog.saveManifest();
+	}
+
+	std::remove(chart.c_str());
+	std::remove((cache + "/chart.json.songs").c_str());
+	std::remove((cache + "/" CATALOG_MANIFEST).c_str());
+	std::remove(cache.c_str());
+	std::remove(dir.c_str());
+}
+
+/**
+* Loads two overlapping charts, then reloads and deletes one of them.  If
+* successful, only songs that enter or leave every chart are added or removed.
+*
+* @throws TestException if a chart change gives the wrong library changes
+*/
+void testChartReload() {
+
+	Song africa("Toto", "Africa");
+	Song takeOnMe("a-ha", "Take On Me");
+	Song separateWays("Journey", "Separate Ways");
+
+	ChartSources sources;
+	if (sources.update("hot.json", { africa, takeOnMe }).size() != 2
+		|| sources.update("rock.json", { africa }).size() != 0) {
+		throw TestException("Initial charts not properly loaded");
+	}
+
+	// africa is still on the rock chart, so is kept
+	std::vector<Mutation> diff = sources.update("hot.json", { takeOnMe, separateWays });
+	if (diff.size() != 1 || diff[0].type != MUTATION_ADD || diff[0].song != separateWays) {
+		throw TestException("Reloaded chart gave wrong changes: " + std::to_string(diff.size()));
+	}
+
+	// saved, then brought up to date with the charts as they are later, gives the
+	// changes the library missed in between
+	const std::string path = "test_reload.charts";
+	ChartSources saved;
+	if (!sources.save(path) || !saved.load(path)) {
+		std::remove(path.c_str());
+		throw TestException("Chart sources not saved");
+	}
+	std::remove(path.c_str());
+
+	diff = sources.erase("rock.json");
+	if (diff.size() != 1 || diff[0].type != MUTATION_REMOVE || diff[0].song != africa
+		|| sources.size() != 1 || sources.songs() != 2) {
+		throw TestException("Deleted chart gave wrong changes: " + std::to_string(diff.size()));
+	}
+
+	diff = saved.erase("rock.json");
+	if (diff.size() != 1 || diff[0].song != africa
+		|| saved.update("hot.json", { takeOnMe, separateWays }).size() != 0) {
+		throw TestException("Saved charts gave wrong changes: " + std::to_string(diff.size()));
+	}
+}
+
+/**
+* Loads overlapping made-up charts, then filters songs by chart.  If successful,
+* each filter gives exactly the songs on the right combination of charts, and
+* malformed filters or unknown charts are rejected.
+*
+* @param nsongs number of made-up songs
+* @throws TestException if a chart filter gives the wrong songs
+*/
+void testChartFilter(int nsongs) {
+
+	// song i is on rock if i is even, alternative if divisible by 3, hot 100 if by 5
+	std::vector<Song> all;
+	std::vector<Song> rock, alternative, hot;
+	for (int i = 0; i < nsongs; ++i) {
+		all.push_back(Song("Chart Artist " + std::to_string(i % 7), "Song " + std::to_string(i)));
+		if (i % 2 == 0) {
+			rock.push_back(all.back());
+		}
+		if (i % 3 == 0) {
+			alternative.push_back(all.back());
+		}
+		if (i % 5 == 0) {
+			hot.push_back(all.back());
+		}
+	}
+	ChartSources sources;
+	sources.update("billboard_rock.json", rock);
+	sources.update("billboard_alternative.json", alternative);
+	sources.update("billboard_hot_100.json", hot);
+
+	auto expect = [&](const std::string &filter, bool(*on)(int)) {
+		std::set<Song> expected;
+		for (int i = 0; i < nsongs; ++i) {
+			if (on(i)) {
+				expected.insert(all[i]);
+			}
+		}
+		std::vector<const Song*> songs;
+		if (!sources.membership().select(filter, songs) || songs.size() != expected.size()
+			|| !std::equal(expected.begin(), expected.end(), songs.begin(),
+				[](const Song &a, const Song *b) { return a == *b; })) {
+			throw TestException("Chart filter \"" + filter + "\" gave wrong songs: "
+				+ std::to_string(songs.size()));
+		}
+	};
+	expect("rock AND alternative", [](int i) { return i % 6 == 0; });
+	expect("rock or alternative", [](int i) { return i % 2 == 0 || i % 3 == 0; });
+	expect("NOT rock", [](int i) { return i % 2 != 0 && (i % 3 == 0 || i % 5 == 0); });
+	expect("(rock OR alternative) AND NOT hot_100",
+		[](int i) { return (i % 2 == 0 || i % 3 == 0) && i % 5 != 0; });
+
+	std::vector<const Song*> songs;
+	for (const std::string filter : { "rock AND", "pop", "(rock", "rock alternative", "" }) {
+		if (sources.membership().select(filter, songs)) {
+			throw TestException("Invalid chart filter accepted: " + filter);
+		}
+	}
+	std::vector<std::string> charts = sources.membership().charts(all[30]);
+	if (charts != std::vector<std::string>({ "rock", "alternative", "hot_100" })) {
+		throw TestException("Wrong charts for song: " + std::to_string(charts.size()));
+	}
+
+	// dropped songs no longer match, and only library songs are searched
+	sources.erase("billboard_hot_100.json");
+	expect("hot_100 OR (alternative AND NOT rock)", [](int i) { return i % 3 == 0 && i % 2 != 0; });
+	MusicLibrary lib;
+	lib.build(all);
+	lib.remove(all[6]);
+	sources.membership().select("rock AND alternative", songs);
+	std::vector<Song> found = lib.find(songs, "Artist 0", "");
+	std::vector<Song> expected;
+	for (int i = 0; i < nsongs; ++i) {
+		if (i % 6 == 0 && i % 7 == 0 && i != 6) {
+			expected.push_back(all[i]);
+		}
+	}
+	if (std::set<Song>(found.begin(), found.end()) != std::set<Song>(expected.begin(), expected.end())) {
+		throw TestException("Chart filtered search gave wrong songs: " + std::to_string(found.size()));
+	}
+
+	// the filter is only sent when set
+	SearchMessage search("Toto", "", "rock AND alternative");
+	std::unique_ptr<Message> parsed = JsonConverter::parseMessage(JsonConverter::toJSON(search));
+	if (((SearchMessage &)(*parsed)).chart_filter != search.chart_filter
+		|| JsonConverter::toJSON(SearchMessage("Toto", "")).count(MESSAGE_CHART_FILTER) != 0) {
+		throw TestException("Chart filter not sent with search");
+	}
+}
+
+/**
+* Loads the rock chart and lists its top songs, then reloads it in a new order.
+* If successful, the top songs come back in chart order with their ranks, only
+* among songs in the library and matching the expressions.
+*
+* @throws TestException if the top songs or ranks are wrong
+*/
+void testChartRanks() {
+
+	std::ifstream fin("data/billboard_rock.json");
+	std::vector<Song> chart = JsonConverter::parseSongs(JSON::parse(fin));
+	ChartSources sources;
+	sources.update("billboard_rock.json", chart);
+	MusicLibrary lib;
+	lib.build(chart);
+
+	std::vector<const Song*> ranked;
+	if (!sources.membership().ranked("rock", ranked) || ranked.size() != chart.size()
+		|| sources.membership().ranked("pop", ranked)) {
+		throw TestException("Chart ranking not kept");
+	}
+	sources.membership().ranked("rock", ranked);
+	std::vector<Song> top = lib.find(ranked, "", "", 3);
+	if (top.size() != 3 || top[0] != chart[0] || top[1] != chart[1] || top[2] != chart[2]) {
+		throw TestException("Wrong top songs of chart");
+	}
+
+	// the first songs by an artist, skipping one removed from the library
+	lib.remove(chart[1]);
+	top = lib.find(ranked, chart[1].artist, "", 1);
+	if (top.size() != 1 || top[0] != chart[2] || sources.membership().rank("rock", top[0]) != 3) {
+		throw TestException("Wrong top songs of chart by artist");
+	}
+
+	// reversed, listing the last song twice
+	std::vector<Song> reversed(chart.rbegin(), chart.rend());
+	reversed.push_back(chart.back());
+	sources.update("billboard_rock.json", reversed);
+	sources.membership().ranked("rock", ranked);
+	if (ranked.size() != chart.size() || *ranked[0] != chart.back()
+		|| sources.membership().rank("rock", chart.back()) != 1
+		|| sources.membership().rank("rock", chart[0]) != chart.size()
+		|| sources.membership().rank("rock", Song("Nobody", "Nothing")) != 0) {
+		throw TestException("Reloaded chart has wrong ranks");
+	}
+
+	// saved and loaded back, with the signature of the chart files they came from
+	const std::string path = "test_sources.charts";
+	ChartSources loaded;
+	std::vector<const Song*> reloaded;
+	sources.setSignature(42);
+	if (!sources.save(path) || loaded.load(path + ".missing")
+		|| !loaded.load(path) || loaded.signature() != 42
+		|| loaded.size() != 1 || loaded.songs() != chart.size()
+		|| !loaded.membership().ranked("rock", reloaded)
+		|| !std::equal(ranked.begin(), ranked.end(), reloaded.begin(), reloaded.end(),
+			[](const Song *a, const Song *b) { return *a == *b; })
+		|| loaded.membership().rank("rock", chart[0]) != chart.size()
+		|| loaded.update("billboard_rock.json", reversed).size() != 0) {
+		std::remove(path.c_str());
+		throw TestException("Chart sources not saved and loaded properly");
+	}
+	std::remove(path.c_str());
+
+	TopNResponseMessage response(TopNMessage("rock", 2, "Imagine"), { chart[1], chart[2] }, { 2, 3 },
+		MESSAGE_STATUS_OK);
+	std::unique_ptr<Message> parsed = JsonConverter::parseMessage(JsonConverter::toJSON(response));
+	TopNResponseMessage &copy = (TopNResponseMessage &)(*parsed);
+	if (copy.top.count != 2 || copy.top.artist_regex != "Imagine" || copy.ranks != response.ranks
+		|| copy.results != response.results) {
+		throw TestException("Top songs not sent properly");
+	}
+}
+
+/**
+* Adds years of weekly snapshots of a made-up chart, in which every song enters
+* at the bottom and climbs one place a week.  If successful, weeks on chart,
+* peaks and trajectories are right whatever order the snapshots are added in,
+* and each position takes about two bytes.
+*
+* @param nweeks number of weekly snapshots
+* @throws TestException if the history is wrong or too large
+*/
+void testChartHistory(int nweeks) {
+
+	uint32_t start;
+	std::string file;
+	uint32_t date;
+	if (!ChartHistory::parseDate("2000-02-29", start) || ChartHistory::formatDate(start) != "2000-02-29"
+		|| ChartHistory::parseDate("2017-13-01", date) || ChartHistory::formatDate(0) != "1970-01-01"
+		|| !ChartHistory::parseName("billboard_rock.2017-11-04.json", file, date)
+		|| file != "billboard_rock.json" || ChartHistory::formatDate(date) != "2017-11-04"
+		|| ChartHistory::parseName("billboard_rock.json", file, date)) {
+		throw TestException("Chart dates not parsed properly");
+	}
+
+	// in week w, song w+r-1 is at rank r
+	const int size = 100;
+	auto snapshot = [&](int w) {
+		std::vector<Song> songs;
+		for (int r = 1; r <= size; ++r) {
+			songs.push_back(Song("History Artist", "Song " + std::to_string(w + r - 1)));
+		}
+		return songs;
+	};
+	ChartHistory history;
+	ChartHistory reversed;
+	for (int w = 0; w < nweeks; ++w) {
+		history.add("rock", start + 7*w, snapshot(w));
+		reversed.add("rock", start + 7*(nweeks - 1 - w), snapshot(nweeks - 1 - w));
+	}
+	if (history.add("rock", start, snapshot(0)) || history.entries() != (size_t)nweeks*size
+		|| history.bytes() > history.entries()*2 + history.size()*4) {
+		throw TestException("Chart history too large: " + std::to_string(history.bytes()) + " bytes");
+	}
+
+	Song song("History Artist", "Song 150");
+	for (const ChartHistory *h : { &history, &reversed }) {
+		std::vector<ChartStats> stats = h->stats(song, true);
+		if (stats.size() != 1 || stats[0].chart != "rock" || stats[0].weeks != size || stats[0].peak != 1
+			|| stats[0].weeks_at_peak != 1 || stats[0].first != start + 7*(150 - size + 1)
+			|| stats[0].last != start + 7*150 || stats[0].last_rank != 1
+			|| stats[0].positions.size() != size || stats[0].positions[0].rank != size
+			|| stats[0].positions[size - 1].date != stats[0].last) {
+			throw TestException("Wrong chart history for " + song.title);
+		}
+	}
+	if (!history.stats(song).front().positions.empty() || !history.stats(Song("Nobody", "Nothing")).empty()) {
+		throw TestException("Chart history gave unexpected results");
+	}
+
+	ChartHistoryResponseMessage response(ChartHistoryMessage(song, true), history.stats(song, true),
+		MESSAGE_STATUS_OK);
+	std::unique_ptr<Message> parsed = JsonConverter::parseMessage(JsonConverter::toJSON(response));
+	ChartHistoryResponseMessage &copy = (ChartHistoryResponseMessage &)(*parsed);
+	if (copy.charts.size() != 1 || copy.charts[0].first != response.charts[0].first
+		|| copy.charts[0].positions.size() != size
+		|| copy.charts[0].positions[7].date != response.charts[0].positions[7].date) {
+		throw TestException("Chart history not sent properly");
+	}
+}
+
+/**
+* Gives made-up songs metadata, then searches them by year and duration ranges.
+* If successful, both narrow ranges (answered from the sorted index) and wide
+* ones (answered by scanning) give exactly the songs in range, and metadata is
+* sent only when known.
+*
+* @param nsongs number of made-up songs
+* @throws TestException if a range gives the wrong songs
+*/
+void testSongInfo(int nsongs) {
+
+	// every 10th song has no metadata
+	MusicLibrary lib;
+	std::vector<Song> songs;
+	for (int i = 0; i < nsongs; ++i) {
+		songs.push_back(Song("Info Artist", "Song " + std::to_string(i)));
+	}
+	lib.build(songs);
+	auto yearOf = [](int i) { return (uint32_t)(1950 + i % 70); };
+	auto durationOf = [](int i) { return (uint32_t)(120 + i % 300); };
+	for (int i = 0; i < nsongs; ++i) {
+		if (i % 10 != 0) {
+			lib.setInfo(songs[i], SongInfo("Album " + std::to_string(i % 5), yearOf(i), durationOf(i), "pop"));
+		}
+	}
+
+	auto check = [&](const SongInfoFilter &filter) {
+		std::set<Song> expected;
+		for (int i = 0; i < nsongs; ++i) {
+			if (i % 10 != 0 && (filter.year_min == 0 || yearOf(i) >= filter.year_min)
+				&& (filter.year_max == 0 || yearOf(i) <= filter.year_max)
+				&& (filter.duration_min == 0 || durationOf(i) >= filter.duration_min)
+				&& (filter.duration_max == 0 || durationOf(i) <= filter.duration_max)) {
+				expected.insert(songs[i]);
+			}
+		}
+		std::vector<const Song*> candidates;
+		lib.select(filter, candidates);
+		std::vector<Song> found = lib.find(candidates, "", "");
+		if (std::set<Song>(found.begin(), found.end()) != expected) {
+			throw TestException("Metadata range gave wrong songs: " + std::to_string(found.size())
+				+ " instead of " + std::to_string(expected.size()));
+		}
+	};
+	check(SongInfoFilter(1985, 1985));
+	check(SongInfoFilter(1980, 1989));
+	check(SongInfoFilter(1960));
+	check(SongInfoFilter(0, 0, 200, 210));
+	check(SongInfoFilter(1970, 2000, 0, 300));
+
+	// changed metadata moves songs between ranges
+	lib.setInfo(songs[1], SongInfo("", 2030));
+	std::vector<const Song*> candidates;
+	lib.select(SongInfoFilter(2030, 2030), candidates);
+	if (candidates.size() != 1 || *candidates[0] != songs[1] || lib.info(songs[1]).album != ""
+		|| lib.info(songs[2]).album != "Album 2" || !lib.info(songs[0]).empty()) {
+		throw TestException("Changed metadata not stored properly");
+	}
+
+	// only known fields are sent
+	AddMessage add(songs[1], SongInfo("", 2030));
+	JSON jadd = JsonConverter::toJSON(add);
+	std::unique_ptr<Message> parsed = JsonConverter::parseMessage(jadd);
+	if (jadd[MESSAGE_SONG].count(MESSAGE_SONG_ALBUM) != 0 || ((AddMessage &)(*parsed)).info.year != 2030) {
+		throw TestException("Metadata not sent properly with song");
+	}
+	SearchResponseMessage response(SearchMessage("", "", "", SongInfoFilter(1980, 1989)),
+		{ songs[2], songs[3] }, MESSAGE_STATUS_OK, "", { lib.info(songs[2]), lib.info(songs[3]) });
+	parsed = JsonConverter::parseMessage(JsonConverter::toJSON(response));
+	SearchResponseMessage &copy = (SearchResponseMessage &)(*parsed);
+	if (copy.search.info_filter.year_max != 1989 || copy.metadata.size() != 2
+		|| copy.metadata[1].duration != durationOf(3) || copy.metadata[0].genre != "pop") {
+		throw TestException("Metadata not sent properly with results");
+	}
+}
+
+/**
+* Gives made-up songs ids, and looks them up and removes them by id.
+* If successful, ids are distinct, the same whatever order songs are added in,
+* and only find songs still in the library.
+*
+* @param nsongs number of made-up songs
+* @throws TestException if an id is wrong or not sent properly
+*/
+void testSongIds(int nsongs) {
+
+	std::vector<Song> songs;
+	for (int i = 0; i < nsongs; ++i) {
+		songs.push_back(Song("Id Artist " + std::to_string(i % 37), "Song " + std::to_string(i)));
+	}
+	MusicLibrary lib;
+	lib.build(songs);
+
+	// same ids when added one at a time, in reverse
+	MusicLibrary reversed;
+	for (int i = nsongs; i-- > 0;) {
+		reversed.add(songs[i]);
+	}
+	std::set<uint64_t> ids;
+	for (const auto &song : songs) {
+		uint64_t id = lib.id(song);
+		if (id == SONG_ID_NONE || id != reversed.id(song) || lib.song(id) == nullptr
+			|| *lib.song(id) != song) {
+			throw TestException("Wrong id for " + song.toString());
+		}
+		ids.insert(id);
+	}
+	if (ids.size() != songs.size() || lib.id(Song("Id Artist", "Unknown")) != SONG_ID_NONE) {
+		throw TestException("Song ids are not distinct");
+	}
+
+	// removed songs are not found by id, and get the same id back when added again
+	uint64_t id = lib.id(songs[3]);
+	lib.remove(songs[3]);
+	if (lib.song(id) != nullptr || lib.id(songs[3]) != SONG_ID_NONE) {
+		throw TestException("Removed song still found by id");
+	}
+	lib.add(songs[3]);
+	if (lib.song(id) == nullptr || lib.id(songs[3]) != id
+		|| lib.song(SongIds::hash(Song("Id Artist", "Unknown"))) != nullptr) {
+		throw TestException("Song not found by id after adding back");
+	}
+
+	// colliding songs: the later one is salted, and no id moves when the first goes
+	SongIds narrow(4);
+	std::map<uint64_t, size_t> first;
+	size_t winner = 0, loser = 0;
+	for (size_t i = 0; i < songs.size() && loser == 0; ++i) {
+		uint64_t hashed = SongIds::hash(songs[i]) & 0xF;
+		if (first.count(hashed) != 0 && hashed != SONG_ID_NONE) {
+			winner = first[hashed];
+			loser = i;
+		}
+		first.insert(std::make_pair(hashed, i));
+	}
+	uint64_t won = narrow.add(songs[winner]);
+	uint64_t lost = narrow.add(songs[loser]);
+	if (loser == 0 || won == lost || narrow.salt(won) != 0 || narrow.salt(lost) == 0) {
+		throw TestException("Colliding song ids not told apart");
+	}
+	narrow.remove(songs[winner]);
+	if (narrow.id(songs[loser]) != lost || narrow.song(lost) == nullptr || *narrow.song(lost) != songs[loser]
+		|| narrow.song(won) != nullptr || narrow.id(songs[winner]) != SONG_ID_NONE) {
+		throw TestException("Song id moved when the song it collided with was removed");
+	}
+	narrow.remove(songs[loser]);
+	if (narrow.add(songs[loser]) != lost || narrow.add(songs[winner]) != won || narrow.size() != 2) {
+		throw TestException("Colliding songs did not get their ids back");
+	}
+
+	// removing by id sends no song until it is known
+	JSON jremove = JsonConverter::toJSON(RemoveMessage(id));
+	std::unique_ptr<Message> parsed = JsonConverter::parseMessage(jremove);
+	if (jremove.count(MESSAGE_SONG) != 0 || ((RemoveMessage &)(*parsed)).id != id) {
+		throw TestException("Remove by id not sent properly");
+	}
+
+	// ids are sent with results
+	LookupResponseMessage lookup(LookupMessage({ id, 1 }), { songs[3] }, { id }, MESSAGE_STATUS_OK);
+	parsed = JsonConverter::parseMessage(JsonConverter::toJSON(lookup));
+	LookupResponseMessage &copy = (LookupResponseMessage &)(*parsed);
+	if (copy.lookup.ids.size() != 2 || copy.ids.size() != 1 || copy.ids[0] != id
+		|| copy.results[0] != songs[3] || !copy.metadata.empty()) {
+		throw TestException("Lookup not sent properly");
+	}
+	SearchResponseMessage search(SearchMessage("", ""), { songs[3] }, MESSAGE_STATUS_OK, "", {}, { id });
+	parsed = JsonConverter::parseMessage(JsonConverter::toJSON(search));
+	if (((SearchResponseMessage &)(*parsed)).ids != std::vector<uint64_t>{ id }) {
+		throw TestException("Search result ids not sent properly");
+	}
+}
+
+/**
+* Autocompletes artists of made-up songs, while songs are added and removed.
+* If successful, completions match counting the songs of every artist with the
+* prefix, whatever case the prefix is typed in.
+*
+* @param nsongs number of made-up songs
+* @throws TestException if the completions are wrong
+*/
+void testAutocomplete(int nsongs) {
+
+	// artists with very different numbers of songs, sharing long prefixes
+	const char *names[] = { "The Band ", "the bandits ", "Thee ", "A", "Abba " };
+	std::vector<Song> songs;
+	for (int i = 0; i < nsongs; ++i) {
+		int a = (i % 7) * (i % 11);
+		songs.push_back(Song(names[a % 5] + std::to_string(a), "Track " + std::to_string(i)));
+	}
+	MusicLibrary lib;
+	lib.build(songs);
+
+	auto lower = [](std::string str) {
+		for (char &c : str) {
+			c = (char)std::tolower((unsigned char)c);
+		}
+		return str;
+	};
+	auto check = [&](const std::string &prefix, size_t k) {
+		std::map<std::string, uint32_t> counts;
+		for (const auto &song : lib.songs()) {
+			std::string key = lower(song.artist);
+			if (key.compare(0, prefix.size(), lower(prefix)) == 0) {
+				++counts[key];
+			}
+		}
+		std::vector<std::pair<uint32_t, std::string>> expected;
+		for (const auto &count : counts) {
+			expected.push_back(std::make_pair(count.second, count.first));
+		}
+		std::sort(expected.begin(), expected.end(), [](const std::pair<uint32_t, std::string> &a,
+			const std::pair<uint32_t, std::string> &b) {
+			return a.first != b.first ? a.first > b.first : a.second < b.second;
+		});
+		expected.resize(std::min(expected.size(), k));
+		std::vector<Completion> found = lib.complete(true, prefix, k);
+		bool same = found.size() == expected.size();
+		for (size_t i = 0; same && i < found.size(); ++i) {
+			same = found[i].songs == expected[i].first && lower(found[i].text) == expected[i].second;
+		}
+		if (!same) {
+			throw TestException("Wrong completions of \"" + prefix + "\": "
+				+ std::to_string(found.size()) + " instead of " + std::to_string(expected.size()));
+		}
+	};
+	const char *prefixes[] = { "", "t", "THE", "the band", "the bandi", "a", "Abba 1", "x" };
+	for (const char *prefix : prefixes) {
+		check(prefix, 5);
+		check(prefix, 100);
+	}
+
+	// the tries follow the library as songs come and go
+	for (int i = 0; i < nsongs; i += 3) {
+		lib.remove(songs[i]);
+	}
+	lib.add(Song("The Band 999", "New"));
+	lib.add(Song("The Band 999", "Newer"));
+	for (const char *prefix : prefixes) {
+		check(prefix, 5);
+	}
+	for (const auto &song : songs) {
+		lib.remove(song);
+	}
+	std::vector<Completion> last = lib.complete(true, "T", 10);
+	if (last.size() != 1 || last[0].text != "The Band 999" || last[0].songs != 2
+		|| !lib.complete(true, "a", 10).empty() || lib.complete(false, "new", 10).size() != 2) {
+		throw TestException("Removed songs still completed");
+	}
+
+	AutocompleteResponseMessage response(AutocompleteMessage(MESSAGE_SONG_ARTIST, "t", 10), last,
+		MESSAGE_STATUS_OK);
+	std::unique_ptr<Message> parsed = JsonConverter::parseMessage(JsonConverter::toJSON(response));
+	AutocompleteResponseMessage &copy = (AutocompleteResponseMessage &)(*parsed);
+	if (copy.autocomplete.prefix != "t" || copy.completions.size() != 1
+		|| copy.completions[0].text != "The Band 999" || copy.completions[0].songs != 2) {
+		throw TestException("Completions not sent properly");
+	}
+}
+
+/**
+* Edit distance between two strings, ignoring case, the slow way
+*/
+uint32_t editDistance(const std::string &a, const std::string &b) {
+	std::vector<uint32_t> row(b.size() + 1);
+	for (size_t j = 0; j <= b.size(); ++j) {
+		row[j] = (uint32_t)j;
+	}
+	for (size_t i = 1; i <= a.size(); ++i) {
+		uint32_t diagonal = row[0];
+		row[0] = (uint32_t)i;
+		for (size_t j = 1; j <= b.size(); ++j) {
+			uint32_t above = row[j];
+			bool same = std::tolower((unsigned char)a[i - 1]) == std::tolower((unsigned char)b[j - 1]);
+			row[j] = std::min({ diagonal + (same ? 0 : 1), above + 1, row[j - 1] + 1 });
+			diagonal = above;
+		}
+	}
+	return row[b.size()];
+}
+
+/**
+* Searches made-up songs for misspelt artists and titles.
+* If successful, fuzzy searches find exactly the songs a comparison against
+* every song finds, with the same distances, closest first.
+*
+* @param nsongs number of made-up songs
+* @throws TestException if a fuzzy search gives the wrong songs
+*/
+void testFuzzySearch(int nsongs) {
+
+	const char *artists[] = { "Imagine Dragons", "Imagine", "Dragon", "The Killers", "Killer Queen",
+		"ABBA", "Abbe", "U2", "Sia", "A Very Long Artist Name That Goes On And On Past Sixty Four Characters" };
+	std::vector<Song> songs;
+	for (int i = 0; i < nsongs; ++i) {
+		songs.push_back(Song(artists[i % 10], "Song Number " + std::to_string(i % 97)));
+	}
+	MusicLibrary lib;
+	lib.build(songs);
+
+	auto check = [&](const std::string &artist, const std::string &title, uint32_t max) {
+		std::set<std::pair<uint32_t, Song>> expected;
+		for (const auto &song : lib.songs()) {
+			uint32_t da = artist.empty() ? 0 : editDistance(artist, song.artist);
+			uint32_t dt = title.empty() ? 0 : editDistance(title, song.title);
+			if (da <= max && dt <= max) {
+				expected.insert(std::make_pair(da + dt, song));
+			}
+		}
+		std::vector<uint32_t> distances;
+		std::vector<Song> found = lib.fuzzyFind(artist, title, max, distances);
+		std::set<std::pair<uint32_t, Song>> got;
+		for (size_t i = 0; i < found.size(); ++i) {
+			if (i > 0 && distances[i] < distances[i - 1]) {
+				throw TestException("Fuzzy results not closest first");
+			}
+			got.insert(std::make_pair(distances[i], found[i]));
+		}
+		if (got != expected || found.size() != expected.size()) {
+			throw TestException("Fuzzy search \"" + artist + " - " + title + "\" found "
+				+ std::to_string(found.size()) + " songs instead of " + std::to_string(expected.size()));
+		}
+	};
+	check("Imagin Dragons", "", 1);
+	check("imagine dragon", "", 2);
+	check("Killrs", "", 2);
+	check("The Killers", "Song Numbr 12", 1);
+	check("", "song number 5", 1);
+	check("abba", "", 1);
+	check("U3", "", 1);
+	check("x", "", 2);
+	check("A Very Long Artist Name That Goes On And On Past Sixty Four Charactrs", "", 2);
+	check("Sia", "Song Number 1", 3);
+
+	for (int i = 0; i < nsongs; i += 2) {
+		lib.remove(songs[i]);
+	}
+	lib.add(Song("Imagine Dragon", "Radioactive"));
+	check("Imagin Dragons", "", 2);
+	check("", "Radioactiv", 1);
+
+	FuzzySearchResponseMessage response(FuzzySearchMessage("Imagin Dragons", "", 1),
+		{ Song("Imagine Dragons", "Song Number 1") }, { 1 }, MESSAGE_STATUS_OK, "", { 42 });
+	std::unique_ptr<Message> parsed = JsonConverter::parseMessage(JsonConverter::toJSON(response));
+	FuzzySearchResponseMessage &copy = (FuzzySearchResponseMessage &)(*parsed);
+	if (copy.search.artist != "Imagin Dragons" || copy.search.max_distance != 1
+		|| copy.distances != std::vector<uint32_t>{ 1 } || copy.ids != std::vector<uint64_t>{ 42 }) {
+		throw TestException("Fuzzy search not sent properly");
+	}
+}
+
+/**
+* Ranks made-up songs for free-text queries.
+* If successful, the top results for every query and count are the ones found by
+* scoring every song, in the same order and with the same kind of match.
+*
+* @param nsongs number of made-up songs
+* @throws TestException if a ranked search gives the wrong songs
+*/
+void testRankedSearch(int nsongs) {
+
+	const char *artists[] = { "Imagine Dragons", "Imagine", "Dragon", "The Killers", "Killer Queen",
+		"The Theme", "Them", "U2", "Sia", "Queens of the Stone Age" };
+	std::vector<Song> songs;
+	for (int i = 0; i < nsongs; ++i) {
+		songs.push_back(Song(artists[(i * 7) % 10], (i % 3 == 0 ? "Dragon " : "Song ") + std::to_string(i % 89)));
+	}
+	MusicLibrary lib;
+	lib.build(songs);
+
+	auto lower = [](std::string str) {
+		for (char &c : str) {
+			c = (char)std::tolower((unsigned char)c);
+		}
+		return str;
+	};
+	auto check = [&](const std::string &query, size_t count) {
+		// best match of each song, through its artist or title
+		std::string q = lower(query);
+		uint32_t edits = q.size() < 5 ? 1 : 2;
+		std::vector<std::pair<std::pair<int, uint32_t>, Song>> expected;
+		for (const auto &song : lib.songs()) {
+			std::pair<int, uint32_t> best(0, 0);
+			for (const std::string &field : { lower(song.artist), lower(song.title) }) {
+				std::pair<int, uint32_t> match(0, 0);
+				uint32_t distance = editDistance(q, field);
+				if (field == q) {
+					match = std::make_pair(-MATCH_EXACT, 0u);
+				}
+				else if (field.compare(0, q.size(), q) == 0) {
+					match = std::make_pair(-MATCH_PREFIX, (uint32_t)(field.size() - q.size()));
+				}
+				else if (field.find(q) != std::string::npos) {
+					match = std::make_pair(-MATCH_SUBSTRING, (uint32_t)(field.size() - q.size()));
+				}
+				else if (distance <= edits) {
+					match = std::make_pair(-MATCH_FUZZY, distance);
+				}
+				if (match.first != 0 && (best.first == 0 || match < best)) {
+					best = match;
+				}
+			}
+			if (best.first != 0) {
+				expected.push_back(std::make_pair(best, song));
+			}
+		}
+		std::vector<const std::pair<std::pair<int, uint32_t>, Song>*> order;
+		for (const auto &entry : expected) {
+			order.push_back(&entry);
+		}
+		std::sort(order.begin(), order.end(), [](const std::pair<std::pair<int, uint32_t>, Song> *a,
+			const std::pair<std::pair<int, uint32_t>, Song> *b) {
+			return a->first != b->first ? a->first < b->first : a->second < b->second;
+		});
+
+		std::vector<RankedMatch> found = lib.rankedFind(query, count);
+		bool same = found.size() == std::min(count, order.size());
+		for (size_t i = 0; same && i < found.size(); ++i) {
+			same = *found[i].song == order[i]->second && -(int)found[i].kind == order[i]->first.first
+				&& found[i].extra == order[i]->first.second && found[i].id == lib.id(*found[i].song);
+		}
+		if (!same) {
+			throw TestException("Ranked search \"" + query + "\" for " + std::to_string(count)
+				+ " gave wrong songs");
+		}
+	};
+	const char *queries[] = { "Imagine", "the", "THEM", "dragon", "song 1", "Killrs", "queen", "u", "sai", "zzz" };
+	size_t counts[] = { 1, 5, 20, 1000 };
+	for (const char *query : queries) {
+		for (size_t count : counts) {
+			check(query, count);
+		}
+	}
+
+	for (int i = 0; i < nsongs; i += 2) {
+		lib.remove(songs[i]);
+	}
+	check("the", 20);
+	check("Dragon", 20);
+	if (!lib.rankedFind("", 20).empty()) {
+		throw TestException("Empty ranked search found songs");
+	}
+
+	RankedSearchResponseMessage response(RankedSearchMessage("the"), { songs[1] }, { MATCH_PREFIX },
+		MESSAGE_STATUS_OK, "", { 7 });
+	JSON jresponse = JsonConverter::toJSON(response);
+	std::unique_ptr<Message> parsed = JsonConverter::parseMessage(jresponse);
+	RankedSearchResponseMessage &copy = (RankedSearchResponseMessage &)(*parsed);
+	if (jresponse[MESSAGE_MATCHES][0] != "prefix" || copy.search.count != RANKED_SEARCH_DEFAULT
+		|| copy.kinds != std::vector<uint32_t>{ MATCH_PREFIX } || copy.ids != std::vector<uint64_t>{ 7 }) {
+		throw TestException("Ranked search not sent properly");
+	}
+}
+
+/**
+* Matches a set of expressions against songs with both Regex and std::regex,
+* then tries unsupported and pathological expressions.  If successful, both
+* agree on every song, unsupported features are rejected, and a pattern that
+* makes std::regex backtrack exponentially runs in linear time.
+*
+* @param nsongs number of songs to match against
+* @throws TestException if the engines disagree or a search is too slow
+*/
+void testRegex(int nsongs) {
+
+	const char *artists[] = { "The Beatles", "Taylor Swift", "AC/DC", "a-ha", "Sigur R\xc3\xb3s",
+		"U2", "Aaaaa", "Beyonc\xc3\xa9", "the the", "" };
+	std::vector<Song> songs;
+	for (int i = 0; i < nsongs; ++i) {
+		songs.push_back(Song(artists[i % 10], "Track " + std::to_string(i) + (i % 4 == 0 ? " (Live)" : "")));
+	}
+	MusicLibrary lib;
+	lib.build(songs);
+
+	const char *patterns[] = { "", "^The", "the$", "[Tt]he", "^[^aeiou]*$", "a|e", "(aa)+a$", "\\d{3}",
+		"^Track 1\\d?$", "\\(Live\\)", "S.*t", "^(?:the )+the$", "[A-Z]{2}/", "a-?h", "\\s\\w+\\s",
+		"^$", "x*", "(a|b)*c", "[0-4]{1,2}[^0-4]", "\\xc3", "Tr(a|ac)k 5$", "(a*)*", "^a{5}$" };
+	for (const char *pattern : patterns) {
+		Regex regex(pattern);
+		std::regex expected(pattern);
+		if (!regex.valid()) {
+			throw TestException(std::string("Valid expression rejected: ") + pattern + ": " + regex.error());
+		}
+		for (const Song &song : lib.songs()) {
+			for (const std::string &field : { song.artist, song.title }) {
+				if (regex.search(field) != std::regex_search(field, expected)) {
+					throw TestException(std::string("Expression ") + pattern + " matched \"" + field
+						+ "\" wrongly");
+				}
+			}
+		}
+	}
+
+	const char *unsupported[] = { "(a)\\1", "(?=a)", "(?!a)", "\\bthe", "(a", "a)", "[z-a]", "*a",
+		"a{2,1}", "a{100000}", "[[:alpha:]]", "[[=a=]]", "[[.a.]]", "(?i)abc" };
+	for (const char *pattern : unsupported) {
+		std::string error;
+		if (Regex::check(pattern, error) || error.empty()) {
+			throw TestException(std::string("Unsupported expression accepted: ") + pattern);
+		}
+	}
+	std::string flags;
+	if (Regex::check("(?i)abc", flags) || flags.find("inline flags are not supported") != 0) {
+		throw TestException("Inline flags reported as: " + flags);
+	}
+	if (!lib.find("(a)\\1", "").empty()) {
+		throw TestException("Unsupported expression found songs");
+	}
+
+	// exponential for a backtracking engine
+	std::string as(100000, 'a');
+	auto start = std::chrono::steady_clock::now();
+	bool matched = Regex("(a*)*b").search(as) || Regex("^(a|aa)+$").search(as + "b");
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (matched || elapsed > 1.0) {
+		throw TestException("Pathological expression took " + std::to_string(elapsed) + " s");
+	}
+}
+
+/**
+* Runs searches on budgets of songs, expression steps and time, and cancels
+* searches through a registry.  If successful, each search stops exactly when its
+* budget runs out, keeping the songs found before, and a cancelled search looks
+* at no more songs.
+*
+* @param nsongs number of songs to search
+* @throws TestException if a search does not stop when it should
+*/
+void testQueryBudget(int nsongs) {
+
+	std::vector<Song> songs;
+	for (int i = 0; i < nsongs; ++i) {
+		songs.push_back(Song("Artist " + std::to_string(i % 37), "Title " + std::to_string(i)));
+	}
+	MusicLibrary lib;
+	lib.build(songs);
+	std::vector<Song> all = lib.find("", "");
+
+	auto check = [&](const std::vector<Song> &results, const QueryBudget &budget, size_t expected,
+		const char *reason, const std::string &what) {
+		bool stopped = reason != nullptr;
+		if (results.size() != expected || budget.exhausted() != stopped
+			|| (stopped && std::string(budget.reason()) != reason)
+			|| !std::equal(results.begin(), results.end(), all.begin())) {
+			throw TestException("Search on " + what + " budget found " + std::to_string(results.size())
+				+ " songs, expected " + std::to_string(expected));
+		}
+	};
+
+	QueryBudget unlimited;
+	check(lib.find("", "", &unlimited), unlimited, all.size(), nullptr, "an unlimited");
+	if (unlimited.songs() != all.size()) {
+		throw TestException("Search did not count the songs it looked at");
+	}
+
+	QueryBudget few(std::chrono::steady_clock::duration::zero(), 100, 0);
+	check(lib.find("", "", &few), few, 100, "song limit reached", "a song");
+
+	uint64_t steps = 0;
+	for (size_t i = 0; i < 10; ++i) {
+		steps += all[i].artist.size() + all[i].title.size();
+	}
+	QueryBudget stepped(std::chrono::steady_clock::duration::zero(), 0, steps);
+	check(lib.find("", "", &stepped), stepped, 10, "expression step limit reached", "a step");
+
+	QueryBudget late(std::chrono::nanoseconds(1), 0, 0);
+	std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	check(lib.find("", "", &late), late, 0, "time limit reached", "a time");
+
+	std::vector<char> data = LibraryImage::build(lib.songs());
+	LibraryImage image(data.data(), data.size());
+	QueryBudget imaged(std::chrono::steady_clock::duration::zero(), 50, 0);
+	check(image.find("", "", &imaged), imaged, 50, "song limit reached", "an image");
+
+	std::vector<const Song*> candidates;
+	for (const auto &song : all) {
+		candidates.push_back(&song);
+	}
+	QueryBudget listed(std::chrono::steady_clock::duration::zero(), 20, 0);
+	check(lib.find(candidates, "", "", 30, &listed), listed, 20, "song limit reached", "a candidate");
+
+	// cancelled from another thread, as by the session's reader, and only by the
+	// session that sent it
+	QueryRegistry queries(std::chrono::steady_clock::duration::zero(), 0, 0);
+	{
+		QueryRegistry::Query query(queries, 1, 42);
+		QueryRegistry::Query other(queries, 2, 42);
+		bool right = false;
+		std::thread([&]() {
+			right = queries.cancel(1, 42) && !queries.cancel(1, 43) && !queries.cancel(3, 42)
+				&& !queries.cancel(1, REQUEST_ID_NONE) && !other.budget().exhausted();
+		}).join();
+		if (!right) {
+			throw TestException("Cancelled the wrong requests");
+		}
+		check(lib.find("", "", &query.budget()), query.budget(), 0, "cancelled", "a cancelled");
+	}
+	if (queries.running() != 0 || queries.cancel(1, 42)) {
+		throw TestException("Finished search still registered");
+	}
+	QueryRegistry limited(std::chrono::steady_clock::duration::zero(), 5, 0);
+	{
+		QueryRegistry::Query query(limited, 1, REQUEST_ID_NONE);
+		check(lib.find("", "", &query.budget()), query.budget(), 5, "song limit reached", "a registry");
+		limited.cancel(1, REQUEST_ID_NONE);
+		if (limited.running() != 1 || std::string(query.budget().reason()) != "song limit reached") {
+			throw TestException("Search without a request id cancelled by the client");
+		}
+		limited.cancelAll();
+		if (!query.budget().exhausted()) {
+			throw TestException("Search not cancelled on shutdown");
+		}
+	}
+
+	// request ids survive the trip through JSON
+	SearchMessage search("a", "b", "", SongInfoFilter(), 99);
+	TopNMessage top("rock", 5, "", "", 98);
+	CancelResponseMessage cancelled(CancelMessage(99), MESSAGE_STATUS_OK);
+	std::unique_ptr<Message> psearch = JsonConverter::parseMessage(JsonConverter::toJSON(search));
+	std::unique_ptr<Message> ptop = JsonConverter::parseMessage(JsonConverter::toJSON(top));
+	std::unique_ptr<Message> pcancel = JsonConverter::parseMessage(JsonConverter::toJSON(cancelled));
+	if (((SearchMessage &)(*psearch)).request != 99 || ((TopNMessage &)(*ptop)).request != 98
+		|| pcancel->type() != MessageType::CANCEL_RESPONSE
+		|| ((CancelResponseMessage &)(*pcancel)).cancel.request != 99
+		|| JsonConverter::toJSON(SearchMessage("a", "b")).count(MESSAGE_REQUEST) != 0) {
+		throw TestException("Request ids not sent properly");
+	}
+}
+
+/**
+* Songs of lyrics search results
+*/
+std::vector<Song> lyricsSongs(const std::vector<LyricsMatch>& matches) {
+	std::vector<Song> out;
+	for (const auto& match : matches) {
+		out.push_back(match.song);
+	}
+	return out;
+}
+
+/**
+* Indexes the lyrics in the data directory, plus a few made-up songs, then
+* searches them.  If successful, exactly the songs containing every query word
+* are found, regardless of case, punctuation and word order.
+*
+* @throws TestException if a search gives the wrong songs
+*/
+void testLyricsSearch() {
+
+	LyricsIndex lyrics;
+	if (lyrics.load("data/lyrics") == 0) {
+		throw TestException("No lyrics indexed");
+	}
+	std::vector<Song> teenage = { { "Katy Perry", "Teenage Dream" } };
+	if (lyricsSongs(lyrics.search("VALENTINE, teenage")) != teenage) {
+		throw TestException("Lyrics search did not find Teenage Dream");
+	}
+
+	Song first("Lyrics Artist", "First");
+	Song second("Lyrics Artist", "Second");
+	lyrics.add(first, "Don't stop believing, hold on to that zebra feeling");
+	lyrics.add(second, "Hold on Zebra, I'm still standing");
+	std::vector<Song> both = { first, second };
+	if (lyricsSongs(lyrics.search("zebra hold")) != both) {
+		throw TestException("Lyrics search did not find both songs");
+	}
+	std::vector<Song> one = { first };
+	if (lyricsSongs(lyrics.search("dont zebra")) != one || !lyrics.search("zebra nothing").empty()
+		|| !lyrics.search("").empty()) {
+		throw TestException("Lyrics search found wrong songs");
+	}
+}
+
+/**
+* Searches lyrics for phrases, in the data directory and in many made-up songs
+* sharing common words so that skip pointers are followed.  If successful,
+* phrases only match words in order and within the allowed distance, and the
+* matching lines are returned.
+*
+* @param nsongs number of made-up songs
+* @throws TestException if a phrase search gives the wrong songs or lines
+*/
+void testLyricsPhrases(int nsongs) {
+
+	// index saved in a pack, reading matching lines back from it
+	const std::string path = "test_lyrics_phrases.pack";
+	LyricsStore store;
+	LyricsIndex lyrics;
+	if (LyricsStore::build("data/lyrics", path) == 0 || !store.open(path)
+		|| !store.index(lyrics) || lyrics.size() != store.size()) {
+		throw TestException("Failed to pack lyrics");
+	}
+	std::string text;
+	std::vector<LyricsMatch> matches = lyrics.search("\"Teenage Dream\"");
+	if (matches.size() != 1 || matches[0].song != Song("Katy Perry", "Teenage Dream")
+		|| matches[0].lines.empty()
+		|| store.lines(matches[0].song, matches[0].lines)[0] != "A teenage dream") {
+		throw TestException("Phrase search did not find Teenage Dream");
+	}
+	store.close();
+	std::remove(path.c_str());
+	if (!lyrics.search("\"dream teenage\"").empty()) {
+		throw TestException("Phrase search matched words out of order");
+	}
+
+	// every song has "la", every 10th has "common word", and every 100th "rare word"
+	// with one word in between
+	std::set<Song> rare;
+	for (int i = 0; i < nsongs; ++i) {
+		text = "la la\n";
+		if (i % 10 == 0) {
+			text += "a common word\n";
+		}
+		if (i % 100 == 0) {
+			text += "the rare old word\n";
+			rare.insert(Song("Phrase Artist", "Song " + std::to_string(i)));
+		}
+		lyrics.add(Song("Phrase Artist", "Song " + std::to_string(i)), text);
+	}
+	matches = lyrics.search("la \"rare word\"~1");
+	if (lyricsSongs(matches) != std::vector<Song>(rare.begin(), rare.end())
+		|| matches[0].lines != std::vector<uint32_t>({ 0, 2 })) {
+		throw TestException("Proximity search found wrong songs: " + std::to_string(matches.size()));
+	}
+	if (!lyrics.search("\"rare word\"").empty()
+		|| lyrics.search("\"common word\" rare").size() != rare.size()) {
+		throw TestException("Phrase search ignored word distance");
+	}
+}
+
+/**
+* Packs the lyrics in the data directory, then reads them back through the
+* cache.  If successful, every song's lyrics match its text file, repeated
+* text compresses, the cache stays within its limit, the index saved in the
+* pack finds what one built from the files does, and damaged packs, indexes
+* and compressed data are rejected.
+*
+* @throws TestException if lyrics are lost or changed by packing
+*/
+void testLyricsStore() {
+
+	// compression round trip, with overlapping matches and no matches at all
+	std::string chorus;
+	for (int i = 0; i < 50; ++i) {
+		chorus += "na na na na, hey hey hey, goodbye\n";
+	}
+	std::string noise;
+	for (int i = 0; i < 1000; ++i) {
+		noise.push_back((char)(i * 7919 % 251));
+	}
+	std::string decompressed;
+	for (const std::string &text : { chorus, noise, std::string() }) {
+		std::string compressed = LyricsStore::compress(text);
+		if (!LyricsStore::decompress(compressed.data(), compressed.size(), text.size(), decompressed)
+			|| decompressed != text) {
+			throw TestException("Lyrics changed by compression");
+		}
+	}
+	std::string compressed = LyricsStore::compress(chorus);
+	if (compressed.size() * 10 > chorus.size()) {
+		throw TestException("Repeated lyrics not compressed: " + std::to_string(compressed.size()));
+	}
+	if (LyricsStore::decompress(compressed.data(), compressed.size() - 1, chorus.size(), decompressed)
+		|| LyricsStore::decompress(compressed.data(), compressed.size(), chorus.size() + 1, decompressed)) {
+		throw TestException("Damaged compressed lyrics accepted");
+	}
+
+	// every song's lyrics, read through a cache too small to hold them all
+	const std::string path = "test_lyrics.pack";
+	std::vector<std::string> names = Catalog::list("data/lyrics", LYRICS_FILE_SUFFIX);
+	if (LyricsStore::build("data/lyrics", path) != names.size()) {
+		throw TestException("Failed to pack lyrics");
+	}
+	LyricsStore store(2048);
+	if (!store.open(path) || store.size() != names.size()
+		|| store.sourceSignature() != LyricsStore::signature("data/lyrics")) {
+		throw TestException("Failed to open lyrics pack");
+	}
+	for (int pass = 0; pass < 2; ++pass) {
+		for (const auto &name : names) {
+			std::string artist, title;
+			LyricsIndex::parseName(name, artist, title);
+			std::ifstream fin("data/lyrics/" + name, std::ios::binary);
+			std::ostringstream ss;
+			ss << fin.rdbuf();
+			std::shared_ptr<const std::string> text = store.lyrics(Song(artist, title));
+			if (!text || *text != ss.str()) {
+				throw TestException("Packed lyrics differ from " + name);
+			}
+			if (store.cacheBytes() > 2048) {
+				throw TestException("Lyrics cache over its limit: " + std::to_string(store.cacheBytes()));
+			}
+		}
+	}
+	store.lyrics(store.song(0));
+	store.lyrics(store.song(0));
+	if (store.hits() == 0 || store.lyrics(Song("Nobody", "Nothing")) != nullptr) {
+		throw TestException("Lyrics cache gave wrong results");
+	}
+
+	// the index saved in the pack searches like one built from the files, by library ids
+	LyricsIndex built, loaded;
+	built.load("data/lyrics");
+	if (!store.index(loaded) || loaded.size() != built.size() || loaded.words() != built.words()
+		|| loaded.bytes() != built.bytes()) {
+		throw TestException("Saved lyrics index differs from the lyrics");
+	}
+	for (const char *query : { "teenage dream", "\"teenage dream\"", "love", "the" }) {
+		std::vector<LyricsMatch> expected = built.search(query);
+		std::vector<LyricsMatch> found = loaded.search(query);
+		bool same = expected.size() == found.size();
+		for (size_t i = 0; same && i < found.size(); ++i) {
+			same = found[i].song == expected[i].song && found[i].lines == expected[i].lines;
+		}
+		if (!same) {
+			throw TestException("Saved lyrics index gave other results for: " + std::string(query));
+		}
+	}
+	if (loaded.id(store.song(0)) != SongIds::hash(store.song(0))) {
+		throw TestException("Saved lyrics index not keyed by song id");
+	}
+
+	// a damaged saved index is rejected
+	std::string saved;
+	built.save(saved);
+	std::vector<char> image = LibraryImage::build(std::set<Song>({ store.song(0) }));
+	if (loaded.load(LibraryImage(image.data(), image.size()), saved.data(), saved.size() - 1)
+		|| loaded.size() != 0) {
+		throw TestException("Damaged lyrics index accepted");
+	}
+	store.close();
+
+	// a truncated pack is rejected
+	std::ifstream fin(path, std::ios::binary);
+	std::string pack((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+	fin.close();
+	{
+		std::ofstream fout(path, std::ios::binary | std::ios::trunc);
+		fout.write(pack.data(), pack.size() - 1);
+	}
+	if (store.open(path)) {
+		throw TestException("Truncated lyrics pack accepted");
+	}
+	std::remove(path.c_str());
+
+	// rewriting a lyrics file outdates the pack, even at the same size
+	const std::string edited = "Signature Artist - Signature Song" LYRICS_FILE_SUFFIX;
+	{
+		std::ofstream fout(edited, std::ios::binary);
+		fout << "first verse";
+	}
+	uint64_t before = LyricsStore::signature(".");
+	std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+	{
+		std::ofstream fout(edited, std::ios::binary | std::ios::trunc);
+		fout << "other verse";
+	}
+	uint64_t after = LyricsStore::signature(".");
+	std::remove(edited.c_str());
+	if (before == after) {
+		throw TestException("Edited lyrics file not noticed by the pack signature");
+	}
+}
+
+/**
+* Builds a flat image of the library, then checks that it contains exactly
+* the library's songs and that searches return the same results.
+*
+* @param lib library to copy
+* @param artist_regex artist search regular expression
+* @param title_regex title search regular expression
+* @throws TestException if the image differs from the library
+*/
+void testLibraryImage(const MusicLibrary& lib,
+	const std::string& artist_regex, const std::string& title_regex) {
+
+	std::vector<char> data = LibraryImage::build(lib.songs());
+	LibraryImage image(data.data(), data.size());
+	if (!image.valid() || image.size() != lib.size()) {
+		throw TestException("Library image not properly built");
+	}
 
-	// load  data from files
-	std::vector<std::string> filenames = {
-		"data/billboard_hot_100.json",
-		"data/billboard_greatest_hot_100.json",
-		"data/billboard_adult_contemporary.json",
-		"data/billboard_adult_pop.json",
-		"data/billboard_alternative.json",
-		"data/billboard_country.json",
-		"data/billboard_electronic.json",
-		"data/billboard_jazz.json",
-		"data/billboard_r&b.json",
-		"data/billboard_rap.json",
-		"data/billboard_rock.json",
+	size_t i = 0;
+	for (const auto& song : lib.songs()) {
+		if (image.song(i++) != song || !image.contains(song)) {
+			throw TestException(std::string("Song not properly stored in image: ")
+				+ song.toString());
+		}
+	}
+	if (image.contains(Song("Not An Artist", "Not A Song"))) {
+		throw TestException("Image contains a song that was never added");
+	}
+
+	// truncated images must be rejected
+	if (LibraryImage(data.data(), data.size() - 1).valid()) {
+		throw TestException("Truncated library image accepted");
+	}
+
+	// images of version 1 have a shorter header, without a log position
+	LibraryImage::setLogPosition(data, 42);
+	LibraryImageHeader header;
+	std::memcpy(&header, data.data(), sizeof(header));
+	header.version = 1;
+	header.size -= sizeof(header) - LIBRARY_IMAGE_V1_HEADER;
+	header.records -= sizeof(header) - LIBRARY_IMAGE_V1_HEADER;
+	header.strings -= sizeof(header) - LIBRARY_IMAGE_V1_HEADER;
+	std::vector<char> v1(data.begin() + (sizeof(header) - LIBRARY_IMAGE_V1_HEADER), data.end());
+	std::memcpy(v1.data(), &header, LIBRARY_IMAGE_V1_HEADER);
+	LibraryImage old(v1.data(), v1.size());
+	if (LibraryImage(data.data(), data.size()).logPosition() != 42 || !old.valid()
+		|| old.logPosition() != 0 || old.size() != image.size() || old.song(0) != image.song(0)) {
+		throw TestException("Library image log position not properly kept");
+	}
+
+	std::vector<Song> expected = lib.find(artist_regex, title_regex);
+	std::vector<Song> results = image.find(artist_regex, title_regex);
+	if (results.size() != expected.size()
+		|| !std::equal(results.begin(), results.end(), expected.begin())) {
+		throw TestException("Image search results differ from library for: "
+			+ artist_regex + " - " + title_regex);
+	}
+}
+
+/**
+* Saves the library as a snapshot, maps it back in, and serves a new library
+* from the mapping.  If successful, the mapped library behaves exactly like the
+* original, including songs added to and removed from it afterwards.
+*
+* @param lib library to snapshot
+* @throws TestException if the mapped library differs
+*/
+void testSnapshot(const MusicLibrary& lib) {
+
+	const std::string path = "test_snapshot.bin";
+	if (!LibraryImage::save(LibraryImage::build(lib.songs()), path)) {
+		throw TestException("Failed to save snapshot");
+	}
+
+	{
+		MappedFile file;
+		if (!file.open(path)) {
+			throw TestException("Failed to map snapshot");
+		}
+		MusicLibrary mapped;
+		mapped.attach(LibraryImage(file.data(), file.size()));
+		if (mapped.size() != lib.size() || mapped.songs() != lib.songs()) {
+			throw TestException("Mapped snapshot differs from library");
+		}
+
+		Song existing("Taylor Swift", "...Ready For It?");
+		Song added("Snapshot Artist", "Ready Or Not");
+		testRemoveSong(mapped, existing.artist, existing.title);
+		testAddSong(mapped, added.artist, added.title);
+		if (mapped.remove(existing) || !mapped.add(existing) || mapped.add(existing)) {
+			throw TestException("Base song not properly removed and restored");
+		}
+		testFindSongs(mapped, "Snapshot|Taylor", "[rR]eady", { existing, added });
+		if (mapped.size() != lib.size() + 1) {
+			throw TestException("Mapped library size not updated");
+		}
+
+		// ids and indexes are only built now, covering the changes made before
+		Song removed = *lib.songs().begin();
+		mapped.remove(removed);
+		for (const Song &song : mapped.songs()) {
+			const Song *found = mapped.song(mapped.id(song));
+			if (found == nullptr || *found != song) {
+				throw TestException("Mapped song has no id: " + song.title);
+			}
+		}
+		std::vector<Completion> completions = mapped.complete(true, "Snapshot", 10);
+		if (mapped.id(removed) != SONG_ID_NONE || completions.size() != 1
+			|| completions[0].songs != 1) {
+			throw TestException("Mapped library not properly indexed");
+		}
+	}
+
+	std::remove(path.c_str());
+}
+
+/**
+* Named shared memory kept in this process, standing in for the blocks the server
+* shares with its workers.  Like the real thing, an unlinked block stays mapped
+* until its last mapping goes away.
+*/
+class TestSharedMemory {
+	static std::map<std::string, std::shared_ptr<std::vector<char>>> &blocks() {
+		static std::map<std::string, std::shared_ptr<std::vector<char>>> blocks;
+		return blocks;
+	}
+
+	std::string name_;
+	std::shared_ptr<std::vector<char>> block_;
+
+public:
+	TestSharedMemory(const std::string &name, size_t size, bool readonly = false) :
+		name_(name), block_(blocks()[name]) {
+		if (block_ == nullptr) {
+			block_ = blocks()[name] = std::make_shared<std::vector<char>>(size);
+		}
+	}
+
+	void *get() {
+		return block_->data();
+	}
+
+	void unlink() {
+		blocks().erase(name_);
+	}
+
+	static bool exists(const std::string &name) {
+		return blocks().count(name) != 0;
+	}
+};
+
+/**
+* Publishes images of a library as it changes, the way the server does for its
+* workers, and maps them the way a worker does.  If successful, a worker switches to
+* each new image while searches holding the one before keep it, and only the last
+* two images stay published.
+*
+* @param lib library to start from
+* @throws TestException if a worker maps the wrong image
+*/
+void testImagePublisher(const MusicLibrary& lib) {
+
+	std::vector<Song> songs;
+	for (const Song &song : lib.songs()) {
+		songs.push_back(song);
+	}
+	MusicLibrary changing;
+	changing.build(songs);
+
+	ImageControl control;
+	ImagePublisher<TestSharedMemory> publisher("test_image", control);
+	PublishedImage<TestSharedMemory> images("test_image", control);
+	if (images.current() != nullptr) {
+		throw TestException("Image mapped before any was published");
+	}
+
+	uint64_t version = changing.version();
+	publisher.publish(LibraryImage::build(changing.songs()));
+	std::shared_ptr<const LibraryImage> before = images.current();
+	if (before == nullptr || before->size() != lib.size() || images.generation() != 1) {
+		throw TestException("Published image not mapped");
+	}
+
+	// changes move the version on, and reach the worker with the next image only
+	Song added("Publisher Artist", "Next Image");
+	if (changing.add(*lib.songs().begin()) || changing.version() != version
+		|| !changing.add(added) || changing.version() == version) {
+		throw TestException("Library version not properly updated");
+	}
+	if (images.current()->contains(added)) {
+		throw TestException("Change seen before it was published");
+	}
+	publisher.publish(LibraryImage::build(changing.songs()));
+	std::shared_ptr<const LibraryImage> after = images.current();
+	if (!after->contains(added) || images.generation() != 2 || before->contains(added)
+		|| before->size() != lib.size()) {
+		throw TestException("Worker did not switch to the new image");
+	}
+
+	// the first image is dropped once a third is out, but stays mapped while held
+	changing.remove(added);
+	publisher.publish(LibraryImage::build(changing.songs()));
+	if (images.current()->contains(added) || TestSharedMemory::exists("test_image_1")
+		|| !TestSharedMemory::exists("test_image_2") || before->size() != lib.size()) {
+		throw TestException("Old images not properly dropped");
+	}
+
+	// an image that is not valid is skipped
+	publisher.publish(std::vector<char>(sizeof(LibraryImageHeader)));
+	if (images.current() == nullptr || images.generation() != 3) {
+		throw TestException("Invalid image mapped");
+	}
+
+	publisher.unlink();
+	if (TestSharedMemory::exists("test_image_3") || TestSharedMemory::exists("test_image_4")) {
+		throw TestException("Images not unlinked");
+	}
+}
+
+/**
+* Applies a mix of adds and removes to a library backed by an LSM store with a
+* tiny memtable, so that runs are written and merged in the background, then
+* reopens the store.  If successful, the library always matches a plain set
+* of the same songs.
+*
+* @param nsongs number of distinct songs to work with
+* @throws TestException if the store differs from the expected songs
+*/
+void testLsmStore(int nsongs) {
+
+	const std::string dir = "test_lsm";
+	std::set<Song> expected;
+	auto song = [](int i) {
+		return Song("LSM Artist " + std::to_string(i % 7), "Song " + std::to_string(i));
 	};
 
-	// parse from file stream
-	for (std::string filename : filenames) {
-		std::ifstream fin(filename);
-		if (fin.is_open()) {
-			JSON j;
-			fin >> j;
-			std::vector<Song> songs = JsonConverter::parseSongs(j);
-			lib.add(songs);
+	LsmStore(dir).destroy();   // anything left by a previous run
+	{
+		LsmStore store(dir, 16, 2);
+		if (!store.open()) {
+			throw TestException("Failed to open LSM store");
+		}
+		MusicLibrary lib;
+		lib.attach(store);
+		store.start();
+
+		for (int i = 0; i < 4 * nsongs; ++i) {
+			int n = (i * 7919) % nsongs;
+			bool add = (i / nsongs) % 2 == 0 || n % 3 == 0;
+			bool changed = add ? lib.add(song(n)) : lib.remove(song(n));
+			bool expectedChanged = add ? expected.insert(song(n)).second : expected.erase(song(n)) > 0;
+			if (changed != expectedChanged) {
+				throw TestException("LSM store change " + std::to_string(i) + " not properly applied");
+			}
+		}
+		store.setLogPosition(1234);
+		store.flush();
+		if (store.logPosition() != 1234) {
+			throw TestException("LSM store log position not written with its runs");
+		}
+
+		std::vector<Song> found = lib.find("Artist 3", "");
+		std::vector<Song> matching;
+		for (const auto& s : expected) {
+			if (s.artist == "LSM Artist 3") {
+				matching.push_back(s);
+			}
+		}
+		if (lib.size() != expected.size() || lib.songs() != expected || found != matching) {
+			throw TestException("LSM store differs from expected songs");
+		}
+		// merged pairwise, each run is more than twice the size of the next newer one
+		size_t doublings = 0;
+		for (size_t limit = 1; limit <= (size_t)nsongs; limit = 2 * limit + 1) {
+			++doublings;
+		}
+		if (store.flushes() == 0 || store.merges() == 0 || store.runs() > doublings) {
+			throw TestException("LSM store runs not written and merged: " + std::to_string(store.runs()));
+		}
+		store.stop();
+	}
+
+	// everything flushed is still there after reopening, without keeping the songs
+	// in memory for ids and indexes
+	LsmStore store(dir);
+	MusicLibrary lib;
+	if (!store.open()) {
+		throw TestException("Failed to reopen LSM store");
+	}
+	lib.setIndexing(false);
+	lib.attach(store);
+	if (lib.size() != expected.size() || lib.songs() != expected
+		|| !lib.contains(*expected.begin()) || store.logPosition() != 1234) {
+		throw TestException("Reopened LSM store differs from expected songs");
+	}
+	Song added("LSM Artist New", "Unindexed");
+	if (!lib.add(added) || !lib.contains(added) || lib.find("New", "").size() != 1
+		|| lib.id(added) != SONG_ID_NONE || lib.id(*expected.begin()) != SONG_ID_NONE
+		|| !lib.complete(true, "LSM", 10).empty() || !lib.remove(added) || lib.contains(added)) {
+		throw TestException("Unindexed LSM library not properly changed");
+	}
+
+	// a run left behind by a crash right after replacing the store is recognized as
+	// replaced
+	std::vector<Song> rebuilt = { song(1), song(2), added };
+	lib.build(rebuilt);
+	store.stop();
+	std::set<Song> stale = { song(3) };
+	if (!LibraryImage::save(LibraryImage::build(stale),
+		dir + "/run-00000000000000000001-00000000000000000001.lsm")) {
+		throw TestException("Failed to write stale LSM run");
+	}
+	{
+		LsmStore reopened(dir);
+		if (!reopened.open() || reopened.runs() != 1
+			|| reopened.songs() != std::set<Song>(rebuilt.begin(), rebuilt.end())) {
+			throw TestException("Rebuilt LSM store differs after reopening");
+		}
+	}
+	if (!store.destroy()) {
+		throw TestException("Failed to remove LSM store: " + dir);
+	}
+}
+
+/**
+* Adds then removes songs from many threads at once through a mutation
+* queue.  If successful, every operation succeeds exactly once and the
+* library ends up unchanged.
+*
+* @param lib library to modify
+* @param nthreads number of concurrent writers
+* @param nsongs number of songs added and removed by each writer
+* @throws TestException if any operation fails or the library changed
+*/
+void testGroupCommit(MusicLibrary& lib, int nthreads, int nsongs) {
+
+	std::shared_timed_mutex mutex;
+	MutationQueue mutations(lib, mutex);
+	mutations.start();
+
+	size_t before = lib.size();
+	std::vector<int> failures(nthreads, 0);
+	std::vector<std::thread> writers;
+	for (int t = 0; t < nthreads; ++t) {
+		writers.push_back(std::thread([&, t]() {
+			for (int i = 0; i < nsongs; ++i) {
+				Song song("Group Commit " + std::to_string(t), std::to_string(i));
+				if (!mutations.add(song)) {
+					++failures[t];
+				}
+				if (!mutations.remove(song)) {
+					++failures[t];
+				}
+			}
+		}));
+	}
+	for (auto& writer : writers) {
+		writer.join();
+	}
+	mutations.stop();
+
+	for (int t = 0; t < nthreads; ++t) {
+		if (failures[t] > 0) {
+			throw TestException("Group commit writer " + std::to_string(t) + " had "
+				+ std::to_string(failures[t]) + " failed operations");
+		}
+	}
+	if (lib.size() != before) {
+		throw TestException("Library size changed after group commit: "
+			+ std::to_string(before) + " vs " + std::to_string(lib.size()));
+	}
+
+	// a change arriving after the queue stopped must fail rather than wait forever
+	bool rejected = false;
+	try {
+		mutations.add(Song("Group Commit", "after stop"));
+	}
+	catch (std::runtime_error&) {
+		rejected = true;
+	}
+	if (!rejected || lib.size() != before) {
+		throw TestException("Stopped mutation queue accepted a change");
+	}
+	std::cout << "Applied " << mutations.applied() << " mutations in "
+		<< mutations.batches() << " batches" << std::endl;
+}
+
+/**
+* Runs searches against the library from several threads at once, each reader
+* holding the given lock type over a batch of full-library searches, and
+* reports the total search throughput.  The batch keeps the time spent
+* searching well above the cost of taking the lock, as a SEARCH in the server
+* does, so the lock mode rather than the lock overhead decides the result.
+*
+* @param lib library to search
+* @param nthreads number of concurrent readers
+* @param nsearches number of searches performed by each reader
+* @return searches per second across all readers
+*/
+template<typename Lock>
+double benchConcurrentFind(const MusicLibrary& lib, int nthreads, int nsearches) {
+
+	static const char* const queries[][2] = {
+		{ "a", "e" }, { "^The", "" }, { "[xyz]", "o.*o" }, { "", "(Love|Heart)" }
+	};
+	const int batch = sizeof(queries)/sizeof(queries[0]);
+
+	std::shared_timed_mutex mutex;
+	std::atomic<size_t> found(0);
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> readers;
+	for (int t = 0; t < nthreads; ++t) {
+		readers.push_back(std::thread([&]() {
+			for (int i = 0; i < nsearches; i += batch) {
+				Lock lock(mutex);
+				for (int q = 0; q < batch && i + q < nsearches; ++q) {
+					found += lib.find(queries[q][0], queries[q][1]).size();
+				}
+			}
+		}));
+	}
+	for (auto& reader : readers) {
+		reader.join();
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	return nthreads*nsearches/elapsed.count();
+}
+
+/**
+* Compares concurrent search throughput when searches take the library
+* lock exclusively versus in shared mode.  Only as many readers as the machine
+* runs in parallel are measured; beyond that shared locking has nothing to gain.
+*
+* @param lib library to search
+* @param nsearches number of searches performed by each reader
+*/
+void benchReadScaling(const MusicLibrary& lib, int nsearches) {
+
+	int cores = (int)std::thread::hardware_concurrency();
+	std::cout << "Concurrent search throughput (searches/s):" << std::endl;
+	if (cores < 2) {
+		std::cout << "   skipped, shared locking needs more than one core to scale" << std::endl;
+		return;
+	}
+	std::cout << "   threads   exclusive      shared" << std::endl;
+	for (int nthreads = 1; nthreads <= std::min(cores, 8); nthreads *= 2) {
+		double exclusive = benchConcurrentFind<std::unique_lock<std::shared_timed_mutex>>(
+			lib, nthreads, nsearches);
+		double shared = benchConcurrentFind<std::shared_lock<std::shared_timed_mutex>>(
+			lib, nthreads, nsearches);
+		std::cout << "   " << std::setw(7) << nthreads
+			<< std::setw(12) << (long)exclusive
+			<< std::setw(12) << (long)shared << std::endl;
+	}
+}
+
+/**
+* Communication layer that only records whether it was closed
+*/
+class ClosableApi : public MusicLibraryApi {
+public:
+	bool closed = false;
+
+	bool sendMessage(const Message&) { return !closed; }
+	std::unique_ptr<Message> recvMessage() { return nullptr; }
+	bool close() { closed = true; return true; }
+};
+
+/**
+* Drains a registry with one idle and one busy session.  If successful, the
+* idle session is closed immediately while the busy one is left to finish
+* its request and is then told to close.
+*
+* @throws TestException if sessions are not drained correctly
+*/
+void testSessionDrain() {
+
+	SessionRegistry sessions;
+	ClosableApi idle_api, busy_api;
+	{
+		SessionRegistry::Session idle(sessions, idle_api, 0);
+		SessionRegistry::Session busy(sessions, busy_api, 1);
+		busy.busy();
+
+		sessions.drain();
+		if (!idle_api.closed || busy_api.closed) {
+			throw TestException("Drain must close idle sessions and only idle sessions");
+		}
+		if (busy.idle()) {
+			throw TestException("Busy session not told to close after its request");
+		}
+		if (sessions.waitUntil(std::chrono::steady_clock::now())) {
+			throw TestException("Registry reported empty with sessions connected");
+		}
+	}
+	if (!sessions.waitUntil(std::chrono::steady_clock::now()) || sessions.active() != 0) {
+		throw TestException("Sessions not removed from registry");
+	}
+
+	// sessions connecting while draining are closed right away
+	ClosableApi late_api;
+	SessionRegistry::Session late(sessions, late_api, 2);
+	if (!late_api.closed) {
+		throw TestException("Session accepted while draining");
+	}
+}
+
+/**
+* Communication layer delivering messages handed to it by the test, as if they
+* were arriving from a client
+*/
+class ScriptedApi : public MusicLibraryApi {
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::deque<std::unique_ptr<Message>> incoming_;
+	bool closed_ = false;
+
+public:
+	size_t read = 0;
+
+	void deliver(Message *msg) {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			incoming_.emplace_back(msg);
+		}
+		cv_.notify_all();
+	}
+
+	size_t undelivered() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return incoming_.size();
+	}
+
+	bool closed() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return closed_;
+	}
+
+	bool sendMessage(const Message&) { return !closed(); }
+
+	std::unique_ptr<Message> recvMessage() {
+		std::unique_lock<std::mutex> lock(mutex_);
+		cv_.wait(lock, [this]() { return closed_ || !incoming_.empty(); });
+		if (closed_) {
+			return nullptr;
+		}
+		std::unique_ptr<Message> msg = std::move(incoming_.front());
+		incoming_.pop_front();
+		++read;
+		lock.unlock();
+		notifyReceive();
+		return msg;
+	}
+
+	bool close() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			closed_ = true;
+		}
+		cv_.notify_all();
+		return true;
+	}
+};
+
+/**
+* Pipelines a CANCEL behind a search that runs past the read timeout, then
+* floods the session with requests.  If successful, the CANCEL stops the
+* search while it runs without the connection timing out, and the reader
+* leaves requests it has no room for on the connection.
+*
+* @throws TestException if the search is not cancelled or messages are lost
+*/
+void testSessionReader() {
+
+	const std::chrono::milliseconds read_timeout(100);
+	TimerWheel timers(std::chrono::milliseconds(10));
+	timers.start();
+	SessionRegistry sessions(timers, std::chrono::milliseconds(0), read_timeout);
+	QueryRegistry queries;
+	ScriptedApi api;
+	{
+		SessionRegistry::Session session(sessions, api, 1);
+		SessionReader reader(api, session, queries, 1);
+
+		api.deliver(new SearchMessage("", "", "", SongInfoFilter(), 5));
+		bool cancelled = false;
+		std::unique_ptr<Message> msg = reader.next(cancelled);
+		if (msg == nullptr || msg->type() != MessageType::SEARCH) {
+			throw TestException("Search not read");
+		}
+		session.busy();
+
+		// the search runs well past the read timeout, with a CANCEL queued behind it
+		{
+			QueryRegistry::Query query(queries, 1, 5);
+			api.deliver(new CancelMessage(5));
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+			while (query.budget().charge(1) && std::chrono::steady_clock::now() < deadline) {
+				std::this_thread::yield();
+			}
+			std::this_thread::sleep_for(3 * read_timeout);
+			if (!query.budget().exhausted() || std::string(query.budget().reason()) != "cancelled") {
+				throw TestException("Pipelined CANCEL did not stop the running search");
+			}
+		}
+		if (api.closed()) {
+			throw TestException("Session closed for a request that arrived while busy");
+		}
+		msg = reader.next(cancelled);
+		if (msg == nullptr || msg->type() != MessageType::CANCEL || !cancelled) {
+			throw TestException("CANCEL not handed to the session after the search");
+		}
+		session.idle();
+
+		// a flood of requests is only read as far as there is room for it
+		const size_t nflood = 3 * SESSION_READ_AHEAD;
+		for (size_t i = 0; i < nflood; ++i) {
+			api.deliver(new SearchMessage("", "", "", SongInfoFilter(), 100 + i));
+		}
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		while (reader.pending() < SESSION_READ_AHEAD && std::chrono::steady_clock::now() < deadline) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		if (reader.pending() != SESSION_READ_AHEAD || api.undelivered() != nflood - SESSION_READ_AHEAD) {
+			throw TestException("Reader held " + std::to_string(reader.pending())
+				+ " messages, at most " + std::to_string(SESSION_READ_AHEAD) + " expected");
+		}
+		for (size_t i = 0; i < nflood; ++i) {
+			session.busy();
+			msg = reader.next(cancelled);
+			if (msg == nullptr || ((SearchMessage &)(*msg)).request != 100 + i) {
+				throw TestException("Flooded requests lost or reordered");
+			}
+			session.idle();
+		}
+	}
+	timers.stop();
+	if (!api.closed()) {
+		throw TestException("Reader did not close the connection");
+	}
+}
+
+/**
+* Schedules timers at delays spanning several wheel levels, then advances
+* the wheel one tick at a time.  If successful, every timer fires on exactly
+* the tick it was scheduled for, and cancelled timers never fire.
+*
+* @throws TestException if a timer fires at the wrong time
+*/
+void testTimerWheel() {
+
+	// use a coarse tick so that real time passing during the test doesn't matter
+	const std::chrono::seconds tick(1);
+	auto t0 = std::chrono::steady_clock::now() + std::chrono::milliseconds(500);
+	TimerWheel timers(tick);
+
+	std::vector<long> delays = { 1, 2, 63, 64, 65, 127, 4095, 4096, 4097, 5000, 262144, 300000 };
+	std::vector<long> fired(delays.size(), -1);
+	for (size_t i = 0; i < delays.size(); ++i) {
+		timers.schedule(delays[i] * tick, [&fired, i, &timers]() { fired[i] = 0; });
+	}
+
+	// cancelled and rescheduled timers
+	bool cancelled_fired = false;
+	TimerWheel::TimerId cancelled = timers.schedule(100 * tick, [&]() { cancelled_fired = true; });
+	long moved_fired = -1;
+	TimerWheel::TimerId moved = timers.schedule(10 * tick, [&]() { moved_fired = 0; });
+	timers.cancel(cancelled);
+	timers.reschedule(moved, 7000 * tick);
+
+	for (long t = 1; t <= 300001; ++t) {
+		timers.advance(t0 + t * tick);
+		for (size_t i = 0; i < delays.size(); ++i) {
+			if (fired[i] == 0) {
+				fired[i] = t;
+			}
+		}
+		if (moved_fired == 0) {
+			moved_fired = t;
+		}
+	}
+
+	for (size_t i = 0; i < delays.size(); ++i) {
+		if (fired[i] != delays[i]) {
+			throw TestException("Timer scheduled for tick " + std::to_string(delays[i])
+				+ " fired at tick " + std::to_string(fired[i]));
+		}
+	}
+	if (cancelled_fired) {
+		throw TestException("Cancelled timer fired");
+	}
+	if (moved_fired != 7000) {
+		throw TestException("Rescheduled timer fired at tick " + std::to_string(moved_fired));
+	}
+	if (timers.size() != 0) {
+		throw TestException("Timers left pending after all fired");
+	}
+}
+
+/**
+* Logs a few batches of changes, simulates a crash in the middle of a write,
+* then replays the log into an empty library.  If successful, the library
+* holds exactly the logged changes and the torn record is discarded.
+*
+* @param policy log sync policy to test
+* @throws TestException if the log does not reproduce the changes
+*/
+void testWriteAheadLog(WalSyncPolicy policy) {
+
+	const std::string path = "test_wal.log";
+	std::remove(path.c_str());
+
+	Song a("Journey", "Don't Stop Believin'");
+	Song b("Toto", "Africa");
+	Song c("a-ha", "Take On Me");
+	SongInfo info("Hunting High and Low", 1985, 225, "Synth-pop");
+	{
+		WriteAheadLog wal(path, policy, std::chrono::milliseconds(10));
+		if (!wal.open()) {
+			throw TestException("Failed to open write-ahead log");
+		}
+		wal.append({ Mutation(MUTATION_ADD, a), Mutation(MUTATION_ADD, b) });
+		wal.append({ Mutation(MUTATION_REMOVE, a), Mutation(MUTATION_ADD, c, info) });
+	}
+
+	// torn write: a partial record at the end of the file
+	std::FILE* file = std::fopen(path.c_str(), "ab");
+	std::fwrite("\x20\x00\x00\x00\x01", 1, 5, file);
+	std::fclose(file);
+
+	MusicLibrary lib;
+	WriteAheadLog wal(path);
+	size_t replayed = wal.replay(lib);
+	if (replayed != 4) {
+		throw TestException("Replayed " + std::to_string(replayed) + " log records instead of 4");
+	}
+	std::set<Song> expected = { b, c };
+	if (lib.songs() != expected) {
+		throw TestException("Library not restored from write-ahead log");
+	}
+	if (lib.info(c).album != info.album || lib.info(c).year != info.year
+		|| lib.info(c).duration != info.duration || lib.info(c).genre != info.genre
+		|| !lib.info(b).empty()) {
+		throw TestException("Song metadata not restored from write-ahead log");
+	}
+
+	// a log of version 1, without metadata or a start, is still read and appended to
+	std::string contents;
+	{
+		std::ifstream in(path, std::ios::binary);
+		contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+	contents = contents.substr(0, 4) + std::string("\x01\x00\x00\x00", 4) + contents.substr(16);
+	{
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		out.write(contents.data(), contents.size());
+	}
+
+	// new records must follow the last good one
+	if (!wal.open() || !wal.append({ Mutation(MUTATION_ADD, a) })) {
+		throw TestException("Failed to append to replayed write-ahead log");
+	}
+	wal.close();
+	MusicLibrary lib2;
+	if (WriteAheadLog(path).replay(lib2) != 5 || lib2.size() != 3) {
+		throw TestException("Records appended after a torn write were lost");
+	}
+	char header[8] = {};
+	file = std::fopen(path.c_str(), "rb");
+	std::fread(header, 1, 8, file);
+	std::fclose(file);
+	if (header[4] != WRITE_AHEAD_LOG_VERSION) {
+		throw TestException("Write-ahead log of version 1 not upgraded");
+	}
+
+	// a checkpoint drops the records before a position, and positions keep counting on
+	Song d("Eurythmics", "Sweet Dreams");
+	uint64_t middle, end;
+	{
+		WriteAheadLog log(path);
+		if (!log.open()) {
+			throw TestException("Failed to reopen write-ahead log");
+		}
+		middle = log.position();
+		log.append({ Mutation(MUTATION_ADD, d) });
+		end = log.position();
+		if (!log.checkpoint(middle) || log.position() != end || log.checkpoint(end + 1)) {
+			throw TestException("Write-ahead log not properly checkpointed");
+		}
+	}
+	MusicLibrary lib3, lib4;
+	if (WriteAheadLog(path).replay(lib3, middle) != 1 || lib3.songs() != std::set<Song>{ d }
+		|| WriteAheadLog(path).replay(lib4, end) != 0) {
+		throw TestException("Checkpointed write-ahead log not properly replayed");
+	}
+
+	// a log ending before the library's changes starts over where the library is
+	{
+		WriteAheadLog log(path);
+		if (!log.open(end + 100) || log.position() != end + 100) {
+			throw TestException("Write-ahead log behind the library not restarted");
 		}
-		else {
-			std::cerr << "Failed to open file: " << filename << std::endl;
+	}
+
+	std::remove(path.c_str());
+}
+
+void setupLibrary(MusicLibrary& lib) {
+
+	// load all chart files in the data directory
+	Catalog catalog("data");
+	bool cached = false;
+	for (const std::string& filename : catalog.scan()) {
+		std::vector<Song> songs;
+		if (catalog.load(filename, songs, cached)) {
+			lib.add(songs);
 		}
 	}
 }
@@ -175,6 +2220,43 @@ int main() {
 		std::vector<Song> expected = { { "Taylor Swift", "...Ready For It?" } };
 		testFindSongs(lib, "Taylor", "[rR]eady", expected);
 
+		testBulkBuild(lib);
+
+		testCatalogCache();
+		testChartReload();
+		testChartFilter(1000);
+		testChartRanks();
+		testChartHistory(520);
+		testSongInfo(5000);
+		testSongIds(5000);
+		testAutocomplete(3000);
+		testFuzzySearch(2000);
+		testRankedSearch(2000);
+		testRegex(2000);
+		testQueryBudget(3000);
+
+		testLyricsSearch();
+		testLyricsPhrases(1000);
+		testLyricsStore();
+
+		testLibraryImage(lib, "Taylor", "[rR]eady");
+		testSnapshot(lib);
+		testImagePublisher(lib);
+		testLsmStore(500);
+
+		testGroupCommit(lib, 8, 200);
+
+		testSessionDrain();
+		testSessionReader();
+
+		testTimerWheel();
+
+		testWriteAheadLog(WAL_SYNC_EVERY);
+		testWriteAheadLog(WAL_SYNC_BATCH);
+		testWriteAheadLog(WAL_SYNC_INTERVAL);
+
+		benchReadScaling(lib, 50);
+
 		std::cout << "All tests passed!" << std::endl;
 	}
 	catch (TestException& exc) {